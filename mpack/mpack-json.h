@@ -0,0 +1 @@
+../src/mpack/mpack-json.h
\ No newline at end of file
@@ -39,6 +39,11 @@
 #define MPACK_WRITER 1
 #endif
 
+/** Enables compilation of the JSON conversion API. */
+#ifndef MPACK_JSON
+#define MPACK_JSON 1
+#endif
+
 
 /*
  * Dependencies
@@ -60,6 +65,18 @@
 #define MPACK_STDIO 0
 #endif
 
+/**
+ * Enables the use of POSIX mmap(). This adds mpack_tree_init_mmap(), which
+ * parses a file in-place from a read-only mapping instead of reading it into
+ * an allocated buffer. It requires MPACK_STDIO.
+ *
+ * The default is enabled on POSIX platforms if MPACK_STDIO is enabled.
+ */
+#if !defined(MPACK_MMAP) && defined(MPACK_STDIO) && MPACK_STDIO && \
+        (defined(__unix__) || defined(__APPLE__))
+#define MPACK_MMAP 1
+#endif
+
 
 /*
  * System Functions
@@ -218,8 +235,7 @@
 /**
  * Number of nodes in each allocated node page.
  *
- * Nodes are 16 bytes when compiled for a 32-bit architecture and
- * 24 bytes when compiled for a 64-bit architecture.
+ * Nodes are 16 bytes on both 32-bit and 64-bit architectures.
  *
  * Using as many nodes fit in one memory page seems to provide the
  * best performance, and has very little waste when parsing small
@@ -229,6 +245,62 @@
 #define MPACK_NODE_PAGE_SIZE (4096 / sizeof(mpack_node_t))
 #endif
 
+/**
+ * The minimum number of key/value pairs in a map for the node parser to
+ * build a hash index of its keys. Lookups by string or integer key in an
+ * indexed map take constant time; smaller maps are searched linearly,
+ * which is faster for a handful of keys.
+ *
+ * The index is stored in the node pages immediately after the map's
+ * children. It uses between 8 and 16 bytes per key/value pair. Maps are
+ * not indexed in a pooled tree if the index does not fit.
+ *
+ * If the keys of an indexed map are all non-negative integers less than
+ * twice its number of pairs (for example field tags 0 to N), the index is
+ * a table of the pairs by key instead, so looking up an integer key is a
+ * single array access.
+ *
+ * Set this to 0 to disable map indexing.
+ */
+#ifndef MPACK_NODE_MAP_INDEX_THRESHOLD
+#define MPACK_NODE_MAP_INDEX_THRESHOLD 16
+#endif
+
+/**
+ * The minimum number of key/value pairs in a map for the node parser to
+ * check whether its keys are sorted. If all keys are strings in strictly
+ * increasing bytewise order, or all keys are integers in strictly
+ * increasing numeric order, lookups in the map use a binary search. This
+ * costs one comparison per key while parsing and no extra memory.
+ *
+ * Indexed maps are searched with their index instead (see
+ * MPACK_NODE_MAP_INDEX_THRESHOLD.)
+ *
+ * Set this to 0 to disable sorted key detection.
+ */
+#ifndef MPACK_NODE_MAP_SORTED_THRESHOLD
+#define MPACK_NODE_MAP_SORTED_THRESHOLD 8
+#endif
+
+/**
+ * The maximum number of segments in a compiled node path (see
+ * mpack_path_compile().) Each segment takes 32 bytes in an mpack_path_t
+ * on a 64-bit platform, and 8 bytes in an mpack_path_shape_t.
+ */
+#ifndef MPACK_NODE_PATH_MAX_SEGMENTS
+#define MPACK_NODE_PATH_MAX_SEGMENTS 16
+#endif
+
+/**
+ * Whether the node parser records the span of encoded bytes of each node,
+ * so that a node can be forwarded unchanged with mpack_node_raw() or
+ * mpack_write_node_raw(). This makes each node twice as large (32 bytes
+ * on a 64-bit platform.)
+ */
+#ifndef MPACK_NODE_RAW
+#define MPACK_NODE_RAW 0
+#endif
+
 /**
  * The initial depth for the node parser. When MPACK_MALLOC is available,
  * the node parser has no practical depth limit, and it is not recursive
@@ -241,6 +313,8 @@
 /**
  * The maximum depth for the node parser if MPACK_MALLOC is not available.
  * The parsing stack is placed on the call stack.
+ *
+ * This is also the largest depth limit that mpack_validate() can check.
  */
 #ifndef MPACK_NODE_MAX_DEPTH_WITHOUT_MALLOC
 #define MPACK_NODE_MAX_DEPTH_WITHOUT_MALLOC 32
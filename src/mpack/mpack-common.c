@@ -154,6 +154,43 @@ int mpack_tag_cmp(mpack_tag_t left, mpack_tag_t right) {
 
 
 
+#ifdef MPACK_MALLOC
+void* mpack_allocator_alloc(const mpack_allocator_t* allocator, size_t size) {
+    if (allocator == NULL)
+        return MPACK_MALLOC(size);
+    return allocator->alloc_fn(allocator->context, size);
+}
+
+void* mpack_allocator_realloc(const mpack_allocator_t* allocator, void* p, size_t used_size, size_t new_size) {
+    if (allocator == NULL)
+        return mpack_realloc(p, used_size, new_size);
+    if (allocator->realloc_fn)
+        return allocator->realloc_fn(allocator->context, p, used_size, new_size);
+    return mpack_allocator_move(allocator, allocator, p, used_size, new_size);
+}
+
+void mpack_allocator_free(const mpack_allocator_t* allocator, void* p) {
+    if (allocator == NULL)
+        MPACK_FREE(p);
+    else
+        allocator->free_fn(allocator->context, p);
+}
+
+void* mpack_allocator_move(const mpack_allocator_t* from, const mpack_allocator_t* to, void* p, size_t used_size, size_t new_size) {
+    mpack_assert(used_size <= new_size, "cannot move %i bytes into %i", (int)used_size, (int)new_size);
+    void* new_p = mpack_allocator_alloc(to, new_size);
+    if (new_p == NULL)
+        return NULL;
+    if (p) {
+        mpack_memcpy(new_p, p, used_size);
+        mpack_allocator_free(from, p);
+    }
+    return new_p;
+}
+#endif
+
+
+
 #if MPACK_READ_TRACKING || MPACK_WRITE_TRACKING
 
 #ifndef MPACK_TRACKING_INITIAL_CAPACITY
@@ -162,22 +199,32 @@ int mpack_tag_cmp(mpack_tag_t left, mpack_tag_t right) {
 #define MPACK_TRACKING_INITIAL_CAPACITY 8
 #endif
 
+// The elements are allocated on the first push rather than here, so that
+// an allocator set right after initializing a reader or writer is used
+// for all of its tracking memory.
 mpack_error_t mpack_track_init(mpack_track_t* track) {
     track->count = 0;
-    track->capacity = MPACK_TRACKING_INITIAL_CAPACITY;
-    track->elements = (mpack_track_element_t*)MPACK_MALLOC(sizeof(mpack_track_element_t) * track->capacity);
-    if (track->elements == NULL)
-        return mpack_error_memory;
+    track->capacity = 0;
+    track->allocator = NULL;
+    track->elements = NULL;
     return mpack_ok;
 }
 
 mpack_error_t mpack_track_grow(mpack_track_t* track) {
-    mpack_assert(track->elements, "null track elements!");
     mpack_assert(track->count == track->capacity, "incorrect growing?");
 
+    if (track->elements == NULL) {
+        track->elements = (mpack_track_element_t*)mpack_allocator_alloc(track->allocator,
+                sizeof(mpack_track_element_t) * MPACK_TRACKING_INITIAL_CAPACITY);
+        if (track->elements == NULL)
+            return mpack_error_memory;
+        track->capacity = MPACK_TRACKING_INITIAL_CAPACITY;
+        return mpack_ok;
+    }
+
     size_t new_capacity = track->capacity * 2;
 
-    mpack_track_element_t* new_elements = (mpack_track_element_t*)mpack_realloc(track->elements,
+    mpack_track_element_t* new_elements = (mpack_track_element_t*)mpack_allocator_realloc(track->allocator, track->elements,
             sizeof(mpack_track_element_t) * track->count, sizeof(mpack_track_element_t) * new_capacity);
     if (new_elements == NULL)
         return mpack_error_memory;
@@ -188,7 +235,6 @@ mpack_error_t mpack_track_grow(mpack_track_t* track) {
 }
 
 mpack_error_t mpack_track_push(mpack_track_t* track, mpack_type_t type, uint64_t count) {
-    mpack_assert(track->elements, "null track elements!");
     mpack_log("track pushing %s count %i\n", mpack_type_to_string(type), (int)count);
 
     // maps have twice the number of elements (key/value pairs)
@@ -210,7 +256,6 @@ mpack_error_t mpack_track_push(mpack_track_t* track, mpack_type_t type, uint64_t
 }
 
 mpack_error_t mpack_track_pop(mpack_track_t* track, mpack_type_t type) {
-    mpack_assert(track->elements, "null track elements!");
     mpack_log("track popping %s\n", mpack_type_to_string(type));
 
     if (track->count == 0) {
@@ -239,7 +284,6 @@ mpack_error_t mpack_track_pop(mpack_track_t* track, mpack_type_t type) {
 
 mpack_error_t mpack_track_element(mpack_track_t* track, bool read) {
     MPACK_UNUSED(read);
-    mpack_assert(track->elements, "null track elements!");
 
     // if there are no open elements, that's fine, we can read/write elements at will
     if (track->count == 0)
@@ -265,7 +309,6 @@ mpack_error_t mpack_track_element(mpack_track_t* track, bool read) {
 
 mpack_error_t mpack_track_bytes(mpack_track_t* track, bool read, uint64_t count) {
     MPACK_UNUSED(read);
-    mpack_assert(track->elements, "null track elements!");
 
     if (track->count == 0) {
         mpack_break("bytes cannot be %s with no open bin, str or ext", read ? "read" : "written");
@@ -301,11 +344,24 @@ mpack_error_t mpack_track_check_empty(mpack_track_t* track) {
 mpack_error_t mpack_track_destroy(mpack_track_t* track, bool cancel) {
     mpack_error_t error = cancel ? mpack_ok : mpack_track_check_empty(track);
     if (track->elements) {
-        MPACK_FREE(track->elements);
+        mpack_allocator_free(track->allocator, track->elements);
         track->elements = NULL;
     }
     return error;
 }
+
+mpack_error_t mpack_track_set_allocator(mpack_track_t* track, const mpack_allocator_t* allocator) {
+    if (track->elements) {
+        size_t size = sizeof(mpack_track_element_t) * track->capacity;
+        mpack_track_element_t* new_elements = (mpack_track_element_t*)mpack_allocator_move(
+                track->allocator, allocator, track->elements, size, size);
+        if (new_elements == NULL)
+            return mpack_error_memory;
+        track->elements = new_elements;
+    }
+    track->allocator = allocator;
+    return mpack_ok;
+}
 #endif
 
 
@@ -325,6 +325,53 @@ MPACK_INLINE bool mpack_tag_equal(mpack_tag_t left, mpack_tag_t right) {
     return mpack_tag_cmp(left, right) == 0;
 }
 
+#ifdef MPACK_MALLOC
+/**
+ * An allocator for the internal memory of a tree, reader or writer.
+ *
+ * By default MPack allocates its node pages, parsing stacks, stream
+ * buffers, growable writer buffers and tracking stacks with MPACK_MALLOC and
+ * MPACK_FREE. An allocator can be attached to an individual tree, reader or
+ * writer to route these allocations elsewhere, for example to an arena
+ * that is reset between messages. Trees and growable writers allocate when
+ * they are initialized, so they take the allocator in their init functions.
+ *
+ * Memory returned to the user (such as from mpack_node_cstr_alloc() or
+ * mpack_read_bytes_alloc()) is always allocated with MPACK_MALLOC regardless
+ * of the allocator.
+ *
+ * The allocator is referenced, not copied; it must outlive any object it is
+ * attached to.
+ *
+ * @see mpack_tree_init_allocator()
+ * @see mpack_tree_set_allocator()
+ * @see mpack_writer_init_growable_allocator()
+ * @see mpack_reader_set_allocator()
+ * @see mpack_writer_set_allocator()
+ */
+typedef struct mpack_allocator_t {
+
+    /** Allocates size bytes, returning NULL on failure. */
+    void* (*alloc_fn)(void* context, size_t size);
+
+    /**
+     * Resizes an allocation of old_size bytes to new_size bytes, returning
+     * NULL on failure (in which case the original allocation is untouched.)
+     *
+     * This may be NULL, in which case allocations are resized by allocating,
+     * copying and freeing.
+     */
+    void* (*realloc_fn)(void* context, void* p, size_t old_size, size_t new_size);
+
+    /** Frees an allocation. This is never called with NULL. */
+    void (*free_fn)(void* context, void* p);
+
+    /** The context passed to each of the above functions. */
+    void* context;
+
+} mpack_allocator_t;
+#endif
+
 /**
  * @}
  */
@@ -366,6 +413,23 @@ MPACK_ALWAYS_INLINE uint64_t mpack_load_native_u64(const char* p) {
 
 
 
+#if defined(MPACK_MALLOC) && MPACK_INTERNAL
+/* Allocation helpers that fall back to MPACK_MALLOC and MPACK_FREE */
+/* when no allocator is attached. */
+/** @cond */
+
+void* mpack_allocator_alloc(const mpack_allocator_t* allocator, size_t size);
+void* mpack_allocator_realloc(const mpack_allocator_t* allocator, void* p, size_t used_size, size_t new_size);
+void mpack_allocator_free(const mpack_allocator_t* allocator, void* p);
+
+// Moves an allocation from one allocator to another, leaving it untouched on failure.
+void* mpack_allocator_move(const mpack_allocator_t* from, const mpack_allocator_t* to, void* p, size_t used_size, size_t new_size);
+
+/** @endcond */
+#endif
+
+
+
 #if MPACK_READ_TRACKING || MPACK_WRITE_TRACKING
 /* Tracks the write state of compound elements (maps, arrays, */
 /* strings, binary blobs and extension types) */
@@ -380,6 +444,7 @@ typedef struct mpack_track_t {
     size_t count;
     size_t capacity;
     mpack_track_element_t* elements;
+    const mpack_allocator_t* allocator;
 } mpack_track_t;
 
 #if MPACK_INTERNAL
@@ -391,6 +456,7 @@ mpack_error_t mpack_track_element(mpack_track_t* track, bool read);
 mpack_error_t mpack_track_bytes(mpack_track_t* track, bool read, uint64_t count);
 mpack_error_t mpack_track_check_empty(mpack_track_t* track);
 mpack_error_t mpack_track_destroy(mpack_track_t* track, bool cancel);
+mpack_error_t mpack_track_set_allocator(mpack_track_t* track, const mpack_allocator_t* allocator);
 #endif
 
 /** @endcond */
@@ -0,0 +1,1603 @@
+/*
+ * Copyright (c) 2015 Nicholas Fraser
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#define MPACK_INTERNAL 1
+
+#include "mpack-json.h"
+
+#if MPACK_JSON
+
+
+
+/*
+ * Output buffering
+ */
+
+void mpack_json_writer_init(mpack_json_writer_t* json, char* buffer, size_t size) {
+    mpack_assert(buffer != NULL, "cannot initialize writer with empty buffer");
+    mpack_memset(json, 0, sizeof(*json));
+    json->buffer = buffer;
+    json->size = size;
+}
+
+void mpack_json_writer_flag_error(mpack_json_writer_t* json, mpack_error_t error) {
+    mpack_log("json writer %p setting error %i: %s\n", json, (int)error, mpack_error_to_string(error));
+    if (json->error == mpack_ok)
+        json->error = error;
+}
+
+void mpack_json_writer_flush(mpack_json_writer_t* json) {
+    if (json->flush == NULL) {
+        mpack_break("cannot flush a json writer without a flush function!");
+        mpack_json_writer_flag_error(json, mpack_error_bug);
+        return;
+    }
+
+    if (json->error == mpack_ok && json->used != 0) {
+        json->flush(json, json->buffer, json->used);
+        json->used = 0;
+    }
+}
+
+mpack_error_t mpack_json_writer_destroy(mpack_json_writer_t* json) {
+    if (json->error == mpack_ok && json->used != 0 && json->flush != NULL) {
+        json->flush(json, json->buffer, json->used);
+        json->flush = NULL;
+    }
+    return json->error;
+}
+
+// Writes bytes that don't fit in the space left in the buffer
+static void mpack_json_write_big(mpack_json_writer_t* json, const char* p, size_t count) {
+    if (json->error != mpack_ok)
+        return;
+    if (json->flush == NULL) {
+        mpack_json_writer_flag_error(json, mpack_error_io);
+        return;
+    }
+
+    // Fill and flush the buffer, then flush the rest directly if it
+    // doesn't fit in the empty buffer
+    size_t left = json->size - json->used;
+    mpack_memcpy(json->buffer + json->used, p, left);
+    p += left;
+    count -= left;
+    json->flush(json, json->buffer, json->size);
+    json->used = 0;
+    if (json->error != mpack_ok)
+        return;
+
+    if (count > json->size) {
+        json->flush(json, p, count);
+        return;
+    }
+    mpack_memcpy(json->buffer, p, count);
+    json->used = count;
+}
+
+MPACK_STATIC_INLINE_SPEED void mpack_json_write(mpack_json_writer_t* json, const char* p, size_t count) {
+    if (count <= json->size - json->used) {
+        mpack_memcpy(json->buffer + json->used, p, count);
+        json->used += count;
+    } else {
+        mpack_json_write_big(json, p, count);
+    }
+}
+
+MPACK_STATIC_INLINE_SPEED void mpack_json_write_char(mpack_json_writer_t* json, char c) {
+    if (json->used != json->size)
+        json->buffer[json->used++] = c;
+    else
+        mpack_json_write_big(json, &c, 1);
+}
+
+void mpack_json_write_bytes(mpack_json_writer_t* json, const char* data, size_t count) {
+    mpack_json_write(json, data, count);
+}
+
+
+
+#if MPACK_NODE || MPACK_READER
+
+/*
+ * Strings and data
+ */
+
+static const char mpack_json_hex[] = "0123456789abcdef";
+
+// For each byte, the character that follows a backslash to escape it in
+// a JSON string, 'u' for a \u00XX escape, or 0 if it's written as is.
+static const char mpack_json_escapes[256] = {
+     'u',  'u',  'u',  'u',  'u',  'u',  'u',  'u',  'b',  't',  'n',  'u',  'f',  'r',  'u',  'u',
+     'u',  'u',  'u',  'u',  'u',  'u',  'u',  'u',  'u',  'u',  'u',  'u',  'u',  'u',  'u',  'u',
+       0,    0,  '"',    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,
+       0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,
+       0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,
+       0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0, '\\',    0,    0,    0,
+       0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,
+       0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,
+       0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,
+       0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,
+       0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,
+       0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,
+       0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,
+       0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,
+       0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,
+       0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,
+};
+
+// Writes the bytes of a string with escapes, but without the quotes. Runs
+// of bytes that don't need escaping are copied as a whole.
+static void mpack_json_write_escaped(mpack_json_writer_t* json, const char* str, size_t length) {
+    const char* end = str + length;
+    const char* run = str;
+    for (; str != end; ++str) {
+        char escape = mpack_json_escapes[(uint8_t)*str];
+        if (escape == 0)
+            continue;
+
+        mpack_json_write(json, run, (size_t)(str - run));
+        run = str + 1;
+        if (escape == 'u') {
+            char u[6] = {'\\', 'u', '0', '0', 0, 0};
+            u[4] = mpack_json_hex[(uint8_t)*str >> 4];
+            u[5] = mpack_json_hex[(uint8_t)*str & 0xf];
+            mpack_json_write(json, u, sizeof(u));
+        } else {
+            char e[2] = {'\\', 0};
+            e[1] = escape;
+            mpack_json_write(json, e, sizeof(e));
+        }
+    }
+    mpack_json_write(json, run, (size_t)(end - run));
+}
+
+static const char mpack_json_base64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Writes data as base64 without the quotes. The length must be a multiple
+// of three except for the last chunk of the data.
+static void mpack_json_write_base64(mpack_json_writer_t* json, const char* data, size_t length) {
+    const uint8_t* p = (const uint8_t*)data;
+    char out[64];
+    size_t used = 0;
+
+    for (; length >= 3; length -= 3, p += 3) {
+        out[used++] = mpack_json_base64[p[0] >> 2];
+        out[used++] = mpack_json_base64[((p[0] & 0x3) << 4) | (p[1] >> 4)];
+        out[used++] = mpack_json_base64[((p[1] & 0xf) << 2) | (p[2] >> 6)];
+        out[used++] = mpack_json_base64[p[2] & 0x3f];
+        if (used == sizeof(out)) {
+            mpack_json_write(json, out, used);
+            used = 0;
+        }
+    }
+
+    if (length != 0) {
+        out[used++] = mpack_json_base64[p[0] >> 2];
+        if (length == 1) {
+            out[used++] = mpack_json_base64[(p[0] & 0x3) << 4];
+            out[used++] = '=';
+        } else {
+            out[used++] = mpack_json_base64[((p[0] & 0x3) << 4) | (p[1] >> 4)];
+            out[used++] = mpack_json_base64[(p[1] & 0xf) << 2];
+        }
+        out[used++] = '=';
+    }
+    mpack_json_write(json, out, used);
+}
+
+
+
+/*
+ * Numbers
+ *
+ * Floating point numbers are formatted with the Grisu2 algorithm by
+ * Florian Loitsch ("Printing Floating-Point Numbers Quickly and
+ * Accurately with Integers", 2010.) It only uses 64-bit integer
+ * arithmetic and a small table of powers of ten. The digits always read
+ * back as the same value, and are the shortest such digits for all but
+ * a tiny fraction of values (where they have one digit too many.)
+ */
+
+static size_t mpack_json_format_u64(char* out, uint64_t value) {
+    char digits[20];
+    size_t count = 0;
+    do {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    for (size_t i = 0; i < count; ++i)
+        out[i] = digits[count - 1 - i];
+    return count;
+}
+
+static size_t mpack_json_format_i64(char* out, int64_t value) {
+    if (value >= 0)
+        return mpack_json_format_u64(out, (uint64_t)value);
+    out[0] = '-';
+    return 1 + mpack_json_format_u64(out + 1, (uint64_t)0 - (uint64_t)value);
+}
+
+// A floating point number f * 2^e with a 64-bit significand
+typedef struct mpack_json_fp_t {
+    uint64_t f;
+    int e;
+} mpack_json_fp_t;
+
+MPACK_STATIC_INLINE mpack_json_fp_t mpack_json_fp(uint64_t f, int e) {
+    mpack_json_fp_t fp;
+    fp.f = f;
+    fp.e = e;
+    return fp;
+}
+
+// Multiplies, rounding the 128-bit product of the significands to 64 bits
+static mpack_json_fp_t mpack_json_fp_mul(mpack_json_fp_t x, mpack_json_fp_t y) {
+    const uint64_t mask = 0xffffffffu;
+    uint64_t a = x.f >> 32, b = x.f & mask, c = y.f >> 32, d = y.f & mask;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t mid = (bd >> 32) + (ad & mask) + (bc & mask) + (UINT64_C(1) << 31);
+    return mpack_json_fp(ac + (ad >> 32) + (bc >> 32) + (mid >> 32), x.e + y.e + 64);
+}
+
+// Shifts the significand so that its top bit is set
+static mpack_json_fp_t mpack_json_fp_normalize(mpack_json_fp_t x) {
+    int shift;
+    for (shift = 32; shift != 0; shift /= 2) {
+        if ((x.f >> (64 - shift)) == 0) {
+            x.f <<= shift;
+            x.e -= shift;
+        }
+    }
+    return x;
+}
+
+// The powers of ten 10^-348, 10^-340, ..., 10^340, normalized and rounded
+static const uint64_t mpack_json_pow10_f[] = {
+    UINT64_C(0xfa8fd5a0081c0288), UINT64_C(0xbaaee17fa23ebf76), UINT64_C(0x8b16fb203055ac76),
+    UINT64_C(0xcf42894a5dce35ea), UINT64_C(0x9a6bb0aa55653b2d), UINT64_C(0xe61acf033d1a45df),
+    UINT64_C(0xab70fe17c79ac6ca), UINT64_C(0xff77b1fcbebcdc4f), UINT64_C(0xbe5691ef416bd60c),
+    UINT64_C(0x8dd01fad907ffc3c), UINT64_C(0xd3515c2831559a83), UINT64_C(0x9d71ac8fada6c9b5),
+    UINT64_C(0xea9c227723ee8bcb), UINT64_C(0xaecc49914078536d), UINT64_C(0x823c12795db6ce57),
+    UINT64_C(0xc21094364dfb5637), UINT64_C(0x9096ea6f3848984f), UINT64_C(0xd77485cb25823ac7),
+    UINT64_C(0xa086cfcd97bf97f4), UINT64_C(0xef340a98172aace5), UINT64_C(0xb23867fb2a35b28e),
+    UINT64_C(0x84c8d4dfd2c63f3b), UINT64_C(0xc5dd44271ad3cdba), UINT64_C(0x936b9fcebb25c996),
+    UINT64_C(0xdbac6c247d62a584), UINT64_C(0xa3ab66580d5fdaf6), UINT64_C(0xf3e2f893dec3f126),
+    UINT64_C(0xb5b5ada8aaff80b8), UINT64_C(0x87625f056c7c4a8b), UINT64_C(0xc9bcff6034c13053),
+    UINT64_C(0x964e858c91ba2655), UINT64_C(0xdff9772470297ebd), UINT64_C(0xa6dfbd9fb8e5b88f),
+    UINT64_C(0xf8a95fcf88747d94), UINT64_C(0xb94470938fa89bcf), UINT64_C(0x8a08f0f8bf0f156b),
+    UINT64_C(0xcdb02555653131b6), UINT64_C(0x993fe2c6d07b7fac), UINT64_C(0xe45c10c42a2b3b06),
+    UINT64_C(0xaa242499697392d3), UINT64_C(0xfd87b5f28300ca0e), UINT64_C(0xbce5086492111aeb),
+    UINT64_C(0x8cbccc096f5088cc), UINT64_C(0xd1b71758e219652c), UINT64_C(0x9c40000000000000),
+    UINT64_C(0xe8d4a51000000000), UINT64_C(0xad78ebc5ac620000), UINT64_C(0x813f3978f8940984),
+    UINT64_C(0xc097ce7bc90715b3), UINT64_C(0x8f7e32ce7bea5c70), UINT64_C(0xd5d238a4abe98068),
+    UINT64_C(0x9f4f2726179a2245), UINT64_C(0xed63a231d4c4fb27), UINT64_C(0xb0de65388cc8ada8),
+    UINT64_C(0x83c7088e1aab65db), UINT64_C(0xc45d1df942711d9a), UINT64_C(0x924d692ca61be758),
+    UINT64_C(0xda01ee641a708dea), UINT64_C(0xa26da3999aef774a), UINT64_C(0xf209787bb47d6b85),
+    UINT64_C(0xb454e4a179dd1877), UINT64_C(0x865b86925b9bc5c2), UINT64_C(0xc83553c5c8965d3d),
+    UINT64_C(0x952ab45cfa97a0b3), UINT64_C(0xde469fbd99a05fe3), UINT64_C(0xa59bc234db398c25),
+    UINT64_C(0xf6c69a72a3989f5c), UINT64_C(0xb7dcbf5354e9bece), UINT64_C(0x88fcf317f22241e2),
+    UINT64_C(0xcc20ce9bd35c78a5), UINT64_C(0x98165af37b2153df), UINT64_C(0xe2a0b5dc971f303a),
+    UINT64_C(0xa8d9d1535ce3b396), UINT64_C(0xfb9b7cd9a4a7443c), UINT64_C(0xbb764c4ca7a44410),
+    UINT64_C(0x8bab8eefb6409c1a), UINT64_C(0xd01fef10a657842c), UINT64_C(0x9b10a4e5e9913129),
+    UINT64_C(0xe7109bfba19c0c9d), UINT64_C(0xac2820d9623bf429), UINT64_C(0x80444b5e7aa7cf85),
+    UINT64_C(0xbf21e44003acdd2d), UINT64_C(0x8e679c2f5e44ff8f), UINT64_C(0xd433179d9c8cb841),
+    UINT64_C(0x9e19db92b4e31ba9), UINT64_C(0xeb96bf6ebadf77d9), UINT64_C(0xaf87023b9bf0ee6b),
+};
+static const int16_t mpack_json_pow10_e[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+    -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+    -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+    -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+    109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+    641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066,
+};
+
+static const uint32_t mpack_json_pow10_u32[] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+// Gets a power of ten 10^-k which brings a number with the given binary
+// exponent into the range needed by mpack_json_digits()
+static mpack_json_fp_t mpack_json_cached_power(int e, int* k) {
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int ik = (int)dk;
+    if (dk - ik > 0.0)
+        ++ik;
+    int index = (ik >> 3) + 1;
+    *k = 348 - index * 8;
+    return mpack_json_fp(mpack_json_pow10_f[index], mpack_json_pow10_e[index]);
+}
+
+// Moves the last digit towards the exact value while it stays within the
+// interval of numbers that read back as the value
+static void mpack_json_round(char* digits, int length, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w) {
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+            (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+        --digits[length - 1];
+        rest += ten_kappa;
+    }
+}
+
+// Generates the shortest digits within delta below the upper boundary mp
+static int mpack_json_digits(mpack_json_fp_t w, mpack_json_fp_t mp, uint64_t delta, char* digits, int* k) {
+    mpack_json_fp_t one = mpack_json_fp(UINT64_C(1) << -mp.e, mp.e);
+    uint64_t wp_w = mp.f - w.f;
+    uint32_t p1 = (uint32_t)(mp.f >> -one.e);
+    uint64_t p2 = mp.f & (one.f - 1);
+    int length = 0;
+
+    int kappa = 1;
+    while (kappa < 10 && p1 >= mpack_json_pow10_u32[kappa])
+        ++kappa;
+
+    while (kappa > 0) {
+        uint32_t d = p1 / mpack_json_pow10_u32[kappa - 1];
+        p1 %= mpack_json_pow10_u32[kappa - 1];
+        if (d != 0 || length != 0)
+            digits[length++] = (char)('0' + d);
+        --kappa;
+        uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+        if (rest <= delta) {
+            *k += kappa;
+            mpack_json_round(digits, length, delta, rest, (uint64_t)mpack_json_pow10_u32[kappa] << -one.e, wp_w);
+            return length;
+        }
+    }
+
+    uint64_t unit = 1;
+    for (;;) {
+        p2 *= 10;
+        delta *= 10;
+        unit *= 10;
+        char d = (char)(p2 >> -one.e);
+        if (d != 0 || length != 0)
+            digits[length++] = (char)('0' + d);
+        p2 &= one.f - 1;
+        --kappa;
+        if (p2 < delta) {
+            *k += kappa;
+            mpack_json_round(digits, length, delta, p2, one.f, wp_w * unit);
+            return length;
+        }
+    }
+}
+
+// Generates the digits of the positive number f * 2^e, returning their
+// count. The number is the digits times 10^k.
+static int mpack_json_grisu2(uint64_t f, int e, bool lower_closer, char* digits, int* k) {
+    // The boundaries halfway to the neighbouring numbers
+    mpack_json_fp_t mp = mpack_json_fp_normalize(mpack_json_fp((f << 1) + 1, e - 1));
+    mpack_json_fp_t mm = lower_closer ? mpack_json_fp((f << 2) - 1, e - 2) : mpack_json_fp((f << 1) - 1, e - 1);
+    mm.f <<= mm.e - mp.e;
+    mm.e = mp.e;
+
+    mpack_json_fp_t c = mpack_json_cached_power(mp.e, k);
+    mpack_json_fp_t w = mpack_json_fp_mul(mpack_json_fp_normalize(mpack_json_fp(f, e)), c);
+    mp = mpack_json_fp_mul(mp, c);
+    mm = mpack_json_fp_mul(mm, c);
+
+    // The products are off by up to one unit, so the interval is narrowed
+    // to be sure that all of the numbers in it read back as the value
+    ++mm.f;
+    --mp.f;
+    return mpack_json_digits(w, mp, mp.f - mm.f, digits, k);
+}
+
+static int mpack_json_format_exponent(char* out, int exponent) {
+    int length = 0;
+    if (exponent < 0) {
+        out[length++] = '-';
+        exponent = -exponent;
+    }
+    if (exponent >= 100) {
+        out[length++] = (char)('0' + exponent / 100);
+        exponent %= 100;
+        out[length++] = (char)('0' + exponent / 10);
+    } else if (exponent >= 10) {
+        out[length++] = (char)('0' + exponent / 10);
+    }
+    out[length++] = (char)('0' + exponent % 10);
+    return length;
+}
+
+// Formats the digits times 10^k as a JSON number in out, which holds the
+// digits on entry. Numbers up to 21 digits before or 6 zeroes after the
+// decimal point are written in full; others in exponential notation.
+static size_t mpack_json_format_digits(char* out, int length, int k) {
+    int point = length + k; // position of the decimal point in the digits
+
+    if (k >= 0 && point <= 21) {
+        // 1234e5 -> 123400000.0
+        for (int i = length; i < point; ++i)
+            out[i] = '0';
+        out[point] = '.';
+        out[point + 1] = '0';
+        return (size_t)point + 2;
+    }
+
+    if (point > 0 && point <= 21) {
+        // 1234e-2 -> 12.34
+        mpack_memmove(out + point + 1, out + point, (size_t)(length - point));
+        out[point] = '.';
+        return (size_t)length + 1;
+    }
+
+    if (point > -6 && point <= 0) {
+        // 1234e-6 -> 0.001234
+        int offset = 2 - point;
+        mpack_memmove(out + offset, out, (size_t)length);
+        out[0] = '0';
+        out[1] = '.';
+        for (int i = 2; i < offset; ++i)
+            out[i] = '0';
+        return (size_t)(length + offset);
+    }
+
+    if (length == 1) {
+        // 1e30
+        out[1] = 'e';
+        return 2 + (size_t)mpack_json_format_exponent(out + 2, point - 1);
+    }
+
+    // 1234e30 -> 1.234e33
+    mpack_memmove(out + 2, out + 1, (size_t)(length - 1));
+    out[1] = '.';
+    out[length + 1] = 'e';
+    return (size_t)length + 2 + (size_t)mpack_json_format_exponent(out + length + 2, point - 1);
+}
+
+// Formats a double, given its sign, biased exponent and significand
+// bits, with the given number of significand bits and exponent bias
+static size_t mpack_json_format_float_bits(char* out, bool negative, int biased, uint64_t significand,
+        int significand_bits, int max_biased)
+{
+    if (biased == max_biased) {
+        // JSON has no representation for infinity and NaN
+        mpack_memcpy(out, "null", 4);
+        return 4;
+    }
+
+    size_t sign = 0;
+    if (negative)
+        out[sign++] = '-';
+
+    if (biased == 0 && significand == 0) {
+        mpack_memcpy(out + sign, "0.0", 3);
+        return sign + 3;
+    }
+
+    // The exponent of the least significant bit of the significand
+    int min_e = 1 - (max_biased / 2) - significand_bits;
+    uint64_t f = significand;
+    int e = min_e;
+    if (biased != 0) {
+        f |= UINT64_C(1) << significand_bits;
+        e = biased - 1 + min_e;
+    }
+
+    int k;
+    int length = mpack_json_grisu2(f, e, significand == 0 && biased > 1, out + sign, &k);
+    return sign + mpack_json_format_digits(out + sign, length, k);
+}
+
+static size_t mpack_json_format_double(char* out, double value) {
+    union {
+        double d;
+        uint64_t i;
+    } u;
+    u.d = value;
+    return mpack_json_format_float_bits(out, (u.i >> 63) != 0, (int)((u.i >> 52) & 0x7ff),
+            u.i & ((UINT64_C(1) << 52) - 1), 52, 0x7ff);
+}
+
+static size_t mpack_json_format_float(char* out, float value) {
+    union {
+        float f;
+        uint32_t i;
+    } u;
+    u.f = value;
+    return mpack_json_format_float_bits(out, (u.i >> 31) != 0, (int)((u.i >> 23) & 0xff),
+            u.i & ((1u << 23) - 1), 23, 0xff);
+}
+
+// Writes a nil, bool or number. A map key is quoted.
+static void mpack_json_write_scalar(mpack_json_writer_t* json, mpack_tag_t tag, bool key) {
+    char out[40];
+    size_t length = 0;
+    if (key)
+        out[length++] = '"';
+
+    switch (tag.type) {
+        case mpack_type_nil:
+            mpack_memcpy(out + length, "null", 4);
+            length += 4;
+            break;
+        case mpack_type_bool:
+            if (tag.v.b) {
+                mpack_memcpy(out + length, "true", 4);
+                length += 4;
+            } else {
+                mpack_memcpy(out + length, "false", 5);
+                length += 5;
+            }
+            break;
+        case mpack_type_int:    length += mpack_json_format_i64(out + length, tag.v.i);     break;
+        case mpack_type_uint:   length += mpack_json_format_u64(out + length, tag.v.u);     break;
+        case mpack_type_float:  length += mpack_json_format_float(out + length, tag.v.f);   break;
+        case mpack_type_double: length += mpack_json_format_double(out + length, tag.v.d);  break;
+        default:
+            mpack_assert(0, "not a scalar type: %i", (int)tag.type);
+            break;
+    }
+
+    if (key)
+        out[length++] = '"';
+    mpack_json_write(json, out, length);
+}
+
+
+
+/*
+ * Structure
+ *
+ * Both the node and reader versions keep a stack of the arrays and maps
+ * being written. It starts on the call stack and moves to the heap if
+ * it needs to grow.
+ */
+
+#ifdef MPACK_MALLOC
+#define MPACK_JSON_INITIAL_DEPTH 8
+#else
+#define MPACK_JSON_INITIAL_DEPTH 32
+#endif
+
+typedef struct mpack_json_level_t {
+    size_t count; // elements in the array, or keys and values in the map
+    size_t left;  // elements left to write
+    bool map;
+    #if MPACK_NODE
+    mpack_node_data_t* child; // the next child to write for a node
+    #endif
+} mpack_json_level_t;
+
+static const char mpack_json_indent[] = "\n                                ";
+
+static void mpack_json_write_newline(mpack_json_writer_t* json, size_t level) {
+    size_t spaces = level * 2;
+    const size_t max = sizeof(mpack_json_indent) - 2;
+    mpack_json_write(json, mpack_json_indent, 1 + (spaces < max ? spaces : max));
+    for (spaces = (spaces < max) ? 0 : spaces - max; spaces > max; spaces -= max)
+        mpack_json_write(json, mpack_json_indent + 1, max);
+    mpack_json_write(json, mpack_json_indent + 1, spaces);
+}
+
+// Writes the separator before the next element of the given level,
+// returning true if the element is a map key
+MPACK_STATIC_INLINE_SPEED bool mpack_json_separate(mpack_json_writer_t* json, mpack_json_level_t* stack, size_t level) {
+    if (level == 0)
+        return false;
+
+    mpack_json_level_t* current = stack + level;
+    size_t index = current->count - current->left;
+    if (current->map && (index & 1)) {
+        if (json->pretty)
+            mpack_json_write(json, ": ", 2);
+        else
+            mpack_json_write_char(json, ':');
+        return false;
+    }
+
+    if (index != 0)
+        mpack_json_write_char(json, ',');
+    if (json->pretty)
+        mpack_json_write_newline(json, level);
+    return current->map;
+}
+
+// Opens an array or map, returning false if the stack couldn't grow
+static bool mpack_json_open(mpack_json_writer_t* json, mpack_json_level_t** stack,
+        mpack_json_level_t* initial, size_t* depth, size_t* level, bool map, uint32_t count)
+{
+    if (*level + 1 == *depth) {
+        #ifdef MPACK_MALLOC
+        size_t new_depth = *depth * 2;
+        mpack_json_level_t* new_stack;
+        if (*stack == initial) {
+            new_stack = (mpack_json_level_t*)mpack_allocator_alloc(json->allocator, sizeof(mpack_json_level_t) * new_depth);
+            if (new_stack)
+                mpack_memcpy(new_stack, initial, sizeof(mpack_json_level_t) * *depth);
+        } else {
+            new_stack = (mpack_json_level_t*)mpack_allocator_realloc(json->allocator, *stack,
+                    sizeof(mpack_json_level_t) * *depth, sizeof(mpack_json_level_t) * new_depth);
+        }
+        if (new_stack == NULL) {
+            mpack_json_writer_flag_error(json, mpack_error_memory);
+            return false;
+        }
+        *stack = new_stack;
+        *depth = new_depth;
+        #else
+        MPACK_UNUSED(initial);
+        mpack_json_writer_flag_error(json, mpack_error_too_big);
+        return false;
+        #endif
+    }
+
+    mpack_json_write_char(json, map ? '{' : '[');
+    mpack_json_level_t* next = *stack + ++*level;
+    next->map = map;
+    next->count = map ? (size_t)count * 2 : count;
+    next->left = next->count;
+    return true;
+}
+
+static void mpack_json_close(mpack_json_writer_t* json, mpack_json_level_t* stack, size_t level) {
+    if (json->pretty && stack[level].count != 0)
+        mpack_json_write_newline(json, level - 1);
+    mpack_json_write_char(json, stack[level].map ? '}' : ']');
+}
+
+#ifdef MPACK_MALLOC
+static void mpack_json_free_stack(mpack_json_writer_t* json, mpack_json_level_t* stack, mpack_json_level_t* initial) {
+    if (stack != initial)
+        mpack_allocator_free(json->allocator, stack);
+}
+#else
+#define mpack_json_free_stack(json, stack, initial) ((void)0)
+#endif
+
+
+
+/*
+ * Node and reader conversion
+ */
+
+#if MPACK_NODE
+void mpack_json_write_node(mpack_json_writer_t* json, mpack_node_t node) {
+    mpack_tree_t* tree = node.tree;
+    if (mpack_tree_error(tree) != mpack_ok) {
+        mpack_json_writer_flag_error(json, mpack_tree_error(tree));
+        return;
+    }
+
+    mpack_json_level_t initial[MPACK_JSON_INITIAL_DEPTH];
+    mpack_json_level_t* stack = initial;
+    size_t depth = MPACK_JSON_INITIAL_DEPTH;
+    size_t level = 0;
+    stack[0].count = 1;
+    stack[0].left = 1;
+    stack[0].map = false;
+    stack[0].child = node.data;
+
+    while (json->error == mpack_ok) {
+        mpack_json_level_t* current = stack + level;
+        if (current->left == 0) {
+            if (level == 0)
+                break;
+            mpack_json_close(json, stack, level);
+            --level;
+            continue;
+        }
+
+        bool key = mpack_json_separate(json, stack, level);
+        mpack_node_data_t* data = current->child++;
+        --current->left;
+
+        switch ((mpack_type_t)data->type) {
+            case mpack_type_str:
+                mpack_json_write_char(json, '"');
+                mpack_json_write_escaped(json, tree->data + data->value.offset, data->len);
+                mpack_json_write_char(json, '"');
+                break;
+
+            case mpack_type_bin:
+            case mpack_type_ext:
+                mpack_json_write_char(json, '"');
+                mpack_json_write_base64(json, tree->data + data->value.offset, data->len);
+                mpack_json_write_char(json, '"');
+                break;
+
+            case mpack_type_array:
+            case mpack_type_map:
+                if (key) {
+                    mpack_json_writer_flag_error(json, mpack_error_type);
+                    break;
+                }
+                if (!mpack_node_expand(mpack_node(tree, data))) {
+                    mpack_json_writer_flag_error(json, mpack_tree_error(tree));
+                    break;
+                }
+                if (mpack_json_open(json, &stack, initial, &depth, &level, data->type == mpack_type_map, data->len))
+                    stack[level].child = data->value.children;
+                break;
+
+            default:
+                mpack_json_write_scalar(json, mpack_node_tag(mpack_node(tree, data)), key);
+                break;
+        }
+    }
+
+    mpack_json_free_stack(json, stack, initial);
+}
+#endif
+
+#if MPACK_READER
+// Reads the bytes of a str, bin or ext and writes them as a string
+static void mpack_json_write_reader_bytes(mpack_json_writer_t* json, mpack_reader_t* reader, size_t count, bool base64) {
+    mpack_json_write_char(json, '"');
+
+    // Data in the reader's buffer is used in place. Anything else is read
+    // in chunks of a multiple of three bytes so they can be encoded to
+    // base64 separately.
+    char chunk[192];
+    while (count != 0 && json->error == mpack_ok) {
+        size_t n = count;
+        const char* p;
+        if (reader->left >= n) {
+            p = mpack_read_bytes_inplace(reader, n);
+        } else {
+            if (n > sizeof(chunk))
+                n = sizeof(chunk);
+            mpack_read_bytes(reader, chunk, n);
+            p = chunk;
+        }
+        if (mpack_reader_error(reader) != mpack_ok) {
+            mpack_json_writer_flag_error(json, mpack_reader_error(reader));
+            return;
+        }
+
+        if (base64)
+            mpack_json_write_base64(json, p, n);
+        else
+            mpack_json_write_escaped(json, p, n);
+        count -= n;
+    }
+
+    mpack_json_write_char(json, '"');
+}
+
+void mpack_json_write_element(mpack_json_writer_t* json, mpack_reader_t* reader) {
+    if (mpack_reader_error(reader) != mpack_ok) {
+        mpack_json_writer_flag_error(json, mpack_reader_error(reader));
+        return;
+    }
+
+    mpack_json_level_t initial[MPACK_JSON_INITIAL_DEPTH];
+    mpack_json_level_t* stack = initial;
+    size_t depth = MPACK_JSON_INITIAL_DEPTH;
+    size_t level = 0;
+    stack[0].count = 1;
+    stack[0].left = 1;
+    stack[0].map = false;
+
+    while (json->error == mpack_ok) {
+        mpack_json_level_t* current = stack + level;
+        if (current->left == 0) {
+            if (level == 0)
+                break;
+            mpack_json_close(json, stack, level);
+            if (current->map)
+                mpack_done_map(reader);
+            else
+                mpack_done_array(reader);
+            --level;
+            continue;
+        }
+
+        bool key = mpack_json_separate(json, stack, level);
+        --current->left;
+
+        mpack_tag_t tag = mpack_read_tag(reader);
+        if (mpack_reader_error(reader) != mpack_ok) {
+            mpack_json_writer_flag_error(json, mpack_reader_error(reader));
+            break;
+        }
+
+        switch (tag.type) {
+            case mpack_type_str:
+                mpack_json_write_reader_bytes(json, reader, tag.v.l, false);
+                mpack_done_str(reader);
+                break;
+            case mpack_type_bin:
+                mpack_json_write_reader_bytes(json, reader, tag.v.l, true);
+                mpack_done_bin(reader);
+                break;
+            case mpack_type_ext:
+                mpack_json_write_reader_bytes(json, reader, tag.v.l, true);
+                mpack_done_ext(reader);
+                break;
+
+            case mpack_type_array:
+            case mpack_type_map:
+                if (key) {
+                    mpack_json_writer_flag_error(json, mpack_error_type);
+                    break;
+                }
+                mpack_json_open(json, &stack, initial, &depth, &level, tag.type == mpack_type_map, tag.v.n);
+                break;
+
+            default:
+                mpack_json_write_scalar(json, tag, key);
+                break;
+        }
+    }
+
+    mpack_json_free_stack(json, stack, initial);
+    if (json->error != mpack_ok)
+        mpack_reader_flag_error(reader, json->error);
+}
+#endif
+
+#endif
+
+
+
+#if MPACK_WRITER
+
+/*
+ * JSON to MessagePack
+ *
+ * MessagePack arrays and maps start with their element count, which JSON
+ * doesn't have, so mpack_write_json() makes two passes over a top-level
+ * array or map. The first only finds the structure: it skips strings and
+ * counts the commas in each array and map, storing the element counts
+ * in the order the containers open. The second parses the JSON and
+ * writes it, taking each container's count from the first pass. Nothing
+ * else is stored, but the counts are one size_t per container in the
+ * whole value, so a long array of small records needs a count for each
+ * record. (Keeping only the open containers' counts would mean rescanning
+ * each container's contents once per level of nesting.)
+ *
+ * Strings are scanned eight bytes at a time with SWAR ("SIMD within a
+ * register") bit tricks, which find quotes, backslashes and control
+ * characters in a 64-bit word without needing platform intrinsics.
+ */
+
+#define MPACK_JSON_ONES UINT64_C(0x0101010101010101)
+#define MPACK_JSON_HIGHS UINT64_C(0x8080808080808080)
+
+MPACK_STATIC_INLINE uint64_t mpack_json_load8(const char* p) {
+    uint64_t word;
+    mpack_memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+// Returns nonzero if a byte of the word is less than n, which must be at
+// most 128. (It can have false positives only after a true one.)
+MPACK_STATIC_INLINE uint64_t mpack_json_swar_less(uint64_t word, uint8_t n) {
+    return (word - MPACK_JSON_ONES * n) & ~word & MPACK_JSON_HIGHS;
+}
+
+// Returns nonzero if a byte of the word is c
+MPACK_STATIC_INLINE uint64_t mpack_json_swar_equal(uint64_t word, uint8_t c) {
+    return mpack_json_swar_less(word ^ (MPACK_JSON_ONES * c), 1);
+}
+
+// Finds the first quote or backslash at or after p
+static const char* mpack_json_find_quote(const char* p, const char* end) {
+    while (end - p >= 8) {
+        uint64_t word = mpack_json_load8(p);
+        if (mpack_json_swar_equal(word, '"') | mpack_json_swar_equal(word, '\\'))
+            break;
+        p += 8;
+    }
+    while (p != end && *p != '"' && *p != '\\')
+        ++p;
+    return p;
+}
+
+// Finds the first quote, backslash or control character at or after p
+static const char* mpack_json_find_special(const char* p, const char* end) {
+    while (end - p >= 8) {
+        uint64_t word = mpack_json_load8(p);
+        if (mpack_json_swar_equal(word, '"') | mpack_json_swar_equal(word, '\\') | mpack_json_swar_less(word, 0x20))
+            break;
+        p += 8;
+    }
+    while (p != end && *p != '"' && *p != '\\' && (uint8_t)*p >= 0x20)
+        ++p;
+    return p;
+}
+
+MPACK_STATIC_INLINE_SPEED const char* mpack_json_skip_whitespace(const char* p, const char* end) {
+    while (p != end) {
+        if (*p == ' ') {
+            // indentation often comes in long runs
+            if (end - p >= 8 && mpack_json_load8(p) == MPACK_JSON_ONES * ' ')
+                p += 8;
+            else
+                ++p;
+        } else if (*p == '\n' || *p == '\r' || *p == '\t') {
+            ++p;
+        } else {
+            break;
+        }
+    }
+    return p;
+}
+
+#ifdef MPACK_MALLOC
+#define MPACK_JSON_INITIAL_COUNTS 64
+#define MPACK_JSON_INITIAL_STACK 16
+#else
+#define MPACK_JSON_INITIAL_COUNTS 256
+#define MPACK_JSON_INITIAL_STACK 32
+#endif
+
+typedef struct mpack_json_parser_t {
+    mpack_writer_t* writer;
+    const char* p;
+    const char* end;
+
+    size_t* counts;         // element counts of the containers in the order they open
+    size_t counts_capacity;
+    size_t counted;         // the number of containers counted
+    size_t containers;      // the number of containers written
+    size_t* stack;          // indices of the open containers' counts, then whether they're maps
+    size_t stack_capacity;
+
+    size_t counts_initial[MPACK_JSON_INITIAL_COUNTS];
+    size_t stack_initial[MPACK_JSON_INITIAL_STACK];
+} mpack_json_parser_t;
+
+// Doubles the capacity of one of the parser's arrays, moving it from the
+// call stack to the heap the first time
+static bool mpack_json_parser_grow(mpack_json_parser_t* parser, size_t** array, size_t* initial, size_t* capacity) {
+    #ifdef MPACK_MALLOC
+    size_t new_capacity = *capacity * 2;
+    size_t* new_array;
+    if (*array == initial) {
+        new_array = (size_t*)mpack_allocator_alloc(parser->writer->allocator, sizeof(size_t) * new_capacity);
+        if (new_array)
+            mpack_memcpy(new_array, initial, sizeof(size_t) * *capacity);
+    } else {
+        new_array = (size_t*)mpack_allocator_realloc(parser->writer->allocator, *array,
+                sizeof(size_t) * *capacity, sizeof(size_t) * new_capacity);
+    }
+    if (new_array == NULL) {
+        mpack_writer_flag_error(parser->writer, mpack_error_memory);
+        return false;
+    }
+    *array = new_array;
+    *capacity = new_capacity;
+    return true;
+    #else
+    MPACK_UNUSED(array);
+    MPACK_UNUSED(initial);
+    MPACK_UNUSED(capacity);
+    mpack_writer_flag_error(parser->writer, mpack_error_too_big);
+    return false;
+    #endif
+}
+
+// Whether each byte is a quote, comma, bracket or brace
+static const uint8_t mpack_json_structural[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 1, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 1, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+// Counts the elements of the array or map at parser->p and all of the
+// containers in it. This is one more than the number of commas; empty
+// containers are found while parsing.
+static bool mpack_json_count(mpack_json_parser_t* parser) {
+    const char* p = parser->p;
+    const char* end = parser->end;
+    size_t depth = 0;
+
+    for (;;) {
+        while (p != end && !mpack_json_structural[(uint8_t)*p])
+            ++p;
+        if (p == end)
+            break;
+
+        switch (*p++) {
+            case '"':
+                // an escape can't be a quote, so it's skipped with the
+                // character after the backslash
+                for (p = mpack_json_find_quote(p, end); p != end && *p != '"'; p = mpack_json_find_quote(p, end)) {
+                    if (end - p < 2)
+                        p = end;
+                    else
+                        p += 2;
+                }
+                if (p == end) {
+                    mpack_writer_flag_error(parser->writer, mpack_error_invalid);
+                    return false;
+                }
+                ++p;
+                break;
+
+            case '[':
+            case '{':
+                if (parser->counted == parser->counts_capacity &&
+                        !mpack_json_parser_grow(parser, &parser->counts, parser->counts_initial, &parser->counts_capacity))
+                    return false;
+                if (depth == parser->stack_capacity &&
+                        !mpack_json_parser_grow(parser, &parser->stack, parser->stack_initial, &parser->stack_capacity))
+                    return false;
+                parser->stack[depth++] = parser->counted;
+                parser->counts[parser->counted++] = 1;
+                break;
+
+            case ',':
+                ++parser->counts[parser->stack[depth - 1]];
+                break;
+
+            default: // closing bracket or brace
+                if (--depth == 0)
+                    return true;
+                break;
+        }
+    }
+
+    // the JSON ended inside a container
+    mpack_writer_flag_error(parser->writer, mpack_error_invalid);
+    return false;
+}
+
+static size_t mpack_json_encode_utf8(char* out, uint32_t c) {
+    if (c < 0x80) {
+        out[0] = (char)c;
+        return 1;
+    }
+    if (c < 0x800) {
+        out[0] = (char)(0xc0 | (c >> 6));
+        out[1] = (char)(0x80 | (c & 0x3f));
+        return 2;
+    }
+    if (c < 0x10000) {
+        out[0] = (char)(0xe0 | (c >> 12));
+        out[1] = (char)(0x80 | ((c >> 6) & 0x3f));
+        out[2] = (char)(0x80 | (c & 0x3f));
+        return 3;
+    }
+    out[0] = (char)(0xf0 | (c >> 18));
+    out[1] = (char)(0x80 | ((c >> 12) & 0x3f));
+    out[2] = (char)(0x80 | ((c >> 6) & 0x3f));
+    out[3] = (char)(0x80 | (c & 0x3f));
+    return 4;
+}
+
+// Parses the four hex digits of a \u escape
+static bool mpack_json_parse_hex(const char* p, const char* end, uint32_t* value) {
+    if (end - p < 4)
+        return false;
+    uint32_t v = 0;
+    for (int i = 0; i < 4; ++i) {
+        char c = p[i];
+        if (c >= '0' && c <= '9')
+            v = v * 16 + (uint32_t)(c - '0');
+        else if (c >= 'a' && c <= 'f')
+            v = v * 16 + (uint32_t)(c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F')
+            v = v * 16 + (uint32_t)(c - 'A' + 10);
+        else
+            return false;
+    }
+    *value = v;
+    return true;
+}
+
+// Decodes a string with escapes, starting after the opening quote. If the
+// writer is NULL, this only measures the decoded length. Returns the
+// position after the closing quote, or NULL if the string is invalid.
+static const char* mpack_json_unescape(mpack_writer_t* writer, const char* p, const char* end, size_t* length) {
+    char out[64];
+    size_t used = 0;
+    size_t total = 0;
+
+    for (;;) {
+        const char* run = p;
+        p = mpack_json_find_special(p, end);
+        if (writer && p != run) {
+            if (used != 0)
+                mpack_write_bytes(writer, out, used);
+            used = 0;
+            mpack_write_bytes(writer, run, (size_t)(p - run));
+        }
+        total += (size_t)(p - run);
+
+        if (p == end || (*p != '"' && *p != '\\'))
+            return NULL;
+        if (*p == '"')
+            break;
+        if (end - p < 2)
+            return NULL;
+
+        char decoded[4];
+        size_t count = 1;
+        char c = p[1];
+        p += 2;
+        switch (c) {
+            case '"': case '\\': case '/':
+                decoded[0] = c;
+                break;
+            case 'b': decoded[0] = '\b'; break;
+            case 'f': decoded[0] = '\f'; break;
+            case 'n': decoded[0] = '\n'; break;
+            case 'r': decoded[0] = '\r'; break;
+            case 't': decoded[0] = '\t'; break;
+            case 'u': {
+                uint32_t code;
+                if (!mpack_json_parse_hex(p, end, &code))
+                    return NULL;
+                p += 4;
+
+                // Characters outside the BMP are escaped as surrogate
+                // pairs. Unpaired surrogates become U+FFFD.
+                uint32_t low;
+                if (code >= 0xd800 && code < 0xdc00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u' &&
+                        mpack_json_parse_hex(p + 2, end, &low) && low >= 0xdc00 && low < 0xe000)
+                {
+                    code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                    p += 6;
+                } else if (code >= 0xd800 && code < 0xe000) {
+                    code = 0xfffd;
+                }
+                count = mpack_json_encode_utf8(decoded, code);
+                break;
+            }
+            default:
+                return NULL;
+        }
+
+        total += count;
+        if (writer) {
+            if (used + count > sizeof(out)) {
+                mpack_write_bytes(writer, out, used);
+                used = 0;
+            }
+            mpack_memcpy(out + used, decoded, count);
+            used += count;
+        }
+    }
+
+    if (writer && used != 0)
+        mpack_write_bytes(writer, out, used);
+    *length = total;
+    return p + 1;
+}
+
+// Parses and writes a string, starting after the opening quote. Returns
+// the position after the closing quote, or NULL if the string is invalid.
+static const char* mpack_json_parse_string(mpack_writer_t* writer, const char* p, const char* end) {
+    const char* start = p;
+    p = mpack_json_find_special(p, end);
+    size_t length = (size_t)(p - start);
+
+    if (p != end && *p == '"') {
+        if (length > UINT32_MAX) {
+            mpack_writer_flag_error(writer, mpack_error_too_big);
+            return NULL;
+        }
+        mpack_write_str(writer, start, (uint32_t)length);
+        return p + 1;
+    }
+
+    // Strings with escapes are measured first so that the header can be
+    // written before the decoded string
+    if (mpack_json_unescape(NULL, start, end, &length) == NULL)
+        return NULL;
+    if (length > UINT32_MAX) {
+        mpack_writer_flag_error(writer, mpack_error_too_big);
+        return NULL;
+    }
+    mpack_start_str(writer, (uint32_t)length);
+    p = mpack_json_unescape(writer, start, end, &length);
+    mpack_finish_str(writer);
+    return p;
+}
+
+static const double mpack_json_exact_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// The number of significant digits passed to strtod(). A decimal number
+// halfway between two doubles has at most 767 significant digits, so
+// truncating to this many and appending a 1 for any nonzero digits past
+// them keeps the number on the same side of every halfway point, and
+// strtod() still rounds it correctly.
+#define MPACK_JSON_MAX_DIGITS 768
+
+// Converts a number that isn't exact in the fast path, starting after the
+// sign. With the stdlib, strtod() gets a locale-independent string of up
+// to MPACK_JSON_MAX_DIGITS significant digits and an exponent, with a
+// final 1 standing for any nonzero digits past those. Otherwise the
+// mantissa is scaled by powers of ten, which can be off by one unit in
+// the last place.
+#if MPACK_STDLIB
+static double mpack_json_slow_double(const char* p, const char* end, uint64_t mantissa, int exponent) {
+    MPACK_UNUSED(mantissa);
+    MPACK_UNUSED(exponent);
+
+    // digits, the final 1, and an exponent of up to 'e-99999'
+    char buffer[MPACK_JSON_MAX_DIGITS + 16];
+    size_t used = 0;
+    long scale = 0; // power of ten of the digits in the buffer
+    bool fraction = false;
+    bool sticky = false;
+
+    for (; p != end; ++p) {
+        char c = *p;
+        if (c == '.') {
+            fraction = true;
+        } else if (c < '0' || c > '9') {
+            break;
+        } else if (used < MPACK_JSON_MAX_DIGITS) {
+            if (used != 0 || c != '0')
+                buffer[used++] = c;
+            if (fraction)
+                --scale;
+        } else {
+            if (!fraction)
+                ++scale;
+            if (c != '0')
+                sticky = true;
+        }
+    }
+    if (used == 0)
+        return 0.0;
+    if (sticky) {
+        buffer[used++] = '1';
+        --scale;
+    }
+
+    if (p != end && (*p == 'e' || *p == 'E')) {
+        ++p;
+        bool negative = false;
+        if (p != end && (*p == '-' || *p == '+'))
+            negative = *p++ == '-';
+        long e = 0;
+        for (; p != end && *p >= '0' && *p <= '9'; ++p)
+            if (e < 100000)
+                e = e * 10 + (*p - '0');
+        scale += negative ? -e : e;
+    }
+
+    // the result is zero or infinity long before these limits
+    if (scale > 99999)
+        scale = 99999;
+    if (scale < -99999)
+        scale = -99999;
+    buffer[used++] = 'e';
+    if (scale < 0) {
+        buffer[used++] = '-';
+        scale = -scale;
+    }
+    char digits[5];
+    size_t count = 0;
+    do {
+        digits[count++] = (char)('0' + scale % 10);
+        scale /= 10;
+    } while (scale != 0);
+    while (count != 0)
+        buffer[used++] = digits[--count];
+    buffer[used] = 0;
+    return strtod(buffer, NULL);
+}
+#else
+static double mpack_json_slow_double(const char* p, const char* end, uint64_t mantissa, int exponent) {
+    MPACK_UNUSED(p);
+    MPACK_UNUSED(end);
+    double value = (double)mantissa;
+    for (; exponent > 22 && value != 0.0; exponent -= 22)
+        value *= 1e22;
+    for (; exponent < -22 && value != 0.0; exponent += 22)
+        value /= 1e22;
+    return exponent < 0 ? value / mpack_json_exact_pow10[-exponent] : value * mpack_json_exact_pow10[exponent];
+}
+#endif
+
+// Parses the digits of an integer with more than 19 digits, returning
+// false if it doesn't fit in 64 bits
+static bool mpack_json_parse_u64(const char* p, const char* end, uint64_t* value) {
+    uint64_t v = 0;
+    for (; p != end; ++p) {
+        uint64_t digit = (uint64_t)(*p - '0');
+        if (v > (UINT64_MAX - digit) / 10)
+            return false;
+        v = v * 10 + digit;
+    }
+    *value = v;
+    return true;
+}
+
+MPACK_STATIC_INLINE bool mpack_json_is_digit(char c) {
+    return (unsigned)(c - '0') < 10;
+}
+
+// Parses and writes a number. Integers are written with the smallest
+// int or uint encoding, and other numbers as a float if that holds the
+// same value, or a double otherwise. Returns the position after the
+// number, or NULL if it's invalid.
+static const char* mpack_json_parse_number(mpack_writer_t* writer, const char* p, const char* end) {
+    bool negative = *p == '-';
+    if (negative)
+        ++p;
+    const char* digits_start = p;
+    if (p == end || !mpack_json_is_digit(*p))
+        return NULL;
+
+    // Up to 19 significant digits always fit in the mantissa.
+    uint64_t mantissa = 0;
+    int exponent = 0;     // power of ten of the mantissa
+    int digits = 0;       // significant digits in the mantissa
+    bool exact = true;    // whether the mantissa holds all nonzero digits
+    bool integer = true;
+
+    if (*p == '0') {
+        ++p;
+    } else {
+        for (; p != end && mpack_json_is_digit(*p); ++p) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+                ++digits;
+            } else {
+                ++exponent;
+                if (*p != '0')
+                    exact = false;
+            }
+        }
+    }
+    const char* integer_end = p;
+
+    if (p != end && *p == '.') {
+        integer = false;
+        ++p;
+        if (p == end || !mpack_json_is_digit(*p))
+            return NULL;
+        for (; p != end && mpack_json_is_digit(*p); ++p) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+                if (mantissa != 0)
+                    ++digits;
+                --exponent;
+            } else if (*p != '0') {
+                exact = false;
+            }
+        }
+    }
+
+    if (p != end && (*p == 'e' || *p == 'E')) {
+        integer = false;
+        ++p;
+        bool negative_exponent = false;
+        if (p != end && (*p == '-' || *p == '+'))
+            negative_exponent = *p++ == '-';
+        if (p == end || !mpack_json_is_digit(*p))
+            return NULL;
+        int e = 0;
+        for (; p != end && mpack_json_is_digit(*p); ++p)
+            if (e < 100000)
+                e = e * 10 + (*p - '0');
+        exponent += negative_exponent ? -e : e;
+    }
+
+    if (integer) {
+        uint64_t value = mantissa;
+        if (exponent == 0 || mpack_json_parse_u64(digits_start, integer_end, &value)) {
+            if (!negative) {
+                mpack_write_u64(writer, value);
+                return p;
+            }
+            if (value <= (UINT64_C(1) << 63)) {
+                mpack_write_i64(writer, (int64_t)(UINT64_C(0) - value));
+                return p;
+            }
+        }
+    }
+
+    double value;
+    if (exact && mantissa <= (UINT64_C(1) << 53) && exponent >= -22 && exponent <= 22) {
+        // both the mantissa and the power of ten are exact, so the result
+        // is correctly rounded
+        value = (double)mantissa;
+        value = exponent < 0 ? value / mpack_json_exact_pow10[-exponent] : value * mpack_json_exact_pow10[exponent];
+    } else {
+        value = mpack_json_slow_double(digits_start, p, mantissa, exponent);
+    }
+    if (negative)
+        value = -value;
+
+    if (value >= -3.4028234663852886e38 && value <= 3.4028234663852886e38 && (double)(float)value == value)
+        mpack_write_float(writer, (float)value);
+    else
+        mpack_write_double(writer, value);
+    return p;
+}
+
+// Parses a map key and the colon after it, starting at the opening quote
+static const char* mpack_json_parse_key(mpack_writer_t* writer, const char* p, const char* end) {
+    if (p == end || *p != '"')
+        return NULL;
+    p = mpack_json_parse_string(writer, p + 1, end);
+    if (p == NULL)
+        return NULL;
+    p = mpack_json_skip_whitespace(p, end);
+    if (p == end || *p != ':')
+        return NULL;
+    return p + 1;
+}
+
+// Parses and writes a literal, returning the position after it, or NULL
+// if it isn't one
+static const char* mpack_json_parse_literal(mpack_writer_t* writer, const char* p, const char* end) {
+    size_t left = (size_t)(end - p);
+    if (left >= 4 && mpack_memcmp(p, "null", 4) == 0) {
+        mpack_write_nil(writer);
+        return p + 4;
+    }
+    if (left >= 4 && mpack_memcmp(p, "true", 4) == 0) {
+        mpack_write_true(writer);
+        return p + 4;
+    }
+    if (left >= 5 && mpack_memcmp(p, "false", 5) == 0) {
+        mpack_write_false(writer);
+        return p + 5;
+    }
+    return NULL;
+}
+
+// Parses and writes a value and all of its children, leaving parser->p
+// after the value, or flagging mpack_error_invalid
+static void mpack_json_parse(mpack_json_parser_t* parser) {
+    mpack_writer_t* writer = parser->writer;
+    const char* p = parser->p;
+    const char* end = parser->end;
+    size_t depth = 0;
+
+    while (p != NULL && mpack_writer_error(writer) == mpack_ok) {
+
+        // parse a value
+        p = mpack_json_skip_whitespace(p, end);
+        if (p == end) {
+            p = NULL;
+            break;
+        }
+
+        char c = *p;
+        if (c == '[' || c == '{') {
+            bool map = c == '{';
+            if (parser->containers == parser->counted) {
+                p = NULL;
+                break;
+            }
+            size_t count = parser->counts[parser->containers++];
+            p = mpack_json_skip_whitespace(p + 1, end);
+            if (p != end && *p == (map ? '}' : ']'))
+                count = 0;
+            if (count > UINT32_MAX) {
+                mpack_writer_flag_error(writer, mpack_error_too_big);
+                break;
+            }
+            parser->stack[depth++] = map;
+            if (map)
+                mpack_start_map(writer, (uint32_t)count);
+            else
+                mpack_start_array(writer, (uint32_t)count);
+
+            if (count != 0) {
+                if (map)
+                    p = mpack_json_parse_key(writer, p, end);
+                continue;
+            }
+            // an empty container is closed below
+        } else if (c == '"') {
+            p = mpack_json_parse_string(writer, p + 1, end);
+        } else if (c == '-' || mpack_json_is_digit(c)) {
+            p = mpack_json_parse_number(writer, p, end);
+        } else {
+            p = mpack_json_parse_literal(writer, p, end);
+        }
+
+        // close containers and find the next value
+        while (p != NULL && depth != 0) {
+            p = mpack_json_skip_whitespace(p, end);
+            if (p == end) {
+                p = NULL;
+                break;
+            }
+            bool map = parser->stack[depth - 1] != 0;
+            if (*p == ',') {
+                p = mpack_json_skip_whitespace(p + 1, end);
+                if (map)
+                    p = mpack_json_parse_key(writer, p, end);
+                break;
+            }
+            if (*p != (map ? '}' : ']')) {
+                p = NULL;
+                break;
+            }
+            ++p;
+            --depth;
+            if (map)
+                mpack_finish_map(writer);
+            else
+                mpack_finish_array(writer);
+        }
+
+        if (depth == 0)
+            break;
+    }
+
+    if (p == NULL)
+        mpack_writer_flag_error(writer, mpack_error_invalid);
+    parser->p = p;
+}
+
+size_t mpack_write_json(mpack_writer_t* writer, const char* json, size_t length) {
+    if (mpack_writer_error(writer) != mpack_ok)
+        return 0;
+
+    mpack_json_parser_t parser;
+    parser.writer = writer;
+    parser.end = json + length;
+    parser.p = mpack_json_skip_whitespace(json, parser.end);
+    parser.counts = parser.counts_initial;
+    parser.counts_capacity = MPACK_JSON_INITIAL_COUNTS;
+    parser.counted = 0;
+    parser.containers = 0;
+    parser.stack = parser.stack_initial;
+    parser.stack_capacity = MPACK_JSON_INITIAL_STACK;
+
+    if (parser.p != parser.end && (*parser.p == '[' || *parser.p == '{')) {
+        if (mpack_json_count(&parser))
+            mpack_json_parse(&parser);
+    } else {
+        mpack_json_parse(&parser);
+    }
+
+    #ifdef MPACK_MALLOC
+    if (parser.counts != parser.counts_initial)
+        mpack_allocator_free(writer->allocator, parser.counts);
+    if (parser.stack != parser.stack_initial)
+        mpack_allocator_free(writer->allocator, parser.stack);
+    #endif
+
+    if (mpack_writer_error(writer) != mpack_ok)
+        return 0;
+    return (size_t)(mpack_json_skip_whitespace(parser.p, parser.end) - json);
+}
+
+#endif
+
+#endif
+
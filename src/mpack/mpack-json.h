@@ -0,0 +1,303 @@
+/*
+ * Copyright (c) 2015 Nicholas Fraser
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * @file
+ *
+ * Declares the MPack JSON API, which converts between MessagePack and JSON.
+ */
+
+#ifndef MPACK_JSON_H
+#define MPACK_JSON_H 1
+
+#include "mpack-node.h"
+
+MPACK_HEADER_START
+
+#if MPACK_JSON
+
+/**
+ * @defgroup json JSON API
+ *
+ * The MPack JSON API converts MessagePack to JSON text, either from a
+ * parsed node tree or directly from a reader. It also converts JSON text
+ * to MessagePack through a writer (see mpack_write_json().)
+ *
+ * MessagePack types without a JSON equivalent are converted as follows:
+ *
+ * - bin and ext data are written as base64 strings (the ext type is not
+ *   kept.)
+ * - Map keys that aren't strings are written as strings containing their
+ *   JSON, e.g. the key 7 is written as "7". Arrays and maps can't be
+ *   keys; they flag mpack_error_type.
+ * - Floats and doubles are written with as few digits as will read back
+ *   as the same value (very rarely one more), with ".0" added to whole
+ *   numbers. NaN and infinity are written as null.
+ *
+ * Strings are written as is, with all control characters, quotes and
+ * backslashes escaped. They should be UTF-8 for the output to be valid
+ * JSON.
+ *
+ * @{
+ */
+
+/**
+ * A buffered JSON writer.
+ *
+ * As with mpack_writer_t, the writer wraps an existing buffer and,
+ * optionally, a flush function. Text is built up in the buffer and
+ * passed to the flush function in large blocks.
+ */
+typedef struct mpack_json_writer_t mpack_json_writer_t;
+
+/**
+ * The JSON writer's flush function to flush the buffer to the output
+ * stream. It should flag an appropriate error on the writer if flushing
+ * fails (usually mpack_error_io.)
+ *
+ * The specified context for callbacks is at json->context.
+ */
+typedef void (*mpack_json_writer_flush_t)(mpack_json_writer_t* json, const char* buffer, size_t count);
+
+struct mpack_json_writer_t {
+    mpack_json_writer_flush_t flush; /* Function to write bytes to the output stream */
+    void* context;                   /* Context for writer callbacks */
+
+    char* buffer;        /* Byte buffer */
+    size_t size;         /* Size of the buffer */
+    size_t used;         /* How many bytes have been written into the buffer */
+    mpack_error_t error; /* Error state */
+    bool pretty;         /* Whether to indent nested elements on separate lines */
+
+    #ifdef MPACK_MALLOC
+    const mpack_allocator_t* allocator; /* Allocator for internal memory, or NULL for MPACK_MALLOC */
+    #endif
+};
+
+/**
+ * @name Core JSON Writer Functions
+ * @{
+ */
+
+/**
+ * Initializes a JSON writer with the given buffer. The writer does not
+ * assume ownership of the buffer.
+ *
+ * The writer writes compact JSON by default. Call
+ * mpack_json_writer_set_pretty() to indent it instead.
+ *
+ * Trying to write past the end of the buffer will result in mpack_error_io
+ * unless a flush function is set with mpack_json_writer_set_flush(). To use
+ * the text without flushing, call mpack_json_writer_buffer_used() to
+ * determine the number of bytes written.
+ *
+ * @param json The JSON writer.
+ * @param buffer The buffer into which to write JSON text.
+ * @param size The size of the buffer.
+ */
+void mpack_json_writer_init(mpack_json_writer_t* json, char* buffer, size_t size);
+
+/**
+ * Cleans up the JSON writer, flushing any buffered bytes to the
+ * underlying stream, if any. Returns the final error state of the
+ * writer.
+ */
+mpack_error_t mpack_json_writer_destroy(mpack_json_writer_t* json);
+
+/**
+ * Sets the custom pointer to pass to the writer callbacks.
+ */
+MPACK_INLINE void mpack_json_writer_set_context(mpack_json_writer_t* json, void* context) {
+    json->context = context;
+}
+
+/**
+ * Sets the flush function to write out the data when the buffer is full.
+ *
+ * If no flush function is used, trying to write past the end of the
+ * buffer will result in mpack_error_io.
+ *
+ * This should normally be called once right after initializing the writer.
+ */
+MPACK_INLINE void mpack_json_writer_set_flush(mpack_json_writer_t* json, mpack_json_writer_flush_t flush) {
+    mpack_assert(json->size != 0, "cannot use flush function without a writeable buffer!");
+    json->flush = flush;
+}
+
+/**
+ * Sets whether the writer writes pretty JSON, with the elements of arrays
+ * and maps on separate lines indented by two spaces per level, or compact
+ * JSON with no whitespace at all. The default is compact.
+ */
+MPACK_INLINE void mpack_json_writer_set_pretty(mpack_json_writer_t* json, bool pretty) {
+    json->pretty = pretty;
+}
+
+#ifdef MPACK_MALLOC
+/**
+ * Sets the allocator used for the stack of nested arrays and maps,
+ * replacing MPACK_MALLOC and MPACK_FREE. The stack is only allocated
+ * for deeply nested elements.
+ *
+ * The allocator is not copied; it must outlive the writer.
+ *
+ * @param json The JSON writer.
+ * @param allocator The allocator to use, or NULL to use MPACK_MALLOC and MPACK_FREE.
+ */
+MPACK_INLINE void mpack_json_writer_set_allocator(mpack_json_writer_t* json, const mpack_allocator_t* allocator) {
+    json->allocator = allocator;
+}
+#endif
+
+/**
+ * Returns the number of bytes currently stored in the buffer. This
+ * may be less than the total number of bytes written if bytes have
+ * been flushed to an underlying stream.
+ */
+MPACK_INLINE size_t mpack_json_writer_buffer_used(mpack_json_writer_t* json) {
+    return json->used;
+}
+
+/**
+ * Flushes any buffered bytes to the flush function.
+ *
+ * This is useful to write out each element of a long stream of JSON
+ * as it's written. It is not necessary before mpack_json_writer_destroy().
+ */
+void mpack_json_writer_flush(mpack_json_writer_t* json);
+
+/**
+ * Places the writer in the given error state. Only the first error is
+ * kept; later errors are ignored.
+ */
+void mpack_json_writer_flag_error(mpack_json_writer_t* json, mpack_error_t error);
+
+/**
+ * Queries the error state of the JSON writer.
+ *
+ * If a writer is in an error state, you should discard all data since the
+ * last time the error flag was checked. The error flag cannot be cleared.
+ */
+MPACK_INLINE mpack_error_t mpack_json_writer_error(mpack_json_writer_t* json) {
+    return json->error;
+}
+
+/**
+ * @}
+ */
+
+/**
+ * @name JSON Writing Functions
+ * @{
+ */
+
+/**
+ * Writes text to the JSON writer as is. This can be used for separators
+ * between elements, such as a newline between the records of a log.
+ */
+void mpack_json_write_bytes(mpack_json_writer_t* json, const char* data, size_t count);
+
+#if MPACK_NODE
+/**
+ * Writes the node and all of its children as JSON.
+ *
+ * The tree is walked iteratively, so deeply nested data doesn't overflow
+ * the call stack. If the node's tree is in an error state, the error is
+ * flagged on the JSON writer as well.
+ */
+void mpack_json_write_node(mpack_json_writer_t* json, mpack_node_t node);
+#endif
+
+#if MPACK_READER
+/**
+ * Reads the next element and all of its children from the reader, and
+ * writes it as JSON.
+ *
+ * This doesn't need a tree, so it can convert messages of any size with
+ * a fixed amount of memory. Strings and data that don't fit in the
+ * reader's buffer are converted in chunks.
+ *
+ * Errors are flagged on both the reader and the JSON writer, since the
+ * rest of the element is not read after an error of either one
+ * (including mpack_error_type for unsupported map keys.)
+ */
+void mpack_json_write_element(mpack_json_writer_t* json, mpack_reader_t* reader);
+#endif
+
+/**
+ * @}
+ */
+
+#if MPACK_WRITER
+/**
+ * @name JSON Parsing Functions
+ * @{
+ */
+
+/**
+ * Parses one JSON value from the given text and writes it to the writer
+ * as MessagePack, without building a tree.
+ *
+ * Integers are written with the smallest int or uint encoding that holds
+ * them. Other numbers are written as a float if it holds the same value,
+ * or as a double otherwise. Strings are unescaped; surrogate pair escapes
+ * are combined, and unpaired surrogates are replaced with U+FFFD. Strings
+ * are not otherwise checked for valid UTF-8.
+ *
+ * Arrays and maps are scanned once to count their elements before being
+ * parsed. One count is stored for every array and map in the value, not
+ * just the open ones, so the memory used grows with the number of
+ * containers: a top-level array of N objects needs N + 1 counts. The
+ * counts are kept on the call stack and moved to memory from the writer's
+ * allocator for large documents. Without MPACK_MALLOC, a document with
+ * more than 256 arrays and maps in total, or nested more than 32 deep,
+ * flags mpack_error_too_big.
+ * Without MPACK_STDLIB, numbers with more than 15 significant digits or
+ * large exponents may be off by one unit in the last place.
+ *
+ * If the JSON is invalid, mpack_error_invalid is flagged on the writer,
+ * and the writer may contain a partial value.
+ *
+ * @param writer The writer to write the value to.
+ * @param json The JSON text.
+ * @param length The length of the JSON text in bytes.
+ * @return The number of bytes used from the text, including whitespace
+ *     after the value, or 0 if an error occurred. Compare this to the
+ *     length to check that the text contains only one value, or use it to
+ *     parse a stream of concatenated values.
+ */
+size_t mpack_write_json(mpack_writer_t* writer, const char* json, size_t length);
+
+/**
+ * @}
+ */
+#endif
+
+/**
+ * @}
+ */
+
+#endif
+
+MPACK_HEADER_END
+
+#endif
+
@@ -31,28 +31,84 @@
  * Tree Parsing
  */
 
-typedef struct mpack_level_t {
-    mpack_node_data_t* child;
-    size_t left; // children left in level
-} mpack_level_t;
+/*
+ * Reads more data from a stream tree until at least the given number of
+ * unclaimed bytes are available past the parse position. If the tree is
+ * not a stream there is no more data, so the message is truncated.
+ *
+ * If the read function has no data available yet, the parser is marked
+ * suspended. The caller must bail out of the current node, and the parse
+ * loop rewinds to the start of the node to parse it again later.
+ */
+static bool mpack_tree_reserve_fill(mpack_tree_parser_t* parser, size_t bytes) {
+    mpack_tree_t* tree = parser->tree;
 
-typedef struct mpack_tree_parser_t {
-    mpack_tree_t* tree;
-    const char* data;
-    size_t left; // bytes left in data
-    size_t possible_nodes_left;
+    #ifdef MPACK_MALLOC
+    if (tree->read_fn) {
+        while (parser->possible_nodes_left < bytes) {
+
+            // The message can't be bigger than the maximum buffer size
+            size_t needed = bytes - parser->possible_nodes_left;
+            if (needed > tree->max_size - tree->data_length) {
+                mpack_tree_flag_error(tree, mpack_error_too_big);
+                return false;
+            }
+
+            // Grow the buffer if the needed bytes don't fit
+            if (needed > tree->buffer_capacity - tree->data_length) {
+                size_t new_capacity = tree->buffer_capacity;
+                while (new_capacity - tree->data_length < needed)
+                    new_capacity = (new_capacity > tree->max_size / 2) ? tree->max_size : new_capacity * 2;
+                mpack_log("growing stream buffer to %i bytes\n", (int)new_capacity);
+
+                char* new_buffer = (char*)mpack_allocator_realloc(tree->allocator, tree->buffer, tree->data_length, new_capacity);
+                if (new_buffer == NULL) {
+                    mpack_tree_flag_error(tree, mpack_error_memory);
+                    return false;
+                }
+                parser->data = new_buffer + (parser->data - tree->data);
+                tree->buffer = new_buffer;
+                tree->data = new_buffer;
+                tree->buffer_capacity = new_capacity;
+            }
+
+            size_t space = tree->buffer_capacity - tree->data_length;
+            size_t read = tree->read_fn(tree, tree->buffer + tree->data_length, space);
+            if (mpack_tree_error(tree) != mpack_ok)
+                return false;
+            if (read > space) {
+                mpack_break("read function read more bytes than requested!");
+                mpack_tree_flag_error(tree, mpack_error_bug);
+                return false;
+            }
+            if (read == 0) {
+                parser->suspended = true;
+                return false;
+            }
+
+            tree->data_length += read;
+            parser->left += read;
+            parser->possible_nodes_left += read;
+        }
+        return true;
+    }
+    #endif
 
-    size_t level;
-    size_t depth;
-    mpack_level_t* stack;
-    bool stack_allocated;
-} mpack_tree_parser_t;
+    mpack_tree_flag_error(tree, mpack_error_invalid);
+    return false;
+}
+
+// Ensures there are at least the given number of unclaimed bytes left in
+// the data, reading more from the stream if needed.
+MPACK_STATIC_INLINE_SPEED bool mpack_tree_reserve_bytes(mpack_tree_parser_t* parser, size_t bytes) {
+    if (bytes <= parser->possible_nodes_left)
+        return true;
+    return mpack_tree_reserve_fill(parser, bytes);
+}
 
 MPACK_STATIC_INLINE_SPEED uint8_t mpack_tree_u8(mpack_tree_parser_t* parser) {
-    if (parser->possible_nodes_left < sizeof(uint8_t)) {
-        mpack_tree_flag_error(parser->tree, mpack_error_invalid);
+    if (!mpack_tree_reserve_bytes(parser, sizeof(uint8_t)))
         return 0;
-    }
     uint8_t val = mpack_load_native_u8(parser->data);
     parser->data += sizeof(uint8_t);
     parser->left -= sizeof(uint8_t);
@@ -61,10 +117,8 @@ MPACK_STATIC_INLINE_SPEED uint8_t mpack_tree_u8(mpack_tree_parser_t* parser) {
 }
 
 MPACK_STATIC_INLINE_SPEED uint16_t mpack_tree_u16(mpack_tree_parser_t* parser) {
-    if (parser->possible_nodes_left < sizeof(uint16_t)) {
-        mpack_tree_flag_error(parser->tree, mpack_error_invalid);
+    if (!mpack_tree_reserve_bytes(parser, sizeof(uint16_t)))
         return 0;
-    }
     uint16_t val = mpack_load_native_u16(parser->data);
     parser->data += sizeof(uint16_t);
     parser->left -= sizeof(uint16_t);
@@ -73,10 +127,8 @@ MPACK_STATIC_INLINE_SPEED uint16_t mpack_tree_u16(mpack_tree_parser_t* parser) {
 }
 
 MPACK_STATIC_INLINE_SPEED uint32_t mpack_tree_u32(mpack_tree_parser_t* parser) {
-    if (parser->possible_nodes_left < sizeof(uint32_t)) {
-        mpack_tree_flag_error(parser->tree, mpack_error_invalid);
+    if (!mpack_tree_reserve_bytes(parser, sizeof(uint32_t)))
         return 0;
-    }
     uint32_t val = mpack_load_native_u32(parser->data);
     parser->data += sizeof(uint32_t);
     parser->left -= sizeof(uint32_t);
@@ -85,10 +137,8 @@ MPACK_STATIC_INLINE_SPEED uint32_t mpack_tree_u32(mpack_tree_parser_t* parser) {
 }
 
 MPACK_STATIC_INLINE_SPEED uint64_t mpack_tree_u64(mpack_tree_parser_t* parser) {
-    if (parser->possible_nodes_left < sizeof(uint64_t)) {
-        mpack_tree_flag_error(parser->tree, mpack_error_invalid);
+    if (!mpack_tree_reserve_bytes(parser, sizeof(uint64_t)))
         return 0;
-    }
     uint64_t val = mpack_load_native_u64(parser->data);
     parser->data += sizeof(uint64_t);
     parser->left -= sizeof(uint64_t);
@@ -119,9 +169,594 @@ MPACK_STATIC_INLINE_SPEED double mpack_tree_double(mpack_tree_parser_t* parser)
     return u.d;
 }
 
+// The hash functions for map keys, used for map indexes and multi-key
+// lookups. Hashes are never stored so they don't need to be stable
+// across platforms.
+
+MPACK_STATIC_INLINE uint32_t mpack_node_hash_u64(uint64_t value) {
+    // MurmurHash3 finalizer. Signed keys are hashed by their two's
+    // complement so that equal int and uint keys hash the same.
+    value ^= value >> 33;
+    value *= UINT64_C(0xff51afd7ed558ccd);
+    value ^= value >> 33;
+    value *= UINT64_C(0xc4ceb9fe1a85ec53);
+    value ^= value >> 33;
+    return (uint32_t)value;
+}
+
+MPACK_STATIC_INLINE uint32_t mpack_node_hash_str(const char* str, size_t length) {
+    // Keys are mixed in eight bytes at a time.
+    uint64_t hash = length;
+    while (length >= sizeof(uint64_t)) {
+        uint64_t word;
+        mpack_memcpy(&word, str, sizeof(word));
+        hash = (hash ^ word) * UINT64_C(0x9e3779b97f4a7c15);
+        hash ^= hash >> 32;
+        str += sizeof(uint64_t);
+        length -= sizeof(uint64_t);
+    }
+    uint64_t tail = 0;
+    for (size_t i = 0; i < length; ++i)
+        tail = (tail << 8) | (uint8_t)str[i];
+    return mpack_node_hash_u64(hash ^ tail);
+}
+
+#if MPACK_NODE_MAP_INDEX_THRESHOLD
+/*
+ * A map index is an open-addressed hash table of the map's keys stored in
+ * the nodes immediately following its children. Each slot is a uint32_t
+ * holding the index of a key/value pair plus one, or zero if the slot is
+ * empty. The table is at most half full so probe sequences are short and
+ * always terminate.
+ *
+ * If a map's keys are all non-negative integers less than twice its
+ * count, such as the field tags of a struct, the index is instead a table
+ * of pairs by key (MPACK_NODE_FLAG_DENSE_INT) so that looking up an
+ * integer key is a single slot access.
+ *
+ * The slots are packed into the raw storage of the nodes. They are always
+ * accessed with memcpy() so as not to violate strict aliasing (the nodes
+ * may be in a pool of declared type mpack_node_data_t.)
+ */
+
+MPACK_STATIC_INLINE size_t mpack_node_map_index_capacity(size_t count) {
+    size_t capacity = 4;
+    while (capacity < count * 2)
+        capacity *= 2;
+    return capacity;
+}
+
+MPACK_STATIC_INLINE size_t mpack_node_map_index_nodes(size_t count) {
+    size_t bytes = mpack_node_map_index_capacity(count) * sizeof(uint32_t);
+    return (bytes + sizeof(mpack_node_data_t) - 1) / sizeof(mpack_node_data_t);
+}
+
+MPACK_STATIC_INLINE uint32_t mpack_node_map_index_get(const mpack_node_data_t* index, size_t slot) {
+    uint32_t entry;
+    mpack_memcpy(&entry, (const char*)index + slot * sizeof(uint32_t), sizeof(entry));
+    return entry;
+}
+
+MPACK_STATIC_INLINE void mpack_node_map_index_set(mpack_node_data_t* index, size_t slot, uint32_t entry) {
+    mpack_memcpy((char*)index + slot * sizeof(uint32_t), &entry, sizeof(entry));
+}
+
+// Returns true if the key can be stored in a dense table of the given
+// number of slots.
+MPACK_STATIC_INLINE bool mpack_node_key_is_dense(mpack_node_data_t* key, size_t slots) {
+    return (key->type == mpack_type_uint || (key->type == mpack_type_int && key->value.i >= 0)) &&
+        key->value.u < (uint64_t)slots;
+}
+
+static void mpack_tree_index_map(mpack_tree_t* tree, mpack_node_data_t* map) {
+    size_t count = map->len;
+    size_t mask = mpack_node_map_index_capacity(count) - 1;
+    mpack_node_data_t* index = map->value.children + count * 2;
+    mpack_memset(index, 0, sizeof(mpack_node_data_t) * mpack_node_map_index_nodes(count));
+
+    size_t dense = 0;
+    while (dense < count && mpack_node_key_is_dense(map->value.children + dense * 2, count * 2))
+        ++dense;
+    if (dense == count) {
+        for (size_t i = 0; i < count; ++i) {
+            size_t slot = (size_t)map->value.children[i * 2].value.u;
+            if (mpack_node_map_index_get(index, slot) == 0) // the first of duplicate keys is kept
+                mpack_node_map_index_set(index, slot, (uint32_t)(i + 1));
+        }
+        map->flags = (uint8_t)((map->flags & ~MPACK_NODE_FLAG_INDEXED) | MPACK_NODE_FLAG_DENSE_INT);
+        return;
+    }
+
+    // Keys are inserted in order, so the first of any duplicate keys
+    // comes first in its probe sequence, same as with a linear search.
+    for (size_t i = 0; i < count; ++i) {
+        mpack_node_data_t* key = map->value.children + i * 2;
+        uint32_t hash;
+        if (key->type == mpack_type_str)
+            hash = mpack_node_hash_str(tree->data + key->value.offset, key->len);
+        else if (key->type == mpack_type_uint)
+            hash = mpack_node_hash_u64(key->value.u);
+        else if (key->type == mpack_type_int)
+            hash = mpack_node_hash_u64((uint64_t)key->value.i);
+        else
+            continue;
+
+        size_t slot = hash & mask;
+        while (mpack_node_map_index_get(index, slot) != 0)
+            slot = (slot + 1) & mask;
+        mpack_node_map_index_set(index, slot, (uint32_t)(i + 1));
+    }
+}
+#endif
+
+#if MPACK_NODE_MAP_SORTED_THRESHOLD
+// The compare functions return less than, equal to or greater than zero
+// if the key node orders before, equal to or after the given key. The
+// data is that of the tree containing the key.
+
+MPACK_STATIC_INLINE int mpack_node_compare_str(const char* data, mpack_node_data_t* key, const char* str, size_t length) {
+    size_t key_length = key->len;
+    int result = mpack_memcmp(data + key->value.offset, str, (key_length < length) ? key_length : length);
+    if (result != 0)
+        return result;
+    if (key_length < length)
+        return -1;
+    return (key_length > length) ? 1 : 0;
+}
+
+MPACK_STATIC_INLINE int mpack_node_compare_int(mpack_node_data_t* key, int64_t num) {
+    if (key->type == mpack_type_int) {
+        if (key->value.i < num)
+            return -1;
+        return (key->value.i > num) ? 1 : 0;
+    }
+    if (num < 0 || key->value.u > (uint64_t)num)
+        return 1;
+    return (key->value.u < (uint64_t)num) ? -1 : 0;
+}
+
+MPACK_STATIC_INLINE int mpack_node_compare_uint(mpack_node_data_t* key, uint64_t num) {
+    if (key->type == mpack_type_int) {
+        if (key->value.i < 0 || (uint64_t)key->value.i < num)
+            return -1;
+        return ((uint64_t)key->value.i > num) ? 1 : 0;
+    }
+    if (key->value.u < num)
+        return -1;
+    return (key->value.u > num) ? 1 : 0;
+}
+
+// Returns the sorted flag for the map's keys, or 0 if they are not all
+// strings or all integers in strictly increasing order. Duplicate keys
+// are not sorted so a binary search always finds the first match, same
+// as a linear search.
+static uint8_t mpack_tree_map_sorted_flag(mpack_tree_t* tree, mpack_node_data_t* map) {
+    mpack_node_data_t* children = map->value.children;
+    size_t count = map->len;
+
+    if (children[0].type == mpack_type_str) {
+        for (size_t i = 1; i < count; ++i) {
+            mpack_node_data_t* prev = children + (i - 1) * 2;
+            mpack_node_data_t* key = children + i * 2;
+            if (key->type != mpack_type_str || mpack_node_compare_str(tree->data, key, tree->data + prev->value.offset, prev->len) <= 0)
+                return 0;
+        }
+        return MPACK_NODE_FLAG_SORTED_STR;
+    }
+
+    if (children[0].type == mpack_type_int || children[0].type == mpack_type_uint) {
+        for (size_t i = 1; i < count; ++i) {
+            mpack_node_data_t* prev = children + (i - 1) * 2;
+            mpack_node_data_t* key = children + i * 2;
+            if (key->type != mpack_type_int && key->type != mpack_type_uint)
+                return 0;
+            int result = (prev->type == mpack_type_int) ?
+                    mpack_node_compare_int(key, prev->value.i) :
+                    mpack_node_compare_uint(key, prev->value.u);
+            if (result <= 0)
+                return 0;
+        }
+        return MPACK_NODE_FLAG_SORTED_INT;
+    }
+
+    return 0;
+}
+#endif
+
+#if MPACK_NODE_MAP_INDEX_THRESHOLD || MPACK_NODE_MAP_SORTED_THRESHOLD
+// Called when all of a map's children have been parsed.
+static void mpack_tree_finish_map(mpack_tree_t* tree, mpack_node_data_t* map) {
+    #if MPACK_NODE_MAP_INDEX_THRESHOLD
+    if (map->flags & MPACK_NODE_FLAG_INDEXED)
+        mpack_tree_index_map(tree, map);
+    #endif
+    #if MPACK_NODE_MAP_SORTED_THRESHOLD
+    if (map->len >= MPACK_NODE_MAP_SORTED_THRESHOLD)
+        map->flags |= mpack_tree_map_sorted_flag(tree, map);
+    #endif
+}
+#endif
+
+// Skips bytes of the data that don't need to be parsed into nodes.
+MPACK_STATIC_INLINE bool mpack_tree_skip_bytes(mpack_tree_parser_t* parser, size_t length) {
+    if (!mpack_tree_reserve_bytes(parser, length))
+        return false;
+    parser->data += length;
+    parser->left -= length;
+    parser->possible_nodes_left -= length;
+    return true;
+}
+
+// Skips over the children of a compound type in a lazy tree without
+// creating nodes for them, leaving the node unexpanded. Its children are
+// parsed by mpack_tree_expand_node() on first access.
+static void mpack_tree_skip_children(mpack_tree_parser_t* parser, mpack_node_data_t* node) {
+    node->flags = MPACK_NODE_FLAG_UNEXPANDED;
+    node->value.offset = (size_t)(parser->data - parser->tree->data);
+
+    // This counts all elements left to skip at any depth. Each element is
+    // at least one byte, so the count can't exceed the data left. (Lazy
+    // trees are never streams so all of the data is available.)
+    uint64_t count = (node->type == mpack_type_map) ? (uint64_t)node->len * 2 : node->len;
+
+    while (count != 0) {
+        if (count > parser->possible_nodes_left) {
+            mpack_tree_flag_error(parser->tree, mpack_error_invalid);
+            return;
+        }
+        --count;
+
+        uint8_t type = mpack_tree_u8(parser);
+        size_t length = 0;
+
+        if (type <= 0x7f || type >= 0xe0) {
+            // fixints have no payload
+        } else if (type <= 0x8f) {
+            count += (uint64_t)(type & 0x0f) * 2;
+        } else if (type <= 0x9f) {
+            count += type & 0x0f;
+        } else if (type <= 0xbf) {
+            length = type & 0x1f;
+        } else {
+            switch (type) {
+                case 0xc0: case 0xc2: case 0xc3:    break;
+                case 0xc4: case 0xd9:               length = mpack_tree_u8(parser); break;
+                case 0xc5: case 0xda:               length = mpack_tree_u16(parser); break;
+                case 0xc6: case 0xdb:               length = mpack_tree_u32(parser); break;
+                case 0xc7:                          length = (size_t)mpack_tree_u8(parser) + 1; break;
+                case 0xc8:                          length = (size_t)mpack_tree_u16(parser) + 1; break;
+                case 0xc9:                          length = (size_t)mpack_tree_u32(parser) + 1; break;
+                case 0xcc: case 0xd0:               length = 1; break;
+                case 0xcd: case 0xd1: case 0xd4:    length = 2; break;
+                case 0xd5:                          length = 3; break;
+                case 0xca: case 0xce: case 0xd2:    length = 4; break;
+                case 0xd6:                          length = 5; break;
+                case 0xcb: case 0xcf: case 0xd3:    length = 8; break;
+                case 0xd7:                          length = 9; break;
+                case 0xd8:                          length = 17; break;
+                case 0xdc:                          count += mpack_tree_u16(parser); break;
+                case 0xdd:                          count += mpack_tree_u32(parser); break;
+                case 0xde:                          count += (uint64_t)mpack_tree_u16(parser) * 2; break;
+                case 0xdf:                          count += (uint64_t)mpack_tree_u32(parser) * 2; break;
+                default:
+                    mpack_tree_flag_error(parser->tree, mpack_error_invalid);
+                    return;
+            }
+        }
+
+        if (mpack_tree_error(parser->tree) != mpack_ok || !mpack_tree_skip_bytes(parser, length))
+            return;
+    }
+}
+
+// Checks that a string is valid UTF-8 for mpack_validate(). Most strings
+// are ASCII, so the whole string is first checked eight bytes at a time
+// for any non-ASCII bytes before decoding it.
+static bool mpack_validate_utf8(const char* str, size_t length) {
+    uint64_t bits = 0;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+        uint64_t word;
+        mpack_memcpy(&word, str + i, sizeof(word));
+        bits |= word;
+    }
+    uint64_t tail = 0;
+    mpack_memcpy(&tail, str + i, length - i);
+    if (((bits | tail) & UINT64_C(0x8080808080808080)) == 0)
+        return true;
+    return mpack_utf8_check((char*)str, length);
+}
+
+/*
+ * Walks the message at the start of the data without creating nodes,
+ * checking the given limits (if any.) This returns the number of bytes
+ * in the message and the number of nodes a tree would use to parse it,
+ * including map indexes.
+ */
+static mpack_error_t mpack_tree_scan(const char* data, size_t length, const mpack_validate_limits_t* limits,
+        size_t* size, uint64_t* node_count)
+{
+    size_t max_depth = limits ? limits->max_depth : 0;
+    size_t max_nodes = limits ? limits->max_nodes : 0;
+    bool check_utf8 = limits ? limits->check_utf8 : false;
+    if (max_depth > MPACK_NODE_MAX_DEPTH_WITHOUT_MALLOC) {
+        mpack_break("max_depth %i exceeds MPACK_NODE_MAX_DEPTH_WITHOUT_MALLOC!", (int)max_depth);
+        return mpack_error_bug;
+    }
+
+    // As in mpack_tree_skip_children(), this counts all elements left to
+    // check at any depth. Each is at least one byte, so as with the
+    // parser's possible_nodes_left, the count can't exceed the data left.
+    // The elements left at each level are only counted to enforce a depth
+    // limit. The data is never a stream so it is walked directly rather
+    // than through a parser.
+    const char* p = data;
+    const char* end = data + length;
+    uint64_t count = 1;
+    uint64_t nodes = 0;
+    uint64_t index_nodes = 0;
+    uint64_t levels[MPACK_NODE_MAX_DEPTH_WITHOUT_MALLOC + 1];
+    size_t depth = 0;
+    levels[0] = 1;
+
+    while (count != 0) {
+        size_t left = (size_t)(end - p);
+        if (count > left)
+            return mpack_error_invalid;
+        if (max_nodes != 0 && count > max_nodes - nodes)
+            return mpack_error_too_big;
+        --count;
+        ++nodes;
+        if (max_depth != 0) {
+            while (levels[depth] == 0)
+                --depth;
+            --levels[depth];
+        }
+
+        uint8_t type = (uint8_t)*p++;
+        --left;
+        if (type <= 0x7f || type >= 0xe0)
+            continue;
+
+        uint64_t bytes = 0; // the payload, not including any length field
+        size_t width = 0;   // the width of the length field
+        size_t extra = 0;   // an ext type byte, counted in the payload
+        bool compound = false;
+        bool pairs = false;
+        bool str = false;
+
+        if (type <= 0x8f) {
+            bytes = type & 0x0f;
+            compound = pairs = true;
+        } else if (type <= 0x9f) {
+            bytes = type & 0x0f;
+            compound = true;
+        } else if (type <= 0xbf) {
+            bytes = type & 0x1f;
+            str = true;
+        } else {
+            switch (type) {
+                case 0xc0: case 0xc2: case 0xc3:    break;
+                case 0xc4:                          width = 1; break;
+                case 0xc5:                          width = 2; break;
+                case 0xc6:                          width = 4; break;
+                case 0xd9:                          width = 1; str = true; break;
+                case 0xda:                          width = 2; str = true; break;
+                case 0xdb:                          width = 4; str = true; break;
+                case 0xc7:                          width = 1; extra = 1; break;
+                case 0xc8:                          width = 2; extra = 1; break;
+                case 0xc9:                          width = 4; extra = 1; break;
+                case 0xcc: case 0xd0:               bytes = 1; break;
+                case 0xcd: case 0xd1: case 0xd4:    bytes = 2; break;
+                case 0xd5:                          bytes = 3; break;
+                case 0xca: case 0xce: case 0xd2:    bytes = 4; break;
+                case 0xd6:                          bytes = 5; break;
+                case 0xcb: case 0xcf: case 0xd3:    bytes = 8; break;
+                case 0xd7:                          bytes = 9; break;
+                case 0xd8:                          bytes = 17; break;
+                case 0xdc:                          width = 2; compound = true; break;
+                case 0xdd:                          width = 4; compound = true; break;
+                case 0xde:                          width = 2; compound = pairs = true; break;
+                case 0xdf:                          width = 4; compound = pairs = true; break;
+                default:
+                    return mpack_error_invalid;
+            }
+
+            if (width != 0) {
+                if (width > left)
+                    return mpack_error_invalid;
+                if (width == 1)
+                    bytes = mpack_load_native_u8(p);
+                else if (width == 2)
+                    bytes = mpack_load_native_u16(p);
+                else
+                    bytes = mpack_load_native_u32(p);
+                bytes += extra;
+                p += width;
+                left -= width;
+            }
+        }
+
+        if (compound) {
+            uint64_t children = pairs ? bytes * 2 : bytes;
+            count += children;
+            #if MPACK_NODE_MAP_INDEX_THRESHOLD
+            if (pairs && bytes >= MPACK_NODE_MAP_INDEX_THRESHOLD)
+                index_nodes += mpack_node_map_index_nodes((size_t)bytes);
+            #endif
+            if (max_depth != 0) {
+                if (depth == max_depth)
+                    return mpack_error_too_big;
+                if (children != 0)
+                    levels[++depth] = children;
+            }
+            continue;
+        }
+
+        if (bytes > left)
+            return mpack_error_invalid;
+        if (str && check_utf8 && !mpack_validate_utf8(p, (size_t)bytes))
+            return mpack_error_type;
+        p += (size_t)bytes;
+    }
+
+    *size = (size_t)(p - data);
+    *node_count = nodes + index_nodes;
+    return mpack_ok;
+}
+
+mpack_error_t mpack_validate(const char* data, size_t length, const mpack_validate_limits_t* limits) {
+    size_t size;
+    uint64_t node_count;
+    mpack_error_t error = mpack_tree_scan(data, length, limits, &size, &node_count);
+    if (error == mpack_ok && size != length)
+        return mpack_error_invalid;
+    return error;
+}
+
+size_t mpack_tree_count_nodes(const char* data, size_t length) {
+    size_t size;
+    uint64_t node_count;
+    if (mpack_tree_scan(data, length, NULL, &size, &node_count) != mpack_ok || node_count > SIZE_MAX)
+        return 0;
+    return (size_t)node_count;
+}
+
+/*
+ * Parses a run of numbers of the same encoding at the start of an array's
+ * elements. Long arrays of numbers are common, and decoding them in a
+ * tight loop for one encoding is much faster than going through the
+ * switch in mpack_tree_parse_nodes() for each one.
+ *
+ * Only elements whose bytes are already available are parsed. Anything
+ * after the run is left to the main parsing loop.
+ */
+
+#define MPACK_TREE_PARSE_RUN(node_type, field, load) \
+    for (; count < max && (uint8_t)*data == type; ++count) { \
+        node[count].type = node_type; \
+        node[count].value.field = load(data + 1); \
+        data += width + 1; \
+    }
+
+MPACK_STATIC_INLINE int8_t  mpack_tree_run_i8 (const char* p) {return (int8_t) mpack_load_native_u8(p);}
+MPACK_STATIC_INLINE int16_t mpack_tree_run_i16(const char* p) {return (int16_t)mpack_load_native_u16(p);}
+MPACK_STATIC_INLINE int32_t mpack_tree_run_i32(const char* p) {return (int32_t)mpack_load_native_u32(p);}
+MPACK_STATIC_INLINE int64_t mpack_tree_run_i64(const char* p) {return (int64_t)mpack_load_native_u64(p);}
+
+MPACK_STATIC_INLINE float mpack_tree_run_float(const char* p) {
+    union {
+        float f;
+        uint32_t i;
+    } u;
+    u.i = mpack_load_native_u32(p);
+    return u.f;
+}
+
+MPACK_STATIC_INLINE double mpack_tree_run_double(const char* p) {
+    union {
+        double d;
+        uint64_t i;
+    } u;
+    u.i = mpack_load_native_u64(p);
+    return u.d;
+}
+
+static void mpack_tree_parse_run(mpack_tree_parser_t* parser) {
+    mpack_level_t* level = parser->stack + parser->level;
+    mpack_node_data_t* node = level->child;
+    const char* data = parser->data;
+    size_t count = 0;
+
+    if (parser->left == 0)
+        return;
+    uint8_t type = (uint8_t)*data;
+
+    if (type <= 0x7f || type >= 0xe0) {
+        // Positive and negative fixints are often mixed, so they make one
+        // run. They have no payload so they're all available.
+        size_t max = level->left;
+        for (; count < max; ++count) {
+            uint8_t byte = (uint8_t)data[count];
+            if (byte > 0x7f && byte < 0xe0)
+                break;
+            node[count].type = (byte <= 0x7f) ? mpack_type_uint : mpack_type_int;
+            node[count].value.i = (int8_t)byte;
+        }
+        data += count;
+
+    } else {
+        size_t width;
+        switch (type) {
+            case 0xcc: case 0xd0:               width = 1; break;
+            case 0xcd: case 0xd1:               width = 2; break;
+            case 0xca: case 0xce: case 0xd2:    width = 4; break;
+            case 0xcb: case 0xcf: case 0xd3:    width = 8; break;
+            default:
+                return;
+        }
+
+        // The first byte of each element is already claimed, so the
+        // elements can read as many more bytes as there are possible
+        // nodes left.
+        size_t max = parser->possible_nodes_left / width;
+        if (max > level->left)
+            max = level->left;
+
+        switch (type) {
+            case 0xcc: MPACK_TREE_PARSE_RUN(mpack_type_uint, u, mpack_load_native_u8); break;
+            case 0xcd: MPACK_TREE_PARSE_RUN(mpack_type_uint, u, mpack_load_native_u16); break;
+            case 0xce: MPACK_TREE_PARSE_RUN(mpack_type_uint, u, mpack_load_native_u32); break;
+            case 0xcf: MPACK_TREE_PARSE_RUN(mpack_type_uint, u, mpack_load_native_u64); break;
+            case 0xd0: MPACK_TREE_PARSE_RUN(mpack_type_int, i, mpack_tree_run_i8); break;
+            case 0xd1: MPACK_TREE_PARSE_RUN(mpack_type_int, i, mpack_tree_run_i16); break;
+            case 0xd2: MPACK_TREE_PARSE_RUN(mpack_type_int, i, mpack_tree_run_i32); break;
+            case 0xd3: MPACK_TREE_PARSE_RUN(mpack_type_int, i, mpack_tree_run_i64); break;
+            case 0xca: MPACK_TREE_PARSE_RUN(mpack_type_float, f, mpack_tree_run_float); break;
+            case 0xcb: MPACK_TREE_PARSE_RUN(mpack_type_double, d, mpack_tree_run_double); break;
+            default: break;
+        }
+        parser->possible_nodes_left -= count * width;
+    }
+
+    if (count != 0) {
+        mpack_log("parsed run of %i numbers of type 0x%x\n", (int)count, (int)type);
+
+        #if MPACK_NODE_RAW
+        // All numbers in the run have the same size
+        size_t offset = (size_t)(parser->data - parser->tree->data);
+        size_t size = (size_t)(data - parser->data) / count;
+        for (size_t i = 0; i < count; ++i) {
+            node[i].raw_offset = offset + i * size;
+            node[i].raw_size = size;
+        }
+        #endif
+    }
+    parser->left -= (size_t)(data - parser->data);
+    parser->data = data;
+    level->child += count;
+    level->left -= count;
+}
+
+#undef MPACK_TREE_PARSE_RUN
+
 static void mpack_tree_parse_children(mpack_tree_parser_t* parser, mpack_node_data_t* node) {
-    mpack_type_t type = node->type;
-    size_t total = node->value.content.n;
+    mpack_type_t type = (mpack_type_t)node->type;
+    size_t total = node->len;
+    size_t index_nodes = 0;
+    #if MPACK_NODE_MAP_INDEX_THRESHOLD || MPACK_NODE_MAP_SORTED_THRESHOLD
+    bool finish_map = false;
+    #endif
+
+    // A lazy tree only parses the children of the root or of the node
+    // being expanded. Anything deeper is skipped.
+    if (parser->tree->lazy && parser->level != 0) {
+        if (total == 0)
+            node->flags = 0;
+        else
+            mpack_tree_skip_children(parser, node);
+        return;
+    }
 
     // Make sure we have enough room in the stack
     if (parser->level + 1 == parser->depth) {
@@ -131,7 +766,7 @@ static void mpack_tree_parse_children(mpack_tree_parser_t* parser, mpack_node_da
 
         // Replace the stack-allocated parsing stack
         if (parser->stack_allocated) {
-            mpack_level_t* new_stack = (mpack_level_t*)MPACK_MALLOC(sizeof(mpack_level_t) * new_depth);
+            mpack_level_t* new_stack = (mpack_level_t*)mpack_allocator_alloc(parser->tree->allocator, sizeof(mpack_level_t) * new_depth);
             if (!new_stack) {
                 mpack_tree_flag_error(parser->tree, mpack_error_memory);
                 parser->level = 0;
@@ -143,12 +778,14 @@ static void mpack_tree_parse_children(mpack_tree_parser_t* parser, mpack_node_da
 
         // Realloc the allocated parsing stack
         } else {
-            parser->stack = (mpack_level_t*)mpack_realloc(parser->stack, sizeof(mpack_level_t) * parser->depth, sizeof(mpack_level_t) * new_depth);
-            if (!parser->stack) {
+            mpack_level_t* new_stack = (mpack_level_t*)mpack_allocator_realloc(parser->tree->allocator, parser->stack,
+                    sizeof(mpack_level_t) * parser->depth, sizeof(mpack_level_t) * new_depth);
+            if (!new_stack) {
                 mpack_tree_flag_error(parser->tree, mpack_error_memory);
                 parser->level = 0;
                 return;
             }
+            parser->stack = new_stack;
         }
         parser->depth = new_depth;
         #else
@@ -166,22 +803,56 @@ static void mpack_tree_parse_children(mpack_tree_parser_t* parser, mpack_node_da
             return;
         }
         total *= 2;
+
+        #if MPACK_NODE_MAP_INDEX_THRESHOLD
+        if (node->len >= MPACK_NODE_MAP_INDEX_THRESHOLD) {
+            index_nodes = mpack_node_map_index_nodes(node->len);
+
+            // We can't grow a fixed pool, so we only index if the pool was
+            // sized for the indexes of all large maps. Otherwise an index
+            // could take space needed by the nodes that follow.
+            #ifdef MPACK_MALLOC
+            bool owned = parser->tree->owned;
+            #else
+            bool owned = false;
+            #endif
+            if (!owned && (!parser->tree->pool_indexed || total + index_nodes > parser->tree->page.left))
+                index_nodes = 0;
+        }
+        #endif
+        #if MPACK_NODE_MAP_SORTED_THRESHOLD
+        finish_map = node->len >= MPACK_NODE_MAP_SORTED_THRESHOLD;
+        #endif
     }
+    node->flags = (index_nodes != 0) ? MPACK_NODE_FLAG_INDEXED : 0;
 
-    // Each node is at least one byte. Count these bytes now to make
-    // sure there is enough data left.
-    if (total > parser->possible_nodes_left) {
-        mpack_tree_flag_error(parser->tree, mpack_error_invalid);
+    #ifdef MPACK_MALLOC
+    if (parser->tree->max_nodes != 0 && total > parser->tree->max_nodes - parser->tree->node_count) {
+        mpack_tree_flag_error(parser->tree, mpack_error_too_big);
         parser->level = 0;
         return;
     }
+    #endif
+
+    // Each node is at least one byte. Count these bytes now to make
+    // sure there is enough data left. (A stream reads this much data
+    // before allocating any nodes, so its memory is bounded in the same
+    // way.)
+    if (!mpack_tree_reserve_bytes(parser, total))
+        return;
     parser->possible_nodes_left -= total;
+    parser->tree->node_count += total;
+
+    // The map index (if any) is allocated contiguously with the children.
+    // It's not counted in possible_nodes_left since it's proportional to
+    // the number of children.
+    size_t alloc = total + index_nodes;
 
     // If there are enough nodes left in the current page, no need to grow
-    if (total <= parser->tree->page.left) {
-        node->value.content.children = parser->tree->page.nodes + parser->tree->page.pos;
-        parser->tree->page.pos += total;
-        parser->tree->page.left -= total;
+    if (alloc <= parser->tree->page.left) {
+        node->value.children = parser->tree->page.nodes + parser->tree->page.pos;
+        parser->tree->page.pos += alloc;
+        parser->tree->page.left -= alloc;
 
     } else {
 
@@ -205,38 +876,41 @@ static void mpack_tree_parse_children(mpack_tree_parser_t* parser, mpack_node_da
 
         // Allocate the new link first. The two cases below put it into the list before trying
         // to allocate its nodes so it gets freed later in case of allocation failure.
-        mpack_tree_link_t* link = (mpack_tree_link_t*)MPACK_MALLOC(sizeof(mpack_tree_link_t));
+        mpack_tree_link_t* link = (mpack_tree_link_t*)mpack_allocator_alloc(parser->tree->allocator, sizeof(mpack_tree_link_t));
         if (link == NULL) {
             mpack_tree_flag_error(parser->tree, mpack_error_memory);
             parser->level = 0;
             return;
         }
 
-        if (total > MPACK_NODE_PAGE_SIZE || parser->tree->page.left > MPACK_NODE_PAGE_SIZE / 8) {
+        if (alloc > MPACK_NODE_PAGE_SIZE || parser->tree->page.left > MPACK_NODE_PAGE_SIZE / 8) {
             mpack_log("allocating seperate page for %i children, %i left in page of size %i\n",
-                    (int)total, (int)parser->tree->page.left, (int)MPACK_NODE_PAGE_SIZE);
+                    (int)alloc, (int)parser->tree->page.left, (int)MPACK_NODE_PAGE_SIZE);
 
             // Allocate only this node's children and insert it after the current page
             link->next = parser->tree->page.next;
             parser->tree->page.next = link;
-            link->nodes = (mpack_node_data_t*)MPACK_MALLOC(sizeof(mpack_node_data_t) * total);
+            link->nodes = (mpack_node_data_t*)mpack_allocator_alloc(parser->tree->allocator, sizeof(mpack_node_data_t) * alloc);
             if (link->nodes == NULL) {
                 mpack_tree_flag_error(parser->tree, mpack_error_memory);
                 parser->level = 0;
                 return;
             }
 
-            // Use the new page for the node's children. pos and left are not used.
-            node->value.content.children = link->nodes;
+            // Use the new page for the node's children. It's full, but we
+            // record its size so its nodes are counted when recycling pages.
+            node->value.children = link->nodes;
+            link->pos = alloc;
+            link->left = 0;
 
         } else {
             mpack_log("allocating new page for %i children, wasting %i in page of size %i\n",
-                    (int)total, (int)parser->tree->page.left, (int)MPACK_NODE_PAGE_SIZE);
+                    (int)alloc, (int)parser->tree->page.left, (int)MPACK_NODE_PAGE_SIZE);
 
             // Move the current page into the new link, and allocate a new page
             *link = parser->tree->page;
             parser->tree->page.next = link;
-            parser->tree->page.nodes = (mpack_node_data_t*)MPACK_MALLOC(sizeof(mpack_node_data_t) * MPACK_NODE_PAGE_SIZE);
+            parser->tree->page.nodes = (mpack_node_data_t*)mpack_allocator_alloc(parser->tree->allocator, sizeof(mpack_node_data_t) * MPACK_NODE_PAGE_SIZE);
             if (parser->tree->page.nodes == NULL) {
                 mpack_tree_flag_error(parser->tree, mpack_error_memory);
                 parser->level = 0;
@@ -244,9 +918,9 @@ static void mpack_tree_parse_children(mpack_tree_parser_t* parser, mpack_node_da
             }
 
             // Take this node's children from the page
-            node->value.content.children = parser->tree->page.nodes;
-            parser->tree->page.pos = total;
-            parser->tree->page.left = MPACK_NODE_PAGE_SIZE - total;
+            node->value.children = parser->tree->page.nodes;
+            parser->tree->page.pos = alloc;
+            parser->tree->page.left = MPACK_NODE_PAGE_SIZE - alloc;
         }
 
         #else
@@ -259,86 +933,89 @@ static void mpack_tree_parse_children(mpack_tree_parser_t* parser, mpack_node_da
 
     // Push this node onto the stack to read its children
     ++parser->level;
-    parser->stack[parser->level].child = node->value.content.children;
+    parser->stack[parser->level].child = node->value.children;
     parser->stack[parser->level].left = total;
+    #if MPACK_NODE_MAP_INDEX_THRESHOLD || MPACK_NODE_MAP_SORTED_THRESHOLD
+    parser->stack[parser->level].map = (finish_map || index_nodes != 0) ? node : NULL;
+    #endif
+    #if MPACK_NODE_RAW
+    parser->stack[parser->level].parent = node;
+    #endif
+
+    if (type == mpack_type_array)
+        mpack_tree_parse_run(parser);
 }
 
 static void mpack_tree_parse_bytes(mpack_tree_parser_t* parser, mpack_node_data_t* node) {
-    size_t length = node->value.data.l;
-    if (length > parser->possible_nodes_left) {
-        mpack_tree_flag_error(parser->tree, mpack_error_invalid);
-        parser->level = 0;
+    size_t length = node->len;
+    if (!mpack_tree_reserve_bytes(parser, length))
         return;
-    }
-    node->value.data.bytes = parser->data;
+    node->value.offset = (size_t)(parser->data - parser->tree->data);
     parser->data += length;
     parser->left -= length;
     parser->possible_nodes_left -= length;
 }
 
-static void mpack_tree_parse(mpack_tree_t* tree, const char* data, size_t length) {
+// Starts parsing a message at the start of the tree's data. For a stream
+// this is a no-op if no data is available yet.
+static void mpack_tree_parse_start(mpack_tree_t* tree) {
     mpack_log("starting parse\n");
 
-    // This function is unfortunately huge and ugly, but there isn't
-    // a good way to break it apart without losing performance. It's
-    // well-commented to try to make up for it.
+    mpack_tree_parser_t* parser = &tree->parser;
+    mpack_memset(parser, 0, sizeof(*parser));
+    parser->tree = tree;
+    parser->data = tree->data;
+    parser->left = tree->data_length;
 
-    if (length == 0) {
-        mpack_tree_init_error(tree, mpack_error_invalid);
+    // We keep track of the number of possible nodes left in the data. This
+    // is to ensure that malicious nested data is not trying to make us
+    // run out of memory by allocating too many nodes. (For example malicious
+    // data that repeats 0xDE 0xFF 0xFF would otherwise cause us to run out
+    // of memory. With this, the parser can only allocate as many nodes as
+    // there are bytes in the data (plus the paging overhead, 12%.) An error
+    // will be flagged immediately if and when there isn't enough data left
+    // to fully read all children of all open compound types on the stack.)
+    parser->possible_nodes_left = tree->data_length;
+
+    // The root node needs at least one byte
+    if (!mpack_tree_reserve_bytes(parser, 1)) {
+        parser->suspended = false;
         return;
     }
+
     if (tree->page.left == 0) {
         mpack_break("initial page has no nodes!");
-        mpack_tree_init_error(tree, mpack_error_bug);
+        mpack_tree_flag_error(tree, mpack_error_bug);
         return;
     }
     tree->root = tree->page.nodes + tree->page.pos;
     ++tree->page.pos;
     --tree->page.left;
 
-    // Setup parser
-    mpack_tree_parser_t parser;
-    mpack_memset(&parser, 0, sizeof(parser));
-    parser.tree = tree;
-    parser.data = data;
-    parser.left = length;
-
-    // We read nodes in a loop instead of recursively for maximum
-    // performance. The stack holds the amount of children left to
-    // read in each level of the tree.
-
-    // Even when we have a malloc() function, it's much faster to
-    // allocate the initial parsing stack on the call stack. We
-    // replace it with a heap allocation if we need to grow it.
-    #ifdef MPACK_MALLOC
-    static const size_t initial_depth = MPACK_NODE_INITIAL_DEPTH;
-    parser.stack_allocated = true;
-    #else
-    static const size_t initial_depth = MPACK_NODE_MAX_DEPTH_WITHOUT_MALLOC;
-    #endif
+    // configure the root node
+    --parser->possible_nodes_left;
+    tree->node_count = 1;
+    parser->state = mpack_tree_parse_state_in_progress;
+}
 
-    mpack_level_t stack_[initial_depth];
-    parser.depth = initial_depth;
-    parser.stack = stack_;
+// Parses nodes until the parser's stack is empty, an error occurs, or a
+// stream runs out of data.
+static void mpack_tree_parse_nodes(mpack_tree_parser_t* parser_ptr) {
 
-    // We keep track of the number of possible nodes left in the data. This
-    // is to ensure that malicious nested data is not trying to make us
-    // run out of memory by allocating too many nodes. (For example malicious
-    // data that repeats 0xDE 0xFF 0xFF would otherwise cause us to run out
-    // of memory. With this, the parser can only allocate as many nodes as
-    // there are bytes in the data (plus the paging overhead, 12%.) An error
-    // will be flagged immediately if and when there isn't enough data left
-    // to fully read all children of all open compound types on the stack.)
-    parser.possible_nodes_left = length;
+    // This function is unfortunately huge and ugly, but there isn't
+    // a good way to break it apart without losing performance. It's
+    // well-commented to try to make up for it.
 
-    // configure the root node
-    --parser.possible_nodes_left;
-    tree->node_count = 1;
-    parser.level = 0;
-    parser.stack[0].child = tree->root;
-    parser.stack[0].left = 1;
+    // The parser is copied out while parsing so that the compiler can
+    // keep it in registers.
+    mpack_tree_parser_t parser = *parser_ptr;
+    mpack_tree_t* tree = parser.tree;
 
     do {
+        // Remember where this node starts in case we run out of data
+        // partway through it
+        size_t node_offset = (size_t)(parser.data - tree->data);
+
         mpack_node_data_t* node = parser.stack[parser.level].child;
         --parser.stack[parser.level].left;
         ++parser.stack[parser.level].child;
@@ -385,7 +1062,7 @@ static void mpack_tree_parse(mpack_tree_t* tree, const char* data, size_t length
             case 0x80: case 0x81: case 0x82: case 0x83: case 0x84: case 0x85: case 0x86: case 0x87:
             case 0x88: case 0x89: case 0x8a: case 0x8b: case 0x8c: case 0x8d: case 0x8e: case 0x8f:
                 node->type = mpack_type_map;
-                node->value.content.n = type & ~0xf0;
+                node->len = type & ~0xf0;
                 mpack_tree_parse_children(&parser, node);
                 break;
 
@@ -393,7 +1070,7 @@ static void mpack_tree_parse(mpack_tree_t* tree, const char* data, size_t length
             case 0x90: case 0x91: case 0x92: case 0x93: case 0x94: case 0x95: case 0x96: case 0x97:
             case 0x98: case 0x99: case 0x9a: case 0x9b: case 0x9c: case 0x9d: case 0x9e: case 0x9f:
                 node->type = mpack_type_array;
-                node->value.content.n = type & ~0xf0;
+                node->len = type & ~0xf0;
                 mpack_tree_parse_children(&parser, node);
                 break;
 
@@ -403,7 +1080,7 @@ static void mpack_tree_parse(mpack_tree_t* tree, const char* data, size_t length
             case 0xb0: case 0xb1: case 0xb2: case 0xb3: case 0xb4: case 0xb5: case 0xb6: case 0xb7:
             case 0xb8: case 0xb9: case 0xba: case 0xbb: case 0xbc: case 0xbd: case 0xbe: case 0xbf:
                 node->type = mpack_type_str;
-                node->value.data.l = type & ~0xe0;
+                node->len = type & ~0xe0;
                 mpack_tree_parse_bytes(&parser, node);
                 break;
 
@@ -421,28 +1098,28 @@ static void mpack_tree_parse(mpack_tree_t* tree, const char* data, size_t length
             // bin8
             case 0xc4:
                 node->type = mpack_type_bin;
-                node->value.data.l = mpack_tree_u8(&parser);
+                node->len = mpack_tree_u8(&parser);
                 mpack_tree_parse_bytes(&parser, node);
                 break;
 
             // bin16
             case 0xc5:
                 node->type = mpack_type_bin;
-                node->value.data.l = mpack_tree_u16(&parser);
+                node->len = mpack_tree_u16(&parser);
                 mpack_tree_parse_bytes(&parser, node);
                 break;
 
             // bin32
             case 0xc6:
                 node->type = mpack_type_bin;
-                node->value.data.l = mpack_tree_u32(&parser);
+                node->len = mpack_tree_u32(&parser);
                 mpack_tree_parse_bytes(&parser, node);
                 break;
 
             // ext8
             case 0xc7:
                 node->type = mpack_type_ext;
-                node->value.data.l = mpack_tree_u8(&parser);
+                node->len = mpack_tree_u8(&parser);
                 node->exttype = mpack_tree_i8(&parser);
                 mpack_tree_parse_bytes(&parser, node);
                 break;
@@ -450,7 +1127,7 @@ static void mpack_tree_parse(mpack_tree_t* tree, const char* data, size_t length
             // ext16
             case 0xc8:
                 node->type = mpack_type_ext;
-                node->value.data.l = mpack_tree_u16(&parser);
+                node->len = mpack_tree_u16(&parser);
                 node->exttype = mpack_tree_i8(&parser);
                 mpack_tree_parse_bytes(&parser, node);
                 break;
@@ -458,7 +1135,7 @@ static void mpack_tree_parse(mpack_tree_t* tree, const char* data, size_t length
             // ext32
             case 0xc9:
                 node->type = mpack_type_ext;
-                node->value.data.l = mpack_tree_u32(&parser);
+                node->len = mpack_tree_u32(&parser);
                 node->exttype = mpack_tree_i8(&parser);
                 mpack_tree_parse_bytes(&parser, node);
                 break;
@@ -526,7 +1203,7 @@ static void mpack_tree_parse(mpack_tree_t* tree, const char* data, size_t length
             // fixext1
             case 0xd4:
                 node->type = mpack_type_ext;
-                node->value.data.l = 1;
+                node->len = 1;
                 node->exttype = mpack_tree_i8(&parser);
                 mpack_tree_parse_bytes(&parser, node);
                 break;
@@ -534,7 +1211,7 @@ static void mpack_tree_parse(mpack_tree_t* tree, const char* data, size_t length
             // fixext2
             case 0xd5:
                 node->type = mpack_type_ext;
-                node->value.data.l = 2;
+                node->len = 2;
                 node->exttype = mpack_tree_i8(&parser);
                 mpack_tree_parse_bytes(&parser, node);
                 break;
@@ -542,7 +1219,7 @@ static void mpack_tree_parse(mpack_tree_t* tree, const char* data, size_t length
             // fixext4
             case 0xd6:
                 node->type = mpack_type_ext;
-                node->value.data.l = 4;
+                node->len = 4;
                 node->exttype = mpack_tree_i8(&parser);
                 mpack_tree_parse_bytes(&parser, node);
                 break;
@@ -550,7 +1227,7 @@ static void mpack_tree_parse(mpack_tree_t* tree, const char* data, size_t length
             // fixext8
             case 0xd7:
                 node->type = mpack_type_ext;
-                node->value.data.l = 8;
+                node->len = 8;
                 node->exttype = mpack_tree_i8(&parser);
                 mpack_tree_parse_bytes(&parser, node);
                 break;
@@ -558,7 +1235,7 @@ static void mpack_tree_parse(mpack_tree_t* tree, const char* data, size_t length
             // fixext16
             case 0xd8:
                 node->type = mpack_type_ext;
-                node->value.data.l = 16;
+                node->len = 16;
                 node->exttype = mpack_tree_i8(&parser);
                 mpack_tree_parse_bytes(&parser, node);
                 break;
@@ -566,49 +1243,49 @@ static void mpack_tree_parse(mpack_tree_t* tree, const char* data, size_t length
             // str8
             case 0xd9:
                 node->type = mpack_type_str;
-                node->value.data.l = mpack_tree_u8(&parser);
+                node->len = mpack_tree_u8(&parser);
                 mpack_tree_parse_bytes(&parser, node);
                 break;
 
             // str16
             case 0xda:
                 node->type = mpack_type_str;
-                node->value.data.l = mpack_tree_u16(&parser);
+                node->len = mpack_tree_u16(&parser);
                 mpack_tree_parse_bytes(&parser, node);
                 break;
 
             // str32
             case 0xdb:
                 node->type = mpack_type_str;
-                node->value.data.l = mpack_tree_u32(&parser);
+                node->len = mpack_tree_u32(&parser);
                 mpack_tree_parse_bytes(&parser, node);
                 break;
 
             // array16
             case 0xdc:
                 node->type = mpack_type_array;
-                node->value.content.n = mpack_tree_u16(&parser);
+                node->len = mpack_tree_u16(&parser);
                 mpack_tree_parse_children(&parser, node);
                 break;
 
             // array32
             case 0xdd:
                 node->type = mpack_type_array;
-                node->value.content.n = mpack_tree_u32(&parser);
+                node->len = mpack_tree_u32(&parser);
                 mpack_tree_parse_children(&parser, node);
                 break;
 
             // map16
             case 0xde:
                 node->type = mpack_type_map;
-                node->value.content.n = mpack_tree_u16(&parser);
+                node->len = mpack_tree_u16(&parser);
                 mpack_tree_parse_children(&parser, node);
                 break;
 
             // map32
             case 0xdf:
                 node->type = mpack_type_map;
-                node->value.content.n = mpack_tree_u32(&parser);
+                node->len = mpack_tree_u32(&parser);
                 mpack_tree_parse_children(&parser, node);
                 break;
 
@@ -618,28 +1295,127 @@ static void mpack_tree_parse(mpack_tree_t* tree, const char* data, size_t length
                 break;
         }
 
-        // Pop any empty compound types from the stack
-        while (parser.level != 0 && parser.stack[parser.level].left == 0)
+        if (mpack_tree_error(tree) != mpack_ok)
+            break;
+
+        // If we ran out of data, rewind to the start of this node so that
+        // it is parsed again in full when more data is available. Its
+        // first byte is claimed again as a possible node.
+        if (parser.suspended) {
+            size_t consumed = (size_t)(parser.data - tree->data) - node_offset;
+            parser.data -= consumed;
+            parser.left += consumed;
+            parser.possible_nodes_left += consumed - 1;
+            ++parser.stack[parser.level].left;
+            --parser.stack[parser.level].child;
+            break;
+        }
+
+        #if MPACK_NODE_RAW
+        // If this is an array or map whose children are still to be
+        // parsed, this is only its header. Its size is updated when its
+        // level is popped.
+        node->raw_offset = node_offset;
+        node->raw_size = (size_t)(parser.data - tree->data) - node_offset;
+        #endif
+
+        // Pop any empty compound types from the stack, finishing
+        // any maps that are now complete
+        while (parser.level != 0 && parser.stack[parser.level].left == 0) {
+            #if MPACK_NODE_MAP_INDEX_THRESHOLD || MPACK_NODE_MAP_SORTED_THRESHOLD
+            if (parser.stack[parser.level].map)
+                mpack_tree_finish_map(tree, parser.stack[parser.level].map);
+            #endif
+            #if MPACK_NODE_RAW
+            mpack_node_data_t* parent = parser.stack[parser.level].parent;
+            parent->raw_size = (size_t)(parser.data - tree->data) - parent->raw_offset;
+            #endif
             --parser.level;
-    } while (parser.level != 0 && mpack_tree_error(parser.tree) == mpack_ok);
+        }
+    } while (parser.level != 0);
 
-    #ifdef MPACK_MALLOC
-    if (!parser.stack_allocated)
-        MPACK_FREE(parser.stack);
-    #endif
+    *parser_ptr = parser;
+}
 
-    tree->size = length - parser.left;
-    mpack_log("parsed tree of %i bytes, %i bytes left\n", (int)tree->size, (int)parser.left);
-    mpack_log("%i nodes in final page\n", (int)tree->page.pos);
+// Parses nodes until the message is complete, an error occurs, or a stream
+// runs out of data. Returns true if the message is complete.
+static bool mpack_tree_continue_parse(mpack_tree_t* tree) {
 
-    // This seems like a bug / performance flaw in GCC. In release the
-    // below assert would compile to:
-    //
-    //     (!(mpack_tree_error(parser.tree) != mpack_ok || possible_nodes_left == remaining) ? __builtin_unreachable() : ((void)0))
-    //
-    // This produces identical assembly with GCC 5.1 on ARM64 under -O3, but
-    // with -O3 -flto, node parsing is over 4% slower. This should be a no-op
-    // even in -flto since the function ends here and possible_nodes_left
+    mpack_tree_parser_t parser = tree->parser;
+
+    // We read nodes in a loop instead of recursively for maximum
+    // performance. The stack holds the amount of children left to
+    // read in each level of the tree.
+
+    // Even when we have a malloc() function, it's much faster to
+    // allocate the initial parsing stack on the call stack. We
+    // replace it with a heap allocation if we need to grow it, or
+    // if we need to suspend parsing to wait for more data.
+    #ifdef MPACK_MALLOC
+    static const size_t initial_depth = MPACK_NODE_INITIAL_DEPTH;
+    #else
+    static const size_t initial_depth = MPACK_NODE_MAX_DEPTH_WITHOUT_MALLOC;
+    #endif
+    mpack_level_t stack_[initial_depth];
+
+    if (parser.stack == NULL) {
+        #ifdef MPACK_MALLOC
+        parser.stack_allocated = true;
+        #endif
+        parser.depth = initial_depth;
+        parser.stack = stack_;
+        parser.level = 0;
+        parser.stack[0].child = tree->root;
+        parser.stack[0].left = 1;
+    }
+
+    mpack_tree_parse_nodes(&parser);
+
+    // Keep the stack of a suspended parse, moving it off the call stack
+    if (parser.suspended && mpack_tree_error(tree) == mpack_ok) {
+        mpack_log("suspending parse at level %i, %i bytes parsed\n",
+                (int)parser.level, (int)(parser.data - tree->data));
+        parser.suspended = false;
+        #ifdef MPACK_MALLOC
+        if (parser.stack_allocated) {
+            mpack_level_t* stack = (mpack_level_t*)mpack_allocator_alloc(tree->allocator, sizeof(mpack_level_t) * parser.depth);
+            if (stack == NULL) {
+                mpack_tree_flag_error(tree, mpack_error_memory);
+                parser.stack = NULL;
+                tree->parser = parser;
+                return false;
+            }
+            mpack_memcpy(stack, parser.stack, sizeof(mpack_level_t) * parser.depth);
+            parser.stack = stack;
+            parser.stack_allocated = false;
+        }
+        #endif
+        tree->parser = parser;
+        return false;
+    }
+
+    #ifdef MPACK_MALLOC
+    if (!parser.stack_allocated)
+        mpack_allocator_free(tree->allocator, parser.stack);
+    #endif
+    parser.stack = NULL;
+    tree->parser = parser;
+    if (mpack_tree_error(tree) != mpack_ok)
+        return false;
+
+    tree->parser.state = mpack_tree_parse_state_parsed;
+    tree->size = (size_t)(parser.data - tree->data);
+    mpack_log("parsed tree of %i bytes, %i bytes left\n", (int)tree->size, (int)parser.left);
+    mpack_log("%i nodes in final page\n", (int)tree->page.pos);
+
+    // This seems like a bug / performance flaw in GCC. In release the
+    // below assert would compile to:
+    //
+    //     (!(mpack_tree_error(parser.tree) != mpack_ok || possible_nodes_left == remaining) ? __builtin_unreachable() : ((void)0))
+    //
+    // This produces identical assembly with GCC 5.1 on ARM64 under -O3, but
+    // with -O3 -flto, node parsing is over 4% slower. This should be a no-op
+    // even in -flto since the function ends here and possible_nodes_left
     // does not escape this function.
     //
     // Leaving a TODO: here to explore this further. In the meantime we preproc it
@@ -649,6 +1425,40 @@ static void mpack_tree_parse(mpack_tree_t* tree, const char* data, size_t length
             "incorrect calculation of possible nodes! %i possible nodes, but %i bytes remaining",
             (int)parser.possible_nodes_left, (int)parser.left);
     #endif
+
+    return true;
+}
+
+
+bool mpack_tree_expand_node(mpack_tree_t* tree, mpack_node_data_t* node) {
+    if (mpack_tree_error(tree) != mpack_ok)
+        return false;
+    mpack_log("expanding %s of %i elements at offset %i\n", mpack_type_to_string((mpack_type_t)node->type),
+            (int)node->len, (int)node->value.offset);
+
+    // The message has already been checked, so the node's children are
+    // parsed from its offset to the end of the message.
+    mpack_tree_parser_t parser;
+    mpack_memset(&parser, 0, sizeof(parser));
+    parser.tree = tree;
+    parser.data = tree->data + node->value.offset;
+    parser.left = tree->size - node->value.offset;
+    parser.possible_nodes_left = parser.left;
+
+    // Any compound children are skipped, so the stack never grows
+    // past the node itself.
+    mpack_level_t stack[2];
+    parser.stack = stack;
+    parser.depth = sizeof(stack) / sizeof(*stack);
+    parser.stack_allocated = true;
+
+    // The children may all have been parsed already as a run of numbers
+    mpack_tree_parse_children(&parser, node);
+    if (mpack_tree_error(tree) != mpack_ok)
+        return false;
+    if (parser.stack[parser.level].left != 0)
+        mpack_tree_parse_nodes(&parser);
+    return mpack_tree_error(tree) == mpack_ok;
 }
 
 
@@ -658,7 +1468,16 @@ static void mpack_tree_parse(mpack_tree_t* tree, const char* data, size_t length
  */
 
 mpack_node_t mpack_tree_root(mpack_tree_t* tree) {
-    return mpack_node(tree, (mpack_tree_error(tree) != mpack_ok) ? &tree->nil_node : tree->root);
+    if (mpack_tree_error(tree) != mpack_ok)
+        return mpack_tree_nil_node(tree);
+
+    if (tree->parser.state != mpack_tree_parse_state_parsed) {
+        mpack_break("tree has not been parsed!");
+        mpack_tree_flag_error(tree, mpack_error_bug);
+        return mpack_tree_nil_node(tree);
+    }
+
+    return mpack_node(tree, tree->root);
 }
 
 static void mpack_tree_init_clear(mpack_tree_t* tree) {
@@ -666,26 +1485,470 @@ static void mpack_tree_init_clear(mpack_tree_t* tree) {
     tree->nil_node.type = mpack_type_nil;
 }
 
+// Parses the whole message in the tree's data in one go
+static void mpack_tree_parse(mpack_tree_t* tree, const char* data, size_t length) {
+    tree->data = data;
+    tree->data_length = length;
+    mpack_tree_parse_start(tree);
+    if (mpack_tree_error(tree) == mpack_ok)
+        mpack_tree_continue_parse(tree);
+}
+
 #ifdef MPACK_MALLOC
-void mpack_tree_init(mpack_tree_t* tree, const char* data, size_t length) {
-    mpack_tree_init_clear(tree);
+static bool mpack_tree_init_page(mpack_tree_t* tree) {
     tree->owned = true;
 
     // allocate first page
     mpack_log("allocating initial page of size %i\n", (int)MPACK_NODE_PAGE_SIZE);
-    tree->page.nodes = (mpack_node_data_t*)MPACK_MALLOC(sizeof(mpack_node_data_t) * MPACK_NODE_PAGE_SIZE);
+    tree->page.nodes = (mpack_node_data_t*)mpack_allocator_alloc(tree->allocator, sizeof(mpack_node_data_t) * MPACK_NODE_PAGE_SIZE);
     if (tree->page.nodes == NULL) {
         tree->error = mpack_error_memory;
-        return;
+        return false;
     }
     tree->page.next = NULL;
     tree->page.pos = 0;
     tree->page.left = MPACK_NODE_PAGE_SIZE;
+    return true;
+}
+
+void mpack_tree_init(mpack_tree_t* tree, const char* data, size_t length) {
+    mpack_tree_init_allocator(tree, data, length, NULL);
+}
+
+void mpack_tree_init_allocator(mpack_tree_t* tree, const char* data, size_t length, const mpack_allocator_t* allocator) {
+    mpack_tree_init_clear(tree);
+    tree->allocator = allocator;
+    if (mpack_tree_init_page(tree))
+        mpack_tree_parse(tree, data, length);
+}
+
+void mpack_tree_init_lazy(mpack_tree_t* tree, const char* data, size_t length) {
+    mpack_tree_init_lazy_allocator(tree, data, length, NULL);
+}
+
+void mpack_tree_init_lazy_allocator(mpack_tree_t* tree, const char* data, size_t length, const mpack_allocator_t* allocator) {
+    mpack_tree_init_clear(tree);
+    tree->allocator = allocator;
+    tree->lazy = true;
+    if (mpack_tree_init_page(tree))
+        mpack_tree_parse(tree, data, length);
+}
+
+void mpack_tree_init_exact(mpack_tree_t* tree, const char* data, size_t length) {
+    mpack_tree_init_exact_allocator(tree, data, length, NULL);
+}
 
+void mpack_tree_init_exact_allocator(mpack_tree_t* tree, const char* data, size_t length, const mpack_allocator_t* allocator) {
+    mpack_tree_init_clear(tree);
+    tree->allocator = allocator;
+    size_t count = mpack_tree_count_nodes(data, length);
+    if (count == 0) {
+        tree->error = mpack_error_invalid;
+        return;
+    }
+    if (count > SIZE_MAX / sizeof(mpack_node_data_t)) {
+        tree->error = mpack_error_too_big;
+        return;
+    }
+
+    // All nodes fit in one page, so parsing never allocates another
+    tree->owned = true;
+    mpack_log("allocating exact page of size %i\n", (int)count);
+    tree->page.nodes = (mpack_node_data_t*)mpack_allocator_alloc(tree->allocator, sizeof(mpack_node_data_t) * count);
+    if (tree->page.nodes == NULL) {
+        tree->error = mpack_error_memory;
+        return;
+    }
+    tree->page.next = NULL;
+    tree->page.pos = 0;
+    tree->page.left = count;
     mpack_tree_parse(tree, data, length);
 }
+
+// Allocates contiguous nodes from the pages of a worker tree, in the same
+// way as mpack_tree_parse_children() allocates the children of a node.
+static mpack_node_data_t* mpack_tree_range_alloc(mpack_tree_t* worker, size_t alloc) {
+    if (alloc <= worker->page.left) {
+        mpack_node_data_t* nodes = worker->page.nodes + worker->page.pos;
+        worker->page.pos += alloc;
+        worker->page.left -= alloc;
+        return nodes;
+    }
+
+    mpack_tree_link_t* link = (mpack_tree_link_t*)mpack_allocator_alloc(worker->allocator, sizeof(mpack_tree_link_t));
+    if (link == NULL) {
+        mpack_tree_flag_error(worker, mpack_error_memory);
+        return NULL;
+    }
+
+    if (alloc > MPACK_NODE_PAGE_SIZE || worker->page.left > MPACK_NODE_PAGE_SIZE / 8) {
+        link->next = worker->page.next;
+        worker->page.next = link;
+        link->nodes = (mpack_node_data_t*)mpack_allocator_alloc(worker->allocator, sizeof(mpack_node_data_t) * alloc);
+        if (link->nodes == NULL) {
+            mpack_tree_flag_error(worker, mpack_error_memory);
+            return NULL;
+        }
+        link->pos = alloc;
+        link->left = 0;
+        return link->nodes;
+    }
+
+    *link = worker->page;
+    worker->page.next = link;
+    worker->page.nodes = (mpack_node_data_t*)mpack_allocator_alloc(worker->allocator, sizeof(mpack_node_data_t) * MPACK_NODE_PAGE_SIZE);
+    if (worker->page.nodes == NULL) {
+        mpack_tree_flag_error(worker, mpack_error_memory);
+        return NULL;
+    }
+    worker->page.pos = alloc;
+    worker->page.left = MPACK_NODE_PAGE_SIZE - alloc;
+    return worker->page.nodes;
+}
+
+// Fully parses a node of a lazy tree for a worker tree. The node is the
+// worker's own copy. The children of nodes that were already expanded
+// belong to the lazy tree, so they are copied into the worker's pages
+// (with the map index, if any) before parsing anything below them that
+// is still unexpanded. The lazy tree is not modified until the worker is
+// joined.
+static void mpack_tree_parse_range_node(mpack_tree_parser_t* parser, mpack_node_data_t* node) {
+    if (node->type != mpack_type_array && node->type != mpack_type_map)
+        return;
+
+    if (node->flags & MPACK_NODE_FLAG_UNEXPANDED) {
+        // The message has already been checked, so as in
+        // mpack_tree_expand_node() the children are parsed from the
+        // node's offset to the end of the message.
+        mpack_tree_t* worker = parser->tree;
+        parser->data = worker->data + node->value.offset;
+        parser->left = worker->size - node->value.offset;
+        parser->possible_nodes_left = parser->left;
+        parser->level = 0;
+        mpack_tree_parse_children(parser, node);
+        if (mpack_tree_error(worker) == mpack_ok && parser->stack[parser->level].left != 0)
+            mpack_tree_parse_nodes(parser);
+        return;
+    }
+
+    size_t count = (node->type == mpack_type_map) ? (size_t)node->len * 2 : node->len;
+    if (count == 0)
+        return;
+    size_t alloc = count;
+    #if MPACK_NODE_MAP_INDEX_THRESHOLD
+    if (node->flags & (MPACK_NODE_FLAG_INDEXED | MPACK_NODE_FLAG_DENSE_INT))
+        alloc += mpack_node_map_index_nodes(node->len);
+    #endif
+    mpack_node_data_t* children = mpack_tree_range_alloc(parser->tree, alloc);
+    if (children == NULL)
+        return;
+    mpack_memcpy(children, node->value.children, sizeof(mpack_node_data_t) * alloc);
+    node->value.children = children;
+
+    for (size_t i = 0; i < count && mpack_tree_error(parser->tree) == mpack_ok; ++i)
+        mpack_tree_parse_range_node(parser, children + i);
+}
+
+void mpack_tree_init_range(mpack_tree_t* worker, mpack_tree_t* tree, size_t first, size_t count) {
+    mpack_tree_init_clear(worker);
+    if (mpack_tree_error(tree) != mpack_ok) {
+        worker->error = mpack_tree_error(tree);
+        return;
+    }
+    if (tree->frozen) {
+        mpack_break("cannot parse a range of a frozen tree!");
+        worker->error = mpack_error_bug;
+        return;
+    }
+
+    // The lazy tree is shared between workers, so misuse is only flagged
+    // on the worker. It's passed on to the tree when joined.
+    if (!tree->lazy || tree->parser.state != mpack_tree_parse_state_parsed) {
+        mpack_break("tree is not a parsed lazy tree!");
+        worker->error = mpack_error_bug;
+        return;
+    }
+    mpack_node_data_t* root = tree->root;
+    if ((root->type != mpack_type_array && root->type != mpack_type_map) ||
+            first > root->len || count > root->len - first)
+    {
+        mpack_break("range [%i, %i) is not in the root of %i elements!",
+                (int)first, (int)(first + count), (int)root->len);
+        worker->error = mpack_error_bug;
+        return;
+    }
+    if (root->type == mpack_type_map) {
+        first *= 2;
+        count *= 2;
+    }
+
+    worker->allocator = tree->allocator;
+    worker->data = tree->data;
+    worker->data_length = tree->size;
+    worker->size = tree->size;
+    worker->range = root->value.children + first;
+    worker->range_count = count;
+
+    // The worker's copy of the range goes at the start of its first page.
+    // Their children are allocated after them like in any other tree.
+    size_t capacity = (count > MPACK_NODE_PAGE_SIZE) ? count : MPACK_NODE_PAGE_SIZE;
+    worker->owned = true;
+    worker->page.nodes = (mpack_node_data_t*)mpack_allocator_alloc(worker->allocator, sizeof(mpack_node_data_t) * capacity);
+    if (worker->page.nodes == NULL) {
+        worker->error = mpack_error_memory;
+        return;
+    }
+    worker->page.pos = count;
+    worker->page.left = capacity - count;
+    worker->root = worker->page.nodes;
+    if (count != 0)
+        mpack_memcpy(worker->root, worker->range, sizeof(mpack_node_data_t) * count);
+
+    // The stack is kept between elements so that it only grows once
+    mpack_level_t stack_[MPACK_NODE_INITIAL_DEPTH];
+    mpack_tree_parser_t parser;
+    mpack_memset(&parser, 0, sizeof(parser));
+    parser.tree = worker;
+    parser.stack = stack_;
+    parser.depth = MPACK_NODE_INITIAL_DEPTH;
+    parser.stack_allocated = true;
+
+    for (size_t i = 0; i < count && mpack_tree_error(worker) == mpack_ok; ++i)
+        mpack_tree_parse_range_node(&parser, worker->root + i);
+
+    if (!parser.stack_allocated)
+        mpack_allocator_free(worker->allocator, parser.stack);
+}
+
+void mpack_tree_join(mpack_tree_t* tree, mpack_tree_t* worker) {
+    if (mpack_tree_error(worker) != mpack_ok) {
+        mpack_tree_flag_error(tree, mpack_tree_error(worker));
+        mpack_tree_destroy(worker);
+        return;
+    }
+
+    mpack_node_data_t* root = tree->root;
+    if (worker->range == NULL || worker->data != tree->data || root == NULL ||
+            worker->range < root->value.children ||
+            worker->range + worker->range_count > root->value.children +
+                (size_t)root->len * (root->type == mpack_type_map ? 2 : 1))
+    {
+        mpack_break("worker tree was not initialized from this tree!");
+        mpack_tree_flag_error(tree, mpack_error_bug);
+        mpack_tree_destroy(worker);
+        return;
+    }
+
+    if (mpack_tree_error(tree) != mpack_ok) {
+        mpack_tree_destroy(worker);
+        return;
+    }
+
+    // The worker's pages are spliced into the tree's list of pages,
+    // after its current page.
+    mpack_tree_link_t* link = (mpack_tree_link_t*)mpack_allocator_alloc(tree->allocator, sizeof(mpack_tree_link_t));
+    if (link == NULL) {
+        mpack_tree_flag_error(tree, mpack_error_memory);
+        mpack_tree_destroy(worker);
+        return;
+    }
+    *link = worker->page;
+    link->left = 0;
+    mpack_tree_link_t* tail = link;
+    while (tail->next)
+        tail = tail->next;
+    tail->next = tree->page.next;
+    tree->page.next = link;
+
+    if (worker->range_count != 0)
+        mpack_memcpy(worker->range, worker->root, sizeof(mpack_node_data_t) * worker->range_count);
+    tree->node_count += worker->node_count;
+
+    worker->page.nodes = NULL;
+    worker->page.next = NULL;
+    mpack_tree_destroy(worker);
+}
+
+void mpack_tree_init_stream(mpack_tree_t* tree, mpack_tree_read_t read_fn, void* context, size_t max_message_size, size_t max_message_nodes) {
+    mpack_tree_init_clear(tree);
+
+    if (max_message_size == 0) {
+        mpack_break("max_message_size cannot be zero!");
+        tree->error = mpack_error_bug;
+        return;
+    }
+
+    tree->read_fn = read_fn;
+    tree->context = context;
+    tree->max_size = max_message_size;
+    tree->max_nodes = max_message_nodes;
+
+    tree->buffer_capacity = (max_message_size < MPACK_BUFFER_SIZE) ? max_message_size : MPACK_BUFFER_SIZE;
+    tree->buffer = (char*)mpack_allocator_alloc(tree->allocator, tree->buffer_capacity);
+    if (tree->buffer == NULL) {
+        tree->error = mpack_error_memory;
+        return;
+    }
+    tree->data = tree->buffer;
+
+    mpack_tree_init_page(tree);
+}
+
+// Frees all node pages of an owned tree.
+static void mpack_tree_free_pages(mpack_tree_t* tree) {
+    if (tree->page.nodes)
+        mpack_allocator_free(tree->allocator, tree->page.nodes);
+    tree->page.nodes = NULL;
+
+    mpack_tree_link_t* link = tree->page.next;
+    while (link) {
+        mpack_tree_link_t* next = link->next;
+        if (link->nodes)
+            mpack_allocator_free(tree->allocator, link->nodes);
+        mpack_allocator_free(tree->allocator, link);
+        link = next;
+    }
+    tree->page.next = NULL;
+}
+
+// Discards all nodes, keeping the node pages for the next message. If the
+// nodes didn't fit in one page, the pages are replaced by a single page
+// big enough for all of them, so parsing a message of the same size or
+// smaller again doesn't allocate.
+static void mpack_tree_recycle_pages(mpack_tree_t* tree) {
+    size_t capacity = tree->page.pos + tree->page.left;
+
+    if (tree->owned && (tree->page.next != NULL || tree->page.nodes == NULL)) {
+        size_t used = tree->page.pos;
+        mpack_tree_link_t* link;
+        for (link = tree->page.next; link; link = link->next)
+            used += link->pos;
+        mpack_tree_free_pages(tree);
+
+        capacity = (used > MPACK_NODE_PAGE_SIZE) ? used : MPACK_NODE_PAGE_SIZE;
+        mpack_log("consolidating node pages into one page of size %i\n", (int)capacity);
+        tree->page.nodes = (mpack_node_data_t*)mpack_allocator_alloc(tree->allocator, sizeof(mpack_node_data_t) * capacity);
+        if (tree->page.nodes == NULL) {
+            mpack_tree_flag_error(tree, mpack_error_memory);
+            capacity = 0;
+        }
+    }
+
+    tree->page.pos = 0;
+    tree->page.left = capacity;
+    tree->root = NULL;
+    tree->node_count = 0;
+    tree->parser.state = mpack_tree_parse_state_not_started;
+}
+
+// Discards the last message parsed from a stream, keeping any data read
+// past its end.
+static void mpack_tree_next_message(mpack_tree_t* tree) {
+    tree->data_length -= tree->size;
+    mpack_memmove(tree->buffer, tree->buffer + tree->size, tree->data_length);
+    tree->size = 0;
+    mpack_tree_recycle_pages(tree);
+}
+
+bool mpack_tree_try_parse(mpack_tree_t* tree) {
+    if (mpack_tree_error(tree) != mpack_ok)
+        return false;
+
+    if (tree->frozen) {
+        mpack_break("cannot parse into a frozen tree!");
+        mpack_tree_flag_error(tree, mpack_error_bug);
+        return false;
+    }
+
+    if (tree->read_fn == NULL) {
+        mpack_break("tree is not a stream!");
+        mpack_tree_flag_error(tree, mpack_error_bug);
+        return false;
+    }
+
+    if (tree->parser.state == mpack_tree_parse_state_parsed) {
+        mpack_tree_next_message(tree);
+        if (mpack_tree_error(tree) != mpack_ok)
+            return false;
+    }
+
+    if (tree->parser.state == mpack_tree_parse_state_not_started) {
+        mpack_tree_parse_start(tree);
+        if (tree->parser.state == mpack_tree_parse_state_not_started)
+            return false;
+    }
+
+    return mpack_tree_continue_parse(tree);
+}
+
+void mpack_tree_set_allocator(mpack_tree_t* tree, const mpack_allocator_t* allocator) {
+    if (tree->frozen && tree->owned) {
+        mpack_break("cannot change the allocator of a frozen tree!");
+        mpack_tree_flag_error(tree, mpack_error_bug);
+        return;
+    }
+
+    // A tree that parses into its own pages has already allocated and
+    // parsed them with the old allocator when it was initialized.
+    if (tree->owned && !tree->read_fn) {
+        mpack_break("cannot change the allocator of a tree that owns its pages! "
+                "Use mpack_tree_init_allocator() instead.");
+        mpack_tree_flag_error(tree, mpack_error_bug);
+        return;
+    }
+
+    if (tree->parser.state == mpack_tree_parse_state_in_progress) {
+        mpack_break("cannot change the allocator during a parse!");
+        mpack_tree_flag_error(tree, mpack_error_bug);
+        return;
+    }
+
+    // A pool tree only allocates its parsing stack during a parse, so
+    // there's nothing to move.
+    if (!tree->owned) {
+        tree->allocator = allocator;
+        return;
+    }
+
+    // Nodes can't be moved since they point to each other, so the parsed
+    // message of a stream is discarded, keeping any data read past its end.
+    if (tree->parser.state == mpack_tree_parse_state_parsed) {
+        tree->data_length -= tree->size;
+        mpack_memmove(tree->buffer, tree->buffer + tree->size, tree->data_length);
+    }
+    tree->size = 0;
+
+    if (tree->buffer) {
+        char* buffer = (char*)mpack_allocator_move(tree->allocator, allocator,
+                tree->buffer, tree->data_length, tree->buffer_capacity);
+        if (buffer == NULL) {
+            mpack_tree_flag_error(tree, mpack_error_memory);
+            return;
+        }
+        tree->buffer = buffer;
+        tree->data = buffer;
+    }
+
+    mpack_tree_free_pages(tree);
+    tree->page.pos = 0;
+    tree->page.left = 0;
+    tree->allocator = allocator;
+    mpack_tree_recycle_pages(tree);
+}
 #endif
 
+// Parses a message into the tree's node pool. Maps are only indexed if the
+// pool has room for the nodes counted by mpack_tree_count_nodes().
+static void mpack_tree_parse_pool(mpack_tree_t* tree, const char* data, size_t length) {
+    #if MPACK_NODE_MAP_INDEX_THRESHOLD
+    size_t count = 0;
+    if (tree->page.left >= (size_t)MPACK_NODE_MAP_INDEX_THRESHOLD * 2)
+        count = mpack_tree_count_nodes(data, length);
+    tree->pool_indexed = count != 0 && count <= tree->page.left;
+    #endif
+    mpack_tree_parse(tree, data, length);
+}
+
 void mpack_tree_init_pool(mpack_tree_t* tree, const char* data, size_t length, mpack_node_data_t* node_pool, size_t node_pool_count) {
     mpack_tree_init_clear(tree);
 
@@ -694,7 +1957,42 @@ void mpack_tree_init_pool(mpack_tree_t* tree, const char* data, size_t length, m
     tree->page.pos = 0;
     tree->page.left = node_pool_count;
 
-    mpack_tree_parse(tree, data, length);
+    mpack_tree_parse_pool(tree, data, length);
+}
+
+void mpack_tree_parse_again(mpack_tree_t* tree, const char* data, size_t length) {
+    if (tree->frozen) {
+        mpack_break("cannot parse new data into a frozen tree!");
+        mpack_tree_flag_error(tree, mpack_error_bug);
+        return;
+    }
+
+    #ifdef MPACK_MALLOC
+    if (tree->read_fn) {
+        mpack_break("cannot parse new data into a stream tree!");
+        mpack_tree_flag_error(tree, mpack_error_bug);
+        return;
+    }
+    #endif
+
+    // A suspended parse can't exist without a stream, so the parser
+    // has nothing to clean up.
+    tree->error = mpack_ok;
+    tree->size = 0;
+    #ifdef MPACK_MALLOC
+    mpack_tree_recycle_pages(tree);
+    if (mpack_tree_error(tree) != mpack_ok)
+        return;
+    if (tree->owned) {
+        mpack_tree_parse(tree, data, length);
+        return;
+    }
+    #else
+    tree->page.left += tree->page.pos;
+    tree->page.pos = 0;
+    #endif
+
+    mpack_tree_parse_pool(tree, data, length);
 }
 
 void mpack_tree_init_error(mpack_tree_t* tree, mpack_error_t error) {
@@ -702,16 +2000,77 @@ void mpack_tree_init_error(mpack_tree_t* tree, mpack_error_t error) {
     tree->error = error;
 }
 
+void mpack_tree_freeze(mpack_tree_t* tree) {
+    if (mpack_tree_error(tree) != mpack_ok)
+        return;
+
+    if (tree->parser.state != mpack_tree_parse_state_parsed) {
+        mpack_break("tree has not been parsed!");
+        mpack_tree_flag_error(tree, mpack_error_bug);
+        return;
+    }
+
+    #ifdef MPACK_MALLOC
+    // Views must never expand nodes, so a lazy tree is fully parsed
+    // by a single worker over all of the root's elements.
+    mpack_node_data_t* root = tree->root;
+    if (tree->lazy && !tree->frozen && (root->type == mpack_type_array || root->type == mpack_type_map)) {
+        mpack_tree_t worker;
+        mpack_tree_init_range(&worker, tree, 0, root->len);
+        mpack_tree_join(tree, &worker);
+        if (mpack_tree_error(tree) != mpack_ok)
+            return;
+    }
+    #endif
+
+    tree->frozen = true;
+}
+
+void mpack_tree_init_view(mpack_tree_t* view, const mpack_tree_t* tree) {
+    mpack_tree_init_clear(view);
+    if (tree->error != mpack_ok) {
+        view->error = tree->error;
+        return;
+    }
+
+    // The tree is shared between threads, so misuse is only flagged
+    // on the view.
+    if (!tree->frozen) {
+        mpack_break("tree is not frozen!");
+        view->error = mpack_error_bug;
+        return;
+    }
+
+    view->data = tree->data;
+    view->data_length = tree->data_length;
+    view->size = tree->size;
+    view->node_count = tree->node_count;
+    view->root = tree->root;
+    view->frozen = true;
+    view->parser.state = mpack_tree_parse_state_parsed;
+    #ifdef MPACK_MALLOC
+    view->allocator = tree->allocator;
+    #endif
+}
+
 #if MPACK_STDIO
 typedef struct mpack_file_tree_t {
     char* data;
     size_t size;
+    #if MPACK_MMAP
+    bool mapped; // data is a read-only mapping of the file rather than an allocation
+    #endif
     char buffer[MPACK_BUFFER_SIZE];
 } mpack_file_tree_t;
 
 static void mpack_file_tree_teardown(mpack_tree_t* tree) {
     mpack_file_tree_t* file_tree = (mpack_file_tree_t*)tree->context;
-    MPACK_FREE(file_tree->data);
+    #if MPACK_MMAP
+    if (file_tree->mapped)
+        munmap(file_tree->data, file_tree->size);
+    else
+    #endif
+        MPACK_FREE(file_tree->data);
     MPACK_FREE(file_tree);
 }
 
@@ -802,7 +2161,87 @@ void mpack_tree_init_file(mpack_tree_t* tree, const char* filename, size_t max_s
         return;
     }
 
+    #if MPACK_MMAP
+    file_tree->mapped = false;
+    #endif
+    mpack_tree_init(tree, file_tree->data, file_tree->size);
+    mpack_tree_set_context(tree, file_tree);
+    mpack_tree_set_teardown(tree, mpack_file_tree_teardown);
+}
+#endif
+
+#if MPACK_MMAP
+static bool mpack_file_tree_map(mpack_tree_t* tree, mpack_file_tree_t* file_tree, const char* filename, size_t max_size) {
+
+    // open the file
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        mpack_tree_init_error(tree, mpack_error_io);
+        return false;
+    }
+
+    // get the file size
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 0) {
+        close(fd);
+        mpack_tree_init_error(tree, mpack_error_io);
+        return false;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        mpack_tree_init_error(tree, mpack_error_invalid);
+        return false;
+    }
+
+    // make sure the size fits in memory and is less than max_size
+    if ((uint64_t)st.st_size > (uint64_t)SIZE_MAX || (max_size != 0 && (size_t)st.st_size > max_size)) {
+        close(fd);
+        mpack_tree_init_error(tree, mpack_error_too_big);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+
+    // map the file. the mapping keeps its own reference to the file, so
+    // we can close it right away.
+    void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        mpack_tree_init_error(tree, mpack_error_io);
+        return false;
+    }
+
+    file_tree->data = (char*)data;
+    file_tree->size = size;
+    file_tree->mapped = true;
+    return true;
+}
+
+void mpack_tree_init_mmap(mpack_tree_t* tree, const char* filename, size_t max_size) {
+
+    // allocate file tree
+    mpack_file_tree_t* file_tree = (mpack_file_tree_t*) MPACK_MALLOC(sizeof(mpack_file_tree_t));
+    if (file_tree == NULL) {
+        mpack_tree_init_error(tree, mpack_error_memory);
+        return;
+    }
+
+    // map the file
+    if (!mpack_file_tree_map(tree, file_tree, filename, max_size)) {
+        MPACK_FREE(file_tree);
+        return;
+    }
+
+    // The parser reads the whole file front to back exactly once, so we
+    // ask for aggressive read-ahead during the parse. Afterwards the node
+    // data is accessed in arbitrary order so we restore the default.
+    #ifdef MADV_SEQUENTIAL
+    madvise(file_tree->data, file_tree->size, MADV_SEQUENTIAL);
+    #endif
     mpack_tree_init(tree, file_tree->data, file_tree->size);
+    #ifdef MADV_NORMAL
+    madvise(file_tree->data, file_tree->size, MADV_NORMAL);
+    #endif
+
     mpack_tree_set_context(tree, file_tree);
     mpack_tree_set_teardown(tree, mpack_file_tree_teardown);
 }
@@ -810,18 +2249,13 @@ void mpack_tree_init_file(mpack_tree_t* tree, const char* filename, size_t max_s
 
 mpack_error_t mpack_tree_destroy(mpack_tree_t* tree) {
     #ifdef MPACK_MALLOC
-    if (tree->owned) {
-        if (tree->page.nodes)
-            MPACK_FREE(tree->page.nodes);
-        mpack_tree_link_t* link = tree->page.next;
-        while (link) {
-            mpack_tree_link_t* next = link->next;
-            if (link->nodes)
-                MPACK_FREE(link->nodes);
-            MPACK_FREE(link);
-            link = next;
-        }
-    }
+    if (tree->owned)
+        mpack_tree_free_pages(tree);
+
+    if (tree->parser.stack && !tree->parser.stack_allocated)
+        mpack_allocator_free(tree->allocator, tree->parser.stack);
+    if (tree->buffer)
+        mpack_allocator_free(tree->allocator, tree->buffer);
     #endif
 
     if (tree->teardown)
@@ -855,8 +2289,8 @@ void mpack_node_flag_error(mpack_node_t node, mpack_error_t error) {
 mpack_tag_t mpack_node_tag(mpack_node_t node) {
     mpack_tag_t tag;
     mpack_memset(&tag, 0, sizeof(tag));
-    tag.type = node.data->type;
-    switch (node.data->type) {
+    tag.type = (mpack_type_t)node.data->type;
+    switch ((mpack_type_t)node.data->type) {
         case mpack_type_nil:                                            break;
         case mpack_type_bool:    tag.v.b = node.data->value.b;          break;
         case mpack_type_float:   tag.v.f = node.data->value.f;          break;
@@ -864,24 +2298,181 @@ mpack_tag_t mpack_node_tag(mpack_node_t node) {
         case mpack_type_int:     tag.v.i = node.data->value.i;          break;
         case mpack_type_uint:    tag.v.u = node.data->value.u;          break;
 
-        case mpack_type_str:     tag.v.l = node.data->value.data.l;     break;
-        case mpack_type_bin:     tag.v.l = node.data->value.data.l;     break;
+        case mpack_type_str:     tag.v.l = node.data->len;     break;
+        case mpack_type_bin:     tag.v.l = node.data->len;     break;
 
         case mpack_type_ext:
-            tag.v.l = node.data->value.data.l;
+            tag.v.l = node.data->len;
             tag.exttype = node.data->exttype;
             break;
 
-        case mpack_type_array:   tag.v.n = node.data->value.content.n;  break;
-        case mpack_type_map:     tag.v.n = node.data->value.content.n;  break;
+        case mpack_type_array:   tag.v.n = node.data->len;  break;
+        case mpack_type_map:     tag.v.n = node.data->len;  break;
     }
     return tag;
 }
 
+#if MPACK_NODE_RAW
+void mpack_node_raw(mpack_node_t node, const char** data, size_t* length) {
+    if (mpack_node_error(node) != mpack_ok) {
+        *data = NULL;
+        *length = 0;
+        return;
+    }
+
+    // The nil node isn't in the tree's data
+    if (node.data == &node.tree->nil_node) {
+        *data = "\xc0";
+        *length = 1;
+        return;
+    }
+
+    *data = node.tree->data + node.data->raw_offset;
+    *length = node.data->raw_size;
+}
+
+#endif
+
+#if MPACK_WRITER
+typedef struct mpack_node_write_level_t {
+    mpack_node_data_t* child;
+    size_t left; // children left to write
+    bool map;
+} mpack_node_write_level_t;
+
+// Writes a node, returning true if it's an array or map with children
+// to be written after it.
+MPACK_STATIC_INLINE_SPEED bool mpack_write_node_data(mpack_writer_t* writer, mpack_tree_t* tree, mpack_node_data_t* data) {
+    switch ((mpack_type_t)data->type) {
+        case mpack_type_nil:    mpack_write_nil(writer);                    return false;
+        case mpack_type_bool:   mpack_write_bool(writer, data->value.b);    return false;
+        case mpack_type_float:  mpack_write_float(writer, data->value.f);   return false;
+        case mpack_type_double: mpack_write_double(writer, data->value.d);  return false;
+        case mpack_type_int:    mpack_write_int(writer, data->value.i);     return false;
+        case mpack_type_uint:   mpack_write_uint(writer, data->value.u);    return false;
+
+        case mpack_type_str:
+            mpack_write_str(writer, tree->data + data->value.offset, data->len);
+            return false;
+        case mpack_type_bin:
+            mpack_write_bin(writer, tree->data + data->value.offset, data->len);
+            return false;
+        case mpack_type_ext:
+            mpack_write_ext(writer, data->exttype, tree->data + data->value.offset, data->len);
+            return false;
+
+        case mpack_type_array:
+            mpack_start_array(writer, data->len);
+            return true;
+        case mpack_type_map:
+            mpack_start_map(writer, data->len);
+            return true;
+    }
+    return false;
+}
+
+void mpack_write_node(mpack_writer_t* writer, mpack_node_t node) {
+    mpack_tree_t* tree = node.tree;
+    if (mpack_tree_error(tree) != mpack_ok) {
+        mpack_writer_flag_error(writer, mpack_tree_error(tree));
+        return;
+    }
+
+    // As with the parser, the stack starts on the call stack and is
+    // moved to the heap if it needs to grow.
+    #ifdef MPACK_MALLOC
+    static const size_t initial_depth = MPACK_NODE_INITIAL_DEPTH;
+    #else
+    static const size_t initial_depth = MPACK_NODE_MAX_DEPTH_WITHOUT_MALLOC;
+    #endif
+    mpack_node_write_level_t stack_[initial_depth];
+    mpack_node_write_level_t* stack = stack_;
+    size_t depth = initial_depth;
+    size_t level = 0;
+    stack[0].child = node.data;
+    stack[0].left = 1;
+    stack[0].map = false;
+
+    while (mpack_writer_error(writer) == mpack_ok) {
+
+        // Finish any arrays and maps that have been fully written
+        if (stack[level].left == 0) {
+            if (level == 0)
+                break;
+            if (stack[level].map)
+                mpack_finish_map(writer);
+            else
+                mpack_finish_array(writer);
+            --level;
+            continue;
+        }
+
+        mpack_node_data_t* data = stack[level].child;
+        ++stack[level].child;
+        --stack[level].left;
+        if (!mpack_write_node_data(writer, tree, data))
+            continue;
+
+        if (!mpack_node_expand(mpack_node(tree, data))) {
+            mpack_writer_flag_error(writer, mpack_tree_error(tree));
+            break;
+        }
+
+        if (level + 1 == depth) {
+            #ifdef MPACK_MALLOC
+            size_t new_depth = depth * 2;
+            mpack_node_write_level_t* new_stack;
+            if (stack == stack_) {
+                new_stack = (mpack_node_write_level_t*)mpack_allocator_alloc(tree->allocator, sizeof(*stack) * new_depth);
+                if (new_stack)
+                    mpack_memcpy(new_stack, stack, sizeof(*stack) * depth);
+            } else {
+                new_stack = (mpack_node_write_level_t*)mpack_allocator_realloc(tree->allocator, stack,
+                        sizeof(*stack) * depth, sizeof(*stack) * new_depth);
+            }
+            if (new_stack == NULL) {
+                mpack_writer_flag_error(writer, mpack_error_memory);
+                break;
+            }
+            stack = new_stack;
+            depth = new_depth;
+            #else
+            mpack_writer_flag_error(writer, mpack_error_too_big);
+            break;
+            #endif
+        }
+
+        ++level;
+        stack[level].child = data->value.children;
+        stack[level].map = data->type == mpack_type_map;
+        stack[level].left = stack[level].map ? (size_t)data->len * 2 : data->len;
+    }
+
+    #ifdef MPACK_MALLOC
+    if (stack != stack_)
+        mpack_allocator_free(tree->allocator, stack);
+    #endif
+}
+
+#if MPACK_NODE_RAW
+void mpack_write_node_raw(mpack_writer_t* writer, mpack_node_t node) {
+    if (mpack_node_error(node) != mpack_ok) {
+        mpack_writer_flag_error(writer, mpack_node_error(node));
+        return;
+    }
+
+    const char* data;
+    size_t length;
+    mpack_node_raw(node, &data, &length);
+    mpack_write_object_bytes(writer, data, length);
+}
+#endif
+#endif
+
 #if MPACK_STDIO
 static void mpack_node_print_element(mpack_node_t node, size_t depth, FILE* file) {
     mpack_node_data_t* data = node.data;
-    switch (data->type) {
+    switch ((mpack_type_t)data->type) {
 
         case mpack_type_nil:
             fprintf(file, "null");
@@ -905,18 +2496,18 @@ static void mpack_node_print_element(mpack_node_t node, size_t depth, FILE* file
             break;
 
         case mpack_type_bin:
-            fprintf(file, "<binary data of length %u>", data->value.data.l);
+            fprintf(file, "<binary data of length %u>", data->len);
             break;
 
         case mpack_type_ext:
-            fprintf(file, "<ext data of type %i and length %u>", data->exttype, data->value.data.l);
+            fprintf(file, "<ext data of type %i and length %u>", data->exttype, data->len);
             break;
 
         case mpack_type_str:
             {
                 putc('"', file);
                 const char* bytes = mpack_node_data(node);
-                for (size_t i = 0; i < data->value.data.l; ++i) {
+                for (size_t i = 0; i < data->len; ++i) {
                     char c = bytes[i];
                     switch (c) {
                         case '\n': fprintf(file, "\\n"); break;
@@ -931,11 +2522,11 @@ static void mpack_node_print_element(mpack_node_t node, size_t depth, FILE* file
 
         case mpack_type_array:
             fprintf(file, "[\n");
-            for (size_t i = 0; i < data->value.content.n; ++i) {
+            for (size_t i = 0; i < data->len; ++i) {
                 for (size_t j = 0; j < depth + 1; ++j)
                     fprintf(file, "    ");
                 mpack_node_print_element(mpack_node_array_at(node, i), depth + 1, file);
-                if (i != data->value.content.n - 1)
+                if (i != data->len - 1)
                     putc(',', file);
                 putc('\n', file);
             }
@@ -946,13 +2537,13 @@ static void mpack_node_print_element(mpack_node_t node, size_t depth, FILE* file
 
         case mpack_type_map:
             fprintf(file, "{\n");
-            for (size_t i = 0; i < data->value.content.n; ++i) {
+            for (size_t i = 0; i < data->len; ++i) {
                 for (size_t j = 0; j < depth + 1; ++j)
                     fprintf(file, "    ");
                 mpack_node_print_element(mpack_node_map_key_at(node, i), depth + 1, file);
                 fprintf(file, ": ");
                 mpack_node_print_element(mpack_node_map_value_at(node, i), depth + 1, file);
-                if (i != data->value.content.n - 1)
+                if (i != data->len - 1)
                     putc(',', file);
                 putc('\n', file);
             }
@@ -982,19 +2573,19 @@ size_t mpack_node_copy_data(mpack_node_t node, char* buffer, size_t size) {
     if (mpack_node_error(node) != mpack_ok)
         return 0;
 
-    mpack_type_t type = node.data->type;
+    mpack_type_t type = (mpack_type_t)node.data->type;
     if (type != mpack_type_str && type != mpack_type_bin && type != mpack_type_ext) {
         mpack_node_flag_error(node, mpack_error_type);
         return 0;
     }
 
-    if (node.data->value.data.l > size) {
+    if (node.data->len > size) {
         mpack_node_flag_error(node, mpack_error_too_big);
         return 0;
     }
 
-    mpack_memcpy(buffer, node.data->value.data.bytes, node.data->value.data.l);
-    return (size_t)node.data->value.data.l;
+    mpack_memcpy(buffer, mpack_node_data_unchecked(node), node.data->len);
+    return (size_t)node.data->len;
 }
 
 void mpack_node_copy_cstr(mpack_node_t node, char* buffer, size_t size) {
@@ -1011,80 +2602,419 @@ void mpack_node_copy_cstr(mpack_node_t node, char* buffer, size_t size) {
         return;
     }
 
-    if (node.data->value.data.l > size - 1) {
+    if (node.data->len > size - 1) {
         buffer[0] = '\0';
         mpack_node_flag_error(node, mpack_error_too_big);
         return;
     }
 
-    mpack_memcpy(buffer, node.data->value.data.bytes, node.data->value.data.l);
-    buffer[node.data->value.data.l] = '\0';
+    mpack_memcpy(buffer, mpack_node_data_unchecked(node), node.data->len);
+    buffer[node.data->len] = '\0';
+}
+
+#ifdef MPACK_MALLOC
+char* mpack_node_data_alloc(mpack_node_t node, size_t maxlen) {
+    if (mpack_node_error(node) != mpack_ok)
+        return NULL;
+
+    // make sure this is a valid data type
+    mpack_type_t type = (mpack_type_t)node.data->type;
+    if (type != mpack_type_str && type != mpack_type_bin && type != mpack_type_ext) {
+        mpack_node_flag_error(node, mpack_error_type);
+        return NULL;
+    }
+
+    if (node.data->len > maxlen) {
+        mpack_node_flag_error(node, mpack_error_too_big);
+        return NULL;
+    }
+
+    char* ret = (char*) MPACK_MALLOC((size_t)node.data->len);
+    if (ret == NULL) {
+        mpack_node_flag_error(node, mpack_error_memory);
+        return NULL;
+    }
+
+    mpack_memcpy(ret, mpack_node_data_unchecked(node), node.data->len);
+    return ret;
+}
+
+char* mpack_node_cstr_alloc(mpack_node_t node, size_t maxlen) {
+    if (mpack_node_error(node) != mpack_ok)
+        return NULL;
+
+    // make sure maxlen makes sense
+    if (maxlen < 1) {
+        mpack_break("maxlen is zero; you must have room for at least a null-terminator");
+        mpack_node_flag_error(node, mpack_error_bug);
+        return NULL;
+    }
+
+    if (node.data->type != mpack_type_str) {
+        mpack_node_flag_error(node, mpack_error_type);
+        return NULL;
+    }
+
+    if (node.data->len > maxlen - 1) {
+        mpack_node_flag_error(node, mpack_error_too_big);
+        return NULL;
+    }
+
+    char* ret = (char*) MPACK_MALLOC((size_t)(node.data->len + 1));
+    if (ret == NULL) {
+        mpack_node_flag_error(node, mpack_error_memory);
+        return NULL;
+    }
+
+    mpack_memcpy(ret, mpack_node_data_unchecked(node), node.data->len);
+    ret[node.data->len] = '\0';
+    return ret;
+}
+#endif
+
+
+/*
+ * Compound Node Functions
+ */
+
+mpack_node_iter_t mpack_node_iter_impl(mpack_node_t node, mpack_type_t type) {
+    mpack_node_iter_t iter;
+    iter.tree = node.tree;
+    iter.pos = NULL;
+    iter.end = NULL;
+
+    if (mpack_node_error(node) != mpack_ok)
+        return iter;
+
+    if (node.data->type != type) {
+        mpack_node_flag_error(node, mpack_error_type);
+        return iter;
+    }
+
+    if (node.data->len == 0 || !mpack_node_expand(node))
+        return iter;
+
+    size_t count = (type == mpack_type_map) ? (size_t)node.data->len * 2 : node.data->len;
+    iter.pos = node.data->value.children;
+    iter.end = iter.pos + count;
+    mpack_node_iter_prefetch(node.tree, iter.pos + (type == mpack_type_map ? 1 : 0));
+    return iter;
 }
 
-#ifdef MPACK_MALLOC
-char* mpack_node_data_alloc(mpack_node_t node, size_t maxlen) {
+// Bulk Array Copy Functions
+//
+// The integer copy functions are identical other than the type and range,
+// so we define their content with a macro, as with the expect range
+// functions.
+//
+// The conversion loop has no early exit so that it can be unrolled or
+// vectorized; failures are accumulated and the first failing element is
+// only searched for if there was one.
+
+static mpack_node_data_t* mpack_node_array_copy_start(mpack_node_t node, size_t count) {
     if (mpack_node_error(node) != mpack_ok)
         return NULL;
 
-    // make sure this is a valid data type
-    mpack_type_t type = node.data->type;
-    if (type != mpack_type_str && type != mpack_type_bin && type != mpack_type_ext) {
+    if (node.data->type != mpack_type_array) {
         mpack_node_flag_error(node, mpack_error_type);
         return NULL;
     }
 
-    if (node.data->value.data.l > maxlen) {
+    if (node.data->len > count) {
         mpack_node_flag_error(node, mpack_error_too_big);
         return NULL;
     }
 
-    char* ret = (char*) MPACK_MALLOC((size_t)node.data->value.data.l);
-    if (ret == NULL) {
-        mpack_node_flag_error(node, mpack_error_memory);
+    if (node.data->len == 0 || !mpack_node_expand(node))
         return NULL;
-    }
+    return node.data->value.children;
+}
 
-    mpack_memcpy(ret, node.data->value.data.bytes, node.data->value.data.l);
-    return ret;
+#define MPACK_NODE_ARRAY_COPY_INT_IMPL(type_t, valid)                   \
+                                                                        \
+    mpack_node_data_t* children = mpack_node_array_copy_start(node, count); \
+    if (children == NULL)                                               \
+        return 0;                                                       \
+    size_t length = node.data->len;                                     \
+                                                                        \
+    /* convert everything, tracking whether any element was invalid. */ \
+    /* Invalid elements store zero rather than reading a value that */  \
+    /* may not have been set (e.g. the other bytes of a bool.) */       \
+    int all_valid = 1;                                                  \
+    size_t i;                                                           \
+    for (i = 0; i < length; ++i) {                                      \
+        mpack_node_data_t* data = children + i;                         \
+        int element_valid = (valid);                                    \
+        all_valid &= element_valid;                                     \
+        out[i] = element_valid ? (type_t)data->value.i : (type_t)0;     \
+    }                                                                   \
+    if (all_valid)                                                      \
+        return length;                                                  \
+                                                                        \
+    /* find the first invalid element */                                \
+    for (i = 0; i < length; ++i) {                                      \
+        mpack_node_data_t* data = children + i;                         \
+        if (!(valid))                                                   \
+            break;                                                      \
+    }                                                                   \
+    mpack_node_flag_error(node, mpack_error_type);                      \
+    return i;
+
+// An int node is in range of an unsigned type if it's non-negative; a
+// uint node is in range of a signed type if it doesn't have the sign bit.
+#define MPACK_NODE_ARRAY_VALID_UINT(max_value)                          \
+    ((data->type == mpack_type_uint ||                                  \
+            (data->type == mpack_type_int && data->value.i >= 0)) &&    \
+        data->value.u <= (max_value))
+#define MPACK_NODE_ARRAY_VALID_INT(min_value, max_value)                \
+    ((data->type == mpack_type_int || (data->type == mpack_type_uint && \
+            data->value.i >= 0)) &&                                     \
+        data->value.i >= (min_value) && data->value.i <= (max_value))
+
+size_t mpack_node_array_copy_u8(mpack_node_t node, uint8_t* out, size_t count) {MPACK_NODE_ARRAY_COPY_INT_IMPL(uint8_t, MPACK_NODE_ARRAY_VALID_UINT(UINT8_MAX))}
+size_t mpack_node_array_copy_u16(mpack_node_t node, uint16_t* out, size_t count) {MPACK_NODE_ARRAY_COPY_INT_IMPL(uint16_t, MPACK_NODE_ARRAY_VALID_UINT(UINT16_MAX))}
+size_t mpack_node_array_copy_u32(mpack_node_t node, uint32_t* out, size_t count) {MPACK_NODE_ARRAY_COPY_INT_IMPL(uint32_t, MPACK_NODE_ARRAY_VALID_UINT(UINT32_MAX))}
+size_t mpack_node_array_copy_u64(mpack_node_t node, uint64_t* out, size_t count) {MPACK_NODE_ARRAY_COPY_INT_IMPL(uint64_t,
+        data->type == mpack_type_uint || (data->type == mpack_type_int && data->value.i >= 0))}
+
+size_t mpack_node_array_copy_i8(mpack_node_t node, int8_t* out, size_t count) {MPACK_NODE_ARRAY_COPY_INT_IMPL(int8_t, MPACK_NODE_ARRAY_VALID_INT(INT8_MIN, INT8_MAX))}
+size_t mpack_node_array_copy_i16(mpack_node_t node, int16_t* out, size_t count) {MPACK_NODE_ARRAY_COPY_INT_IMPL(int16_t, MPACK_NODE_ARRAY_VALID_INT(INT16_MIN, INT16_MAX))}
+size_t mpack_node_array_copy_i32(mpack_node_t node, int32_t* out, size_t count) {MPACK_NODE_ARRAY_COPY_INT_IMPL(int32_t, MPACK_NODE_ARRAY_VALID_INT(INT32_MIN, INT32_MAX))}
+size_t mpack_node_array_copy_i64(mpack_node_t node, int64_t* out, size_t count) {MPACK_NODE_ARRAY_COPY_INT_IMPL(int64_t,
+        data->type == mpack_type_int || (data->type == mpack_type_uint && data->value.i >= 0))}
+
+// Arrays of reals are usually all floats or all doubles, so we check for
+// that first and convert them in a loop without a branch.
+#define MPACK_NODE_ARRAY_COPY_REAL_IMPL(type_t)                         \
+                                                                        \
+    mpack_node_data_t* children = mpack_node_array_copy_start(node, count); \
+    if (children == NULL)                                               \
+        return 0;                                                       \
+    size_t length = node.data->len;                                     \
+    size_t i;                                                           \
+                                                                        \
+    uint8_t type = children[0].type;                                    \
+    int same = 1;                                                       \
+    for (i = 1; i < length; ++i)                                        \
+        same &= (children[i].type == type);                             \
+    if (same && type == mpack_type_double) {                            \
+        for (i = 0; i < length; ++i)                                    \
+            out[i] = (type_t)children[i].value.d;                       \
+        return length;                                                  \
+    }                                                                   \
+    if (same && type == mpack_type_float) {                             \
+        for (i = 0; i < length; ++i)                                    \
+            out[i] = (type_t)children[i].value.f;                       \
+        return length;                                                  \
+    }                                                                   \
+                                                                        \
+    for (i = 0; i < length; ++i) {                                      \
+        mpack_node_data_t* data = children + i;                         \
+        switch (data->type) {                                           \
+            case mpack_type_uint: out[i] = (type_t)data->value.u; break; \
+            case mpack_type_int: out[i] = (type_t)data->value.i; break; \
+            case mpack_type_float: out[i] = (type_t)data->value.f; break; \
+            case mpack_type_double: out[i] = (type_t)data->value.d; break; \
+            default:                                                    \
+                mpack_node_flag_error(node, mpack_error_type);          \
+                return i;                                               \
+        }                                                               \
+    }                                                                   \
+    return length;
+
+size_t mpack_node_array_copy_float(mpack_node_t node, float* out, size_t count) {MPACK_NODE_ARRAY_COPY_REAL_IMPL(float)}
+size_t mpack_node_array_copy_double(mpack_node_t node, double* out, size_t count) {MPACK_NODE_ARRAY_COPY_REAL_IMPL(double)}
+
+MPACK_STATIC_INLINE bool mpack_node_key_is_int(mpack_node_data_t* key, int64_t num) {
+    return (key->type == mpack_type_int && key->value.i == num) ||
+        (key->type == mpack_type_uint && num >= 0 && key->value.u == (uint64_t)num);
 }
 
-char* mpack_node_cstr_alloc(mpack_node_t node, size_t maxlen) {
-    if (mpack_node_error(node) != mpack_ok)
+MPACK_STATIC_INLINE bool mpack_node_key_is_uint(mpack_node_data_t* key, uint64_t num) {
+    return (key->type == mpack_type_uint && key->value.u == num) ||
+        (key->type == mpack_type_int && key->value.i >= 0 && (uint64_t)key->value.i == num);
+}
+
+MPACK_STATIC_INLINE bool mpack_node_key_is_str(const char* data, mpack_node_data_t* key, const char* str, size_t length) {
+    return key->type == mpack_type_str && key->len == length &&
+        mpack_memcmp(str, data + key->value.offset, length) == 0;
+}
+
+// The map_find functions return the value for the given key in the given
+// map, or NULL if the key is not found. The node must be a map.
+
+static mpack_node_data_t* mpack_node_map_find_int(mpack_node_t node, int64_t num) {
+    size_t count = node.data->len;
+
+    #if MPACK_NODE_MAP_INDEX_THRESHOLD
+    if (node.data->flags & MPACK_NODE_FLAG_DENSE_INT) {
+        if (num < 0 || (uint64_t)num >= (uint64_t)count * 2)
+            return NULL;
+        uint32_t entry = mpack_node_map_index_get(mpack_node_child(node, count * 2), (size_t)num);
+        return (entry != 0) ? mpack_node_child(node, (entry - 1) * 2 + 1) : NULL;
+    }
+
+    if (node.data->flags & MPACK_NODE_FLAG_INDEXED) {
+        mpack_node_data_t* index = mpack_node_child(node, count * 2);
+        size_t mask = mpack_node_map_index_capacity(count) - 1;
+        size_t slot = mpack_node_hash_u64((uint64_t)num) & mask;
+        for (uint32_t entry; (entry = mpack_node_map_index_get(index, slot)) != 0; slot = (slot + 1) & mask)
+            if (mpack_node_key_is_int(mpack_node_child(node, (entry - 1) * 2), num))
+                return mpack_node_child(node, (entry - 1) * 2 + 1);
         return NULL;
+    }
+    #endif
 
-    // make sure maxlen makes sense
-    if (maxlen < 1) {
-        mpack_break("maxlen is zero; you must have room for at least a null-terminator");
-        mpack_node_flag_error(node, mpack_error_bug);
+    #if MPACK_NODE_MAP_SORTED_THRESHOLD
+    if (node.data->flags & MPACK_NODE_FLAG_SORTED_INT) {
+        size_t low = 0;
+        size_t high = count;
+        while (low < high) {
+            size_t mid = low + (high - low) / 2;
+            mpack_node_data_t* key = mpack_node_child(node, mid * 2);
+            int result = mpack_node_compare_int(key, num);
+            if (result == 0)
+                return mpack_node_child(node, mid * 2 + 1);
+            if (result < 0)
+                low = mid + 1;
+            else
+                high = mid;
+        }
         return NULL;
     }
+    if (node.data->flags & MPACK_NODE_FLAG_SORTED_STR)
+        return NULL; // the keys are all strings
+    #endif
 
-    if (node.data->type != mpack_type_str) {
-        mpack_node_flag_error(node, mpack_error_type);
+    for (size_t i = 0; i < count; ++i)
+        if (mpack_node_key_is_int(mpack_node_child(node, i * 2), num))
+            return mpack_node_child(node, i * 2 + 1);
+    return NULL;
+}
+
+static mpack_node_data_t* mpack_node_map_find_uint(mpack_node_t node, uint64_t num) {
+    size_t count = node.data->len;
+
+    #if MPACK_NODE_MAP_INDEX_THRESHOLD
+    if (node.data->flags & MPACK_NODE_FLAG_DENSE_INT) {
+        if (num >= (uint64_t)count * 2)
+            return NULL;
+        uint32_t entry = mpack_node_map_index_get(mpack_node_child(node, count * 2), (size_t)num);
+        return (entry != 0) ? mpack_node_child(node, (entry - 1) * 2 + 1) : NULL;
+    }
+
+    if (node.data->flags & MPACK_NODE_FLAG_INDEXED) {
+        mpack_node_data_t* index = mpack_node_child(node, count * 2);
+        size_t mask = mpack_node_map_index_capacity(count) - 1;
+        size_t slot = mpack_node_hash_u64(num) & mask;
+        for (uint32_t entry; (entry = mpack_node_map_index_get(index, slot)) != 0; slot = (slot + 1) & mask)
+            if (mpack_node_key_is_uint(mpack_node_child(node, (entry - 1) * 2), num))
+                return mpack_node_child(node, (entry - 1) * 2 + 1);
         return NULL;
     }
+    #endif
 
-    if (node.data->value.data.l > maxlen - 1) {
-        mpack_node_flag_error(node, mpack_error_too_big);
+    #if MPACK_NODE_MAP_SORTED_THRESHOLD
+    if (node.data->flags & MPACK_NODE_FLAG_SORTED_INT) {
+        size_t low = 0;
+        size_t high = count;
+        while (low < high) {
+            size_t mid = low + (high - low) / 2;
+            mpack_node_data_t* key = mpack_node_child(node, mid * 2);
+            int result = mpack_node_compare_uint(key, num);
+            if (result == 0)
+                return mpack_node_child(node, mid * 2 + 1);
+            if (result < 0)
+                low = mid + 1;
+            else
+                high = mid;
+        }
         return NULL;
     }
+    if (node.data->flags & MPACK_NODE_FLAG_SORTED_STR)
+        return NULL; // the keys are all strings
+    #endif
 
-    char* ret = (char*) MPACK_MALLOC((size_t)(node.data->value.data.l + 1));
-    if (ret == NULL) {
-        mpack_node_flag_error(node, mpack_error_memory);
+    for (size_t i = 0; i < count; ++i)
+        if (mpack_node_key_is_uint(mpack_node_child(node, i * 2), num))
+            return mpack_node_child(node, i * 2 + 1);
+    return NULL;
+}
+
+// The hash is of the key for looking it up in an indexed map. If it's
+// NULL, it's computed as needed.
+static mpack_node_data_t* mpack_node_map_find_str(mpack_node_t node, const char* str, size_t length, const uint32_t* hash) {
+    size_t count = node.data->len;
+    #if !MPACK_NODE_MAP_INDEX_THRESHOLD
+    MPACK_UNUSED(hash);
+    #endif
+
+    #if MPACK_NODE_MAP_INDEX_THRESHOLD
+    if (node.data->flags & MPACK_NODE_FLAG_DENSE_INT)
+        return NULL; // the keys are all integers
+
+    if (node.data->flags & MPACK_NODE_FLAG_INDEXED) {
+        mpack_node_data_t* index = mpack_node_child(node, count * 2);
+        size_t mask = mpack_node_map_index_capacity(count) - 1;
+        size_t slot = (hash ? *hash : mpack_node_hash_str(str, length)) & mask;
+        for (uint32_t entry; (entry = mpack_node_map_index_get(index, slot)) != 0; slot = (slot + 1) & mask)
+            if (mpack_node_key_is_str(node.tree->data, mpack_node_child(node, (entry - 1) * 2), str, length))
+                return mpack_node_child(node, (entry - 1) * 2 + 1);
         return NULL;
     }
+    #endif
 
-    mpack_memcpy(ret, node.data->value.data.bytes, node.data->value.data.l);
-    ret[node.data->value.data.l] = '\0';
-    return ret;
+    #if MPACK_NODE_MAP_SORTED_THRESHOLD
+    if (node.data->flags & MPACK_NODE_FLAG_SORTED_STR) {
+        size_t low = 0;
+        size_t high = count;
+        while (low < high) {
+            size_t mid = low + (high - low) / 2;
+            mpack_node_data_t* key = mpack_node_child(node, mid * 2);
+            int result = mpack_node_compare_str(node.tree->data, key, str, length);
+            if (result == 0)
+                return mpack_node_child(node, mid * 2 + 1);
+            if (result < 0)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        return NULL;
+    }
+    if (node.data->flags & MPACK_NODE_FLAG_SORTED_INT)
+        return NULL; // the keys are all integers
+    #endif
+
+    for (size_t i = 0; i < count; ++i)
+        if (mpack_node_key_is_str(node.tree->data, mpack_node_child(node, i * 2), str, length))
+            return mpack_node_child(node, i * 2 + 1);
+    return NULL;
 }
-#endif
 
+// Returns the value of a string key whose pair was guessed from the
+// layout of a similar map, or NULL if the guessed pair doesn't have the
+// key. As with mpack_node_map_find_str(), the first of any duplicate keys
+// is returned, so unless the keys are sorted, a match after the first
+// pair is checked against the keys before it (through the index if the
+// map has one.)
+static mpack_node_data_t* mpack_node_map_guess_str(mpack_node_t node, size_t pair, const char* str, size_t length, const uint32_t* hash) {
+    if (pair >= node.data->len || !mpack_node_key_is_str(node.tree->data, mpack_node_child(node, pair * 2), str, length))
+        return NULL;
+    if (pair == 0 || (node.data->flags & MPACK_NODE_FLAG_SORTED_STR))
+        return mpack_node_child(node, pair * 2 + 1);
 
-/*
- * Compound Node Functions
- */
+    #if MPACK_NODE_MAP_INDEX_THRESHOLD
+    if (node.data->flags & MPACK_NODE_FLAG_INDEXED)
+        return mpack_node_map_find_str(node, str, length, hash);
+    #else
+    MPACK_UNUSED(hash);
+    #endif
+
+    for (size_t i = 0; i < pair; ++i)
+        if (mpack_node_key_is_str(node.tree->data, mpack_node_child(node, i * 2), str, length))
+            return mpack_node_child(node, i * 2 + 1);
+    return mpack_node_child(node, pair * 2 + 1);
+}
 
 mpack_node_t mpack_node_map_int_impl(mpack_node_t node, int64_t num, bool optional) {
     if (mpack_node_error(node) != mpack_ok)
@@ -1095,15 +3025,12 @@ mpack_node_t mpack_node_map_int_impl(mpack_node_t node, int64_t num, bool option
         return mpack_tree_nil_node(node.tree);
     }
 
-    for (size_t i = 0; i < node.data->value.content.n; ++i) {
-        mpack_node_data_t* key = mpack_node_child(node, i * 2);
-        mpack_node_data_t* value = mpack_node_child(node, i * 2 + 1);
+    if (!mpack_node_expand(node))
+        return mpack_tree_nil_node(node.tree);
 
-        if (key->type == mpack_type_int && key->value.i == num)
-            return mpack_node(node.tree, value);
-        if (key->type == mpack_type_uint && num >= 0 && key->value.u == (uint64_t)num)
-            return mpack_node(node.tree, value);
-    }
+    mpack_node_data_t* value = mpack_node_map_find_int(node, num);
+    if (value)
+        return mpack_node(node.tree, value);
 
     if (!optional)
         mpack_node_flag_error(node, mpack_error_data);
@@ -1119,15 +3046,12 @@ mpack_node_t mpack_node_map_uint_impl(mpack_node_t node, uint64_t num, bool opti
         return mpack_tree_nil_node(node.tree);
     }
 
-    for (size_t i = 0; i < node.data->value.content.n; ++i) {
-        mpack_node_data_t* key = mpack_node_child(node, i * 2);
-        mpack_node_data_t* value = mpack_node_child(node, i * 2 + 1);
+    if (!mpack_node_expand(node))
+        return mpack_tree_nil_node(node.tree);
 
-        if (key->type == mpack_type_uint && key->value.u == num)
-            return mpack_node(node.tree, value);
-        if (key->type == mpack_type_int && key->value.i >= 0 && (uint64_t)key->value.i == num)
-            return mpack_node(node.tree, value);
-    }
+    mpack_node_data_t* value = mpack_node_map_find_uint(node, num);
+    if (value)
+        return mpack_node(node.tree, value);
 
     if (!optional)
         mpack_node_flag_error(node, mpack_error_data);
@@ -1143,13 +3067,12 @@ mpack_node_t mpack_node_map_str_impl(mpack_node_t node, const char* str, size_t
         return mpack_tree_nil_node(node.tree);
     }
 
-    for (size_t i = 0; i < node.data->value.content.n; ++i) {
-        mpack_node_data_t* key = mpack_node_child(node, i * 2);
-        mpack_node_data_t* value = mpack_node_child(node, i * 2 + 1);
+    if (!mpack_node_expand(node))
+        return mpack_tree_nil_node(node.tree);
 
-        if (key->type == mpack_type_str && key->value.data.l == length && mpack_memcmp(str, key->value.data.bytes, length) == 0)
-            return mpack_node(node.tree, value);
-    }
+    mpack_node_data_t* value = mpack_node_map_find_str(node, str, length, NULL);
+    if (value)
+        return mpack_node(node.tree, value);
 
     if (!optional)
         mpack_node_flag_error(node, mpack_error_data);
@@ -1165,13 +3088,575 @@ bool mpack_node_map_contains_str(mpack_node_t node, const char* str, size_t leng
         return false;
     }
 
-    for (size_t i = 0; i < node.data->value.content.n; ++i) {
-        mpack_node_data_t* key = mpack_node_child(node, i * 2);
-        if (key->type == mpack_type_str && key->value.data.l == length && mpack_memcmp(str, key->value.data.bytes, length) == 0)
-            return true;
+    if (!mpack_node_expand(node))
+        return false;
+
+    return mpack_node_map_find_str(node, str, length, NULL) != NULL;
+}
+
+mpack_node_map_cursor_t mpack_node_map_cursor(mpack_node_t node) {
+    mpack_node_map_cursor_t cursor;
+    cursor.tree = node.tree;
+    cursor.map = NULL;
+    cursor.next = 0;
+
+    if (mpack_node_error(node) != mpack_ok)
+        return cursor;
+
+    if (node.data->type != mpack_type_map) {
+        mpack_node_flag_error(node, mpack_error_type);
+        return cursor;
     }
 
-    return false;
+    if (mpack_node_expand(node))
+        cursor.map = node.data;
+    return cursor;
+}
+
+mpack_node_t mpack_node_map_cursor_str_impl(mpack_node_map_cursor_t* cursor, const char* str, size_t length, bool optional) {
+    mpack_tree_t* tree = cursor->tree;
+    if (mpack_tree_error(tree) != mpack_ok || cursor->map == NULL)
+        return mpack_tree_nil_node(tree);
+
+    mpack_node_t node = mpack_node(tree, cursor->map);
+    size_t count = node.data->len;
+    size_t next = (cursor->next < count) ? cursor->next : 0;
+    mpack_node_data_t* value = NULL;
+
+    // The key is usually the next one. Dense and sorted maps have no
+    // duplicate string keys, so a match there is the only one; otherwise
+    // they are searched as usual. An indexed map may have duplicates, and
+    // its index finds the first directly.
+    if (node.data->flags & (MPACK_NODE_FLAG_DENSE_INT | MPACK_NODE_FLAG_SORTED_STR | MPACK_NODE_FLAG_SORTED_INT)) {
+        if (next < count && mpack_node_key_is_str(tree->data, mpack_node_child(node, next * 2), str, length))
+            value = mpack_node_child(node, next * 2 + 1);
+        else
+            value = mpack_node_map_find_str(node, str, length, NULL);
+    } else if (node.data->flags & MPACK_NODE_FLAG_INDEXED) {
+        value = mpack_node_map_find_str(node, str, length, NULL);
+    } else {
+        // Other maps are searched forward from the next key, wrapping
+        // around. The keys skipped before the next one are then checked so
+        // that the first of any duplicates is found, same as with
+        // mpack_node_map_str().
+        size_t found = count;
+        for (size_t i = 0; i < count; ++i) {
+            size_t pair = next + i;
+            if (pair >= count)
+                pair -= count;
+            if (mpack_node_key_is_str(tree->data, mpack_node_child(node, pair * 2), str, length)) {
+                found = pair;
+                break;
+            }
+        }
+        if (found != count && found >= next) {
+            for (size_t pair = 0; pair < next; ++pair) {
+                if (mpack_node_key_is_str(tree->data, mpack_node_child(node, pair * 2), str, length)) {
+                    found = pair;
+                    break;
+                }
+            }
+        }
+        if (found != count)
+            value = mpack_node_child(node, found * 2 + 1);
+    }
+
+    if (value) {
+        cursor->next = (size_t)(value - mpack_node_child(node, 0)) / 2 + 1;
+        return mpack_node(tree, value);
+    }
+
+    if (!optional)
+        mpack_node_flag_error(node, mpack_error_data);
+    return mpack_tree_nil_node(tree);
+}
+
+
+#if MPACK_NODE_MAP_INDEX_THRESHOLD
+// Finds the value of a string key in an indexed map, also returning
+// whether the key appears in it more than once. Keys are inserted into
+// the index in order, so the first match in the probe sequence is the
+// first occurrence of the key.
+static mpack_node_data_t* mpack_node_map_index_find_str(mpack_node_t node, const char* str, size_t length, bool* duplicate) {
+    size_t count = node.data->len;
+    mpack_node_data_t* index = mpack_node_child(node, count * 2);
+    size_t mask = mpack_node_map_index_capacity(count) - 1;
+    size_t slot = mpack_node_hash_str(str, length) & mask;
+    mpack_node_data_t* value = NULL;
+    for (uint32_t entry; (entry = mpack_node_map_index_get(index, slot)) != 0; slot = (slot + 1) & mask) {
+        if (mpack_node_key_is_str(node.tree->data, mpack_node_child(node, (entry - 1) * 2), str, length)) {
+            if (value) {
+                *duplicate = true;
+                break;
+            }
+            value = mpack_node_child(node, (entry - 1) * 2 + 1);
+        }
+    }
+    return value;
+}
+#endif
+
+/*
+ * Maps without an index or sorted keys are searched for many keys in one
+ * pass over their keys. Up to MPACK_NODE_MAP_SCAN_KEYS requested keys are
+ * put in a small hash table on the call stack, so each key of the map is
+ * matched in constant time. The table is at most half full.
+ */
+
+#define MPACK_NODE_MAP_SCAN_KEYS 64
+
+// The table only holds a few keys, so rather than hashing whole keys this
+// mixes just their length and three of their bytes. Keys that collide are
+// still compared in full.
+MPACK_STATIC_INLINE uint32_t mpack_node_map_scan_hash(const char* str, size_t length) {
+    if (length == 0)
+        return 0;
+    uint32_t hash = (uint32_t)length * 0x9e3779b1u;
+    hash ^= (uint32_t)(uint8_t)str[0] * 0x85ebca6bu;
+    hash ^= (uint32_t)(uint8_t)str[length / 2] * 0xc2b2ae35u;
+    hash ^= (uint32_t)(uint8_t)str[length - 1] * 0x27d4eb2fu;
+    return hash ^ (hash >> 15);
+}
+
+static size_t mpack_node_map_scan_cstr(mpack_node_t node, const char* const* keys, size_t count,
+        mpack_node_t* values, bool* duplicates)
+{
+    uint32_t hashes[MPACK_NODE_MAP_SCAN_KEYS];
+    size_t lengths[MPACK_NODE_MAP_SCAN_KEYS];
+    uint8_t slots[MPACK_NODE_MAP_SCAN_KEYS * 2];
+    const size_t mask = MPACK_NODE_MAP_SCAN_KEYS * 2 - 1;
+    mpack_memset(slots, 0, sizeof(slots));
+
+    for (size_t i = 0; i < count; ++i) {
+        lengths[i] = mpack_strlen(keys[i]);
+        hashes[i] = mpack_node_map_scan_hash(keys[i], lengths[i]);
+        size_t slot = hashes[i] & mask;
+        while (slots[slot] != 0)
+            slot = (slot + 1) & mask;
+        slots[slot] = (uint8_t)(i + 1);
+    }
+
+    // The same key may be requested more than once, so the whole probe
+    // sequence is matched against each key of the map. Only the first of
+    // any duplicate keys in the map is kept, as with mpack_node_map_cstr(),
+    // and later ones are reported in duplicates (if not NULL).
+    size_t found = 0;
+    mpack_node_data_t* nil = &node.tree->nil_node;
+    for (size_t j = 0; j < node.data->len; ++j) {
+        mpack_node_data_t* key = mpack_node_child(node, j * 2);
+        if (key->type != mpack_type_str)
+            continue;
+        uint32_t hash = mpack_node_map_scan_hash(node.tree->data + key->value.offset, key->len);
+        for (size_t slot = hash & mask; slots[slot] != 0; slot = (slot + 1) & mask) {
+            size_t i = (size_t)slots[slot] - 1;
+            if (hashes[i] != hash || !mpack_node_key_is_str(node.tree->data, key, keys[i], lengths[i]))
+                continue;
+            if (values[i].data != nil) {
+                if (duplicates)
+                    duplicates[i] = true;
+                continue;
+            }
+            values[i].data = key + 1;
+            ++found;
+        }
+    }
+    return found;
+}
+
+size_t mpack_node_map_cstr_many_impl(mpack_node_t node, const char* const* keys, size_t count,
+        mpack_node_t* values, bool* duplicates, bool optional)
+{
+    for (size_t i = 0; i < count; ++i)
+        values[i] = mpack_tree_nil_node(node.tree);
+    if (duplicates)
+        for (size_t i = 0; i < count; ++i)
+            duplicates[i] = false;
+
+    if (mpack_node_error(node) != mpack_ok)
+        return 0;
+
+    if (node.data->type != mpack_type_map) {
+        mpack_node_flag_error(node, mpack_error_type);
+        return 0;
+    }
+
+    if (!mpack_node_expand(node))
+        return 0;
+
+    size_t found = 0;
+
+    #if MPACK_NODE_MAP_INDEX_THRESHOLD
+    // The index is only probed past the first match if duplicates are
+    // wanted
+    if ((node.data->flags & MPACK_NODE_FLAG_INDEXED) && duplicates) {
+        for (size_t i = 0; i < count; ++i) {
+            mpack_node_data_t* value = mpack_node_map_index_find_str(node, keys[i], mpack_strlen(keys[i]), duplicates + i);
+            if (value) {
+                values[i].data = value;
+                ++found;
+            }
+        }
+    } else
+    #endif
+
+    // Maps with an index or sorted keys find each key directly. Sorted
+    // keys are strictly increasing and dense keys are all integers, so
+    // they have no duplicate string keys.
+    if (node.data->flags & (MPACK_NODE_FLAG_INDEXED | MPACK_NODE_FLAG_DENSE_INT |
+                MPACK_NODE_FLAG_SORTED_STR | MPACK_NODE_FLAG_SORTED_INT))
+    {
+        for (size_t i = 0; i < count; ++i) {
+            mpack_node_data_t* value = mpack_node_map_find_str(node, keys[i], mpack_strlen(keys[i]), NULL);
+            if (value) {
+                values[i].data = value;
+                ++found;
+            }
+        }
+    } else {
+        for (size_t i = 0; i < count; i += MPACK_NODE_MAP_SCAN_KEYS) {
+            size_t batch = count - i;
+            if (batch > MPACK_NODE_MAP_SCAN_KEYS)
+                batch = MPACK_NODE_MAP_SCAN_KEYS;
+            found += mpack_node_map_scan_cstr(node, keys + i, batch, values + i, duplicates ? duplicates + i : NULL);
+        }
+    }
+
+    if (found != count && !optional)
+        mpack_node_flag_error(node, mpack_error_data);
+    return found;
+}
+
+/*
+ * Columns are extracted from an array of maps in batches of up to
+ * MPACK_NODE_MAP_SCAN_KEYS. The position of each column's key in the
+ * last map is kept on the call stack and checked first in the next map,
+ * so maps with the same layout are read without searching them. (A match
+ * there in a map that may have duplicate keys is still checked for an
+ * earlier duplicate; see mpack_node_map_guess_str().)
+ */
+
+// Stores a column value, or zero if value is NULL.
+static void mpack_node_column_store(mpack_node_column_t* column, size_t row, mpack_tree_t* tree, mpack_node_data_t* value) {
+    mpack_node_t node = mpack_node(tree, value);
+    switch (column->type) {
+        case mpack_type_bool:
+            ((bool*)column->values)[row] = value ? mpack_node_bool(node) : false;
+            break;
+        case mpack_type_int:
+            ((int64_t*)column->values)[row] = value ? mpack_node_i64(node) : 0;
+            break;
+        case mpack_type_uint:
+            ((uint64_t*)column->values)[row] = value ? mpack_node_u64(node) : 0;
+            break;
+        case mpack_type_float:
+            ((float*)column->values)[row] = value ? mpack_node_float(node) : 0.0f;
+            break;
+        default:
+            ((double*)column->values)[row] = value ? mpack_node_double(node) : 0.0;
+            break;
+    }
+}
+
+static void mpack_node_array_columns_batch(mpack_node_t node, mpack_node_column_t* columns, size_t column_count) {
+    mpack_tree_t* tree = node.tree;
+    size_t lengths[MPACK_NODE_MAP_SCAN_KEYS];
+    size_t positions[MPACK_NODE_MAP_SCAN_KEYS];
+
+    // until a key is found, guess that the keys are in column order
+    for (size_t i = 0; i < column_count; ++i) {
+        lengths[i] = mpack_strlen(columns[i].key);
+        positions[i] = i;
+    }
+
+    for (size_t row = 0; row < node.data->len; ++row) {
+        mpack_node_t map = mpack_node(tree, mpack_node_child(node, row));
+        if (map.data->type != mpack_type_map) {
+            mpack_node_flag_error(map, mpack_error_type);
+            return;
+        }
+        if (!mpack_node_expand(map))
+            return;
+
+        for (size_t i = 0; i < column_count; ++i) {
+            mpack_node_column_t* column = columns + i;
+            mpack_node_data_t* value = mpack_node_map_guess_str(map, positions[i], column->key, lengths[i], NULL);
+            if (value == NULL)
+                value = mpack_node_map_find_str(map, column->key, lengths[i], NULL);
+            if (value)
+                positions[i] = (size_t)(value - mpack_node_child(map, 0)) / 2;
+
+            if (column->present) {
+                if (value && value->type == mpack_type_nil)
+                    value = NULL;
+                uint8_t bit = (uint8_t)(1u << (row % 8));
+                if (value)
+                    column->present[row / 8] |= bit;
+                else
+                    column->present[row / 8] &= (uint8_t)~bit;
+            } else if (!value) {
+                mpack_node_flag_error(map, mpack_error_data);
+                return;
+            }
+
+            mpack_node_column_store(column, row, tree, value);
+        }
+
+        if (mpack_tree_error(tree) != mpack_ok)
+            return;
+    }
+}
+
+size_t mpack_node_array_columns(mpack_node_t node, mpack_node_column_t* columns, size_t column_count, size_t count) {
+    if (mpack_node_error(node) != mpack_ok)
+        return 0;
+
+    for (size_t i = 0; i < column_count; ++i) {
+        mpack_type_t type = columns[i].type;
+        if (type != mpack_type_bool && type != mpack_type_int && type != mpack_type_uint &&
+                type != mpack_type_float && type != mpack_type_double)
+        {
+            mpack_break("column %i has unsupported type %i!", (int)i, (int)type);
+            mpack_node_flag_error(node, mpack_error_bug);
+            return 0;
+        }
+    }
+
+    if (node.data->type != mpack_type_array) {
+        mpack_node_flag_error(node, mpack_error_type);
+        return 0;
+    }
+
+    if (node.data->len > count) {
+        mpack_node_flag_error(node, mpack_error_too_big);
+        return 0;
+    }
+
+    if (node.data->len == 0 || !mpack_node_expand(node))
+        return 0;
+
+    for (size_t i = 0; i < column_count; i += MPACK_NODE_MAP_SCAN_KEYS) {
+        size_t batch = column_count - i;
+        if (batch > MPACK_NODE_MAP_SCAN_KEYS)
+            batch = MPACK_NODE_MAP_SCAN_KEYS;
+        mpack_node_array_columns_batch(node, columns + i, batch);
+    }
+
+    if (mpack_node_error(node) != mpack_ok)
+        return 0;
+    return node.data->len;
+}
+
+
+
+/*
+ * Node path functions
+ */
+
+mpack_error_t mpack_path_compile(mpack_path_t* path, const char* cstr) {
+    path->count = 0;
+    path->wildcard = false;
+
+    const char* p = cstr;
+    while (*p != '\0') {
+        if (path->count == MPACK_NODE_PATH_MAX_SEGMENTS)
+            return mpack_error_too_big;
+        mpack_path_segment_t* segment = path->segments + path->count;
+        mpack_memset(segment, 0, sizeof(*segment));
+
+        if (*p == '[') {
+            ++p;
+            if (*p == '*') {
+                segment->type = mpack_path_segment_wildcard;
+                ++p;
+            } else {
+                if (*p < '0' || *p > '9')
+                    return mpack_error_invalid;
+                size_t index = 0;
+                for (; *p >= '0' && *p <= '9'; ++p) {
+                    size_t digit = (size_t)(*p - '0');
+                    if (index > (SIZE_MAX - digit) / 10)
+                        return mpack_error_invalid;
+                    index = index * 10 + digit;
+                }
+                segment->type = mpack_path_segment_index;
+                segment->value = index;
+            }
+            if (*p != ']')
+                return mpack_error_invalid;
+            ++p;
+
+        } else {
+            // Keys after the first segment must start with a dot
+            if (*p == '.')
+                ++p;
+            else if (path->count != 0)
+                return mpack_error_invalid;
+
+            const char* key = p;
+            while (*p != '\0' && *p != '.' && *p != '[')
+                ++p;
+            size_t length = (size_t)(p - key);
+            if (length == 0)
+                return mpack_error_invalid;
+
+            if (length == 1 && *key == '*') {
+                segment->type = mpack_path_segment_wildcard;
+            } else {
+                segment->type = mpack_path_segment_key;
+                segment->key = key;
+                segment->value = length;
+                #if MPACK_NODE_MAP_INDEX_THRESHOLD
+                segment->hash = mpack_node_hash_str(key, length);
+                #endif
+            }
+        }
+
+        if (segment->type == mpack_path_segment_wildcard)
+            path->wildcard = true;
+        ++path->count;
+    }
+
+    return mpack_ok;
+}
+
+// Returns the child of an array or map for a key or index segment, or
+// NULL if there isn't one.
+static mpack_node_data_t* mpack_node_path_child(mpack_node_t node, const mpack_path_segment_t* segment) {
+    if (!mpack_node_expand(node))
+        return NULL;
+
+    if (node.data->type == mpack_type_map) {
+        if (segment->type == mpack_path_segment_key) {
+            #if MPACK_NODE_MAP_INDEX_THRESHOLD
+            const uint32_t* hash = &segment->hash;
+            #else
+            const uint32_t* hash = NULL;
+            #endif
+            return mpack_node_map_find_str(node, segment->key, segment->value, hash);
+        }
+        return mpack_node_map_find_uint(node, (uint64_t)segment->value);
+    }
+
+    if (segment->type == mpack_path_segment_key || segment->value >= node.data->len)
+        return NULL;
+    return mpack_node_child(node, segment->value);
+}
+
+// Returns the value of a key segment in a map, first checking the pair
+// recorded in the shape if the map has the recorded number of pairs, and
+// recording the position it's found at.
+static mpack_node_data_t* mpack_node_path_shape_child(mpack_node_t node, const mpack_path_segment_t* segment,
+        mpack_path_shape_t* shape, size_t i)
+{
+    if (!mpack_node_expand(node))
+        return NULL;
+
+    #if MPACK_NODE_MAP_INDEX_THRESHOLD
+    const uint32_t* hash = &segment->hash;
+    #else
+    const uint32_t* hash = NULL;
+    #endif
+
+    mpack_node_data_t* child = NULL;
+    if (node.data->len == shape->counts[i])
+        child = mpack_node_map_guess_str(node, shape->pairs[i], segment->key, segment->value, hash);
+    if (child == NULL)
+        child = mpack_node_path_child(node, segment);
+    if (child) {
+        shape->counts[i] = node.data->len;
+        shape->pairs[i] = (uint32_t)((size_t)(child - mpack_node_child(node, 0)) / 2);
+    }
+    return child;
+}
+
+// The shape is NULL if the path is not cached.
+static mpack_node_t mpack_node_path_impl(mpack_node_t node, const mpack_path_t* path, mpack_path_shape_t* shape, bool optional) {
+    if (mpack_node_error(node) != mpack_ok)
+        return mpack_tree_nil_node(node.tree);
+
+    if (path->wildcard) {
+        mpack_break("path contains wildcards! use mpack_node_path_all().");
+        mpack_node_flag_error(node, mpack_error_bug);
+        return mpack_tree_nil_node(node.tree);
+    }
+
+    for (size_t i = 0; i < path->count; ++i) {
+        const mpack_path_segment_t* segment = path->segments + i;
+        mpack_type_t type = (mpack_type_t)node.data->type;
+        if (type != mpack_type_map && (type != mpack_type_array || segment->type == mpack_path_segment_key)) {
+            mpack_node_flag_error(node, mpack_error_type);
+            return mpack_tree_nil_node(node.tree);
+        }
+
+        mpack_node_data_t* child;
+        if (shape && segment->type == mpack_path_segment_key && type == mpack_type_map)
+            child = mpack_node_path_shape_child(node, segment, shape, i);
+        else
+            child = mpack_node_path_child(node, segment);
+        if (child == NULL) {
+            if (!optional)
+                mpack_node_flag_error(node, mpack_error_data);
+            return mpack_tree_nil_node(node.tree);
+        }
+        node.data = child;
+    }
+
+    return node;
+}
+
+mpack_node_t mpack_node_path(mpack_node_t node, const mpack_path_t* path) {
+    return mpack_node_path_impl(node, path, NULL, false);
+}
+
+mpack_node_t mpack_node_path_optional(mpack_node_t node, const mpack_path_t* path) {
+    return mpack_node_path_impl(node, path, NULL, true);
+}
+
+mpack_node_t mpack_node_path_cached(mpack_node_t node, const mpack_path_t* path, mpack_path_shape_t* shape) {
+    return mpack_node_path_impl(node, path, shape, false);
+}
+
+mpack_node_t mpack_node_path_cached_optional(mpack_node_t node, const mpack_path_t* path, mpack_path_shape_t* shape) {
+    return mpack_node_path_impl(node, path, shape, true);
+}
+
+// Adds the nodes matching the given segments to the results, returning
+// the new number of matches. This recurses once per wildcard.
+static size_t mpack_node_path_match(mpack_node_t node, const mpack_path_segment_t* segment, const mpack_path_segment_t* end,
+        mpack_node_t* results, size_t capacity, size_t count)
+{
+    for (; segment != end; ++segment) {
+        mpack_type_t type = (mpack_type_t)node.data->type;
+        if (type != mpack_type_array && type != mpack_type_map)
+            return count;
+
+        if (segment->type == mpack_path_segment_wildcard) {
+            if (!mpack_node_expand(node))
+                return count;
+            size_t stride = (type == mpack_type_map) ? 2 : 1;
+            size_t offset = stride - 1;
+            for (size_t i = 0; i < node.data->len; ++i)
+                count = mpack_node_path_match(mpack_node(node.tree, mpack_node_child(node, i * stride + offset)),
+                        segment + 1, end, results, capacity, count);
+            return count;
+        }
+
+        mpack_node_data_t* child = mpack_node_path_child(node, segment);
+        if (child == NULL)
+            return count;
+        node.data = child;
+    }
+
+    if (count < capacity)
+        results[count] = node;
+    return count + 1;
+}
+
+size_t mpack_node_path_all(mpack_node_t node, const mpack_path_t* path, mpack_node_t* results, size_t capacity) {
+    if (mpack_node_error(node) != mpack_ok)
+        return 0;
+    size_t count = mpack_node_path_match(node, path->segments, path->segments + path->count, results, capacity, 0);
+    return (mpack_node_error(node) == mpack_ok) ? count : 0;
 }
 
 
@@ -29,6 +29,7 @@
 #define MPACK_NODE_H 1
 
 #include "mpack-reader.h"
+#include "mpack-writer.h"
 
 MPACK_HEADER_START
 
@@ -101,6 +102,22 @@ typedef void (*mpack_tree_error_t)(mpack_tree_t* tree, mpack_error_t error);
  */
 typedef void (*mpack_tree_teardown_t)(mpack_tree_t* tree);
 
+/**
+ * The MPack tree's read function. It should read as much data as is
+ * immediately available into the buffer, up to count bytes, and return
+ * the number of bytes read.
+ *
+ * When called from mpack_tree_try_parse(), it may return 0 if no data is
+ * available yet. Parsing is suspended, and resumes from where it left off
+ * the next time mpack_tree_try_parse() is called.
+ *
+ * In case of error (including the end of the stream), it should flag an
+ * appropriate error on the tree.
+ *
+ * @see mpack_tree_init_stream()
+ */
+typedef size_t (*mpack_tree_read_t)(mpack_tree_t* tree, char* buffer, size_t count);
+
 
 
 /* Hide internals from documentation */
@@ -124,12 +141,31 @@ struct mpack_node_t {
     mpack_tree_t* tree;
 };
 
+/*
+ * Flags set by the parser on compound nodes.
+ */
+#define MPACK_NODE_FLAG_INDEXED 0x1 /* The map has a hash index of its keys after its children. */
+#define MPACK_NODE_FLAG_SORTED_STR 0x2 /* The map's keys are all strings in strictly increasing order. */
+#define MPACK_NODE_FLAG_SORTED_INT 0x4 /* The map's keys are all integers in strictly increasing order. */
+#define MPACK_NODE_FLAG_UNEXPANDED 0x8 /* The children of the array or map haven't been parsed; value.offset is the offset of the first. */
+#define MPACK_NODE_FLAG_DENSE_INT 0x10 /* The map's keys are all non-negative integers less than twice its count, and its index is a table of them by value. */
+
 struct mpack_node_data_t {
-    mpack_type_t type;
+    /* The mpack_type_t of the node. This is stored in a byte along with
+       the other small fields so that a node fits in 16 bytes. */
+    uint8_t type;
 
     int8_t exttype; /**< \internal The extension type if the type is mpack_type_ext. */
 
-    /* The value for non-compound types. */
+    uint8_t flags; /**< \internal The parser flags (MPACK_NODE_FLAG_*) if the type is array or map. */
+
+    /*
+     * The element count if the type is an array, the number of key/value
+     * pairs if the type is map, or the number of bytes if the type is
+     * str, bin or ext.
+     */
+    uint32_t len;
+
     union
     {
         bool     b; /* The value if the type is bool. */
@@ -138,20 +174,55 @@ struct mpack_node_data_t {
         int64_t  i; /* The value if the type is signed int. */
         uint64_t u; /* The value if the type is unsigned int. */
 
-        struct {
-            uint32_t l; /* The number of bytes if the type is str, bin or ext. */
-            const char* bytes;
-        } data;
-
-        struct {
-            /* The element count if the type is an array, or the number of
-               key/value pairs if the type is map. */
-            uint32_t n;
-            mpack_node_data_t* children;
-        } content;
+        /* The offset of the data in the tree's data buffer if the type
+           is str, bin or ext. This is an offset rather than a pointer
+           because the buffer of a stream tree can move as it grows. */
+        size_t offset;
+
+        mpack_node_data_t* children; /* The children if the type is array or map. */
     } value;
+
+    #if MPACK_NODE_RAW
+    size_t raw_offset; /* The offset of the node's encoded bytes in the tree's data */
+    size_t raw_size;   /* The number of encoded bytes of the node, including its children */
+    #endif
 };
 
+typedef struct mpack_level_t {
+    mpack_node_data_t* child;
+    size_t left; // children left in level
+    #if MPACK_NODE_MAP_INDEX_THRESHOLD || MPACK_NODE_MAP_SORTED_THRESHOLD
+    mpack_node_data_t* map; // map to finish when this level is done, or NULL
+    #endif
+    #if MPACK_NODE_RAW
+    mpack_node_data_t* parent; // compound node whose size is known when this level is done
+    #endif
+} mpack_level_t;
+
+typedef enum mpack_tree_parse_state_t {
+    mpack_tree_parse_state_not_started,
+    mpack_tree_parse_state_in_progress,
+    mpack_tree_parse_state_parsed
+} mpack_tree_parse_state_t;
+
+/*
+ * The state of the parser. This is kept in the tree so that parsing a
+ * stream can be suspended when it runs out of data and resumed later.
+ */
+typedef struct mpack_tree_parser_t {
+    mpack_tree_t* tree;
+    mpack_tree_parse_state_t state;
+    const char* data; // parse position in the tree's data
+    size_t left; // bytes left in data
+    size_t possible_nodes_left;
+
+    size_t level;
+    size_t depth;
+    mpack_level_t* stack;
+    bool stack_allocated; // stack is on the call stack
+    bool suspended; // ran out of data in the middle of a node
+} mpack_tree_parser_t;
+
 struct mpack_tree_t {
     mpack_tree_error_t error_fn;    /* Function to call on error */
     mpack_tree_teardown_t teardown; /* Function to teardown the context on destroy */
@@ -160,14 +231,31 @@ struct mpack_tree_t {
     mpack_node_data_t nil_node; /* a nil node to be returned in case of error */
     mpack_error_t error;
 
+    const char* data;   /* The data being parsed; str, bin and ext nodes are offsets into it */
+    size_t data_length; /* The number of bytes of data available */
     size_t node_count;
     size_t size;
     mpack_node_data_t* root;
 
     mpack_tree_link_t page;
+    bool lazy; /* Nodes below the root's children are parsed on first access */
+    bool frozen; /* The nodes are shared read-only with views of the tree */
+    bool pool_indexed; /* The node pool has room for the indexes of the message's large maps */
     #ifdef MPACK_MALLOC
     bool owned;
+    const mpack_allocator_t* allocator; /* Allocator for internal memory, or NULL for MPACK_MALLOC */
+
+    mpack_tree_read_t read_fn; /* Function to read more data if the tree is a stream */
+    char* buffer;              /* The buffer owned by a stream tree (same as data) */
+    size_t buffer_capacity;
+    size_t max_size;           /* The maximum message size of a stream tree */
+    size_t max_nodes;          /* The maximum number of nodes in a message of a stream tree */
+
+    mpack_node_data_t* range;  /* The children of a lazy tree's root parsed by a worker tree */
+    size_t range_count;
     #endif
+
+    mpack_tree_parser_t parser;
 };
 
 // internal functions
@@ -180,7 +268,21 @@ MPACK_INLINE mpack_node_t mpack_node(mpack_tree_t* tree, mpack_node_data_t* data
 }
 
 MPACK_INLINE mpack_node_data_t* mpack_node_child(mpack_node_t node, size_t child) {
-    return node.data->value.content.children + child;
+    return node.data->value.children + child;
+}
+
+MPACK_INLINE const char* mpack_node_data_unchecked(mpack_node_t node) {
+    return node.tree->data + node.data->value.offset;
+}
+
+bool mpack_tree_expand_node(mpack_tree_t* tree, mpack_node_data_t* node);
+
+// Parses the children of an array or map in a lazy tree if they haven't
+// been parsed yet. Returns false if the tree is in an error state.
+MPACK_INLINE bool mpack_node_expand(mpack_node_t node) {
+    if (node.data->flags & MPACK_NODE_FLAG_UNEXPANDED)
+        return mpack_tree_expand_node(node.tree, node.data);
+    return true;
 }
 
 MPACK_INLINE mpack_node_t mpack_tree_nil_node(mpack_tree_t* tree) {
@@ -207,6 +309,127 @@ MPACK_INLINE mpack_node_t mpack_tree_nil_node(mpack_tree_t* tree) {
  * pointer must remain valid until after the tree is destroyed.
  */
 void mpack_tree_init(mpack_tree_t* tree, const char* data, size_t length);
+
+/**
+ * Initializes a tree as with mpack_tree_init(), allocating its internal
+ * memory (node pages and the parsing stack) with the given allocator
+ * instead of MPACK_MALLOC and MPACK_FREE. This includes the first node
+ * page, so the tree never calls MPACK_MALLOC, for example when parsing
+ * each request into a per-request arena.
+ *
+ * The allocator is not copied; it must outlive the tree.
+ *
+ * @param allocator The allocator to use, or NULL to use MPACK_MALLOC and MPACK_FREE.
+ */
+void mpack_tree_init_allocator(mpack_tree_t* tree, const char* data, size_t length, const mpack_allocator_t* allocator);
+
+/**
+ * Initializes a lazy tree by parsing the given data buffer. The tree must be
+ * destroyed with mpack_tree_destroy(), even if parsing fails.
+ *
+ * A lazy tree only creates nodes for the root and its children. Deeper
+ * arrays and maps are skipped over by their encoded lengths and parsed
+ * when their elements are first accessed (by mpack_node_array_at(),
+ * mpack_node_map_int() and the like.) This is much faster and uses far
+ * less memory when only a few parts of a large message are used.
+ *
+ * The whole message is still checked when the tree is initialized, so
+ * invalid data flags mpack_error_invalid here as with mpack_tree_init().
+ * Accessing an unparsed node can only fail with mpack_error_memory.
+ *
+ * The tree remains lazy when parsed again with mpack_tree_parse_again().
+ *
+ * As with mpack_tree_init(), the data pointer must remain valid until
+ * after the tree is destroyed.
+ */
+void mpack_tree_init_lazy(mpack_tree_t* tree, const char* data, size_t length);
+
+/**
+ * Initializes a lazy tree as with mpack_tree_init_lazy(), allocating its
+ * internal memory with the given allocator. See mpack_tree_init_allocator().
+ *
+ * Nodes expanded on first access and the nodes of worker trees
+ * initialized from it with mpack_tree_init_range() use the same allocator.
+ */
+void mpack_tree_init_lazy_allocator(mpack_tree_t* tree, const char* data, size_t length, const mpack_allocator_t* allocator);
+
+/**
+ * Initializes a tree by parsing the given data buffer into a single
+ * allocation of exactly as many nodes as it needs. The tree must be
+ * destroyed with mpack_tree_destroy(), even if parsing fails.
+ *
+ * The nodes are first counted with mpack_tree_count_nodes(). This is
+ * much faster than parsing, and in return the tree wastes no memory at
+ * the end of node pages and keeps all of its nodes contiguous instead
+ * of giving large arrays and maps their own pages. This is best for
+ * large messages that are kept for a long time.
+ *
+ * If the tree is parsed again with mpack_tree_parse_again(), it reuses
+ * its allocation and grows as usual.
+ *
+ * As with mpack_tree_init(), the data pointer must remain valid until
+ * after the tree is destroyed.
+ */
+void mpack_tree_init_exact(mpack_tree_t* tree, const char* data, size_t length);
+
+/**
+ * Initializes a tree as with mpack_tree_init_exact(), allocating its
+ * internal memory with the given allocator. See mpack_tree_init_allocator().
+ */
+void mpack_tree_init_exact_allocator(mpack_tree_t* tree, const char* data, size_t length, const mpack_allocator_t* allocator);
+
+/**
+ * Initializes a worker tree that fully parses a range of the root's
+ * elements of a parsed lazy tree. The nodes are handed over to the lazy
+ * tree with mpack_tree_join().
+ *
+ * This splits the parsing of a large message into two passes. The lazy
+ * tree is the first pass: it checks the whole message and records where
+ * each of the root's elements start without creating nodes for their
+ * contents. Worker trees are the second pass. A worker creates nodes in
+ * its own pages with the lazy tree's allocator, and only touches the part
+ * of the lazy tree in its range, so workers for separate ranges can be
+ * initialized in parallel on separate threads (as long as the allocator
+ * is thread-safe.) The lazy tree must not be used otherwise until all of
+ * them are joined.
+ *
+ * The range is of array elements if the root is an array, or of key/value
+ * pairs if the root is a map. Any parts of the range that were already
+ * parsed by accessing them are copied instead of being parsed again, so
+ * node handles taken inside the range before it is joined are stale
+ * afterwards (see mpack_tree_join().)
+ *
+ * The worker must be passed to mpack_tree_join() or destroyed with
+ * mpack_tree_destroy(), even if parsing fails. It can't be used for
+ * anything else. The lazy tree is not modified until the worker is
+ * joined, so a worker that is destroyed instead leaves the tree as it
+ * was.
+ *
+ * @param worker The worker tree to initialize
+ * @param tree A lazy tree that has been parsed successfully
+ * @param first The index of the first element of the root to parse
+ * @param count The number of elements of the root to parse
+ */
+void mpack_tree_init_range(mpack_tree_t* worker, mpack_tree_t* tree, size_t first, size_t count);
+
+/**
+ * Moves the nodes parsed by a worker tree into the lazy tree it was
+ * initialized from with mpack_tree_init_range(), and destroys the worker.
+ *
+ * Afterwards the elements of the worker's range are fully parsed, exactly
+ * as if the whole message had been parsed with mpack_tree_init(). If the
+ * worker failed, its error is flagged on the tree.
+ *
+ * The root's elements in the range are replaced in place, so handles to
+ * them (and to the root) remain valid. Handles to nodes within those
+ * elements that were taken before the join are stale: they still refer
+ * to the tree's earlier copies, which remain readable until the tree is
+ * destroyed or parsed again but are no longer part of it. Fetch such
+ * nodes again from the root after joining.
+ *
+ * Workers can be joined in any order, but only on one thread at a time.
+ */
+void mpack_tree_join(mpack_tree_t* tree, mpack_tree_t* worker);
 #endif
 
 /**
@@ -216,16 +439,133 @@ void mpack_tree_init(mpack_tree_t* tree, const char* data, size_t length);
  * If the data does not fit in the pool, mpack_error_too_big will be flagged
  * on the tree.
  *
+ * Large maps are only indexed (see MPACK_NODE_MAP_INDEX_THRESHOLD) if
+ * the pool has at least as many nodes as mpack_tree_count_nodes() returns
+ * for the message. A smaller pool is never filled with indexes, so any
+ * pool that fits the message's nodes can parse it.
+ *
  * The tree must be destroyed with mpack_tree_destroy(), even if parsing fails.
  */
 void mpack_tree_init_pool(mpack_tree_t* tree, const char* data, size_t length, mpack_node_data_t* node_pool, size_t node_pool_count);
 
+/**
+ * Returns the number of nodes a tree needs to parse the message at the
+ * start of the given data, or 0 if the message is invalid or truncated.
+ *
+ * This walks the message without parsing it, in the same way as
+ * mpack_validate(). The count includes the space for the indexes of
+ * large maps (see MPACK_NODE_MAP_INDEX_THRESHOLD), so a pool of exactly
+ * this many nodes passed to mpack_tree_init_pool() fits the whole
+ * message with all of its maps indexed.
+ */
+size_t mpack_tree_count_nodes(const char* data, size_t length);
+
+#ifdef MPACK_MALLOC
+/**
+ * Initializes a tree to parse messages incrementally from a stream.
+ *
+ * No data is read by this call. Call mpack_tree_try_parse() to read and
+ * parse each message. Data is read with the given read function into a
+ * buffer owned by the tree, which grows as needed up to max_message_size.
+ * Any string or blob data types reference this buffer, so they are only
+ * valid until the next message is parsed or the tree is destroyed.
+ *
+ * The tree must be destroyed with mpack_tree_destroy().
+ *
+ * @param tree The tree to initialize
+ * @param read_fn The function to call to read more data
+ * @param context The context for the tree callbacks
+ * @param max_message_size The maximum size of a message in bytes. A
+ *     message larger than this flags mpack_error_too_big.
+ * @param max_message_nodes The maximum number of nodes in a message, or
+ *     0 for no limit other than max_message_size. A message with more
+ *     nodes than this flags mpack_error_too_big.
+ *
+ * @see mpack_tree_read_t
+ */
+void mpack_tree_init_stream(mpack_tree_t* tree, mpack_tree_read_t read_fn, void* context, size_t max_message_size, size_t max_message_nodes);
+
+/**
+ * Attempts to parse the next message from a stream tree.
+ *
+ * Bytes are read and parsed as they become available. If the read function
+ * runs out of data before the message is complete, this returns false.
+ * Call it again when more data is available; parsing resumes where it left
+ * off without parsing anything twice.
+ *
+ * When this returns true, the message is complete and can be accessed with
+ * mpack_tree_root(). The next call discards it and starts on the next
+ * message, keeping any bytes of it that have already been read.
+ *
+ * This returns false if the tree is in an error state.
+ *
+ * @see mpack_tree_init_stream()
+ */
+bool mpack_tree_try_parse(mpack_tree_t* tree);
+#endif
+
+/**
+ * Discards the tree's parsed data and parses the given data buffer into it
+ * instead, reusing its node pages. Any error on the tree is cleared first.
+ *
+ * This is much faster than destroying the tree and initializing a new one
+ * when parsing many messages. If the previous message didn't fit in one
+ * page, its pages are replaced with a single page big enough to hold all
+ * of its nodes, so in the steady state this performs no allocations. A
+ * pooled tree parses into the same pool.
+ *
+ * As with mpack_tree_init(), any string or blob data types reference the
+ * new data. The previous data is no longer referenced.
+ *
+ * This cannot be used on a stream tree; mpack_tree_try_parse() reuses
+ * node pages in the same way.
+ */
+void mpack_tree_parse_again(mpack_tree_t* tree, const char* data, size_t length);
+
 /**
  * Initializes an MPack tree directly into an error state. Use this if you
  * are writing a wrapper to mpack_tree_init() which can fail its setup.
  */
 void mpack_tree_init_error(mpack_tree_t* tree, mpack_error_t error);
 
+/**
+ * Freezes a parsed tree so that it can be read concurrently from many
+ * threads through views initialized with mpack_tree_init_view().
+ *
+ * Reading nodes doesn't modify them, but every node accessor can flag an
+ * error on its tree, and a lazy tree parses nodes on first access. A
+ * frozen tree is instead read through views, each of which has its own
+ * error state. A lazy tree is fully parsed here so that its nodes are
+ * never written again.
+ *
+ * A frozen tree cannot be parsed again. It should not be read directly
+ * while any views of it are in use, and it must not be destroyed until
+ * they are all destroyed.
+ *
+ * This does nothing if the tree is in an error state.
+ *
+ * @throws mpack_error_memory if a lazy tree could not be fully parsed
+ */
+void mpack_tree_freeze(mpack_tree_t* tree);
+
+/**
+ * Initializes a view of a frozen tree (see mpack_tree_freeze().)
+ *
+ * A view shares the tree's nodes and data without copying them. It has
+ * its own error state, error handler, context and teardown function,
+ * so errors flagged while reading nodes of a view affect only that view.
+ * The tree is not modified, so each thread can initialize its own views
+ * of the same tree without locking.
+ *
+ * If the tree is in an error state, the view is initialized in the same
+ * error state. A view cannot be parsed again. It must be destroyed with
+ * mpack_tree_destroy(), which does not free anything of the tree.
+ *
+ * @param view The view to initialize
+ * @param tree A frozen tree
+ */
+void mpack_tree_init_view(mpack_tree_t* view, const mpack_tree_t* tree);
+
 #if MPACK_STDIO
 /**
  * Initializes a tree by reading and parsing the given file. The tree must be
@@ -241,6 +581,26 @@ void mpack_tree_init_error(mpack_tree_t* tree, mpack_error_t error);
 void mpack_tree_init_file(mpack_tree_t* tree, const char* filename, size_t max_bytes);
 #endif
 
+#if MPACK_MMAP
+/**
+ * Initializes a tree by mapping and parsing the given file. The tree must be
+ * destroyed with mpack_tree_destroy(), even if parsing fails.
+ *
+ * Unlike mpack_tree_init_file(), the file is not copied into memory. It is
+ * mapped read-only and parsed in-place, and any string or blob data types
+ * reference the mapping directly. The mapping is removed when the tree is
+ * destroyed. This avoids a copy of the whole file and is not limited to
+ * files of LONG_MAX bytes.
+ *
+ * The file must not be truncated or modified while the tree exists.
+ *
+ * @param tree The tree to initialize
+ * @param filename The filename passed to open() to map the file
+ * @param max_bytes The maximum size of file to map, or 0 for unlimited size.
+ */
+void mpack_tree_init_mmap(mpack_tree_t* tree, const char* filename, size_t max_bytes);
+#endif
+
 /**
  * Returns the root node of the tree, if the tree is not in an error state.
  * Returns a nil node otherwise.
@@ -308,6 +668,38 @@ MPACK_INLINE void mpack_tree_set_teardown(mpack_tree_t* tree, mpack_tree_teardow
     tree->teardown = teardown;
 }
 
+#ifdef MPACK_MALLOC
+/**
+ * Sets the allocator used for the tree's internal memory, replacing
+ * MPACK_MALLOC and MPACK_FREE.
+ *
+ * This can only be used on a tree initialized with mpack_tree_init_pool()
+ * or mpack_tree_init_stream(). Other trees allocate and parse their node
+ * pages when they are initialized, so they take an allocator up front with
+ * mpack_tree_init_allocator() and its lazy and exact variants instead.
+ * Changing the allocator of such a tree flags mpack_error_bug.
+ *
+ * For a pool tree, this covers the parsing stack. For a stream tree, this
+ * covers its node pages, the parsing stack and its buffer. Nodes cannot be
+ * moved, so the node pages of a stream are freed and any parsed message is
+ * discarded; the buffer keeps any data read past the end of the message.
+ * Use this before parsing with mpack_tree_try_parse(). This cannot be
+ * called while a stream parse is incomplete.
+ *
+ * Node pages are reused between messages, so an allocator attached to a
+ * long-lived tree is only called when a message needs more nodes than any
+ * before it.
+ *
+ * The allocator is not copied; it must outlive the tree.
+ *
+ * @throws mpack_error_memory if existing allocations could not be moved
+ *
+ * @param tree The MPack tree.
+ * @param allocator The allocator to use, or NULL to use MPACK_MALLOC and MPACK_FREE.
+ */
+void mpack_tree_set_allocator(mpack_tree_t* tree, const mpack_allocator_t* allocator);
+#endif
+
 /**
  * Places the tree in the given error state, jumping if a jump target is set.
  *
@@ -351,10 +743,31 @@ MPACK_INLINE mpack_error_t mpack_node_error(mpack_node_t node) {
  */
 mpack_tag_t mpack_node_tag(mpack_node_t node);
 
+#if MPACK_NODE_RAW
+/**
+ * Gets the encoded bytes of the node in the tree's data, including
+ * all of its children if it's an array or map. This lets a part of a
+ * message be forwarded or stored without re-encoding it.
+ *
+ * A nil node returned for a missing optional key or path gives the
+ * encoding of nil. If the node's tree is in an error state, data is
+ * set to NULL and length to zero.
+ *
+ * The pointer is valid as long as the data backing the tree is valid.
+ *
+ * This requires MPACK_NODE_RAW.
+ *
+ * @see mpack_write_node_raw()
+ */
+void mpack_node_raw(mpack_node_t node, const char** data, size_t* length);
+#endif
+
 #if MPACK_STDIO
 /**
  * Converts a node to pseudo-JSON for debugging purposes
  * and pretty-prints it to the given file.
+ *
+ * @see mpack_write_node()
  */
 void mpack_node_print_file(mpack_node_t node, FILE* file);
 
@@ -373,6 +786,56 @@ MPACK_INLINE void mpack_node_print(mpack_node_t node) {
  * @}
  */
 
+#if MPACK_WRITER
+/**
+ * @name Node Writer Functions
+ * @{
+ */
+
+/**
+ * Writes the node and all of its children to the writer as one element.
+ *
+ * The node is written with the writer's usual encodings, so integers,
+ * strings and the headers of arrays and maps take the smallest encoding
+ * for their values regardless of how they were encoded in the tree's
+ * data. This can be used to normalize a message, or to frame part of it
+ * as a new message.
+ *
+ * The tree is walked iteratively with its own stack, so deeply nested
+ * data doesn't overflow the call stack. The stack grows as needed if
+ * MPACK_MALLOC is available; otherwise nodes nested more than
+ * MPACK_NODE_MAX_DEPTH_WITHOUT_MALLOC deep flag mpack_error_too_big.
+ *
+ * If the node's tree is in an error state, the error is flagged on the
+ * writer as well. Any arrays or maps of a lazy tree that haven't been
+ * parsed yet are parsed as they're written.
+ *
+ * @see mpack_write_node_raw()
+ */
+void mpack_write_node(mpack_writer_t* writer, mpack_node_t node);
+
+#if MPACK_NODE_RAW
+/**
+ * Writes the encoded bytes of the node to the writer unchanged, as one
+ * element. This is a single copy rather than reading the node and
+ * writing it again, and it keeps the encodings of the original data.
+ *
+ * If the node's tree is in an error state, the error is flagged on the
+ * writer as well.
+ *
+ * This requires MPACK_NODE_RAW.
+ *
+ * @see mpack_node_raw()
+ * @see mpack_write_node()
+ */
+void mpack_write_node_raw(mpack_writer_t* writer, mpack_node_t node);
+#endif
+
+/**
+ * @}
+ */
+#endif
+
 /**
  * @name Node Primitive Value Functions
  * @{
@@ -387,7 +850,7 @@ MPACK_INLINE_SPEED mpack_type_t mpack_node_type(mpack_node_t node);
 MPACK_INLINE_SPEED mpack_type_t mpack_node_type(mpack_node_t node) {
     if (mpack_node_error(node) != mpack_ok)
         return mpack_type_nil;
-    return node.data->type;
+    return (mpack_type_t)node.data->type;
 }
 #endif
 
@@ -789,9 +1252,9 @@ MPACK_INLINE_SPEED uint32_t mpack_node_data_len(mpack_node_t node) {
     if (mpack_node_error(node) != mpack_ok)
         return 0;
 
-    mpack_type_t type = node.data->type;
+    mpack_type_t type = (mpack_type_t)node.data->type;
     if (type == mpack_type_str || type == mpack_type_bin || type == mpack_type_ext)
-        return (uint32_t)node.data->value.data.l;
+        return (uint32_t)node.data->len;
 
     mpack_node_flag_error(node, mpack_error_type);
     return 0;
@@ -810,7 +1273,7 @@ MPACK_INLINE_SPEED size_t mpack_node_strlen(mpack_node_t node) {
         return 0;
 
     if (node.data->type == mpack_type_str)
-        return (size_t)node.data->value.data.l;
+        return (size_t)node.data->len;
 
     mpack_node_flag_error(node, mpack_error_type);
     return 0;
@@ -839,9 +1302,9 @@ MPACK_INLINE_SPEED const char* mpack_node_data(mpack_node_t node) {
     if (mpack_node_error(node) != mpack_ok)
         return NULL;
 
-    mpack_type_t type = node.data->type;
+    mpack_type_t type = (mpack_type_t)node.data->type;
     if (type == mpack_type_str || type == mpack_type_bin || type == mpack_type_ext)
-        return node.data->value.data.bytes;
+        return mpack_node_data_unchecked(node);
 
     mpack_node_flag_error(node, mpack_error_type);
     return NULL;
@@ -941,7 +1404,7 @@ MPACK_INLINE_SPEED size_t mpack_node_array_length(mpack_node_t node) {
         return 0;
     }
 
-    return (size_t)node.data->value.content.n;
+    return (size_t)node.data->len;
 }
 #endif
 
@@ -963,11 +1426,14 @@ MPACK_INLINE_SPEED mpack_node_t mpack_node_array_at(mpack_node_t node, size_t in
         return mpack_tree_nil_node(node.tree);
     }
 
-    if (index >= node.data->value.content.n) {
+    if (index >= node.data->len) {
         mpack_node_flag_error(node, mpack_error_data);
         return mpack_tree_nil_node(node.tree);
     }
 
+    if (!mpack_node_expand(node))
+        return mpack_tree_nil_node(node.tree);
+
     return mpack_node(node.tree, mpack_node_child(node, index));
 }
 #endif
@@ -988,7 +1454,7 @@ MPACK_INLINE_SPEED size_t mpack_node_map_count(mpack_node_t node) {
         return 0;
     }
 
-    return node.data->value.content.n;
+    return node.data->len;
 }
 #endif
 
@@ -1005,11 +1471,14 @@ MPACK_INLINE_SPEED mpack_node_t mpack_node_map_at(mpack_node_t node, size_t inde
         return mpack_tree_nil_node(node.tree);
     }
 
-    if (index >= node.data->value.content.n) {
+    if (index >= node.data->len) {
         mpack_node_flag_error(node, mpack_error_data);
         return mpack_tree_nil_node(node.tree);
     }
 
+    if (!mpack_node_expand(node))
+        return mpack_tree_nil_node(node.tree);
+
     return mpack_node(node.tree, mpack_node_child(node, index * 2 + offset));
 }
 #endif
@@ -1038,6 +1507,192 @@ MPACK_INLINE mpack_node_t mpack_node_map_value_at(mpack_node_t node, size_t inde
     return mpack_node_map_at(node, index, 1);
 }
 
+/**
+ * An iterator over the elements of an array or the key/value pairs of a
+ * map. See mpack_node_array_iter() and mpack_node_map_iter().
+ */
+typedef struct mpack_node_iter_t {
+    /** @cond */
+    mpack_tree_t* tree;
+    mpack_node_data_t* pos; /* The next element, or the key of the next pair */
+    mpack_node_data_t* end;
+    /** @endcond */
+} mpack_node_iter_t;
+
+/** @cond */
+// internal iterator setup
+mpack_node_iter_t mpack_node_iter_impl(mpack_node_t node, mpack_type_t type);
+
+// Hints that the payload of the given node will be read soon, if it's
+// outside of the node itself (the children of an array or map, or the
+// data of a str, bin or ext.)
+MPACK_INLINE void mpack_node_iter_prefetch(mpack_tree_t* tree, const mpack_node_data_t* data) {
+    if (data->type == mpack_type_array || data->type == mpack_type_map) {
+        if (!(data->flags & MPACK_NODE_FLAG_UNEXPANDED))
+            MPACK_PREFETCH(data->value.children);
+    } else if (data->type == mpack_type_str || data->type == mpack_type_bin || data->type == mpack_type_ext) {
+        MPACK_PREFETCH(tree->data + data->value.offset);
+    }
+}
+/** @endcond */
+
+/**
+ * Returns an iterator over the elements of the given array node, for use
+ * with mpack_node_iter_next().
+ *
+ * The node is checked once here, so iterating performs no error, type or
+ * bounds checks; it just walks the array's children. The next element's
+ * children or data are prefetched as each element is returned.
+ *
+ * An empty iterator is returned if the node's tree is in an error state.
+ *
+ * @throws mpack_error_type if the node is not an array
+ */
+MPACK_INLINE mpack_node_iter_t mpack_node_array_iter(mpack_node_t node) {
+    return mpack_node_iter_impl(node, mpack_type_array);
+}
+
+/**
+ * Returns an iterator over the key/value pairs of the given map node, for
+ * use with mpack_node_iter_next_pair().
+ *
+ * As with mpack_node_array_iter(), the node is only checked here.
+ *
+ * An empty iterator is returned if the node's tree is in an error state.
+ *
+ * @throws mpack_error_type if the node is not a map
+ */
+MPACK_INLINE mpack_node_iter_t mpack_node_map_iter(mpack_node_t node) {
+    return mpack_node_iter_impl(node, mpack_type_map);
+}
+
+/**
+ * Stores the next element of an array iterator in the given node and
+ * returns true, or returns false if there are no elements left.
+ *
+ * @see mpack_node_array_iter()
+ */
+MPACK_INLINE bool mpack_node_iter_next(mpack_node_iter_t* iter, mpack_node_t* element) {
+    if (iter->pos == iter->end)
+        return false;
+    mpack_node_data_t* data = iter->pos++;
+    if (iter->pos != iter->end)
+        mpack_node_iter_prefetch(iter->tree, iter->pos);
+    *element = mpack_node(iter->tree, data);
+    return true;
+}
+
+/**
+ * Stores the key and value of the next pair of a map iterator in the
+ * given nodes and returns true, or returns false if there are no pairs
+ * left.
+ *
+ * @see mpack_node_map_iter()
+ */
+MPACK_INLINE bool mpack_node_iter_next_pair(mpack_node_iter_t* iter, mpack_node_t* key, mpack_node_t* value) {
+    if (iter->pos == iter->end)
+        return false;
+    mpack_node_data_t* data = iter->pos;
+    iter->pos += 2;
+    if (iter->pos != iter->end)
+        mpack_node_iter_prefetch(iter->tree, iter->pos + 1);
+    *key = mpack_node(iter->tree, data);
+    *value = mpack_node(iter->tree, data + 1);
+    return true;
+}
+
+/**
+ * Converts the elements of the given array node to 8-bit unsigned integers,
+ * storing them in the given native array, and returns the number of
+ * elements stored.
+ *
+ * The array node is checked once, and its elements are then converted in a
+ * single loop without the per-element error checks of mpack_node_u8(). This
+ * is much faster than calling mpack_node_u8() on mpack_node_array_at() for
+ * each element of a large array.
+ *
+ * Each element may be an integer of any size and signedness, as long as its
+ * value can be represented in an 8-bit unsigned int. If an element cannot
+ * be converted, mpack_error_type is raised and the index of the first such
+ * element is returned. Elements before it are stored, but the rest of the
+ * output array is undefined.
+ *
+ * If the array has more than count elements, mpack_error_too_big is raised
+ * and 0 is returned.
+ *
+ * @throws mpack_error_type if the node is not an array, or if an element is
+ *     not an integer in range
+ * @throws mpack_error_too_big if the array has more than count elements
+ */
+size_t mpack_node_array_copy_u8(mpack_node_t node, uint8_t* out, size_t count);
+
+/**
+ * Converts the elements of the given array node to 16-bit unsigned integers.
+ *
+ * @see mpack_node_array_copy_u8()
+ */
+size_t mpack_node_array_copy_u16(mpack_node_t node, uint16_t* out, size_t count);
+
+/**
+ * Converts the elements of the given array node to 32-bit unsigned integers.
+ *
+ * @see mpack_node_array_copy_u8()
+ */
+size_t mpack_node_array_copy_u32(mpack_node_t node, uint32_t* out, size_t count);
+
+/**
+ * Converts the elements of the given array node to 64-bit unsigned integers.
+ *
+ * @see mpack_node_array_copy_u8()
+ */
+size_t mpack_node_array_copy_u64(mpack_node_t node, uint64_t* out, size_t count);
+
+/**
+ * Converts the elements of the given array node to 8-bit signed integers.
+ *
+ * @see mpack_node_array_copy_u8()
+ */
+size_t mpack_node_array_copy_i8(mpack_node_t node, int8_t* out, size_t count);
+
+/**
+ * Converts the elements of the given array node to 16-bit signed integers.
+ *
+ * @see mpack_node_array_copy_u8()
+ */
+size_t mpack_node_array_copy_i16(mpack_node_t node, int16_t* out, size_t count);
+
+/**
+ * Converts the elements of the given array node to 32-bit signed integers.
+ *
+ * @see mpack_node_array_copy_u8()
+ */
+size_t mpack_node_array_copy_i32(mpack_node_t node, int32_t* out, size_t count);
+
+/**
+ * Converts the elements of the given array node to 64-bit signed integers.
+ *
+ * @see mpack_node_array_copy_u8()
+ */
+size_t mpack_node_array_copy_i64(mpack_node_t node, int64_t* out, size_t count);
+
+/**
+ * Converts the elements of the given array node to floats. As with
+ * mpack_node_float(), each element may be an integer, float or double, and
+ * doubles and large integers may lose precision.
+ *
+ * @see mpack_node_array_copy_u8()
+ */
+size_t mpack_node_array_copy_float(mpack_node_t node, float* out, size_t count);
+
+/**
+ * Converts the elements of the given array node to doubles. As with
+ * mpack_node_double(), each element may be an integer, float or double, and
+ * very large integers may lose precision.
+ *
+ * @see mpack_node_array_copy_u8()
+ */
+size_t mpack_node_array_copy_double(mpack_node_t node, double* out, size_t count);
+
 /**
  * Returns the value node in the given map for the given integer key. If the given
  * node is not a map, mpack_error_type is raised and a nil node is
@@ -1134,6 +1789,402 @@ MPACK_INLINE bool mpack_node_map_contains_cstr(mpack_node_t node, const char* cs
     return mpack_node_map_contains_str(node, cstr, mpack_strlen(cstr));
 }
 
+/**
+ * A cursor for looking up many string keys in a map in the order they
+ * appear in it. See mpack_node_map_cursor().
+ */
+typedef struct mpack_node_map_cursor_t {
+    /** @cond */
+    mpack_tree_t* tree;
+    mpack_node_data_t* map; /* NULL if the map was invalid */
+    size_t next; /* The pair after the last key found */
+    /** @endcond */
+} mpack_node_map_cursor_t;
+
+/**
+ * Returns a cursor for looking up string keys in the given map node with
+ * mpack_node_map_cursor_cstr() and related functions.
+ *
+ * The cursor remembers where the last key was found and searches forward
+ * from there, wrapping around to the start of the map. When keys are
+ * looked up in the order they were written, as is usual when decoding a
+ * struct, each lookup is found at or just after the previous one rather
+ * than by searching from the start of the map.
+ *
+ * If the map has duplicate keys, the first is found, same as with
+ * mpack_node_map_str(). To ensure this, a match in a map that has no
+ * index and isn't sorted is also checked against the keys before the
+ * cursor's position, so there the cursor mostly saves the comparisons
+ * after the key rather than before it.
+ *
+ * @throws mpack_error_type if the node is not a map
+ */
+mpack_node_map_cursor_t mpack_node_map_cursor(mpack_node_t node);
+
+/** @cond */
+mpack_node_t mpack_node_map_cursor_str_impl(mpack_node_map_cursor_t* cursor, const char* str, size_t length, bool optional);
+/** @endcond */
+
+/**
+ * Returns the value node for the given string key in a map cursor's map.
+ * If the map does not contain the key, mpack_error_data is raised and a
+ * nil node is returned.
+ *
+ * @see mpack_node_map_cursor()
+ * @see mpack_node_map_str()
+ * @throws mpack_error_data if the map does not contain the given key
+ */
+MPACK_INLINE mpack_node_t mpack_node_map_cursor_str(mpack_node_map_cursor_t* cursor, const char* str, size_t length) {
+    return mpack_node_map_cursor_str_impl(cursor, str, length, false);
+}
+
+/**
+ * Returns the value node for the given string key in a map cursor's map,
+ * or a nil node if the map does not contain the key.
+ *
+ * @see mpack_node_map_cursor()
+ * @see mpack_node_map_str_optional()
+ */
+MPACK_INLINE mpack_node_t mpack_node_map_cursor_str_optional(mpack_node_map_cursor_t* cursor, const char* str, size_t length) {
+    return mpack_node_map_cursor_str_impl(cursor, str, length, true);
+}
+
+/**
+ * Returns the value node for the given null-terminated string key in a
+ * map cursor's map. If the map does not contain the key, mpack_error_data
+ * is raised and a nil node is returned.
+ *
+ * @see mpack_node_map_cursor()
+ * @see mpack_node_map_cstr()
+ * @throws mpack_error_data if the map does not contain the given key
+ */
+MPACK_INLINE mpack_node_t mpack_node_map_cursor_cstr(mpack_node_map_cursor_t* cursor, const char* cstr) {
+    return mpack_node_map_cursor_str_impl(cursor, cstr, mpack_strlen(cstr), false);
+}
+
+/**
+ * Returns the value node for the given null-terminated string key in a
+ * map cursor's map, or a nil node if the map does not contain the key.
+ *
+ * @see mpack_node_map_cursor()
+ * @see mpack_node_map_cstr_optional()
+ */
+MPACK_INLINE mpack_node_t mpack_node_map_cursor_cstr_optional(mpack_node_map_cursor_t* cursor, const char* cstr) {
+    return mpack_node_map_cursor_str_impl(cursor, cstr, mpack_strlen(cstr), true);
+}
+
+/** @cond */
+size_t mpack_node_map_cstr_many_impl(mpack_node_t node, const char* const* keys, size_t count,
+        mpack_node_t* values, bool* duplicates, bool optional);
+/** @endcond */
+
+/**
+ * Looks up the values of many null-terminated string keys in the given map
+ * at once, for example to read all fields of a struct. The value for
+ * keys[i] is stored in values[i]. If the given node is not a map,
+ * mpack_error_type is raised. If any of the keys does not exist in the
+ * map, mpack_error_data is raised. A nil node is stored for each key
+ * that is not found.
+ *
+ * A small map is searched in a single pass over its keys, and a large
+ * map with its index, so this is much faster than calling
+ * mpack_node_map_cstr() for each key. As with mpack_node_map_cstr(), a
+ * key that appears more than once in the map resolves to its first
+ * occurrence.
+ *
+ * Duplicate keys are reported without flagging an error. If duplicates
+ * is not NULL, duplicates[i] is set to whether keys[i] appears more than
+ * once in the map. Finding them costs a little more for an indexed map,
+ * since the search for each key continues past its first occurrence.
+ *
+ * @param node The map node
+ * @param keys The keys to look up
+ * @param count The number of keys
+ * @param values An array of count nodes in which to store the values
+ * @param duplicates An array of count bools in which to store whether each
+ *     key appears more than once, or NULL
+ *
+ * @return The number of keys found.
+ * @throws mpack_error_type if the node is not a map
+ * @throws mpack_error_data if any key does not exist
+ */
+MPACK_INLINE size_t mpack_node_map_cstr_many(mpack_node_t node, const char* const* keys, size_t count,
+        mpack_node_t* values, bool* duplicates)
+{
+    return mpack_node_map_cstr_many_impl(node, keys, count, values, duplicates, false);
+}
+
+/**
+ * Looks up the values of many null-terminated string keys in the given map
+ * at once, storing a nil node for each key that is not found. See
+ * mpack_node_map_cstr_many().
+ *
+ * @return The number of keys found.
+ * @throws mpack_error_type if the node is not a map
+ */
+MPACK_INLINE size_t mpack_node_map_cstr_many_optional(mpack_node_t node, const char* const* keys, size_t count,
+        mpack_node_t* values, bool* duplicates)
+{
+    return mpack_node_map_cstr_many_impl(node, keys, count, values, duplicates, true);
+}
+
+/**
+ * A column to extract from an array of maps with mpack_node_array_columns().
+ */
+typedef struct mpack_node_column_t {
+    /** The null-terminated string key of the column in each map. */
+    const char* key;
+
+    /**
+     * The type of the column's values, which determines the type of the
+     * values array: mpack_type_bool for bool, mpack_type_int for int64_t,
+     * mpack_type_uint for uint64_t, mpack_type_float for float or
+     * mpack_type_double for double. Each value is converted as by
+     * mpack_node_bool(), mpack_node_i64(), mpack_node_u64(),
+     * mpack_node_float() or mpack_node_double().
+     */
+    mpack_type_t type;
+
+    /** An array with room for one value per map. */
+    void* values;
+
+    /**
+     * A bitmap with room for one bit per map, or NULL if the column is
+     * required. Bit (i % 8) of byte (i / 8) is set if map i has a non-nil
+     * value for the key, and cleared (with a zero value stored) if it does
+     * not.
+     */
+    uint8_t* present;
+} mpack_node_column_t;
+
+/**
+ * Extracts columns of values from an array of maps, such as an array of
+ * records, storing the value of each column's key in each map in the
+ * column's values array. Returns the number of maps.
+ *
+ * The array is walked once for each batch of up to 64 columns. The
+ * position of each key is found in the first map and checked first in each
+ * following map, so maps with the same keys in the same order are read
+ * without searching them. As with mpack_node_map_cstr(), a key that
+ * appears more than once in a map resolves to its first occurrence.
+ *
+ * If a column is required (its present bitmap is NULL) and a map does not
+ * contain its key, mpack_error_data is raised.
+ *
+ * @throws mpack_error_type if the node is not an array, an element is not a
+ *     map, or a value cannot be converted to its column's type
+ * @throws mpack_error_too_big if the array has more than count maps
+ * @throws mpack_error_data if a required column's key is missing from a map
+ */
+size_t mpack_node_array_columns(mpack_node_t node, mpack_node_column_t* columns, size_t column_count, size_t count);
+
+/**
+ * @}
+ */
+
+/**
+ * @name Path Functions
+ * @{
+ */
+
+/** @cond */
+typedef enum mpack_path_segment_type_t {
+    mpack_path_segment_key,
+    mpack_path_segment_index,
+    mpack_path_segment_wildcard
+} mpack_path_segment_type_t;
+
+typedef struct mpack_path_segment_t {
+    const char* key; /* The key in the path string if the type is key */
+    size_t value;    /* The length of the key, or the index if the type is index */
+    uint32_t hash;   /* The hash of the key for looking it up in an indexed map */
+    uint8_t type;    /* The mpack_path_segment_type_t */
+} mpack_path_segment_t;
+/** @endcond */
+
+/**
+ * A compiled path to nodes in a tree. See mpack_path_compile().
+ */
+typedef struct mpack_path_t {
+    /** @cond */
+    mpack_path_segment_t segments[MPACK_NODE_PATH_MAX_SEGMENTS];
+    size_t count;
+    bool wildcard;
+    /** @endcond */
+} mpack_path_t;
+
+/**
+ * Compiles a path to nodes in a tree for use with mpack_node_path() and
+ * mpack_node_path_all().
+ *
+ * A path is a sequence of segments, each of which looks up a child of
+ * the current node:
+ *
+ * - `.key` or `key` (at the start of the path) looks up a string key in a map.
+ *   A key extends to the next `.` or `[`, and can't be empty.
+ * - `[n]` looks up index n of an array, or unsigned integer key n of a map.
+ * - `[*]` or `.*` matches every element of an array or every value of a map.
+ *
+ * For example `users[3].name` or `users[*].tags[0]`. An empty path matches
+ * the node itself.
+ *
+ * Keys are hashed and indices are converted when the path is compiled, so
+ * a compiled path can be evaluated many times much faster than the
+ * equivalent chain of mpack_node_map_cstr() and mpack_node_array_at().
+ * The keys reference the path string, so it must remain valid as long as
+ * the path is used.
+ *
+ * @return mpack_ok if the path was compiled, mpack_error_invalid if it is
+ *     malformed, or mpack_error_too_big if it has more than
+ *     MPACK_NODE_PATH_MAX_SEGMENTS segments.
+ */
+mpack_error_t mpack_path_compile(mpack_path_t* path, const char* cstr);
+
+/**
+ * Returns the node at the given path from the given node.
+ *
+ * Errors are raised as with the equivalent chain of node functions. A
+ * nil node is returned in case of error.
+ *
+ * The path must not contain wildcards. Use mpack_node_path_all() instead.
+ *
+ * @throws mpack_error_type if a key or index is looked up in a node that
+ *     is not a map or array
+ * @throws mpack_error_data if a key or index does not exist
+ */
+mpack_node_t mpack_node_path(mpack_node_t node, const mpack_path_t* path);
+
+/**
+ * Returns the node at the given path from the given node, or a nil node
+ * if any key or index in the path does not exist.
+ *
+ * The path must not contain wildcards.
+ *
+ * @throws mpack_error_type if a key or index is looked up in a node that
+ *     is not a map or array
+ */
+mpack_node_t mpack_node_path_optional(mpack_node_t node, const mpack_path_t* path);
+
+/**
+ * The learned shape of the maps along a compiled path, for looking up the
+ * path in many trees of the same shape with mpack_node_path_cached().
+ *
+ * A shape must be initialized with mpack_path_shape_init() before use.
+ */
+typedef struct mpack_path_shape_t {
+    /** @cond */
+    uint32_t counts[MPACK_NODE_PATH_MAX_SEGMENTS]; /* The number of pairs in the map of each key segment, or 0 if unknown */
+    uint32_t pairs[MPACK_NODE_PATH_MAX_SEGMENTS];  /* The pair at which each key segment was last found */
+    /** @endcond */
+} mpack_path_shape_t;
+
+/**
+ * Initializes a path shape with no known positions.
+ */
+MPACK_INLINE void mpack_path_shape_init(mpack_path_shape_t* shape) {
+    mpack_memset(shape, 0, sizeof(*shape));
+}
+
+/**
+ * Returns the node at the given path from the given node as with
+ * mpack_node_path(), using and updating the given shape.
+ *
+ * For each key in the path, the shape records how many key/value pairs
+ * its map had and which pair the key was found at. If the map in the next
+ * tree has the same number of pairs, that pair is checked first with a
+ * single key comparison. Otherwise (or if the key has moved) the map is
+ * searched as usual and the new position is recorded. Messages that share
+ * a few fixed layouts, such as RPC requests, are then looked up without
+ * searching their maps.
+ *
+ * Each path needs its own shape. Paths can be shared between threads
+ * but shapes cannot. If a map has duplicate keys, the first is found, same
+ * as with mpack_node_path(); a match at the recorded pair of a map whose
+ * keys aren't sorted is checked against the keys before it, through the
+ * map's index if it has one.
+ *
+ * @throws mpack_error_type if a key or index is looked up in a node that
+ *     is not a map or array
+ * @throws mpack_error_data if a key or index does not exist
+ */
+mpack_node_t mpack_node_path_cached(mpack_node_t node, const mpack_path_t* path, mpack_path_shape_t* shape);
+
+/**
+ * Returns the node at the given path from the given node as with
+ * mpack_node_path_optional(), using and updating the given shape. See
+ * mpack_node_path_cached().
+ *
+ * @throws mpack_error_type if a key or index is looked up in a node that
+ *     is not a map or array
+ */
+mpack_node_t mpack_node_path_cached_optional(mpack_node_t node, const mpack_path_t* path, mpack_path_shape_t* shape);
+
+/**
+ * Finds all nodes matching the given path from the given node, storing
+ * up to the given capacity of them in the results array in order.
+ *
+ * Elements that don't match (because they are missing a key or index, or
+ * are not a map or array) are skipped without raising an error.
+ *
+ * @return The total number of matching nodes, which may be larger than the
+ *     capacity. Zero is returned if the node's tree is in an error state.
+ */
+size_t mpack_node_path_all(mpack_node_t node, const mpack_path_t* path, mpack_node_t* results, size_t capacity);
+
+/**
+ * @}
+ */
+
+/**
+ * @name Validation Functions
+ * @{
+ */
+
+/**
+ * Limits and checks for mpack_validate().
+ */
+typedef struct mpack_validate_limits_t {
+    /**
+     * The maximum nesting depth of arrays and maps, or 0 for no limit.
+     * A message that is just an array or map has depth 1. This cannot
+     * exceed MPACK_NODE_MAX_DEPTH_WITHOUT_MALLOC.
+     */
+    size_t max_depth;
+
+    /**
+     * The maximum number of elements in the message including the root
+     * and the keys of maps (the number of nodes a tree would parse), or
+     * 0 for no limit.
+     */
+    size_t max_nodes;
+
+    /** Whether all strings must be valid UTF-8. */
+    bool check_utf8;
+} mpack_validate_limits_t;
+
+/**
+ * Checks that the given data is exactly one valid MessagePack message
+ * without parsing it into nodes.
+ *
+ * This skips over the message in the same way as the node parser, but
+ * allocates nothing. The only state is a counter of elements left to
+ * check plus, if a depth limit is given, a count of elements left per
+ * level in a fixed array on the call stack. This is several times faster
+ * than parsing a tree, so it is useful to reject untrusted messages
+ * before deciding what to do with them.
+ *
+ * @param data The data to check
+ * @param length The length of the data. Any bytes after the message
+ *     make it invalid.
+ * @param limits The limits to check, or NULL for none
+ *
+ * @return mpack_ok if the message is valid, mpack_error_invalid if it is
+ *     malformed or truncated or there is data after it, mpack_error_too_big
+ *     if it exceeds a limit, or mpack_error_type if a string is not valid
+ *     UTF-8.
+ */
+mpack_error_t mpack_validate(const char* data, size_t length, const mpack_validate_limits_t* limits);
+
 /**
  * @}
  */
@@ -63,6 +63,9 @@
 #ifndef MPACK_WRITER
 #define MPACK_WRITER 0
 #endif
+#ifndef MPACK_JSON
+#define MPACK_JSON 0
+#endif
 
 #ifndef MPACK_STDLIB
 #define MPACK_STDLIB 0
@@ -70,6 +73,9 @@
 #ifndef MPACK_STDIO
 #define MPACK_STDIO 0
 #endif
+#ifndef MPACK_MMAP
+#define MPACK_MMAP 0
+#endif
 
 #ifndef MPACK_DEBUG
 #define MPACK_DEBUG 0
@@ -93,6 +99,21 @@
 #ifndef MPACK_OPTIMIZE_FOR_SIZE
 #define MPACK_OPTIMIZE_FOR_SIZE 0
 #endif
+#ifndef MPACK_NODE_MAP_INDEX_THRESHOLD
+#define MPACK_NODE_MAP_INDEX_THRESHOLD 0
+#endif
+#ifndef MPACK_NODE_MAP_SORTED_THRESHOLD
+#define MPACK_NODE_MAP_SORTED_THRESHOLD 0
+#endif
+#ifndef MPACK_NODE_PATH_MAX_SEGMENTS
+#define MPACK_NODE_PATH_MAX_SEGMENTS 16
+#endif
+#ifndef MPACK_NODE_RAW
+#define MPACK_NODE_RAW 0
+#endif
+#ifndef MPACK_NODE_MAX_DEPTH_WITHOUT_MALLOC
+#define MPACK_NODE_MAX_DEPTH_WITHOUT_MALLOC 32
+#endif
 
 #ifndef MPACK_EMIT_INLINE_DEFS
 #define MPACK_EMIT_INLINE_DEFS 0
@@ -136,6 +157,12 @@
 #include "sal-stack-lwip/lwip/include/lwip/arch.h"
 #endif // YOTTA_CFG_MBED
 #endif
+#if MPACK_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 
 
@@ -284,6 +311,7 @@ MPACK_HEADER_START
 
 #if defined(__GNUC__) || defined(__clang__)
     #define MPACK_UNREACHABLE __builtin_unreachable()
+    #define MPACK_PREFETCH(addr) __builtin_prefetch(addr)
     #define MPACK_NORETURN(fn) fn __attribute__((noreturn))
 
     // gcov gets confused with always_inline, so we disable it under the unit tests
@@ -302,6 +330,9 @@ MPACK_HEADER_START
 #ifndef MPACK_UNREACHABLE
     #define MPACK_UNREACHABLE ((void)0)
 #endif
+#ifndef MPACK_PREFETCH
+    #define MPACK_PREFETCH(addr) ((void)0)
+#endif
 #ifndef MPACK_NORETURN
     #define MPACK_NORETURN(fn) fn
 #endif
@@ -419,6 +450,9 @@ size_t mpack_strlen(const char *s);
 #if MPACK_WRITE_TRACKING && !defined(MPACK_WRITER)
     #error "MPACK_WRITE_TRACKING requires MPACK_WRITER."
 #endif
+#if MPACK_MMAP && !MPACK_STDIO
+    #error "MPACK_MMAP requires MPACK_STDIO."
+#endif
 #ifndef MPACK_MALLOC
     #if MPACK_STDIO
     #error "MPACK_STDIO requires preprocessor definitions for MPACK_MALLOC and MPACK_FREE."
@@ -55,6 +55,19 @@ void mpack_reader_init_data(mpack_reader_t* reader, const char* data, size_t cou
     MPACK_UNUSED(MPACK_READER_TRACK(reader, mpack_track_init(&reader->track)));
 }
 
+#ifdef MPACK_MALLOC
+void mpack_reader_set_allocator(mpack_reader_t* reader, const mpack_allocator_t* allocator) {
+    #if MPACK_READ_TRACKING
+    mpack_error_t error = mpack_track_set_allocator(&reader->track, allocator);
+    if (error != mpack_ok)
+        mpack_reader_flag_error(reader, error);
+    #else
+    MPACK_UNUSED(reader);
+    MPACK_UNUSED(allocator);
+    #endif
+}
+#endif
+
 #if MPACK_STDIO
 typedef struct mpack_file_reader_t {
     FILE* file;
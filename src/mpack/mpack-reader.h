@@ -261,6 +261,28 @@ MPACK_INLINE void mpack_reader_set_teardown(mpack_reader_t* reader, mpack_reader
     reader->teardown = teardown;
 }
 
+#ifdef MPACK_MALLOC
+/**
+ * Sets the allocator used for the reader's internal memory, replacing
+ * MPACK_MALLOC and MPACK_FREE.
+ *
+ * The reader only allocates internally for its read tracking stack, so this
+ * has no effect unless MPACK_READ_TRACKING is enabled. The stack is only
+ * allocated once something is read, so nothing is allocated with
+ * MPACK_MALLOC if this is called right after initializing the reader.
+ * Otherwise existing allocations are moved to the new allocator. Strings and data returned by the reader's
+ * allocating functions are still allocated with MPACK_MALLOC.
+ *
+ * The allocator is not copied; it must outlive the reader.
+ *
+ * @throws mpack_error_memory if existing allocations could not be moved
+ *
+ * @param reader The MPack reader.
+ * @param allocator The allocator to use, or NULL to use MPACK_MALLOC and MPACK_FREE.
+ */
+void mpack_reader_set_allocator(mpack_reader_t* reader, const mpack_allocator_t* allocator);
+#endif
+
 /**
  * Queries the error state of the MPack reader.
  *
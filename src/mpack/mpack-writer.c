@@ -58,6 +58,7 @@ void mpack_writer_init_error(mpack_writer_t* writer, mpack_error_t error) {
 typedef struct mpack_growable_writer_t {
     char** target_data;
     size_t* target_size;
+    const mpack_allocator_t* allocator; /* The allocator of this struct */
 } mpack_growable_writer_t;
 
 static void mpack_growable_writer_flush(mpack_writer_t* writer, const char* data, size_t count) {
@@ -88,7 +89,9 @@ static void mpack_growable_writer_flush(mpack_writer_t* writer, const char* data
     if (new_size > writer->size) {
         mpack_log("flush growing from %i to %i\n", (int)writer->size, (int)new_size);
 
-        char* new_buffer = (char*)mpack_realloc(writer->buffer, count, new_size);
+        // only the data already in the buffer needs to be kept
+        size_t buffered = is_extra_data ? writer->used : count;
+        char* new_buffer = (char*)mpack_allocator_realloc(writer->allocator, writer->buffer, buffered, new_size);
         if (new_buffer == NULL) {
             mpack_writer_flag_error(writer, mpack_error_memory);
             return;
@@ -116,9 +119,9 @@ static void mpack_growable_writer_teardown(mpack_writer_t* writer) {
         // shrink the buffer to an appropriate size if the data is
         // much smaller than the buffer
         if (writer->used < writer->size / 2) {
-            char* buffer = (char*)mpack_realloc(writer->buffer, writer->used, writer->used);
+            char* buffer = (char*)mpack_allocator_realloc(writer->allocator, writer->buffer, writer->used, writer->used);
             if (!buffer) {
-                MPACK_FREE(writer->buffer);
+                mpack_allocator_free(writer->allocator, writer->buffer);
                 mpack_writer_flag_error(writer, mpack_error_memory);
                 return;
             }
@@ -131,19 +134,25 @@ static void mpack_growable_writer_teardown(mpack_writer_t* writer) {
         writer->buffer = NULL;
 
     } else if (writer->buffer) {
-        MPACK_FREE(writer->buffer);
+        mpack_allocator_free(writer->allocator, writer->buffer);
         writer->buffer = NULL;
     }
 
-    MPACK_FREE(growable_writer);
+    mpack_allocator_free(growable_writer->allocator, growable_writer);
     writer->context = NULL;
 }
 
 void mpack_writer_init_growable(mpack_writer_t* writer, char** target_data, size_t* target_size) {
+    mpack_writer_init_growable_allocator(writer, target_data, target_size, NULL);
+}
+
+void mpack_writer_init_growable_allocator(mpack_writer_t* writer, char** target_data, size_t* target_size,
+        const mpack_allocator_t* allocator)
+{
     *target_data = NULL;
     *target_size = 0;
 
-    mpack_growable_writer_t* growable_writer = (mpack_growable_writer_t*) MPACK_MALLOC(sizeof(mpack_growable_writer_t));
+    mpack_growable_writer_t* growable_writer = (mpack_growable_writer_t*)mpack_allocator_alloc(allocator, sizeof(mpack_growable_writer_t));
     if (growable_writer == NULL) {
         mpack_writer_init_error(writer, mpack_error_memory);
         return;
@@ -152,20 +161,48 @@ void mpack_writer_init_growable(mpack_writer_t* writer, char** target_data, size
 
     growable_writer->target_data = target_data;
     growable_writer->target_size = target_size;
+    growable_writer->allocator = allocator;
 
     size_t capacity = MPACK_BUFFER_SIZE;
-    char* buffer = (char*)MPACK_MALLOC(capacity);
+    char* buffer = (char*)mpack_allocator_alloc(allocator, capacity);
     if (buffer == NULL) {
-        MPACK_FREE(growable_writer);
+        mpack_allocator_free(allocator, growable_writer);
         mpack_writer_init_error(writer, mpack_error_memory);
         return;
     }
 
     mpack_writer_init(writer, buffer, capacity);
+    writer->allocator = allocator;
+    #if MPACK_WRITE_TRACKING
+    writer->track.allocator = allocator;
+    #endif
     mpack_writer_set_context(writer, growable_writer);
     mpack_writer_set_flush(writer, mpack_growable_writer_flush);
     mpack_writer_set_teardown(writer, mpack_growable_writer_teardown);
 }
+
+void mpack_writer_set_allocator(mpack_writer_t* writer, const mpack_allocator_t* allocator) {
+    #if MPACK_WRITE_TRACKING
+    mpack_error_t error = mpack_track_set_allocator(&writer->track, allocator);
+    if (error != mpack_ok) {
+        mpack_writer_flag_error(writer, error);
+        return;
+    }
+    #endif
+
+    // the growable writer owns its buffer, so it moves with the allocator
+    if (writer->teardown == mpack_growable_writer_teardown && writer->buffer) {
+        char* buffer = (char*)mpack_allocator_move(writer->allocator, allocator,
+                writer->buffer, writer->used, writer->size);
+        if (buffer == NULL) {
+            mpack_writer_flag_error(writer, mpack_error_memory);
+            return;
+        }
+        writer->buffer = buffer;
+    }
+
+    writer->allocator = allocator;
+}
 #endif
 
 #if MPACK_STDIO
@@ -788,6 +825,11 @@ void mpack_write_bytes(mpack_writer_t* writer, const char* data, size_t count) {
     mpack_write_native(writer, data, count);
 }
 
+void mpack_write_object_bytes(mpack_writer_t* writer, const char* data, size_t count) {
+    mpack_writer_track_element(writer);
+    mpack_write_native(writer, data, count);
+}
+
 void mpack_write_cstr(mpack_writer_t* writer, const char* str) {
     size_t len = mpack_strlen(str);
     if (len > UINT32_MAX)
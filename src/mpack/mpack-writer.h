@@ -108,6 +108,10 @@ struct mpack_writer_t {
     size_t used;          /* How many bytes have been written into the buffer */
     mpack_error_t error;  /* Error state */
 
+    #ifdef MPACK_MALLOC
+    const mpack_allocator_t* allocator; /* Allocator for internal memory, or NULL for MPACK_MALLOC */
+    #endif
+
     #if MPACK_WRITE_TRACKING
     mpack_track_t track; /* Stack of map/array/str/bin/ext writes */
     #endif
@@ -152,6 +156,27 @@ void mpack_writer_init(mpack_writer_t* writer, char* buffer, size_t size);
  * @param size Where to write the size of the data.
  */
 void mpack_writer_init_growable(mpack_writer_t* writer, char** data, size_t* size);
+
+/**
+ * Initializes an MPack writer using a growable buffer as with
+ * mpack_writer_init_growable(), allocating the buffer and all other
+ * internal memory of the writer with the given allocator instead of
+ * MPACK_MALLOC and MPACK_FREE.
+ *
+ * The allocated data must be freed with the allocator.
+ *
+ * The allocator is not copied; it must outlive the writer.
+ *
+ * @throws mpack_error_memory if the buffer fails to grow when
+ * flushing (not mpack_error_io)
+ *
+ * @param writer The MPack writer.
+ * @param data Where to place the allocated data.
+ * @param size Where to write the size of the data.
+ * @param allocator The allocator to use, or NULL to use MPACK_MALLOC and MPACK_FREE.
+ */
+void mpack_writer_init_growable_allocator(mpack_writer_t* writer, char** data, size_t* size,
+        const mpack_allocator_t* allocator);
 #endif
 
 /**
@@ -269,6 +294,32 @@ MPACK_INLINE void mpack_writer_set_teardown(mpack_writer_t* writer, mpack_writer
     writer->teardown = teardown;
 }
 
+#ifdef MPACK_MALLOC
+/**
+ * Sets the allocator used for the writer's internal memory, replacing
+ * MPACK_MALLOC and MPACK_FREE.
+ *
+ * This covers the write tracking stack and the buffer of a growable
+ * writer. The tracking stack is only allocated once something is written,
+ * so nothing is allocated with MPACK_MALLOC if this is called right after
+ * initializing the writer. A growable writer allocates its buffer when it
+ * is initialized, so it should take the allocator up front with
+ * mpack_writer_init_growable_allocator() instead; otherwise the buffer is
+ * moved to the new allocator here.
+ *
+ * If the writer has a growable buffer, the resulting data must be freed
+ * with this allocator instead of MPACK_FREE().
+ *
+ * The allocator is not copied; it must outlive the writer.
+ *
+ * @throws mpack_error_memory if existing allocations could not be moved
+ *
+ * @param writer The MPack writer.
+ * @param allocator The allocator to use, or NULL to use MPACK_MALLOC and MPACK_FREE.
+ */
+void mpack_writer_set_allocator(mpack_writer_t* writer, const mpack_allocator_t* allocator);
+#endif
+
 /**
  * Returns the number of bytes currently stored in the buffer. This
  * may be less than the total number of bytes written if bytes have
@@ -463,6 +514,16 @@ void mpack_start_ext(mpack_writer_t* writer, int8_t exttype, uint32_t count);
  */
 void mpack_write_bytes(mpack_writer_t* writer, const char* data, size_t count);
 
+/**
+ * Writes an object that is already encoded as MessagePack, such as part
+ * of a message being forwarded. The data must contain exactly one
+ * complete object (which may be an array or map with its elements.) It
+ * is copied as is and counts as a single element.
+ *
+ * @see mpack_write_node_raw()
+ */
+void mpack_write_object_bytes(mpack_writer_t* writer, const char* data, size_t count);
+
 #if MPACK_WRITE_TRACKING
 /**
  * Finishes writing an array.
@@ -16,6 +16,7 @@
     #define MPACK_WRITER 1
     #define MPACK_EXPECT 1
     #define MPACK_NODE 1
+    #define MPACK_JSON 1
 
     #define MPACK_STDLIB 1
     #define MPACK_STDIO 1
@@ -34,6 +35,16 @@
 #define ftell  test_ftell
 #endif
 
+// The mmap tree is tested wherever POSIX is available
+#if defined(MPACK_STDIO) && MPACK_STDIO && (defined(__unix__) || defined(__APPLE__))
+#define MPACK_MMAP 1
+#endif
+
+// Frozen trees are stress tested with threads wherever POSIX is available
+#if defined(MPACK_MALLOC) && (defined(__unix__) || defined(__APPLE__))
+#define MPACK_TEST_THREADS 1
+#endif
+
 // Tracking matches the default config, except the test suite
 // also supports MPACK_NO_TRACKING to disable it.
 #if defined(MPACK_MALLOC) && !defined(MPACK_NO_TRACKING)
@@ -59,6 +70,9 @@
 #define MPACK_STACK_SIZE 7
 #define MPACK_BUFFER_SIZE 7
 #define MPACK_NODE_PAGE_SIZE 7
+#define MPACK_NODE_MAP_INDEX_THRESHOLD 3
+#define MPACK_NODE_MAP_SORTED_THRESHOLD 2
+#define MPACK_NODE_RAW 1
 
 #ifdef MPACK_MALLOC
 #define MPACK_NODE_INITIAL_DEPTH 3
@@ -470,13 +470,11 @@ static void test_file_node_elements(mpack_node_t node, mpack_tag_t tag) {
     }
 }
 
-static void test_file_node(void) {
-    mpack_tree_t tree;
-    mpack_tree_init_file(&tree, test_filename, 0);
-    TEST_TRUE(mpack_tree_error(&tree) == mpack_ok, "file tree parsing failed: %s",
-            mpack_error_to_string(mpack_tree_error(&tree)));
+static void test_file_node_contents(mpack_tree_t* tree) {
+    TEST_TRUE(mpack_tree_error(tree) == mpack_ok, "file tree parsing failed: %s",
+            mpack_error_to_string(mpack_tree_error(tree)));
 
-    mpack_node_t root = mpack_tree_root(&tree);
+    mpack_node_t root = mpack_tree_root(tree);
     TEST_TRUE(mpack_node_array_length(root) == 5);
 
     mpack_node_t node = mpack_node_array_at(root, 0);
@@ -524,8 +522,14 @@ static void test_file_node(void) {
     test_file_node_elements(mpack_node_array_at(node, 3), mpack_tag_map(UINT8_MAX + 1));
     test_file_node_elements(mpack_node_array_at(node, 4), mpack_tag_map(UINT16_MAX + 1));
 
-    mpack_error_t error = mpack_tree_destroy(&tree);
+    mpack_error_t error = mpack_tree_destroy(tree);
     TEST_TRUE(error == mpack_ok, "file tree failed with error %s", mpack_error_to_string(error));
+}
+
+static void test_file_node(void) {
+    mpack_tree_t tree;
+    mpack_tree_init_file(&tree, test_filename, 0);
+    test_file_node_contents(&tree);
 
     // test file size out of bounds
     if (sizeof(size_t) >= sizeof(long)) {
@@ -538,6 +542,26 @@ static void test_file_node(void) {
     TEST_TREE_DESTROY_ERROR(&tree, mpack_error_io);
 }
 
+#if MPACK_MMAP
+static void test_file_node_mmap(void) {
+    mpack_tree_t tree;
+    mpack_tree_init_mmap(&tree, test_filename, 0);
+    test_file_node_contents(&tree);
+
+    // test file larger than max_size
+    mpack_tree_init_mmap(&tree, test_filename, 1);
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_too_big);
+
+    // test missing file
+    mpack_tree_init_mmap(&tree, "invalid-filename", 0);
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_io);
+
+    // test directory
+    mpack_tree_init_mmap(&tree, test_dir, 0);
+    TEST_TRUE(mpack_tree_destroy(&tree) != mpack_ok);
+}
+#endif
+
 static bool test_file_node_failure() {
 
     // The node failure test may fail with either
@@ -616,6 +640,9 @@ void test_file(void) {
     #endif
     #if MPACK_NODE
     test_file_node();
+    #if MPACK_MMAP
+    test_file_node_mmap();
+    #endif
     #endif
 
     test_system_fail_until_ok(&test_file_write_failure);
@@ -0,0 +1,656 @@
+/*
+ * Copyright (c) 2015 Nicholas Fraser
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "test-json.h"
+#include "test-system.h"
+
+#if MPACK_JSON
+
+#if MPACK_NODE || MPACK_READER
+// JSON is written through a small buffer with a flush function that
+// collects it, to test flushing of both short and long output.
+
+static char test_json_output[4096];
+static size_t test_json_output_size;
+
+static void test_json_flush(mpack_json_writer_t* json, const char* buffer, size_t count) {
+    if (test_json_output_size + count > sizeof(test_json_output)) {
+        mpack_json_writer_flag_error(json, mpack_error_io);
+        return;
+    }
+    memcpy(test_json_output + test_json_output_size, buffer, count);
+    test_json_output_size += count;
+}
+
+static void test_json_writer_init(mpack_json_writer_t* json, char* buffer, size_t size, bool pretty) {
+    test_json_output_size = 0;
+    mpack_json_writer_init(json, buffer, size);
+    mpack_json_writer_set_flush(json, test_json_flush);
+    mpack_json_writer_set_pretty(json, pretty);
+}
+
+static bool test_json_output_is(const char* expected) {
+    size_t length = strlen(expected);
+    if (test_json_output_size != length || memcmp(test_json_output, expected, length) != 0) {
+        printf("expected: %s\n", expected);
+        printf("actual:   %.*s\n", (int)test_json_output_size, test_json_output);
+        return false;
+    }
+    return true;
+}
+
+#if MPACK_READER
+// The reader has a small buffer so that long strings and data are
+// converted in chunks.
+
+typedef struct test_json_source_t {
+    const char* data;
+    size_t left;
+} test_json_source_t;
+
+static size_t test_json_fill(mpack_reader_t* reader, char* buffer, size_t count) {
+    test_json_source_t* source = (test_json_source_t*)reader->context;
+    if (count > source->left)
+        count = source->left;
+    memcpy(buffer, source->data, count);
+    source->data += count;
+    source->left -= count;
+    return count;
+}
+#endif
+
+// Converts the data with both the node and reader versions, checking
+// the output and error of each
+static void test_json_convert(const char* data, size_t size, const char* expected, bool pretty, mpack_error_t error) {
+    char buffer[8];
+
+    #if MPACK_NODE
+    mpack_node_data_t pool[128];
+    mpack_tree_t tree;
+    mpack_tree_init_pool(&tree, data, size, pool, sizeof(pool) / sizeof(*pool));
+    mpack_json_writer_t json;
+    test_json_writer_init(&json, buffer, sizeof(buffer), pretty);
+    mpack_json_write_node(&json, mpack_tree_root(&tree));
+    mpack_error_t json_error = mpack_json_writer_destroy(&json);
+    TEST_TRUE(json_error == error, "node json error %i (%s) instead of %i (%s)",
+            (int)json_error, mpack_error_to_string(json_error), (int)error, mpack_error_to_string(error));
+    if (error == mpack_ok)
+        TEST_TRUE(test_json_output_is(expected), "node json output does not match");
+    mpack_tree_destroy(&tree);
+    #endif
+
+    #if MPACK_READER
+    test_json_source_t source;
+    source.data = data;
+    source.left = size;
+    char reader_buffer[16];
+    mpack_reader_t reader;
+    mpack_reader_init(&reader, reader_buffer, sizeof(reader_buffer), 0);
+    mpack_reader_set_context(&reader, &source);
+    mpack_reader_set_fill(&reader, test_json_fill);
+    mpack_json_writer_t reader_json;
+    test_json_writer_init(&reader_json, buffer, sizeof(buffer), pretty);
+    mpack_json_write_element(&reader_json, &reader);
+    mpack_error_t reader_json_error = mpack_json_writer_destroy(&reader_json);
+    TEST_TRUE(reader_json_error == error, "reader json error %i (%s) instead of %i (%s)",
+            (int)reader_json_error, mpack_error_to_string(reader_json_error), (int)error, mpack_error_to_string(error));
+    if (error == mpack_ok)
+        TEST_TRUE(test_json_output_is(expected), "reader json output does not match");
+    TEST_TRUE(mpack_reader_destroy(&reader) == error);
+    #endif
+}
+
+#define TEST_JSON(data, expected) \
+    test_json_convert(data, sizeof(data) - 1, expected, false, mpack_ok)
+#define TEST_JSON_PRETTY(data, expected) \
+    test_json_convert(data, sizeof(data) - 1, expected, true, mpack_ok)
+#define TEST_JSON_ERROR(data, error) \
+    test_json_convert(data, sizeof(data) - 1, NULL, false, error)
+
+static void test_json_scalars() {
+    TEST_JSON("\xc0", "null");
+    TEST_JSON("\xc2", "false");
+    TEST_JSON("\xc3", "true");
+    TEST_JSON("\x00", "0");
+    TEST_JSON("\x7f", "127");
+    TEST_JSON("\xff", "-1");
+    TEST_JSON("\xcf\xff\xff\xff\xff\xff\xff\xff\xff", "18446744073709551615");
+    TEST_JSON("\xd3\x80\x00\x00\x00\x00\x00\x00\x00", "-9223372036854775808");
+}
+
+static void test_json_floats() {
+    TEST_JSON("\xcb\x00\x00\x00\x00\x00\x00\x00\x00", "0.0");
+    TEST_JSON("\xcb\x80\x00\x00\x00\x00\x00\x00\x00", "-0.0");
+    TEST_JSON("\xcb\x3f\xf0\x00\x00\x00\x00\x00\x00", "1.0");
+    TEST_JSON("\xcb\xbf\xf8\x00\x00\x00\x00\x00\x00", "-1.5");
+    TEST_JSON("\xcb\x3f\xb9\x99\x99\x99\x99\x99\x9a", "0.1");
+    TEST_JSON("\xcb\x3f\xd3\x33\x33\x33\x33\x33\x33", "0.3");
+    TEST_JSON("\xcb\x40\x93\x4a\x45\x6d\x5c\xfa\xad", "1234.5678");
+    TEST_JSON("\xcb\x3e\xb0\xc6\xf7\xa0\xb5\xed\x8d", "0.000001");
+    TEST_JSON("\xcb\x3e\x7a\xd7\xf2\x9a\xbc\xaf\x48", "1e-7");
+    TEST_JSON("\xcb\x44\x1a\xc5\x3a\x7e\x04\xbc\xda", "123456789012345680000.0");
+    TEST_JSON("\xcb\x44\x4b\x1a\xe4\xd6\xe2\xef\x50", "1e21");
+    TEST_JSON("\xcb\x00\x00\x00\x00\x00\x00\x00\x01", "5e-324");
+    TEST_JSON("\xcb\x7f\xef\xff\xff\xff\xff\xff\xff", "1.7976931348623157e308");
+    TEST_JSON("\xcb\x7f\xf0\x00\x00\x00\x00\x00\x00", "null");
+    TEST_JSON("\xcb\x7f\xf8\x00\x00\x00\x00\x00\x00", "null");
+
+    TEST_JSON("\xca\x3d\xcc\xcc\xcd", "0.1");
+    TEST_JSON("\xca\x4b\x80\x00\x00", "16777216.0");
+    TEST_JSON("\xca\x7f\x7f\xff\xff", "3.4028235e38");
+    TEST_JSON("\xca\x00\x00\x00\x01", "1e-45");
+    TEST_JSON("\xca\xff\x80\x00\x00", "null");
+}
+
+static void test_json_strings() {
+    TEST_JSON("\xa0", "\"\"");
+    TEST_JSON("\xa5hello", "\"hello\"");
+    TEST_JSON("\xa8\"a\\b/\x7f\xc3\xa9", "\"\\\"a\\\\b/\x7f\xc3\xa9\"");
+    TEST_JSON("\xa8\x08\x0c\x0a\x0d\x09\x00\x01\x1f", "\"\\b\\f\\n\\r\\t\\u0000\\u0001\\u001f\"");
+    TEST_JSON("\xd9\x24""the quick brown fox jumps\nover a dog",
+            "\"the quick brown fox jumps\\nover a dog\"");
+
+    // bin and ext are base64 with padding
+    TEST_JSON("\xc4\x00", "\"\"");
+    TEST_JSON("\xc4\x01M", "\"TQ==\"");
+    TEST_JSON("\xc4\x02Ma", "\"TWE=\"");
+    TEST_JSON("\xc4\x03Man", "\"TWFu\"");
+    TEST_JSON("\xc4\x03\xfb\xff\xbf", "\"+/+/\"");
+    TEST_JSON("\xd4\x01\x4d", "\"TQ==\"");
+    TEST_JSON("\xc7\x0a\x07""any carnal", "\"YW55IGNhcm5hbA==\"");
+}
+
+static void test_json_containers() {
+    TEST_JSON("\x90", "[]");
+    TEST_JSON("\x80", "{}");
+    TEST_JSON("\x93\x01\xc0\xa1x", "[1,null,\"x\"]");
+    TEST_JSON("\x82\xa7""compact\xc3\xa6""schema\x00", "{\"compact\":true,\"schema\":0}");
+    TEST_JSON("\x92\x91\x90\x81\xa1""a\x80", "[[[]],{\"a\":{}}]");
+
+    // non-string keys are quoted
+    TEST_JSON("\x84\x01\x02\xff\xc0\xc3\xc2\xcb\x3f\xf8\x00\x00\x00\x00\x00\x00\xc0",
+            "{\"1\":2,\"-1\":null,\"true\":false,\"1.5\":null}");
+    TEST_JSON("\x81\xc4\x01M\x01", "{\"TQ==\":1}");
+
+    // containers can't be keys
+    TEST_JSON_ERROR("\x81\x90\x01", mpack_error_type);
+    TEST_JSON_ERROR("\x91\x81\x80\x01", mpack_error_type);
+
+    // errors in the data are propagated
+    TEST_JSON_ERROR("\x92\x01\xc1", mpack_error_invalid);
+    TEST_JSON_ERROR("\xc1", mpack_error_invalid);
+}
+
+static void test_json_pretty() {
+    TEST_JSON_PRETTY("\x01", "1");
+    TEST_JSON_PRETTY("\x90", "[]");
+    TEST_JSON_PRETTY("\x92\x01\x02", "[\n  1,\n  2\n]");
+    TEST_JSON_PRETTY("\x82\xa1""a\x91\x80\xa1""b\x80",
+            "{\n  \"a\": [\n    {}\n  ],\n  \"b\": {}\n}");
+
+    // indentation past the length of the indent string
+    char data[32];
+    char expected[1024];
+    char* e = expected;
+    for (int i = 0; i < 20; ++i) {
+        data[i] = '\x91';
+        *e++ = '[';
+        *e++ = '\n';
+        for (int j = 0; j <= i; ++j) {
+            *e++ = ' ';
+            *e++ = ' ';
+        }
+    }
+    data[20] = '\x00';
+    *e++ = '0';
+    for (int i = 19; i >= 0; --i) {
+        *e++ = '\n';
+        for (int j = 0; j < i; ++j) {
+            *e++ = ' ';
+            *e++ = ' ';
+        }
+        *e++ = ']';
+    }
+    *e = 0;
+    test_json_convert(data, 21, expected, true, mpack_ok);
+}
+
+#endif
+
+#if MPACK_NODE
+static void test_json_buffer() {
+    static const char data[] = "\x92\xa5hello\xa5world";
+    mpack_node_data_t pool[8];
+    mpack_tree_t tree;
+    mpack_tree_init_pool(&tree, data, sizeof(data) - 1, pool, sizeof(pool) / sizeof(*pool));
+
+    // without a flush function the output must fit in the buffer
+    char buffer[32];
+    mpack_json_writer_t json;
+    mpack_json_writer_init(&json, buffer, sizeof(buffer));
+    mpack_json_write_node(&json, mpack_tree_root(&tree));
+    mpack_json_write_bytes(&json, "\n", 1);
+    TEST_TRUE(mpack_json_writer_buffer_used(&json) == 18);
+    TEST_TRUE(memcmp(buffer, "[\"hello\",\"world\"]\n", 18) == 0);
+    TEST_TRUE(mpack_json_writer_destroy(&json) == mpack_ok);
+
+    mpack_json_writer_init(&json, buffer, 10);
+    mpack_json_write_node(&json, mpack_tree_root(&tree));
+    TEST_TRUE(mpack_json_writer_destroy(&json) == mpack_error_io);
+
+    // errors in the tree are flagged on the writer
+    mpack_tree_flag_error(&tree, mpack_error_data);
+    mpack_json_writer_init(&json, buffer, sizeof(buffer));
+    mpack_json_write_node(&json, mpack_tree_root(&tree));
+    TEST_TRUE(mpack_json_writer_buffer_used(&json) == 0);
+    TEST_TRUE(mpack_json_writer_destroy(&json) == mpack_error_data);
+    mpack_tree_destroy(&tree);
+
+    // flushing explicitly
+    test_json_writer_init(&json, buffer, sizeof(buffer), false);
+    mpack_json_write_bytes(&json, "abc", 3);
+    mpack_json_writer_flush(&json);
+    TEST_TRUE(mpack_json_writer_buffer_used(&json) == 0);
+    TEST_TRUE(test_json_output_is("abc"));
+    TEST_TRUE(mpack_json_writer_destroy(&json) == mpack_ok);
+
+    // only the first error is kept
+    mpack_json_writer_init(&json, buffer, sizeof(buffer));
+    mpack_json_writer_flag_error(&json, mpack_error_io);
+    mpack_json_writer_flag_error(&json, mpack_error_type);
+    TEST_TRUE(mpack_json_writer_error(&json) == mpack_error_io);
+    TEST_TRUE(mpack_json_writer_destroy(&json) == mpack_error_io);
+}
+
+// Writes a deeply nested element, testing growth of the stack
+static bool test_json_deep() {
+    static const int depth = 100;
+    char data[512];
+    char* p = data;
+    for (int i = 0; i < depth; ++i) {
+        *p++ = '\x81';
+        *p++ = '\xa1';
+        *p++ = 'a';
+    }
+    *p++ = '\x07';
+
+    char expected[1024];
+    char* e = expected;
+    for (int i = 0; i < depth; ++i) {
+        memcpy(e, "{\"a\":", 5);
+        e += 5;
+    }
+    *e++ = '7';
+    for (int i = 0; i < depth; ++i)
+        *e++ = '}';
+    *e = 0;
+
+    mpack_node_data_t pool[256];
+    mpack_tree_t tree;
+    mpack_tree_init_pool(&tree, data, (size_t)(p - data), pool, sizeof(pool) / sizeof(*pool));
+    char buffer[64];
+    mpack_json_writer_t json;
+    test_json_writer_init(&json, buffer, sizeof(buffer), false);
+    mpack_json_write_node(&json, mpack_tree_root(&tree));
+    mpack_error_t error = mpack_json_writer_destroy(&json);
+    mpack_tree_destroy(&tree);
+
+    #ifdef MPACK_MALLOC
+    if (error == mpack_error_memory)
+        return false;
+    TEST_TRUE(error == mpack_ok, "unexpected error state %i (%s)", (int)error, mpack_error_to_string(error));
+    TEST_TRUE(test_json_output_is(expected));
+    #else
+    TEST_TRUE(error == mpack_error_too_big, "unexpected error state %i (%s)", (int)error, mpack_error_to_string(error));
+    #endif
+    return true;
+}
+#endif
+
+#if MPACK_WRITER
+static void test_json_parse(const char* json, const char* expected, size_t expected_size) {
+    char buffer[256];
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, buffer, sizeof(buffer));
+    size_t length = strlen(json);
+    size_t used = mpack_write_json(&writer, json, length);
+    size_t size = mpack_writer_buffer_used(&writer);
+    mpack_error_t error = mpack_writer_destroy(&writer);
+    TEST_TRUE(error == mpack_ok, "parsing %s flagged error %i (%s)", json, (int)error, mpack_error_to_string(error));
+    TEST_TRUE(used == length, "parsing %s used %i bytes of %i", json, (int)used, (int)length);
+    TEST_TRUE(size == expected_size && memcmp(buffer, expected, size) == 0, "parsing %s wrote the wrong data", json);
+}
+
+static void test_json_parse_error(const char* json, mpack_error_t expected) {
+    char buffer[256];
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, buffer, sizeof(buffer));
+    size_t used = mpack_write_json(&writer, json, strlen(json));
+    mpack_error_t error = mpack_writer_destroy(&writer);
+    TEST_TRUE(used == 0);
+    TEST_TRUE(error == expected, "parsing %s flagged error %i (%s) instead of %i (%s)", json,
+            (int)error, mpack_error_to_string(error), (int)expected, mpack_error_to_string(expected));
+}
+
+#define TEST_JSON_PARSE(json, expected) \
+    test_json_parse(json, expected, sizeof(expected) - 1)
+
+static void test_json_parse_scalars() {
+    TEST_JSON_PARSE("null", "\xc0");
+    TEST_JSON_PARSE("true", "\xc3");
+    TEST_JSON_PARSE(" false\n", "\xc2");
+    TEST_JSON_PARSE("0", "\x00");
+    TEST_JSON_PARSE("-0", "\x00");
+    TEST_JSON_PARSE("127", "\x7f");
+    TEST_JSON_PARSE("128", "\xcc\x80");
+    TEST_JSON_PARSE("-1", "\xff");
+    TEST_JSON_PARSE("-33", "\xd0\xdf");
+    TEST_JSON_PARSE("65536", "\xce\x00\x01\x00\x00");
+    TEST_JSON_PARSE("18446744073709551615", "\xcf\xff\xff\xff\xff\xff\xff\xff\xff");
+    TEST_JSON_PARSE("-9223372036854775808", "\xd3\x80\x00\x00\x00\x00\x00\x00\x00");
+
+    // integers out of range become floats
+    TEST_JSON_PARSE("18446744073709551616", "\xca\x5f\x80\x00\x00");
+    TEST_JSON_PARSE("-9223372036854775809", "\xca\xdf\x00\x00\x00");
+
+    // numbers are floats if that keeps their value
+    TEST_JSON_PARSE("1.0", "\xca\x3f\x80\x00\x00");
+    TEST_JSON_PARSE("-0.0", "\xca\x80\x00\x00\x00");
+    TEST_JSON_PARSE("1.5e0", "\xca\x3f\xc0\x00\x00");
+    TEST_JSON_PARSE("1E3", "\xca\x44\x7a\x00\x00");
+    TEST_JSON_PARSE("0.1", "\xcb\x3f\xb9\x99\x99\x99\x99\x99\x9a");
+    TEST_JSON_PARSE("25e-4", "\xcb\x3f\x64\x7a\xe1\x47\xae\x14\x7b");
+    TEST_JSON_PARSE("0.30000000000000004", "\xcb\x3f\xd3\x33\x33\x33\x33\x33\x34");
+    TEST_JSON_PARSE("1e23", "\xcb\x44\xb5\x2d\x02\xc7\xe1\x4a\xf6");
+    TEST_JSON_PARSE("123456789012345678901234567890", "\xcb\x45\xf8\xee\x90\xff\x6c\x37\x3e");
+    TEST_JSON_PARSE("1e-320", "\xcb\x00\x00\x00\x00\x00\x00\x07\xe8");
+    TEST_JSON_PARSE("1e400", "\xcb\x7f\xf0\x00\x00\x00\x00\x00\x00");
+    #if MPACK_STDLIB
+    // halfway between two doubles, rounded to even
+    TEST_JSON_PARSE("9007199254740993.0", "\xca\x5a\x00\x00\x00");
+
+    // just above halfway between 1 and the next double, which can't be
+    // decided from the first few dozen digits
+    TEST_JSON_PARSE("1.000000000000000111022302462515654042363166809082031250001",
+            "\xcb\x3f\xf0\x00\x00\x00\x00\x00\x01");
+    TEST_JSON_PARSE("1.000000000000000111022302462515654042363166809082031250000",
+            "\xca\x3f\x80\x00\x00");
+
+    // the same with the nonzero digit past the digits given to strtod()
+    static const char halfway[] = "1.00000000000000011102230246251565404236316680908203125";
+    char json[1024];
+    size_t length = strlen(halfway);
+    memcpy(json, halfway, length);
+    memset(json + length, '0', 800);
+    json[length + 800] = '1';
+    json[length + 801] = 0;
+    TEST_JSON_PARSE(json, "\xcb\x3f\xf0\x00\x00\x00\x00\x00\x01");
+    #endif
+}
+
+static void test_json_parse_strings() {
+    TEST_JSON_PARSE("\"\"", "\xa0");
+    TEST_JSON_PARSE("\"hello\"", "\xa5hello");
+    TEST_JSON_PARSE("\"the quick brown fox jumps over the lazy dog\"",
+            "\xd9\x2b""the quick brown fox jumps over the lazy dog");
+    TEST_JSON_PARSE("\"\\\"\\\\\\/\\b\\f\\n\\r\\t\"", "\xa8\"\\/\b\f\n\r\t");
+    TEST_JSON_PARSE("\"caf\\u00e9 \\u20ac\"", "\xa9""caf\xc3\xa9 \xe2\x82\xac");
+    TEST_JSON_PARSE("\"\\uD83D\\uDE00!\"", "\xa5\xf0\x9f\x98\x80!");
+    TEST_JSON_PARSE("\"\\ud83d \\ude00\"", "\xa7\xef\xbf\xbd \xef\xbf\xbd");
+    TEST_JSON_PARSE("\"\xc3\xa9\\u0000\"", "\xa3\xc3\xa9\x00");
+    TEST_JSON_PARSE("\"a long string with an escape at the end\\n\"",
+            "\xd9\x28""a long string with an escape at the end\n");
+}
+
+static void test_json_parse_containers() {
+    TEST_JSON_PARSE("[]", "\x90");
+    TEST_JSON_PARSE("{}", "\x80");
+    TEST_JSON_PARSE("[1,[2,{}],{\"a\":[true]}]", "\x93\x01\x92\x02\x80\x81\xa1""a\x91\xc3");
+    TEST_JSON_PARSE("{\"compact\":true,\"schema\":0}", "\x82\xa7""compact\xc3\xa6""schema\x00");
+    TEST_JSON_PARSE("{\n  \"a\": [\n    {}, [ ]\n  ],\n  \"b\" : \"]}[{,\\\"\"\n}\n",
+            "\x82\xa1""a\x92\x80\x90\xa1""b\xa6]}[{,\"");
+
+    // many containers and deep nesting
+    char json[512];
+    char expected[256];
+    char* p = json;
+    char* e = expected;
+    *e++ = '\xdc';
+    *e++ = 0;
+    *e++ = 100;
+    *p++ = '[';
+    for (int i = 0; i < 100; ++i) {
+        memcpy(p, "[],", 3);
+        p += 3;
+        *e++ = '\x90';
+    }
+    p[-1] = ']';
+    *p = 0;
+    test_json_parse(json, expected, (size_t)(e - expected));
+
+    p = json;
+    e = expected;
+    for (int i = 0; i < 30; ++i) {
+        *p++ = '[';
+        *e++ = '\x91';
+    }
+    *p++ = '0';
+    *e++ = 0;
+    for (int i = 0; i < 30; ++i)
+        *p++ = ']';
+    *p = 0;
+    test_json_parse(json, expected, (size_t)(e - expected));
+}
+
+static void test_json_parse_invalid() {
+    static const char* invalid[] = {
+        "", " ", "nul", "True", "+1", "-", "1.", ".5", "1e", "1e+", "[01]",
+        "\"abc", "\"a\x01\"", "\"\\x\"", "\"\\u12\"", "\"\\u12g4\"", "\"\\",
+        "[", "]", "[1", "[1,]", "[,1]", "[1 2]", "[1}", "{]", "[{]}",
+        "{\"a\"}", "{\"a\" 1}", "{\"a\":}", "{1:2}", "{\"a\":1,}", "{,}",
+    };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(*invalid); ++i)
+        test_json_parse_error(invalid[i], mpack_error_invalid);
+}
+
+static void test_json_parse_stream() {
+    static const char json[] = "1 [2]\n{\"a\":3}\n\"b\" 01";
+    const char* p = json;
+    const char* end = json + sizeof(json) - 1;
+    char buffer[64];
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, buffer, sizeof(buffer));
+    size_t values = 0;
+    while (p != end) {
+        size_t used = mpack_write_json(&writer, p, (size_t)(end - p));
+        if (used == 0)
+            break;
+        p += used;
+        ++values;
+    }
+    TEST_TRUE(values == 6);
+    static const char expected[] = "\x01\x91\x02\x81\xa1""a\x03\xa1""b\x00\x01";
+    TEST_TRUE(mpack_writer_buffer_used(&writer) == sizeof(expected) - 1);
+    TEST_TRUE(memcmp(buffer, expected, sizeof(expected) - 1) == 0);
+    TEST_TRUE(mpack_writer_destroy(&writer) == mpack_ok);
+
+    // errors of the writer are kept
+    mpack_writer_init(&writer, buffer, 4);
+    TEST_TRUE(mpack_write_json(&writer, "[\"abcde\"]", 9) == 0);
+    TEST_TRUE(mpack_write_json(&writer, "1", 1) == 0);
+    TEST_TRUE(mpack_writer_destroy(&writer) == mpack_error_io);
+}
+
+#if MPACK_NODE
+// Converts JSON to MessagePack and back
+static void test_json_parse_round_trip() {
+    static const char json[] = "{\"name\":\"mpack\",\"version\":[0,8,2],\"ratio\":0.1,\"neg\":-5,"
+            "\"nested\":{\"empty\":[],\"text\":\"tab\\t\\u0001\"},\"ok\":true,\"none\":null}";
+    char data[256];
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, data, sizeof(data));
+    mpack_write_json(&writer, json, sizeof(json) - 1);
+    size_t size = mpack_writer_buffer_used(&writer);
+    TEST_TRUE(mpack_writer_destroy(&writer) == mpack_ok);
+
+    mpack_node_data_t pool[64];
+    mpack_tree_t tree;
+    mpack_tree_init_pool(&tree, data, size, pool, sizeof(pool) / sizeof(*pool));
+    char buffer[256];
+    mpack_json_writer_t json_writer;
+    mpack_json_writer_init(&json_writer, buffer, sizeof(buffer));
+    mpack_json_write_node(&json_writer, mpack_tree_root(&tree));
+    size_t used = mpack_json_writer_buffer_used(&json_writer);
+    TEST_TRUE(mpack_json_writer_destroy(&json_writer) == mpack_ok);
+    TEST_TRUE(mpack_tree_destroy(&tree) == mpack_ok);
+    TEST_TRUE(used == sizeof(json) - 1 && memcmp(buffer, json, used) == 0);
+}
+#endif
+
+#ifdef MPACK_MALLOC
+// Parses many nested containers, testing growth of the parser's arrays
+static bool test_json_parse_large() {
+    static const int depth = 100;
+    char json[1024];
+    char expected[512];
+    char* p = json;
+    char* e = expected;
+    for (int i = 0; i < depth; ++i) {
+        memcpy(p, "[{},", 4);
+        p += 4;
+        *e++ = '\x92';
+        *e++ = '\x80';
+    }
+    *p++ = '0';
+    *e++ = 0;
+    for (int i = 0; i < depth; ++i)
+        *p++ = ']';
+
+    char buffer[512];
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, buffer, sizeof(buffer));
+    size_t used = mpack_write_json(&writer, json, (size_t)(p - json));
+    size_t size = mpack_writer_buffer_used(&writer);
+    mpack_error_t error = mpack_writer_destroy(&writer);
+    if (error == mpack_error_memory)
+        return false;
+
+    TEST_TRUE(error == mpack_ok, "unexpected error state %i (%s)", (int)error, mpack_error_to_string(error));
+    TEST_TRUE(used == (size_t)(p - json));
+    TEST_TRUE(size == (size_t)(e - expected) && memcmp(buffer, expected, size) == 0);
+    return true;
+}
+
+// Parses a flat array of more records than the parser keeps counts for on
+// the call stack. The records are shallow, so only the counts grow.
+static bool test_json_parse_records() {
+    static const int records = 300;
+    char json[4096];
+    char expected[2048];
+    char* p = json;
+    char* e = expected;
+    *p++ = '[';
+    *e++ = '\xdc';
+    *e++ = (char)(records >> 8);
+    *e++ = (char)(records & 0xff);
+    for (int i = 0; i < records; ++i) {
+        int value = i % 100;
+        memcpy(p, "{\"i\":", 5);
+        p += 5;
+        if (value >= 10)
+            *p++ = (char)('0' + value / 10);
+        *p++ = (char)('0' + value % 10);
+        *p++ = '}';
+        *p++ = ',';
+        *e++ = '\x81';
+        *e++ = '\xa1';
+        *e++ = 'i';
+        *e++ = (char)value;
+    }
+    p[-1] = ']';
+
+    char buffer[2048];
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, buffer, sizeof(buffer));
+    size_t used = mpack_write_json(&writer, json, (size_t)(p - json));
+    size_t size = mpack_writer_buffer_used(&writer);
+    mpack_error_t error = mpack_writer_destroy(&writer);
+    if (error == mpack_error_memory)
+        return false;
+
+    TEST_TRUE(error == mpack_ok, "unexpected error state %i (%s)", (int)error, mpack_error_to_string(error));
+    TEST_TRUE(used == (size_t)(p - json));
+    TEST_TRUE(size == (size_t)(e - expected) && memcmp(buffer, expected, size) == 0);
+    return true;
+}
+#else
+static void test_json_parse_large() {
+    // without malloc, the number of containers is limited
+    char json[1024];
+    char* p = json;
+    *p++ = '[';
+    for (int i = 0; i < 300; ++i) {
+        memcpy(p, "[],", 3);
+        p += 3;
+    }
+    p[-1] = ']';
+    *p = 0;
+    test_json_parse_error(json, mpack_error_too_big);
+}
+#endif
+#endif
+
+void test_json() {
+    #if MPACK_NODE || MPACK_READER
+    test_json_scalars();
+    test_json_floats();
+    test_json_strings();
+    test_json_containers();
+    test_json_pretty();
+    #endif
+    #if MPACK_WRITER
+    test_json_parse_scalars();
+    test_json_parse_strings();
+    test_json_parse_containers();
+    test_json_parse_invalid();
+    test_json_parse_stream();
+    #if MPACK_NODE
+    test_json_parse_round_trip();
+    #endif
+    #ifdef MPACK_MALLOC
+    test_system_fail_until_ok(&test_json_parse_large);
+    test_system_fail_until_ok(&test_json_parse_records);
+    #else
+    test_json_parse_large();
+    #endif
+    #endif
+    #if MPACK_NODE
+    test_json_buffer();
+    #ifdef MPACK_MALLOC
+    test_system_fail_until_ok(&test_json_deep);
+    #else
+    test_json_deep();
+    #endif
+    #endif
+}
+
+#endif
+
@@ -22,6 +22,10 @@
 #include "test-node.h"
 #include "test-system.h"
 
+#ifdef MPACK_TEST_THREADS
+#include <pthread.h>
+#endif
+
 #if MPACK_NODE
 
 mpack_error_t test_tree_error = mpack_ok;
@@ -571,6 +575,177 @@ static void test_node_read_array() {
     TEST_TREE_DESTROY_ERROR(&tree, mpack_error_data);
 }
 
+static void test_node_read_iter() {
+    // [1, "ab", [2, 3], {}, []]
+    static const char array[] = "\x95\x01\xa2""ab\x92\x02\x03\x80\x90";
+    // {"a": 1, "b": [2], "c": {"d": 3}}
+    static const char map[] = "\x83\xa1""a\x01\xa1""b\x91\x02\xa1""c\x81\xa1""d\x03";
+    mpack_node_data_t pool[16];
+    mpack_tree_t tree;
+    mpack_node_iter_t iter;
+    mpack_node_t node, key, value;
+
+    // the iterators only write the nodes when they return true, which
+    // some compilers can't see through the test macros
+    mpack_memset(&key, 0, sizeof(key));
+    mpack_memset(&value, 0, sizeof(value));
+
+    // array elements are returned in order
+    mpack_tree_init_pool(&tree, array, sizeof(array) - 1, pool, sizeof(pool) / sizeof(*pool));
+    iter = mpack_node_array_iter(mpack_tree_root(&tree));
+    TEST_TRUE(mpack_node_iter_next(&iter, &node));
+    TEST_TRUE(1 == mpack_node_i32(node));
+    TEST_TRUE(mpack_node_iter_next(&iter, &node));
+    TEST_TRUE(2 == mpack_node_strlen(node));
+    TEST_TRUE(mpack_node_iter_next(&iter, &node));
+    mpack_node_iter_t inner = mpack_node_array_iter(node);
+    TEST_TRUE(mpack_node_iter_next(&inner, &node));
+    TEST_TRUE(2 == mpack_node_i32(node));
+    TEST_TRUE(mpack_node_iter_next(&inner, &node));
+    TEST_TRUE(3 == mpack_node_i32(node));
+    TEST_TRUE(!mpack_node_iter_next(&inner, &node));
+    TEST_TRUE(mpack_node_iter_next(&iter, &node));
+    inner = mpack_node_map_iter(node);
+    TEST_TRUE(!mpack_node_iter_next_pair(&inner, &key, &value));
+    TEST_TRUE(mpack_node_iter_next(&iter, &node));
+    inner = mpack_node_array_iter(node);
+    TEST_TRUE(!mpack_node_iter_next(&inner, &node));
+    TEST_TRUE(!mpack_node_iter_next(&iter, &node));
+    TEST_TRUE(!mpack_node_iter_next(&iter, &node));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+
+    // map pairs are returned in order
+    mpack_tree_init_pool(&tree, map, sizeof(map) - 1, pool, sizeof(pool) / sizeof(*pool));
+    iter = mpack_node_map_iter(mpack_tree_root(&tree));
+    TEST_TRUE(mpack_node_iter_next_pair(&iter, &key, &value));
+    TEST_TRUE(1 == mpack_node_strlen(key) && *mpack_node_data(key) == 'a');
+    TEST_TRUE(1 == mpack_node_i32(value));
+    TEST_TRUE(mpack_node_iter_next_pair(&iter, &key, &value));
+    TEST_TRUE(1 == mpack_node_strlen(key) && *mpack_node_data(key) == 'b');
+    TEST_TRUE(1 == mpack_node_array_length(value));
+    TEST_TRUE(mpack_node_iter_next_pair(&iter, &key, &value));
+    TEST_TRUE(1 == mpack_node_strlen(key) && *mpack_node_data(key) == 'c');
+    TEST_TRUE(3 == mpack_node_i32(mpack_node_map_cstr(value, "d")));
+    TEST_TRUE(!mpack_node_iter_next_pair(&iter, &key, &value));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+
+    // the wrong type flags an error and returns an empty iterator
+    mpack_tree_init_pool(&tree, map, sizeof(map) - 1, pool, sizeof(pool) / sizeof(*pool));
+    iter = mpack_node_array_iter(mpack_tree_root(&tree));
+    TEST_TRUE(!mpack_node_iter_next(&iter, &node));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_type);
+    mpack_tree_init_pool(&tree, array, sizeof(array) - 1, pool, sizeof(pool) / sizeof(*pool));
+    iter = mpack_node_map_iter(mpack_tree_root(&tree));
+    TEST_TRUE(!mpack_node_iter_next_pair(&iter, &key, &value));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_type);
+
+    // a tree in an error state returns an empty iterator
+    mpack_tree_init_pool(&tree, array, sizeof(array) - 1, pool, sizeof(pool) / sizeof(*pool));
+    mpack_tree_flag_error(&tree, mpack_error_data);
+    iter = mpack_node_array_iter(mpack_tree_root(&tree));
+    TEST_TRUE(!mpack_node_iter_next(&iter, &node));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_data);
+
+    #ifdef MPACK_MALLOC
+    // unexpanded children of a lazy tree are expanded by the iterator
+    mpack_tree_init_lazy(&tree, map, sizeof(map) - 1);
+    iter = mpack_node_map_iter(mpack_tree_root(&tree));
+    TEST_TRUE(mpack_node_iter_next_pair(&iter, &key, &value));
+    TEST_TRUE(mpack_node_iter_next_pair(&iter, &key, &value));
+    TEST_TRUE(0 != (value.data->flags & MPACK_NODE_FLAG_UNEXPANDED));
+    inner = mpack_node_array_iter(value);
+    TEST_TRUE(0 == (value.data->flags & MPACK_NODE_FLAG_UNEXPANDED));
+    TEST_TRUE(mpack_node_iter_next(&inner, &node));
+    TEST_TRUE(2 == mpack_node_i32(node));
+    TEST_TRUE(!mpack_node_iter_next(&inner, &node));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+    #endif
+}
+
+static void test_node_read_array_copy() {
+    // [1, 200, 70000, 5000000000]
+    static const char uints[] = "\x94\x01\xcc\xc8\xce\x00\x01\x11\x70\xcf\x00\x00\x00\x01\x2a\x05\xf2\x00";
+    // [-1, 2, -200, 0xffffffffffffffff]
+    static const char ints[] = "\x94\xff\xd0\x02\xd1\xff\x38\xcf\xff\xff\xff\xff\xff\xff\xff\xff";
+    // [1.5, 2.5, -0.25]
+    static const char doubles[] = "\x93\xcb\x3f\xf8\x00\x00\x00\x00\x00\x00"
+        "\xcb\x40\x04\x00\x00\x00\x00\x00\x00\xcb\xbf\xd0\x00\x00\x00\x00\x00\x00";
+    // [1.5, 2, -3, 0.5f, "x"]
+    static const char mixed[] = "\x95\xcb\x3f\xf8\x00\x00\x00\x00\x00\x00"
+        "\x02\xfd\xca\x3f\x00\x00\x00\xa1x";
+    mpack_node_data_t pool[16];
+    mpack_tree_t tree;
+    uint8_t u8s[8];
+    uint32_t u32s[8];
+    uint64_t u64s[8];
+    int8_t i8s[8];
+    int16_t i16s[8];
+    int64_t i64s[8];
+    float floats[8];
+    double reals[8];
+
+    // unsigned elements are converted up to the first that doesn't fit
+    mpack_tree_init_pool(&tree, uints, sizeof(uints) - 1, pool, sizeof(pool) / sizeof(*pool));
+    TEST_TRUE(4 == mpack_node_array_copy_u64(mpack_tree_root(&tree), u64s, 8));
+    TEST_TRUE(u64s[0] == 1 && u64s[1] == 200 && u64s[2] == 70000 && u64s[3] == UINT64_C(5000000000));
+    TEST_TRUE(4 == mpack_node_array_copy_i64(mpack_tree_root(&tree), i64s, 4));
+    TEST_TRUE(i64s[3] == INT64_C(5000000000));
+    TEST_TRUE(4 == mpack_node_array_copy_double(mpack_tree_root(&tree), reals, 4));
+    TEST_TRUE(reals[2] == 70000.0);
+    TEST_TREE_DESTROY_NOERROR(&tree);
+    mpack_tree_init_pool(&tree, uints, sizeof(uints) - 1, pool, sizeof(pool) / sizeof(*pool));
+    TEST_TRUE(3 == mpack_node_array_copy_u32(mpack_tree_root(&tree), u32s, 8));
+    TEST_TRUE(u32s[0] == 1 && u32s[1] == 200 && u32s[2] == 70000);
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_type);
+    mpack_tree_init_pool(&tree, uints, sizeof(uints) - 1, pool, sizeof(pool) / sizeof(*pool));
+    TEST_TRUE(1 == mpack_node_array_copy_i8(mpack_tree_root(&tree), i8s, 8));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_type);
+
+    // signed elements
+    mpack_tree_init_pool(&tree, ints, sizeof(ints) - 1, pool, sizeof(pool) / sizeof(*pool));
+    TEST_TRUE(3 == mpack_node_array_copy_i16(mpack_tree_root(&tree), i16s, 8));
+    TEST_TRUE(i16s[0] == -1 && i16s[1] == 2 && i16s[2] == -200);
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_type);
+    mpack_tree_init_pool(&tree, ints, sizeof(ints) - 1, pool, sizeof(pool) / sizeof(*pool));
+    TEST_TRUE(3 == mpack_node_array_copy_i64(mpack_tree_root(&tree), i64s, 8));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_type);
+    mpack_tree_init_pool(&tree, ints, sizeof(ints) - 1, pool, sizeof(pool) / sizeof(*pool));
+    TEST_TRUE(0 == mpack_node_array_copy_u8(mpack_tree_root(&tree), u8s, 8));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_type);
+
+    // reals, uniform and mixed
+    mpack_tree_init_pool(&tree, doubles, sizeof(doubles) - 1, pool, sizeof(pool) / sizeof(*pool));
+    TEST_TRUE(3 == mpack_node_array_copy_double(mpack_tree_root(&tree), reals, 8));
+    TEST_TRUE(reals[0] == 1.5 && reals[1] == 2.5 && reals[2] == -0.25);
+    TEST_TRUE(3 == mpack_node_array_copy_float(mpack_tree_root(&tree), floats, 8));
+    TEST_TRUE(floats[0] == 1.5f && floats[1] == 2.5f && floats[2] == -0.25f);
+    TEST_TRUE(0 == mpack_node_array_copy_i64(mpack_tree_root(&tree), i64s, 8));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_type);
+    mpack_tree_init_pool(&tree, mixed, sizeof(mixed) - 1, pool, sizeof(pool) / sizeof(*pool));
+    TEST_TRUE(4 == mpack_node_array_copy_double(mpack_tree_root(&tree), reals, 8));
+    TEST_TRUE(reals[0] == 1.5 && reals[1] == 2.0 && reals[2] == -3.0 && reals[3] == 0.5);
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_type);
+
+    // the array must fit, and must be an array
+    mpack_tree_init_pool(&tree, uints, sizeof(uints) - 1, pool, sizeof(pool) / sizeof(*pool));
+    TEST_TRUE(0 == mpack_node_array_copy_u64(mpack_tree_root(&tree), u64s, 3));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_too_big);
+    mpack_tree_init_pool(&tree, "\x90", 1, pool, sizeof(pool) / sizeof(*pool));
+    TEST_TRUE(0 == mpack_node_array_copy_u8(mpack_tree_root(&tree), u8s, 0));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+    mpack_tree_init_pool(&tree, "\x80", 1, pool, sizeof(pool) / sizeof(*pool));
+    TEST_TRUE(0 == mpack_node_array_copy_double(mpack_tree_root(&tree), reals, 8));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_type);
+
+    #ifdef MPACK_MALLOC
+    // unexpanded arrays of a lazy tree are expanded
+    mpack_tree_init_lazy(&tree, "\x91\x93\x01\x02\x03", 5);
+    TEST_TRUE(3 == mpack_node_array_copy_u8(mpack_node_array_at(mpack_tree_root(&tree), 0), u8s, 8));
+    TEST_TRUE(u8s[0] == 1 && u8s[1] == 2 && u8s[2] == 3);
+    TEST_TREE_DESTROY_NOERROR(&tree);
+    #endif
+}
+
 static void test_node_read_map() {
     // test map using maps as keys and values
     static const char test[] = "\x82\x80\x81\x01\x02\x81\x03\x04\xc3";
@@ -625,6 +800,1642 @@ static void test_node_read_map_search() {
     TEST_TREE_DESTROY_NOERROR(&tree);
 }
 
+static size_t test_node_map_index_data(char* buf) {
+    char* p = buf;
+
+    // a map of 100 string keys, 100 int keys and a few extras
+    *p++ = (char)0xde;
+    *p++ = 0;
+    *p++ = (char)203;
+
+    for (int i = 0; i < 100; ++i) {
+        *p++ = (char)(0xa0 | 3);
+        *p++ = 'k';
+        *p++ = (char)('0' + i / 10);
+        *p++ = (char)('0' + i % 10);
+        *p++ = (char)i; // value positive fixnum
+    }
+    for (int i = 0; i < 100; ++i) {
+        *p++ = (char)0xd0;
+        *p++ = (char)(i - 50); // key int8
+        *p++ = (char)0xcc;
+        *p++ = (char)(100 + i); // value uint8
+    }
+
+    // duplicate key
+    *p++ = (char)(0xa0 | 3);
+    *p++ = 'k'; *p++ = '0'; *p++ = '7';
+    *p++ = (char)0xcc;
+    *p++ = (char)0xff;
+
+    // non-indexable keys
+    *p++ = (char)0xc0;
+    *p++ = 1;
+    *p++ = (char)0x90;
+    *p++ = 2;
+
+    return (size_t)(p - buf);
+}
+
+static void test_node_map_index_lookups(mpack_tree_t* tree) {
+    mpack_node_t root = mpack_tree_root(tree);
+    TEST_TRUE(203 == mpack_node_map_count(root));
+
+    char key[3] = {'k', '0', '0'};
+    for (int i = 0; i < 100; ++i) {
+        key[1] = (char)('0' + i / 10);
+        key[2] = (char)('0' + i % 10);
+        TEST_TRUE(i == mpack_node_i32(mpack_node_map_str(root, key, 3)));
+        TEST_TRUE(100 + i == mpack_node_i32(mpack_node_map_int(root, i - 50)));
+        if (i >= 50)
+            TEST_TRUE(100 + i == mpack_node_i32(mpack_node_map_uint(root, (uint64_t)(i - 50))));
+    }
+
+    // the first of duplicate keys is found
+    TEST_TRUE(7 == mpack_node_i32(mpack_node_map_cstr(root, "k07")));
+
+    // missing keys
+    TEST_TRUE(false == mpack_node_map_contains_cstr(root, "k100"));
+    TEST_TRUE(false == mpack_node_map_contains_cstr(root, "k0"));
+    TEST_TRUE(false == mpack_node_map_contains_cstr(root, ""));
+    TEST_TRUE(mpack_type_nil == mpack_node_type(mpack_node_map_int_optional(root, 50)));
+    TEST_TRUE(mpack_type_nil == mpack_node_type(mpack_node_map_uint_optional(root, UINT64_MAX)));
+    TEST_TRUE(mpack_ok == mpack_tree_error(tree));
+    TEST_TRUE(mpack_type_nil == mpack_node_type(mpack_node_map_int(root, -51)));
+    TEST_TREE_DESTROY_ERROR(tree, mpack_error_data);
+}
+
+static void test_node_read_map_index() {
+    char buf[1024];
+    size_t size = test_node_map_index_data(buf);
+
+    mpack_tree_t tree;
+    TEST_TREE_INIT(&tree, buf, size);
+    #if defined(MPACK_MALLOC) && MPACK_NODE_MAP_INDEX_THRESHOLD
+    TEST_TRUE(0 != (tree.root->flags & MPACK_NODE_FLAG_INDEXED));
+    #endif
+    test_node_map_index_lookups(&tree);
+
+    // a pool with no room for the index is searched linearly
+    mpack_node_data_t pool[1 + 203 * 2];
+    mpack_tree_init_pool(&tree, buf, size, pool, sizeof(pool) / sizeof(*pool));
+    TEST_TRUE(0 == (pool[0].flags & MPACK_NODE_FLAG_INDEXED));
+    test_node_map_index_lookups(&tree);
+
+    // a pool that fits the nodes but not the indexes is never filled with
+    // an index that the nodes after the map need:
+    // [{"k15": 15, "k14": 14, ..., "k00": 0}, [0, 1, ..., 7]]
+    char* p = buf;
+    *p++ = (char)0x92;
+    *p++ = (char)0xde;
+    *p++ = 0;
+    *p++ = 16;
+    for (int i = 15; i >= 0; --i) {
+        *p++ = (char)(0xa0 | 3);
+        *p++ = 'k';
+        *p++ = (char)('0' + i / 10);
+        *p++ = (char)('0' + i % 10);
+        *p++ = (char)i;
+    }
+    *p++ = (char)0x98;
+    for (int i = 0; i < 8; ++i)
+        *p++ = (char)i;
+    size = (size_t)(p - buf);
+    mpack_tree_init_pool(&tree, buf, size, pool, 1 + 2 + 16 * 2 + 8);
+    TEST_TRUE(0 == (pool[1].flags & MPACK_NODE_FLAG_INDEXED));
+    TEST_TRUE(3 == mpack_node_i32(mpack_node_map_cstr(mpack_node_array_at(mpack_tree_root(&tree), 0), "k03")));
+    TEST_TRUE(7 == mpack_node_i32(mpack_node_array_at(mpack_node_array_at(mpack_tree_root(&tree), 1), 7)));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+    mpack_tree_init_pool(&tree, buf, size, pool, mpack_tree_count_nodes(buf, size) - 1);
+    TEST_TRUE(0 == (pool[1].flags & MPACK_NODE_FLAG_INDEXED));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+}
+
+static void test_node_read_count() {
+    TEST_TRUE(1 == mpack_tree_count_nodes("\x07", 1));
+    TEST_TRUE(6 == mpack_tree_count_nodes("\x82\x01\x02\x03\x91\x04", 6));
+    TEST_TRUE(0 == mpack_tree_count_nodes("", 0));
+    TEST_TRUE(0 == mpack_tree_count_nodes("\x92\x01", 2));
+    TEST_TRUE(0 == mpack_tree_count_nodes("\xc1", 1));
+
+    // data after the message is not counted
+    TEST_TRUE(3 == mpack_tree_count_nodes("\x92\x01\x02\x03", 4));
+
+    // a pool of exactly the counted size fits the message and its index
+    char buf[1024];
+    size_t size = test_node_map_index_data(buf);
+    size_t count = mpack_tree_count_nodes(buf, size);
+    #if MPACK_NODE_MAP_INDEX_THRESHOLD
+    TEST_TRUE(count > 1 + 203 * 2);
+    #else
+    TEST_TRUE(count == 1 + 203 * 2);
+    #endif
+    mpack_node_data_t pool[1024];
+    mpack_tree_t tree;
+    mpack_tree_init_pool(&tree, buf, size, pool, count);
+    TEST_TRUE(tree.page.left == 0);
+    #if MPACK_NODE_MAP_INDEX_THRESHOLD
+    TEST_TRUE(0 != (pool[0].flags & MPACK_NODE_FLAG_INDEXED));
+    #endif
+    test_node_map_index_lookups(&tree);
+}
+
+static void test_node_read_map_sorted() {
+    // the pools have no room for an index so sorted maps use binary search
+    mpack_node_data_t pool[1 + 5 * 2];
+    mpack_tree_t tree;
+
+    static const char strs[] = "\x85\xa0\x00\xa1""a\x01\xa2""ab\x02\xa1""b\x03\xa2""ba\x04";
+    mpack_tree_init_pool(&tree, strs, sizeof(strs) - 1, pool, sizeof(pool) / sizeof(*pool));
+    mpack_node_t root = mpack_tree_root(&tree);
+    #if MPACK_NODE_MAP_SORTED_THRESHOLD && MPACK_NODE_MAP_SORTED_THRESHOLD <= 5
+    TEST_TRUE(MPACK_NODE_FLAG_SORTED_STR == pool[0].flags);
+    #endif
+    TEST_TRUE(0 == mpack_node_i32(mpack_node_map_cstr(root, "")));
+    TEST_TRUE(1 == mpack_node_i32(mpack_node_map_cstr(root, "a")));
+    TEST_TRUE(2 == mpack_node_i32(mpack_node_map_cstr(root, "ab")));
+    TEST_TRUE(3 == mpack_node_i32(mpack_node_map_cstr(root, "b")));
+    TEST_TRUE(4 == mpack_node_i32(mpack_node_map_cstr(root, "ba")));
+    TEST_TRUE(false == mpack_node_map_contains_cstr(root, "aa"));
+    TEST_TRUE(false == mpack_node_map_contains_cstr(root, "bb"));
+    TEST_TRUE(false == mpack_node_map_contains_cstr(root, "abc"));
+    TEST_TRUE(mpack_type_nil == mpack_node_type(mpack_node_map_int_optional(root, 0)));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+
+    static const char ints[] = "\x85\xd0\x80\x00\xff\x01\x00\x02\x7f\x03\xcf\xff\xff\xff\xff\xff\xff\xff\xff\x04";
+    mpack_tree_init_pool(&tree, ints, sizeof(ints) - 1, pool, sizeof(pool) / sizeof(*pool));
+    root = mpack_tree_root(&tree);
+    #if MPACK_NODE_MAP_SORTED_THRESHOLD && MPACK_NODE_MAP_SORTED_THRESHOLD <= 5
+    TEST_TRUE(MPACK_NODE_FLAG_SORTED_INT == pool[0].flags);
+    #endif
+    TEST_TRUE(0 == mpack_node_i32(mpack_node_map_int(root, -128)));
+    TEST_TRUE(1 == mpack_node_i32(mpack_node_map_int(root, -1)));
+    TEST_TRUE(2 == mpack_node_i32(mpack_node_map_uint(root, 0)));
+    TEST_TRUE(3 == mpack_node_i32(mpack_node_map_uint(root, 127)));
+    TEST_TRUE(3 == mpack_node_i32(mpack_node_map_int(root, 127)));
+    TEST_TRUE(4 == mpack_node_i32(mpack_node_map_uint(root, UINT64_MAX)));
+    TEST_TRUE(mpack_type_nil == mpack_node_type(mpack_node_map_int_optional(root, INT64_MIN)));
+    TEST_TRUE(mpack_type_nil == mpack_node_type(mpack_node_map_int_optional(root, 1)));
+    TEST_TRUE(mpack_type_nil == mpack_node_type(mpack_node_map_int_optional(root, INT64_MAX)));
+    TEST_TRUE(mpack_type_nil == mpack_node_type(mpack_node_map_uint_optional(root, 128)));
+    TEST_TRUE(false == mpack_node_map_contains_cstr(root, "a"));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+
+    // duplicate keys are not sorted, and the first is found
+    static const char dups[] = "\x83\xa1""a\x00\xa1""b\x01\xa1""b\x02";
+    mpack_tree_init_pool(&tree, dups, sizeof(dups) - 1, pool, sizeof(pool) / sizeof(*pool));
+    TEST_TRUE(0 == (pool[0].flags & (MPACK_NODE_FLAG_SORTED_STR | MPACK_NODE_FLAG_SORTED_INT)));
+    TEST_TRUE(1 == mpack_node_i32(mpack_node_map_cstr(mpack_tree_root(&tree), "b")));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+
+    // mixed key types are not sorted
+    static const char mixed[] = "\x82\xa1""a\x00\x01\x01";
+    mpack_tree_init_pool(&tree, mixed, sizeof(mixed) - 1, pool, sizeof(pool) / sizeof(*pool));
+    TEST_TRUE(0 == (pool[0].flags & (MPACK_NODE_FLAG_SORTED_STR | MPACK_NODE_FLAG_SORTED_INT)));
+    TEST_TRUE(0 == mpack_node_i32(mpack_node_map_cstr(mpack_tree_root(&tree), "a")));
+    TEST_TRUE(1 == mpack_node_i32(mpack_node_map_int(mpack_tree_root(&tree), 1)));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+}
+
+static void test_node_read_map_dense() {
+    mpack_node_data_t pool[64];
+    mpack_tree_t tree;
+
+    // {3: 30, 0: 0, 5: 50, 1: 10, 2: 20, 3: 99}
+    static const char dense[] = "\x86\x03\x1e\x00\x00\x05\x32\x01\x0a\xd0\x02\x14\x03\x63";
+    mpack_tree_init_pool(&tree, dense, sizeof(dense) - 1, pool, sizeof(pool) / sizeof(*pool));
+    mpack_node_t root = mpack_tree_root(&tree);
+    #if MPACK_NODE_MAP_INDEX_THRESHOLD && MPACK_NODE_MAP_INDEX_THRESHOLD <= 6
+    TEST_TRUE(0 != (pool[0].flags & MPACK_NODE_FLAG_DENSE_INT));
+    TEST_TRUE(0 == (pool[0].flags & MPACK_NODE_FLAG_INDEXED));
+    #endif
+    TEST_TRUE(0 == mpack_node_i32(mpack_node_map_uint(root, 0)));
+    TEST_TRUE(10 == mpack_node_i32(mpack_node_map_int(root, 1)));
+    TEST_TRUE(20 == mpack_node_i32(mpack_node_map_int(root, 2)));
+    TEST_TRUE(20 == mpack_node_i32(mpack_node_map_uint(root, 2)));
+    TEST_TRUE(30 == mpack_node_i32(mpack_node_map_int(root, 3)));
+    TEST_TRUE(50 == mpack_node_i32(mpack_node_map_uint(root, 5)));
+    TEST_TRUE(mpack_type_nil == mpack_node_type(mpack_node_map_int_optional(root, 4)));
+    TEST_TRUE(mpack_type_nil == mpack_node_type(mpack_node_map_int_optional(root, 11)));
+    TEST_TRUE(mpack_type_nil == mpack_node_type(mpack_node_map_int_optional(root, 12)));
+    TEST_TRUE(mpack_type_nil == mpack_node_type(mpack_node_map_int_optional(root, -1)));
+    TEST_TRUE(mpack_type_nil == mpack_node_type(mpack_node_map_int_optional(root, INT64_MAX)));
+    TEST_TRUE(mpack_type_nil == mpack_node_type(mpack_node_map_uint_optional(root, UINT64_MAX)));
+    TEST_TRUE(false == mpack_node_map_contains_cstr(root, "a"));
+    mpack_node_map_cursor_t cursor = mpack_node_map_cursor(root);
+    TEST_TRUE(mpack_type_nil == mpack_node_type(mpack_node_map_cursor_cstr_optional(&cursor, "a")));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+
+    // keys of twice the count or more, or negative keys, are hashed
+    static const char large[] = "\x86\x00\x00\x0c\x01\x01\x02\x02\x03\x03\x04\x04\x05";
+    mpack_tree_init_pool(&tree, large, sizeof(large) - 1, pool, sizeof(pool) / sizeof(*pool));
+    root = mpack_tree_root(&tree);
+    TEST_TRUE(0 == (pool[0].flags & MPACK_NODE_FLAG_DENSE_INT));
+    TEST_TRUE(1 == mpack_node_i32(mpack_node_map_uint(root, 12)));
+    TEST_TRUE(5 == mpack_node_i32(mpack_node_map_int(root, 4)));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+    static const char negative[] = "\x83\xff\x00\x00\x01\x01\x02";
+    mpack_tree_init_pool(&tree, negative, sizeof(negative) - 1, pool, sizeof(pool) / sizeof(*pool));
+    root = mpack_tree_root(&tree);
+    TEST_TRUE(0 == (pool[0].flags & MPACK_NODE_FLAG_DENSE_INT));
+    TEST_TRUE(0 == mpack_node_i32(mpack_node_map_int(root, -1)));
+    TEST_TRUE(2 == mpack_node_i32(mpack_node_map_uint(root, 1)));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+}
+
+// Arrays starting with runs of each encoding of numbers, each ending
+// with an element that breaks the run (if any)
+#if MPACK_NODE_RAW
+// Checks that the encoded bytes of a node and all of its descendants
+// hold exactly their encodings
+static void test_node_raw_check(mpack_node_t node) {
+    const char* data;
+    size_t length;
+    mpack_node_raw(node, &data, &length);
+    TEST_TRUE(data != NULL && length != 0);
+    if (data == NULL)
+        return;
+
+    mpack_type_t type = mpack_node_type(node);
+    if (type != mpack_type_array && type != mpack_type_map) {
+        mpack_node_data_t pool[1];
+        mpack_tree_t tree;
+        mpack_tree_init_pool(&tree, data, length, pool, 1);
+        TEST_TRUE(mpack_tree_size(&tree) == length);
+        TEST_TRUE(mpack_tag_equal(mpack_node_tag(node), mpack_node_tag(mpack_tree_root(&tree))));
+        TEST_TREE_DESTROY_NOERROR(&tree);
+        return;
+    }
+
+    // The children follow the header one after the other up to the end
+    size_t count = (type == mpack_type_map) ? mpack_node_map_count(node) * 2 : mpack_node_array_length(node);
+    const char* end = data + length;
+    for (size_t i = count; i > 0; --i) {
+        mpack_node_t child = (type == mpack_type_map) ?
+            ((i % 2) ? mpack_node_map_key_at(node, (i - 1) / 2) : mpack_node_map_value_at(node, (i - 1) / 2)) :
+            mpack_node_array_at(node, i - 1);
+        const char* child_data;
+        size_t child_length;
+        mpack_node_raw(child, &child_data, &child_length);
+        TEST_TRUE(child_data + child_length == end);
+        test_node_raw_check(child);
+        end = child_data;
+    }
+    TEST_TRUE(end > data && end - data <= 5);
+}
+#endif
+
+static const char test_node_number_runs[] =
+    "\x9b"
+    "\x95\x01\xff\x7f\xe0\xc3"
+    "\x93\xcc\xc8\xcc\xc9\xcd\x01\x2c"
+    "\x92\xcd\x01\x2c\xcd\xff\xff"
+    "\x92\xce\x00\x01\x11\x70\x01"
+    "\x91\xcf\x00\x00\x00\x01\x00\x00\x00\x00"
+    "\x92\xd0\x9c\xd0\x80"
+    "\x92\xd1\xfe\xd4\xc0"
+    "\x92\xd2\xff\xfe\xee\x90\xd2\x00\x00\x00\x01"
+    "\x92\xd3\xff\xff\xff\xfe\xff\xff\xff\xff\xa1x"
+    "\x92\xca\x3f\xc0\x00\x00\xca\x40\x20\x00\x00"
+    "\x92\xcb\x40\x04\x00\x00\x00\x00\x00\x00\xcb\xc0\x0c\x00\x00\x00\x00\x00\x00";
+
+static void test_node_number_runs_check(mpack_tree_t* tree) {
+    mpack_node_t root = mpack_tree_root(tree);
+    mpack_node_t a;
+
+    #if MPACK_NODE_RAW
+    test_node_raw_check(root);
+    #endif
+
+    a = mpack_node_array_at(root, 0);
+    TEST_TRUE(mpack_type_uint == mpack_node_type(mpack_node_array_at(a, 0)));
+    TEST_TRUE(1 == mpack_node_u8(mpack_node_array_at(a, 0)));
+    TEST_TRUE(mpack_type_int == mpack_node_type(mpack_node_array_at(a, 1)));
+    TEST_TRUE(-1 == mpack_node_i8(mpack_node_array_at(a, 1)));
+    TEST_TRUE(127 == mpack_node_u8(mpack_node_array_at(a, 2)));
+    TEST_TRUE(-32 == mpack_node_i8(mpack_node_array_at(a, 3)));
+    TEST_TRUE(true == mpack_node_bool(mpack_node_array_at(a, 4)));
+
+    a = mpack_node_array_at(root, 1);
+    TEST_TRUE(200 == mpack_node_u8(mpack_node_array_at(a, 0)));
+    TEST_TRUE(201 == mpack_node_u8(mpack_node_array_at(a, 1)));
+    TEST_TRUE(300 == mpack_node_u16(mpack_node_array_at(a, 2)));
+
+    a = mpack_node_array_at(root, 2);
+    TEST_TRUE(300 == mpack_node_u16(mpack_node_array_at(a, 0)));
+    TEST_TRUE(UINT16_MAX == mpack_node_u16(mpack_node_array_at(a, 1)));
+
+    a = mpack_node_array_at(root, 3);
+    TEST_TRUE(70000 == mpack_node_u32(mpack_node_array_at(a, 0)));
+    TEST_TRUE(1 == mpack_node_u32(mpack_node_array_at(a, 1)));
+    TEST_TRUE(UINT64_C(4294967296) == mpack_node_u64(mpack_node_array_at(mpack_node_array_at(root, 4), 0)));
+
+    a = mpack_node_array_at(root, 5);
+    TEST_TRUE(mpack_type_int == mpack_node_type(mpack_node_array_at(a, 0)));
+    TEST_TRUE(-100 == mpack_node_i8(mpack_node_array_at(a, 0)));
+    TEST_TRUE(INT8_MIN == mpack_node_i8(mpack_node_array_at(a, 1)));
+
+    a = mpack_node_array_at(root, 6);
+    TEST_TRUE(-300 == mpack_node_i16(mpack_node_array_at(a, 0)));
+    TEST_TRUE(mpack_type_nil == mpack_node_type(mpack_node_array_at(a, 1)));
+
+    a = mpack_node_array_at(root, 7);
+    TEST_TRUE(-70000 == mpack_node_i32(mpack_node_array_at(a, 0)));
+    TEST_TRUE(1 == mpack_node_i32(mpack_node_array_at(a, 1)));
+
+    a = mpack_node_array_at(root, 8);
+    TEST_TRUE(INT64_C(-4294967297) == mpack_node_i64(mpack_node_array_at(a, 0)));
+    TEST_TRUE(mpack_type_str == mpack_node_type(mpack_node_array_at(a, 1)));
+
+    a = mpack_node_array_at(root, 9);
+    TEST_TRUE(mpack_type_float == mpack_node_type(mpack_node_array_at(a, 0)));
+    TEST_TRUE(1.5f == mpack_node_float_strict(mpack_node_array_at(a, 0)));
+    TEST_TRUE(2.5f == mpack_node_float_strict(mpack_node_array_at(a, 1)));
+
+    a = mpack_node_array_at(root, 10);
+    TEST_TRUE(mpack_type_double == mpack_node_type(mpack_node_array_at(a, 0)));
+    TEST_TRUE(2.5 == mpack_node_double_strict(mpack_node_array_at(a, 0)));
+    TEST_TRUE(-3.5 == mpack_node_double_strict(mpack_node_array_at(a, 1)));
+
+    TEST_TREE_DESTROY_NOERROR(tree);
+}
+
+static void test_node_read_number_runs() {
+    mpack_node_data_t pool[128];
+    mpack_tree_t tree;
+    mpack_tree_init_pool(&tree, test_node_number_runs, sizeof(test_node_number_runs) - 1, pool, sizeof(pool) / sizeof(*pool));
+    TEST_TRUE(tree.node_count == 37);
+    test_node_number_runs_check(&tree);
+
+    // runs can't read past the end of the data
+    TEST_SIMPLE_TREE_READ_ERROR("\x93\xcd\x01\x2c\xcd\x01", mpack_type_nil == mpack_node_type(node), mpack_error_invalid);
+    TEST_SIMPLE_TREE_READ_ERROR("\x92\xcb\x40\x04\x00\x00\x00\x00\x00\x00\xcb\x40", mpack_type_nil == mpack_node_type(node), mpack_error_invalid);
+    TEST_SIMPLE_TREE_READ_ERROR("\x92\x92\x01\x02\x91\xcf\x00", mpack_type_nil == mpack_node_type(node), mpack_error_invalid);
+    TEST_SIMPLE_TREE_READ_ERROR("\x94\x01\x02\x03", mpack_type_nil == mpack_node_type(node), mpack_error_invalid);
+}
+
+static bool test_node_path_is_str(mpack_node_t node, const char* cstr) {
+    size_t length = strlen(cstr);
+    return mpack_node_type(node) == mpack_type_str && mpack_node_strlen(node) == length &&
+        memcmp(mpack_node_data(node), cstr, length) == 0;
+}
+
+static void test_node_read_path() {
+    // {"users": [{"name": "a", "tags": ["x", "y"]}, {"name": "b", "tags": []}, {"id": 3}],
+    //  "count": 3, 7: "seven"}
+    static const char test[] =
+        "\x83\xa5users\x93"
+            "\x82\xa4name\xa1""a\xa4tags\x92\xa1x\xa1y"
+            "\x82\xa4name\xa1""b\xa4tags\x90"
+            "\x81\xa2id\x03"
+        "\xa5""count\x03\x07\xa5seven";
+    mpack_node_data_t pool[128];
+    mpack_path_t path;
+    mpack_node_t results[4];
+
+    // malformed paths
+    TEST_TRUE(mpack_error_invalid == mpack_path_compile(&path, "a..b"));
+    TEST_TRUE(mpack_error_invalid == mpack_path_compile(&path, "a."));
+    TEST_TRUE(mpack_error_invalid == mpack_path_compile(&path, "."));
+    TEST_TRUE(mpack_error_invalid == mpack_path_compile(&path, "a["));
+    TEST_TRUE(mpack_error_invalid == mpack_path_compile(&path, "a[]"));
+    TEST_TRUE(mpack_error_invalid == mpack_path_compile(&path, "a[x]"));
+    TEST_TRUE(mpack_error_invalid == mpack_path_compile(&path, "a[1"));
+    TEST_TRUE(mpack_error_invalid == mpack_path_compile(&path, "a[*x]"));
+    TEST_TRUE(mpack_error_invalid == mpack_path_compile(&path, "[1]b"));
+    TEST_TRUE(mpack_error_invalid == mpack_path_compile(&path, "a[99999999999999999999999]"));
+    TEST_TRUE(mpack_ok == mpack_path_compile(&path, "a.b.c.d.e.f.g.h.i.j.k.l.m.n.o.p"));
+    TEST_TRUE(mpack_error_too_big == mpack_path_compile(&path, "a.b.c.d.e.f.g.h.i.j.k.l.m.n.o.p.q"));
+
+    // single nodes
+    TEST_TRUE(mpack_ok == mpack_path_compile(&path, "users[1].name"));
+    TEST_SIMPLE_TREE_READ(test, test_node_path_is_str(mpack_node_path(node, &path), "b"));
+    TEST_TRUE(mpack_ok == mpack_path_compile(&path, ".users[0].tags[1]"));
+    TEST_SIMPLE_TREE_READ(test, test_node_path_is_str(mpack_node_path(node, &path), "y"));
+    TEST_TRUE(mpack_ok == mpack_path_compile(&path, "[7]"));
+    TEST_SIMPLE_TREE_READ(test, test_node_path_is_str(mpack_node_path(node, &path), "seven"));
+    TEST_TRUE(mpack_ok == mpack_path_compile(&path, "count"));
+    TEST_SIMPLE_TREE_READ(test, 3 == mpack_node_i32(mpack_node_path(node, &path)));
+    TEST_TRUE(mpack_ok == mpack_path_compile(&path, ""));
+    TEST_SIMPLE_TREE_READ(test, node.data == mpack_node_path(node, &path).data);
+
+    // missing nodes and type errors
+    TEST_TRUE(mpack_ok == mpack_path_compile(&path, "users[3]"));
+    TEST_SIMPLE_TREE_READ_ERROR(test, mpack_type_nil == mpack_node_type(mpack_node_path(node, &path)), mpack_error_data);
+    TEST_SIMPLE_TREE_READ(test, mpack_type_nil == mpack_node_type(mpack_node_path_optional(node, &path)));
+    TEST_TRUE(mpack_ok == mpack_path_compile(&path, "users[2].name"));
+    TEST_SIMPLE_TREE_READ_ERROR(test, mpack_type_nil == mpack_node_type(mpack_node_path(node, &path)), mpack_error_data);
+    TEST_SIMPLE_TREE_READ(test, mpack_type_nil == mpack_node_type(mpack_node_path_optional(node, &path)));
+    TEST_TRUE(mpack_ok == mpack_path_compile(&path, "count.x"));
+    TEST_SIMPLE_TREE_READ_ERROR(test, mpack_type_nil == mpack_node_type(mpack_node_path_optional(node, &path)), mpack_error_type);
+    TEST_TRUE(mpack_ok == mpack_path_compile(&path, "users.name"));
+    TEST_SIMPLE_TREE_READ_ERROR(test, mpack_type_nil == mpack_node_type(mpack_node_path(node, &path)), mpack_error_type);
+    TEST_TRUE(mpack_ok == mpack_path_compile(&path, "users[*].name"));
+    mpack_tree_t tree;
+    mpack_tree_init_pool(&tree, test, sizeof(test) - 1, pool, sizeof(pool) / sizeof(*pool));
+    TEST_BREAK(mpack_type_nil == mpack_node_type(mpack_node_path(mpack_tree_root(&tree), &path)));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_bug);
+
+    // wildcards skip elements that don't match
+    TEST_SIMPLE_TREE_READ(test, 2 == mpack_node_path_all(node, &path, results, 4));
+    TEST_SIMPLE_TREE_READ(test, 2 == mpack_node_path_all(node, &path, results, 1) &&
+            test_node_path_is_str(results[0], "a"));
+    TEST_TRUE(mpack_ok == mpack_path_compile(&path, "users[*].tags[*]"));
+    TEST_SIMPLE_TREE_READ(test, 2 == mpack_node_path_all(node, &path, results, 4) &&
+            test_node_path_is_str(results[0], "x") && test_node_path_is_str(results[1], "y"));
+    TEST_TRUE(mpack_ok == mpack_path_compile(&path, "*"));
+    TEST_SIMPLE_TREE_READ(test, 3 == mpack_node_path_all(node, &path, results, 4) &&
+            3 == mpack_node_i32(results[1]) && test_node_path_is_str(results[2], "seven"));
+    TEST_TRUE(mpack_ok == mpack_path_compile(&path, "users[*].*"));
+    TEST_SIMPLE_TREE_READ(test, 5 == mpack_node_path_all(node, &path, NULL, 0));
+    TEST_TRUE(mpack_ok == mpack_path_compile(&path, "count"));
+    TEST_SIMPLE_TREE_READ(test, 1 == mpack_node_path_all(node, &path, results, 4) && 3 == mpack_node_i32(results[0]));
+    TEST_SIMPLE_TREE_READ_ERROR(test, 0 == mpack_node_path_all((mpack_node_flag_error(node, mpack_error_data), node),
+            &path, results, 4), mpack_error_data);
+
+    // keys are looked up with the map index
+    #ifdef MPACK_MALLOC
+    char buf[1024];
+    size_t size = test_node_map_index_data(buf);
+    mpack_tree_init(&tree, buf, size);
+    TEST_TRUE(mpack_ok == mpack_path_compile(&path, "k42"));
+    TEST_TRUE(42 == mpack_node_i32(mpack_node_path(mpack_tree_root(&tree), &path)));
+    TEST_TRUE(mpack_ok == mpack_path_compile(&path, "k07"));
+    TEST_TRUE(7 == mpack_node_i32(mpack_node_path(mpack_tree_root(&tree), &path)));
+    TEST_TRUE(mpack_ok == mpack_path_compile(&path, "[10]"));
+    TEST_TRUE(160 == mpack_node_i32(mpack_node_path(mpack_tree_root(&tree), &path)));
+    TEST_TRUE(mpack_ok == mpack_path_compile(&path, "k100"));
+    TEST_TRUE(mpack_type_nil == mpack_node_type(mpack_node_path_optional(mpack_tree_root(&tree), &path)));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+
+    // and unparsed nodes of a lazy tree are expanded
+    buf[0] = '\x91';
+    size = test_node_map_index_data(buf + 1) + 1;
+    mpack_tree_init_lazy(&tree, buf, size);
+    TEST_TRUE(mpack_ok == mpack_path_compile(&path, "[0].k42"));
+    TEST_TRUE(42 == mpack_node_i32(mpack_node_path(mpack_tree_root(&tree), &path)));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+    #endif
+}
+
+// Looks up a cached path in the given message, returning its value as an
+// int or -1 in case of error.
+static int32_t test_node_path_cached(const char* data, size_t length, const mpack_path_t* path, mpack_path_shape_t* shape, bool optional) {
+    mpack_node_data_t pool[32];
+    mpack_tree_t tree;
+    mpack_tree_init_pool(&tree, data, length, pool, sizeof(pool) / sizeof(*pool));
+    mpack_node_t node = optional ?
+        mpack_node_path_cached_optional(mpack_tree_root(&tree), path, shape) :
+        mpack_node_path_cached(mpack_tree_root(&tree), path, shape);
+    int32_t value = (mpack_node_type(node) == mpack_type_nil) ? 0 : mpack_node_i32(node);
+    return (mpack_tree_destroy(&tree) == mpack_ok) ? value : -1;
+}
+
+static void test_node_read_path_cached() {
+    // {"id": 1, "p": {"x": 10, "y": 20}}
+    static const char first[] = "\x82\xa2id\x01\xa1p\x82\xa1x\x0a\xa1y\x14";
+    // {"id": 2, "p": {"x": 11, "y": 21}}
+    static const char same[] = "\x82\xa2id\x02\xa1p\x82\xa1x\x0b\xa1y\x15";
+    // {"p": {"y": 22, "x": 12}, "id": 3}
+    static const char reordered[] = "\x82\xa1p\x82\xa1y\x16\xa1x\x0c\xa2id\x03";
+    // {"v": 0, "id": 4, "p": {"x": 13, "y": 23}}
+    static const char larger[] = "\x83\xa1v\x00\xa2id\x04\xa1p\x82\xa1x\x0d\xa1y\x17";
+    // {"id": 5, "p": [6]}
+    static const char other[] = "\x82\xa2id\x05\xa1p\x91\x06";
+    mpack_path_t path;
+    mpack_path_shape_t shape;
+
+    // positions are learned on the first lookup and checked first after
+    TEST_TRUE(mpack_ok == mpack_path_compile(&path, "p.y"));
+    mpack_path_shape_init(&shape);
+    TEST_TRUE(20 == test_node_path_cached(first, sizeof(first) - 1, &path, &shape, false));
+    TEST_TRUE(shape.counts[0] == 2 && shape.pairs[0] == 1);
+    TEST_TRUE(shape.counts[1] == 2 && shape.pairs[1] == 1);
+    TEST_TRUE(21 == test_node_path_cached(same, sizeof(same) - 1, &path, &shape, false));
+
+    // keys that moved or maps of a different size are searched and relearned
+    TEST_TRUE(22 == test_node_path_cached(reordered, sizeof(reordered) - 1, &path, &shape, false));
+    TEST_TRUE(shape.counts[0] == 2 && shape.pairs[0] == 0);
+    TEST_TRUE(shape.counts[1] == 2 && shape.pairs[1] == 0);
+    TEST_TRUE(23 == test_node_path_cached(larger, sizeof(larger) - 1, &path, &shape, false));
+    TEST_TRUE(shape.counts[0] == 3 && shape.pairs[0] == 2);
+    TEST_TRUE(shape.counts[1] == 2 && shape.pairs[1] == 1);
+    TEST_TRUE(21 == test_node_path_cached(same, sizeof(same) - 1, &path, &shape, false));
+
+    // errors are the same as uncached paths
+    TEST_TRUE(-1 == test_node_path_cached(other, sizeof(other) - 1, &path, &shape, false));
+    TEST_TRUE(-1 == test_node_path_cached(other, sizeof(other) - 1, &path, &shape, true));
+    TEST_TRUE(mpack_ok == mpack_path_compile(&path, "p.z"));
+    mpack_path_shape_init(&shape);
+    TEST_TRUE(-1 == test_node_path_cached(first, sizeof(first) - 1, &path, &shape, false));
+    TEST_TRUE(0 == test_node_path_cached(first, sizeof(first) - 1, &path, &shape, true));
+    TEST_TRUE(shape.counts[1] == 0);
+
+    // a recorded position holding a later duplicate finds the first, in
+    // small maps and indexed maps
+    TEST_TRUE(mpack_ok == mpack_path_compile(&path, "a"));
+    mpack_path_shape_init(&shape);
+    TEST_TRUE(2 == test_node_path_cached("\x82\xa1""b\x01\xa1""a\x02", 7, &path, &shape, false));
+    TEST_TRUE(shape.counts[0] == 2 && shape.pairs[0] == 1);
+    TEST_TRUE(3 == test_node_path_cached("\x82\xa1""a\x03\xa1""a\x04", 7, &path, &shape, false));
+    TEST_TRUE(shape.counts[0] == 2 && shape.pairs[0] == 0);
+    mpack_path_shape_init(&shape);
+    TEST_TRUE(2 == test_node_path_cached("\x84\xa1""x\x00\xa1""b\x01\xa1""a\x02\xa1""c\x03", 13, &path, &shape, false));
+    TEST_TRUE(shape.counts[0] == 4 && shape.pairs[0] == 2);
+    TEST_TRUE(5 == test_node_path_cached("\x84\xa1""a\x05\xa1""b\x06\xa1""a\x07\xa1""c\x08", 13, &path, &shape, false));
+    TEST_TRUE(shape.counts[0] == 4 && shape.pairs[0] == 0);
+
+    // index segments are looked up as usual
+    TEST_TRUE(mpack_ok == mpack_path_compile(&path, "p[0]"));
+    mpack_path_shape_init(&shape);
+    TEST_TRUE(6 == test_node_path_cached(other, sizeof(other) - 1, &path, &shape, false));
+    TEST_TRUE(6 == test_node_path_cached(other, sizeof(other) - 1, &path, &shape, false));
+    TEST_TRUE(shape.counts[0] == 2 && shape.counts[1] == 0);
+}
+
+static void test_node_read_map_many() {
+    mpack_node_data_t pool[128];
+    mpack_node_t values[4];
+    static const char* const keys[] = {"a", "b", "c", "a"};
+
+    // unsorted, sorted and indexed maps (depending on the thresholds)
+    TEST_SIMPLE_TREE_READ("\x82\xa1""b\x01\xa1""a\x02", 2 == mpack_node_map_cstr_many_optional(node, keys, 2, values, NULL) &&
+            2 == mpack_node_i32(values[0]) && 1 == mpack_node_i32(values[1]));
+    TEST_SIMPLE_TREE_READ("\x82\xa1""a\x01\xa1""b\x02", 2 == mpack_node_map_cstr_many_optional(node, keys, 2, values, NULL) &&
+            1 == mpack_node_i32(values[0]) && 2 == mpack_node_i32(values[1]));
+    TEST_SIMPLE_TREE_READ("\x83\xa1""c\x03\xa1""a\x01\xa1""b\x02", 4 == mpack_node_map_cstr_many(node, keys, 4, values, NULL) &&
+            1 == mpack_node_i32(values[0]) && 2 == mpack_node_i32(values[1]) &&
+            3 == mpack_node_i32(values[2]) && 1 == mpack_node_i32(values[3]));
+
+    // missing keys
+    TEST_SIMPLE_TREE_READ("\x82\xa1""b\x01\xa2""aa\x02", 1 == mpack_node_map_cstr_many_optional(node, keys, 3, values, NULL) &&
+            mpack_type_nil == mpack_node_type(values[0]) && 1 == mpack_node_i32(values[1]) &&
+            mpack_type_nil == mpack_node_type(values[2]));
+    TEST_SIMPLE_TREE_READ_ERROR("\x82\xa1""b\x01\xa0\x02", 1 == mpack_node_map_cstr_many(node, keys, 2, values, NULL), mpack_error_data);
+    TEST_SIMPLE_TREE_READ_ERROR("\x84\xa1""b\x01\xa1""c\x02\xa1""d\x03\x01\x04", 2 == mpack_node_map_cstr_many(node, keys, 3, values, NULL), mpack_error_data);
+    TEST_SIMPLE_TREE_READ_ERROR("\x82\x01\x01\x02\x02", 0 == mpack_node_map_cstr_many(node, keys, 1, values, NULL), mpack_error_data);
+    TEST_SIMPLE_TREE_READ("\x80", 0 == mpack_node_map_cstr_many(node, keys, 0, values, NULL));
+
+    // the first of duplicate keys is found, and duplicates are reported
+    // without flagging an error (in unsorted, sorted and indexed maps,
+    // depending on the thresholds)
+    bool duplicates[4];
+    TEST_SIMPLE_TREE_READ("\x82\xa1""a\x01\xa1""a\x02", 1 == mpack_node_map_cstr_many_optional(node, keys, 2, values, NULL) &&
+            1 == mpack_node_i32(values[0]) && mpack_type_nil == mpack_node_type(values[1]));
+    TEST_SIMPLE_TREE_READ("\x83\xa1""a\x01\xa1""b\x02\xa1""a\x03", 2 == mpack_node_map_cstr_many(node, keys, 2, values, NULL) &&
+            1 == mpack_node_i32(values[0]) && 2 == mpack_node_i32(values[1]));
+    TEST_SIMPLE_TREE_READ("\x82\xa1""a\x01\xa1""a\x02", 1 == mpack_node_map_cstr_many_optional(node, keys, 2, values, duplicates) &&
+            1 == mpack_node_i32(values[0]) && duplicates[0] && !duplicates[1]);
+    TEST_SIMPLE_TREE_READ("\x83\xa1""a\x01\xa1""b\x02\xa1""a\x03", 3 == mpack_node_map_cstr_many_optional(node, keys, 4, values, duplicates) &&
+            1 == mpack_node_i32(values[0]) && 2 == mpack_node_i32(values[1]) && 1 == mpack_node_i32(values[3]) &&
+            duplicates[0] && !duplicates[1] && !duplicates[2] && duplicates[3]);
+    TEST_SIMPLE_TREE_READ("\x83\xa1""a\x01\xa1""b\x02\xa1""c\x03", 4 == mpack_node_map_cstr_many(node, keys, 4, values, duplicates) &&
+            !duplicates[0] && !duplicates[1] && !duplicates[2] && !duplicates[3]);
+
+    // type errors
+    TEST_SIMPLE_TREE_READ_ERROR("\x91\x01", 0 == mpack_node_map_cstr_many(node, keys, 1, values, NULL) &&
+            mpack_type_nil == mpack_node_type(values[0]), mpack_error_type);
+
+    #ifdef MPACK_MALLOC
+    char buf[1024];
+    size_t size = test_node_map_index_data(buf);
+    mpack_tree_t tree;
+    mpack_tree_init(&tree, buf, size);
+    static const char* const index_keys[] = {"k42", "k99", "k00", "k100"};
+    TEST_TRUE(3 == mpack_node_map_cstr_many_optional(mpack_tree_root(&tree), index_keys, 4, values, NULL));
+    TEST_TRUE(42 == mpack_node_i32(values[0]));
+    TEST_TRUE(99 == mpack_node_i32(values[1]));
+    TEST_TRUE(0 == mpack_node_i32(values[2]));
+    TEST_TRUE(mpack_type_nil == mpack_node_type(values[3]));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+
+    // the index data has a duplicate "k07"
+    static const char* const duplicate_keys[] = {"k06", "k07"};
+    mpack_tree_init(&tree, buf, size);
+    TEST_TRUE(2 == mpack_node_map_cstr_many(mpack_tree_root(&tree), duplicate_keys, 2, values, duplicates));
+    TEST_TRUE(7 == mpack_node_i32(values[1]));
+    TEST_TRUE(!duplicates[0] && duplicates[1]);
+    TEST_TRUE(mpack_node_map_cstr(mpack_tree_root(&tree), "k07").data == values[1].data);
+    TEST_TREE_DESTROY_NOERROR(&tree);
+    #endif
+}
+
+static void test_node_read_map_cursor() {
+    // {"c": 1, "a": 2, "e": 3, "b": 4, "d": 5, "f": 6}
+    static const char test[] = "\x86\xa1""c\x01\xa1""a\x02\xa1""e\x03\xa1""b\x04\xa1""d\x05\xa1""f\x06";
+    mpack_node_data_t pool[64];
+    mpack_tree_t tree;
+    mpack_node_map_cursor_t cursor;
+
+    // keys in order
+    mpack_tree_init_pool(&tree, test, sizeof(test) - 1, pool, sizeof(pool) / sizeof(*pool));
+    cursor = mpack_node_map_cursor(mpack_tree_root(&tree));
+    TEST_TRUE(1 == mpack_node_i32(mpack_node_map_cursor_cstr(&cursor, "c")));
+    TEST_TRUE(2 == mpack_node_i32(mpack_node_map_cursor_cstr(&cursor, "a")));
+    TEST_TRUE(3 == mpack_node_i32(mpack_node_map_cursor_cstr(&cursor, "e")));
+    TEST_TRUE(4 == mpack_node_i32(mpack_node_map_cursor_cstr(&cursor, "b")));
+    TEST_TRUE(5 == mpack_node_i32(mpack_node_map_cursor_str(&cursor, "dx", 1)));
+    TEST_TRUE(6 == mpack_node_i32(mpack_node_map_cursor_cstr(&cursor, "f")));
+    TEST_TRUE(1 == mpack_node_i32(mpack_node_map_cursor_cstr(&cursor, "c")));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+
+    // skipped, repeated and earlier keys
+    mpack_tree_init_pool(&tree, test, sizeof(test) - 1, pool, sizeof(pool) / sizeof(*pool));
+    cursor = mpack_node_map_cursor(mpack_tree_root(&tree));
+    TEST_TRUE(2 == mpack_node_i32(mpack_node_map_cursor_cstr(&cursor, "a")));
+    TEST_TRUE(5 == mpack_node_i32(mpack_node_map_cursor_cstr(&cursor, "d")));
+    TEST_TRUE(1 == mpack_node_i32(mpack_node_map_cursor_cstr(&cursor, "c")));
+    TEST_TRUE(1 == mpack_node_i32(mpack_node_map_cursor_cstr(&cursor, "c")));
+    TEST_TRUE(mpack_type_nil == mpack_node_type(mpack_node_map_cursor_cstr_optional(&cursor, "z")));
+    TEST_TRUE(mpack_type_nil == mpack_node_type(mpack_node_map_cursor_str_optional(&cursor, "", 0)));
+    TEST_TRUE(3 == mpack_node_i32(mpack_node_map_cursor_cstr(&cursor, "e")));
+    TEST_TRUE(6 == mpack_node_i32(mpack_node_map_cursor_cstr_optional(&cursor, "f")));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+
+    // small maps are searched from the next key, wrapping around
+    mpack_tree_init_pool(&tree, "\x82\xa1""b\x01\xa1""a\x02", 7, pool, sizeof(pool) / sizeof(*pool));
+    cursor = mpack_node_map_cursor(mpack_tree_root(&tree));
+    TEST_TRUE(2 == mpack_node_i32(mpack_node_map_cursor_cstr(&cursor, "a")));
+    TEST_TRUE(1 == mpack_node_i32(mpack_node_map_cursor_cstr(&cursor, "b")));
+    TEST_TRUE(1 == mpack_node_i32(mpack_node_map_cursor_cstr(&cursor, "b")));
+    TEST_TRUE(2 == mpack_node_i32(mpack_node_map_cursor_cstr(&cursor, "a")));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+
+    // duplicate keys resolve to the first, in small maps and indexed maps
+    mpack_tree_init_pool(&tree, "\x82\xa1""a\x01\xa1""a\x02", 7, pool, sizeof(pool) / sizeof(*pool));
+    cursor = mpack_node_map_cursor(mpack_tree_root(&tree));
+    TEST_TRUE(1 == mpack_node_i32(mpack_node_map_cursor_cstr(&cursor, "a")));
+    TEST_TRUE(1 == mpack_node_i32(mpack_node_map_cursor_cstr(&cursor, "a")));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+    mpack_tree_init_pool(&tree, "\x84\xa1""b\x01\xa1""a\x02\xa1""c\x03\xa1""a\x04", 13, pool, sizeof(pool) / sizeof(*pool));
+    cursor = mpack_node_map_cursor(mpack_tree_root(&tree));
+    TEST_TRUE(2 == mpack_node_i32(mpack_node_map_cursor_cstr(&cursor, "a")));
+    TEST_TRUE(3 == mpack_node_i32(mpack_node_map_cursor_cstr(&cursor, "c")));
+    TEST_TRUE(2 == mpack_node_i32(mpack_node_map_cursor_cstr(&cursor, "a")));
+    TEST_TRUE(2 == mpack_node_i32(mpack_node_map_cursor_cstr(&cursor, "a")));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+
+    // missing keys
+    mpack_tree_init_pool(&tree, test, sizeof(test) - 1, pool, sizeof(pool) / sizeof(*pool));
+    cursor = mpack_node_map_cursor(mpack_tree_root(&tree));
+    TEST_TRUE(mpack_type_nil == mpack_node_type(mpack_node_map_cursor_cstr(&cursor, "z")));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_data);
+    mpack_tree_init_pool(&tree, "\x80", 1, pool, sizeof(pool) / sizeof(*pool));
+    cursor = mpack_node_map_cursor(mpack_tree_root(&tree));
+    TEST_TRUE(mpack_type_nil == mpack_node_type(mpack_node_map_cursor_cstr_optional(&cursor, "a")));
+    TEST_TRUE(mpack_type_nil == mpack_node_type(mpack_node_map_cursor_cstr(&cursor, "a")));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_data);
+
+    // the node must be a map, and lookups in a tree in an error state
+    // return nil
+    mpack_tree_init_pool(&tree, "\x91\xa1""c", 3, pool, sizeof(pool) / sizeof(*pool));
+    cursor = mpack_node_map_cursor(mpack_tree_root(&tree));
+    TEST_TRUE(mpack_type_nil == mpack_node_type(mpack_node_map_cursor_cstr_optional(&cursor, "c")));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_type);
+    mpack_tree_init_pool(&tree, test, sizeof(test) - 1, pool, sizeof(pool) / sizeof(*pool));
+    cursor = mpack_node_map_cursor(mpack_tree_root(&tree));
+    mpack_tree_flag_error(&tree, mpack_error_data);
+    TEST_TRUE(mpack_type_nil == mpack_node_type(mpack_node_map_cursor_cstr(&cursor, "c")));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_data);
+
+    #ifdef MPACK_MALLOC
+    // unexpanded maps of a lazy tree are expanded
+    mpack_tree_init_lazy(&tree, "\x91\x82\xa1""x\x01\xa1""y\x02", 8);
+    cursor = mpack_node_map_cursor(mpack_node_array_at(mpack_tree_root(&tree), 0));
+    TEST_TRUE(1 == mpack_node_i32(mpack_node_map_cursor_cstr(&cursor, "x")));
+    TEST_TRUE(2 == mpack_node_i32(mpack_node_map_cursor_cstr(&cursor, "y")));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+    #endif
+}
+
+static void test_node_read_columns() {
+    // [{"a": 1, "b": 2.5, "c": true}, {"b": -1, "a": 2, "c": false}, {"a": 3, "c": nil}]
+    static const char records[] =
+        "\x93\x83\xa1""a\x01\xa1""b\xcb\x40\x04\x00\x00\x00\x00\x00\x00\xa1""c\xc3"
+        "\x83\xa1""b\xff\xa1""a\x02\xa1""c\xc2"
+        "\x82\xa1""a\x03\xa1""c\xc0";
+    mpack_node_data_t pool[64];
+    mpack_tree_t tree;
+    uint64_t a[4];
+    int64_t a_signed[4];
+    double b[4];
+    float b_float[4];
+    bool c[4];
+    uint8_t b_present[1] = {0xff};
+    uint8_t c_present[1] = {0xff};
+    mpack_node_column_t columns[] = {
+        {"a", mpack_type_uint, a, NULL},
+        {"b", mpack_type_double, b, b_present},
+        {"c", mpack_type_bool, c, c_present},
+        {"a", mpack_type_int, a_signed, NULL},
+        {"b", mpack_type_float, b_float, NULL}
+    };
+
+    // missing and nil values are cleared in the present bitmap
+    mpack_tree_init_pool(&tree, records, sizeof(records) - 1, pool, sizeof(pool) / sizeof(*pool));
+    TEST_TRUE(3 == mpack_node_array_columns(mpack_tree_root(&tree), columns, 4, 4));
+    TEST_TRUE(a[0] == 1 && a[1] == 2 && a[2] == 3);
+    TEST_TRUE(a_signed[0] == 1 && a_signed[1] == 2 && a_signed[2] == 3);
+    TEST_TRUE(b[0] == 2.5 && b[1] == -1.0 && b[2] == 0.0);
+    TEST_TRUE(b_present[0] == 0xfb);
+    TEST_TRUE(c[0] == true && c[1] == false && c[2] == false);
+    TEST_TRUE(c_present[0] == 0xfb);
+    TEST_TREE_DESTROY_NOERROR(&tree);
+
+    // a key at its last position that's a later duplicate finds the first,
+    // in small maps and indexed maps
+    mpack_tree_init_pool(&tree, "\x92\x82\xa1""b\x01\xa1""a\x02\x82\xa1""a\x03\xa1""a\x04", 15,
+            pool, sizeof(pool) / sizeof(*pool));
+    TEST_TRUE(2 == mpack_node_array_columns(mpack_tree_root(&tree), columns, 1, 4));
+    TEST_TRUE(a[0] == 2 && a[1] == 3);
+    TEST_TREE_DESTROY_NOERROR(&tree);
+    mpack_tree_init_pool(&tree, "\x92\x84\xa1""x\x00\xa1""b\x01\xa1""a\x02\xa1""c\x03"
+            "\x84\xa1""a\x05\xa1""b\x06\xa1""a\x07\xa1""c\x08", 27, pool, sizeof(pool) / sizeof(*pool));
+    TEST_TRUE(2 == mpack_node_array_columns(mpack_tree_root(&tree), columns, 1, 4));
+    TEST_TRUE(a[0] == 2 && a[1] == 5);
+    TEST_TREE_DESTROY_NOERROR(&tree);
+
+    // a required column must be in every map
+    mpack_tree_init_pool(&tree, records, sizeof(records) - 1, pool, sizeof(pool) / sizeof(*pool));
+    TEST_TRUE(0 == mpack_node_array_columns(mpack_tree_root(&tree), columns, 5, 4));
+    TEST_TRUE(b_float[0] == 2.5f && b_float[1] == -1.0f);
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_data);
+
+    // values must convert to the column type
+    mpack_tree_init_pool(&tree, "\x92\x81\xa1""a\x01\x81\xa1""a\xff", 10, pool, sizeof(pool) / sizeof(*pool));
+    TEST_TRUE(0 == mpack_node_array_columns(mpack_tree_root(&tree), columns, 1, 4));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_type);
+    mpack_tree_init_pool(&tree, "\x91\x81\xa1""a\xa1""x", 6, pool, sizeof(pool) / sizeof(*pool));
+    TEST_TRUE(0 == mpack_node_array_columns(mpack_tree_root(&tree), columns + 3, 1, 4));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_type);
+    mpack_tree_init_pool(&tree, "\x91\x81\xa1""a\xc0", 5, pool, sizeof(pool) / sizeof(*pool));
+    TEST_TRUE(0 == mpack_node_array_columns(mpack_tree_root(&tree), columns, 1, 4));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_type);
+
+    // the node must be an array of maps that fits
+    mpack_tree_init_pool(&tree, "\x92\x80\x01", 3, pool, sizeof(pool) / sizeof(*pool));
+    TEST_TRUE(0 == mpack_node_array_columns(mpack_tree_root(&tree), columns + 1, 1, 4));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_type);
+    mpack_tree_init_pool(&tree, "\x80", 1, pool, sizeof(pool) / sizeof(*pool));
+    TEST_TRUE(0 == mpack_node_array_columns(mpack_tree_root(&tree), columns, 3, 4));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_type);
+    mpack_tree_init_pool(&tree, records, sizeof(records) - 1, pool, sizeof(pool) / sizeof(*pool));
+    TEST_TRUE(0 == mpack_node_array_columns(mpack_tree_root(&tree), columns, 3, 2));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_too_big);
+    mpack_tree_init_pool(&tree, "\x90", 1, pool, sizeof(pool) / sizeof(*pool));
+    TEST_TRUE(0 == mpack_node_array_columns(mpack_tree_root(&tree), columns, 3, 0));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+
+    // unsupported column types are a bug
+    mpack_node_column_t bad_column = {"a", mpack_type_str, a, NULL};
+    mpack_tree_init_pool(&tree, records, sizeof(records) - 1, pool, sizeof(pool) / sizeof(*pool));
+    TEST_BREAK(0 == mpack_node_array_columns(mpack_tree_root(&tree), &bad_column, 1, 4));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_bug);
+
+    #ifdef MPACK_MALLOC
+    // the maps of a lazy tree are expanded
+    mpack_tree_init_lazy(&tree, records, sizeof(records) - 1);
+    TEST_TRUE(3 == mpack_node_array_columns(mpack_tree_root(&tree), columns, 3, 4));
+    TEST_TRUE(a[0] == 1 && a[1] == 2 && a[2] == 3);
+    TEST_TRUE(b[0] == 2.5 && b[1] == -1.0 && b_present[0] == 0xfb);
+    TEST_TREE_DESTROY_NOERROR(&tree);
+    #endif
+}
+
+#if MPACK_NODE_RAW
+// {"route": "b", "body": {"id": 7, "tags": ["x", []], "v": 1.5}}
+static const char test_node_raw_message[] =
+    "\x82\xa5route\xa1""b\xa4""body"
+        "\x83\xa2id\x07\xa4tags\x92\xa1x\x90\xa1v\xca\x3f\xc0\x00\x00";
+static const char test_node_raw_body[] = "\x83\xa2id\x07\xa4tags\x92\xa1x\x90\xa1v\xca\x3f\xc0\x00\x00";
+
+static void test_node_read_raw() {
+    mpack_node_data_t pool[128];
+    const char* data;
+    size_t length;
+
+    TEST_SIMPLE_TREE_READ(test_node_raw_message, (mpack_node_raw(node, &data, &length),
+                data == test_node_raw_message && length == sizeof(test_node_raw_message) - 1));
+    TEST_SIMPLE_TREE_READ(test_node_raw_message, (test_node_raw_check(node), true));
+    TEST_SIMPLE_TREE_READ(test_node_raw_message, (mpack_node_raw(mpack_node_map_cstr(node, "body"), &data, &length),
+                length == sizeof(test_node_raw_body) - 1 && memcmp(data, test_node_raw_body, length) == 0));
+
+    // missing optional nodes are nil
+    TEST_SIMPLE_TREE_READ(test_node_raw_message, (mpack_node_raw(mpack_node_map_cstr_optional(node, "x"), &data, &length),
+                length == 1 && *data == '\xc0'));
+
+    // errors
+    TEST_SIMPLE_TREE_READ_ERROR(test_node_raw_message, (mpack_node_raw(mpack_node_map_cstr(node, "x"), &data, &length),
+                data == NULL && length == 0), mpack_error_data);
+
+    #if MPACK_WRITER
+    // forwarding a subtree
+    char buf[64];
+    mpack_writer_t writer;
+    mpack_tree_t tree;
+    mpack_tree_init_pool(&tree, test_node_raw_message, sizeof(test_node_raw_message) - 1, pool, sizeof(pool) / sizeof(*pool));
+    mpack_node_t root = mpack_tree_root(&tree);
+    mpack_writer_init(&writer, buf, sizeof(buf));
+    mpack_start_array(&writer, 2);
+    mpack_write_node_raw(&writer, mpack_node_map_cstr(root, "body"));
+    mpack_write_node_raw(&writer, mpack_node_map_cstr_optional(root, "x"));
+    mpack_finish_array(&writer);
+    TEST_TRUE(mpack_writer_buffer_used(&writer) == sizeof(test_node_raw_body) + 1);
+    TEST_TRUE(buf[0] == '\x92' && buf[sizeof(test_node_raw_body)] == '\xc0');
+    TEST_TRUE(memcmp(buf + 1, test_node_raw_body, sizeof(test_node_raw_body) - 1) == 0);
+    TEST_TRUE(mpack_writer_destroy(&writer) == mpack_ok);
+
+    // the tree's error is flagged on the writer
+    mpack_writer_init(&writer, buf, sizeof(buf));
+    mpack_write_node_raw(&writer, mpack_node_map_cstr(root, "x"));
+    TEST_TRUE(mpack_writer_destroy(&writer) == mpack_error_data);
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_data);
+    #endif
+}
+#endif
+
+static void test_node_read_parse_again() {
+    char buf[1024];
+    size_t size = test_node_map_index_data(buf);
+    mpack_tree_t tree;
+
+    // a pooled tree reuses its pool, and errors are cleared
+    mpack_node_data_t pool[4];
+    mpack_tree_init_pool(&tree, "\x93\x01\x02", 3, pool, sizeof(pool) / sizeof(*pool));
+    TEST_TRUE(mpack_error_invalid == mpack_tree_error(&tree));
+    mpack_tree_parse_again(&tree, "\x93\x01\x02\x03", 4);
+    TEST_TRUE(3 == mpack_node_i32(mpack_node_array_at(mpack_tree_root(&tree), 2)));
+    mpack_tree_parse_again(&tree, "\x94\x01\x02\x03\x04", 5);
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_too_big);
+
+    #ifdef MPACK_MALLOC
+    // a message that spills into more pages is consolidated into one
+    mpack_tree_init(&tree, "\x07", 1);
+    mpack_tree_parse_again(&tree, buf, size);
+    TEST_TRUE(tree.page.next != NULL);
+    mpack_tree_parse_again(&tree, "\x07", 1);
+    TEST_TRUE(tree.page.next == NULL);
+    TEST_TRUE(7 == mpack_node_i32(mpack_tree_root(&tree)));
+
+    // after which messages of that size don't allocate
+    test_system_fail_after(0);
+    mpack_tree_parse_again(&tree, "\x92\x01\x02", 3);
+    TEST_TRUE(2 == mpack_node_i32(mpack_node_array_at(mpack_tree_root(&tree), 1)));
+    mpack_tree_parse_again(&tree, buf, size);
+    TEST_TRUE(mpack_ok == mpack_tree_error(&tree));
+    test_system_fail_reset();
+    TEST_TRUE(tree.page.next == NULL);
+    test_node_map_index_lookups(&tree);
+    #endif
+}
+
+#ifdef MPACK_MALLOC
+typedef struct test_node_stream_t {
+    const char* data;
+    size_t left;
+    size_t step; // maximum bytes per read
+    bool starved; // whether the last read returned no data
+} test_node_stream_t;
+
+// Reads at most step bytes at a time, and returns no data on every
+// other read to simulate data that hasn't arrived yet.
+static size_t test_node_stream_read(mpack_tree_t* tree, char* buffer, size_t count) {
+    test_node_stream_t* stream = (test_node_stream_t*)tree->context;
+    stream->starved = !stream->starved;
+    if (stream->starved)
+        return 0;
+
+    if (stream->left == 0) {
+        mpack_tree_flag_error(tree, mpack_error_io);
+        return 0;
+    }
+
+    if (count > stream->step)
+        count = stream->step;
+    if (count > stream->left)
+        count = stream->left;
+    memcpy(buffer, stream->data, count);
+    stream->data += count;
+    stream->left -= count;
+    return count;
+}
+
+static void test_node_stream_init(mpack_tree_t* tree, test_node_stream_t* stream, const char* data, size_t length, size_t step, size_t max_size, size_t max_nodes) {
+    stream->data = data;
+    stream->left = length;
+    stream->step = step;
+    stream->starved = false;
+    mpack_tree_init_stream(tree, test_node_stream_read, stream, max_size, max_nodes);
+}
+
+static bool test_node_stream_parse(mpack_tree_t* tree) {
+    for (int i = 0; i < 10000; ++i)
+        if (mpack_tree_try_parse(tree))
+            return true;
+    return false;
+}
+
+static void test_node_read_stream() {
+    char buf[1024];
+    size_t size = test_node_map_index_data(buf);
+
+    static const size_t steps[] = {1, 3, 64, sizeof(buf)};
+    for (size_t i = 0; i < sizeof(steps) / sizeof(*steps); ++i) {
+        mpack_tree_t tree;
+        test_node_stream_t stream;
+        test_node_stream_init(&tree, &stream, buf, size, steps[i], sizeof(buf), 0);
+
+        // nothing is available on the first read
+        TEST_TRUE(false == mpack_tree_try_parse(&tree));
+        TEST_TRUE(mpack_ok == mpack_tree_error(&tree));
+
+        TEST_TRUE(test_node_stream_parse(&tree));
+        TEST_TRUE(size == mpack_tree_size(&tree));
+        test_node_map_index_lookups(&tree);
+    }
+}
+
+static void test_node_read_stream_messages() {
+    static const char messages[] = "\x81\xa1""a\x01\x07\x92\xc0\xa3""abc";
+    mpack_tree_t tree;
+    test_node_stream_t stream;
+    test_node_stream_init(&tree, &stream, messages, sizeof(messages) - 1, 1, 64, 0);
+
+    TEST_TRUE(test_node_stream_parse(&tree));
+    TEST_TRUE(1 == mpack_node_i32(mpack_node_map_cstr(mpack_tree_root(&tree), "a")));
+    TEST_TRUE(test_node_stream_parse(&tree));
+    TEST_TRUE(7 == mpack_node_i32(mpack_tree_root(&tree)));
+    TEST_TRUE(test_node_stream_parse(&tree));
+    TEST_TRUE(mpack_type_nil == mpack_node_type(mpack_node_array_at(mpack_tree_root(&tree), 0)));
+    TEST_TRUE(3 == mpack_node_strlen(mpack_node_array_at(mpack_tree_root(&tree), 1)));
+    TEST_TRUE(0 == memcmp("abc", mpack_node_data(mpack_node_array_at(mpack_tree_root(&tree), 1)), 3));
+
+    // the end of the stream is an error
+    TEST_TRUE(false == test_node_stream_parse(&tree));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_io);
+
+    // a truncated message is an error at the end of the stream
+    test_node_stream_init(&tree, &stream, messages, 3, 1, 64, 0);
+    TEST_TRUE(false == test_node_stream_parse(&tree));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_io);
+
+    // several messages can arrive in one read
+    test_node_stream_init(&tree, &stream, messages, sizeof(messages) - 1, sizeof(messages), 64, 0);
+    TEST_TRUE(test_node_stream_parse(&tree));
+    TEST_TRUE(test_node_stream_parse(&tree));
+    TEST_TRUE(7 == mpack_node_i32(mpack_tree_root(&tree)));
+    TEST_TRUE(test_node_stream_parse(&tree));
+    TEST_TRUE(2 == mpack_node_array_length(mpack_tree_root(&tree)));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+}
+
+static void test_node_read_stream_limits() {
+    static const char str[] = "\xa9""123456789";
+    mpack_tree_t tree;
+    test_node_stream_t stream;
+
+    // message size
+    test_node_stream_init(&tree, &stream, str, sizeof(str) - 1, 4, 10, 0);
+    TEST_TRUE(test_node_stream_parse(&tree));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+    test_node_stream_init(&tree, &stream, str, sizeof(str) - 1, 4, 9, 0);
+    TEST_TRUE(false == test_node_stream_parse(&tree));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_too_big);
+
+    // node count
+    static const char array[] = "\x92\x01\x02";
+    test_node_stream_init(&tree, &stream, array, sizeof(array) - 1, 1, 64, 3);
+    TEST_TRUE(test_node_stream_parse(&tree));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+    test_node_stream_init(&tree, &stream, array, sizeof(array) - 1, 1, 64, 2);
+    TEST_TRUE(false == test_node_stream_parse(&tree));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_too_big);
+
+    // a huge array can't allocate more nodes than the bytes it has read
+    static const char huge[] = "\xdd\xff\xff\xff\xff";
+    test_node_stream_init(&tree, &stream, huge, sizeof(huge) - 1, 1, 1024, 0);
+    TEST_TRUE(false == test_node_stream_parse(&tree));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_too_big);
+
+    // misuse
+    test_node_stream_init(&tree, &stream, str, sizeof(str) - 1, 1, 64, 0);
+    TEST_BREAK(mpack_type_nil == mpack_node_type(mpack_tree_root(&tree)));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_bug);
+    TEST_BREAK((mpack_tree_init_stream(&tree, test_node_stream_read, &stream, 0, 0), true));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_bug);
+    mpack_tree_init(&tree, str, sizeof(str) - 1);
+    TEST_BREAK(false == mpack_tree_try_parse(&tree));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_bug);
+}
+
+static void test_node_read_stream_number_runs() {
+    static const size_t steps[] = {1, 3, 64};
+    for (size_t i = 0; i < sizeof(steps) / sizeof(*steps); ++i) {
+        mpack_tree_t tree;
+        test_node_stream_t stream;
+        test_node_stream_init(&tree, &stream, test_node_number_runs, sizeof(test_node_number_runs) - 1, steps[i], 1024, 0);
+        TEST_TRUE(test_node_stream_parse(&tree));
+        TEST_TRUE(tree.node_count == 37);
+        test_node_number_runs_check(&tree);
+    }
+
+    // the lazy parse of the root array's runs
+    mpack_tree_t tree;
+    mpack_tree_init_lazy(&tree, test_node_number_runs, sizeof(test_node_number_runs) - 1);
+    TEST_TRUE(tree.node_count == 12);
+    test_node_number_runs_check(&tree);
+}
+
+#if MPACK_NODE_RAW
+static void test_node_read_stream_raw() {
+    const char* data;
+    size_t length;
+    mpack_tree_t tree;
+
+    // nodes of a lazy tree have their spans before and after expansion
+    mpack_tree_init_lazy(&tree, test_node_raw_message, sizeof(test_node_raw_message) - 1);
+    mpack_node_raw(mpack_node_map_cstr(mpack_tree_root(&tree), "body"), &data, &length);
+    TEST_TRUE(length == sizeof(test_node_raw_body) - 1 && memcmp(data, test_node_raw_body, length) == 0);
+    test_node_raw_check(mpack_tree_root(&tree));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+
+    // a stream parsed in small steps
+    test_node_stream_t stream;
+    test_node_stream_init(&tree, &stream, test_node_raw_message, sizeof(test_node_raw_message) - 1, 3, 1024, 0);
+    TEST_TRUE(test_node_stream_parse(&tree));
+    test_node_raw_check(mpack_tree_root(&tree));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+}
+#endif
+
+// [{"a": [1, [2, 3]]}, {"b": {"c": {"d": 4}}}, 5, [], [[[6]], "x"]]
+static const char test_node_range_data[] =
+    "\x95\x81\xa1""a\x92\x01\x92\x02\x03\x81\xa1""b\x81\xa1""c\x81\xa1""d\x04"
+    "\x05\x90\x92\x91\x91\x06\xa1""x";
+
+static void test_node_read_allocator() {
+    char buf[1024];
+    size_t size = test_node_map_index_data(buf);
+    size_t count = test_malloc_count();
+    mpack_tree_t tree;
+
+    // a tree initialized with an allocator allocates all of its pages
+    // with it, including the first
+    mpack_tree_init_allocator(&tree, buf, size, &test_allocator);
+    TEST_TRUE(tree.page.next != NULL);
+    TEST_TRUE(test_allocator_count() == test_malloc_count() - count);
+    mpack_tree_parse_again(&tree, buf, size);
+    TEST_TRUE(test_allocator_count() == test_malloc_count() - count);
+    test_node_map_index_lookups(&tree);
+    TEST_TRUE(test_allocator_count() == 0);
+
+    // as do lazy and exact trees, and the workers of a lazy tree
+    mpack_tree_t worker;
+    mpack_tree_init_lazy_allocator(&tree, test_node_range_data, sizeof(test_node_range_data) - 1, &test_allocator);
+    TEST_TRUE(test_allocator_count() == 1);
+    mpack_tree_init_range(&worker, &tree, 0, 5);
+    mpack_tree_join(&tree, &worker);
+    TEST_TRUE(test_allocator_count() == test_malloc_count() - count);
+    TEST_TRUE(6 == mpack_node_i32(mpack_node_array_at(mpack_node_array_at(mpack_node_array_at(
+            mpack_node_array_at(mpack_tree_root(&tree), 4), 0), 0), 0)));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+    mpack_tree_init_exact_allocator(&tree, buf, size, &test_allocator);
+    TEST_TRUE(test_allocator_count() == 1 && test_malloc_count() == count + 1);
+    test_node_map_index_lookups(&tree);
+    TEST_TRUE(test_allocator_count() == 0);
+
+    // the allocator of a tree that owns its pages can't be changed
+    mpack_tree_init(&tree, buf, size);
+    TEST_BREAK((mpack_tree_set_allocator(&tree, &test_allocator), true));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_bug);
+    TEST_TRUE(test_allocator_count() == 0);
+
+
+    // a stream keeps the data it has read past the parsed message
+    static const char messages[] = "\x92\x01\x02\x91\x03\x92\x07";
+    test_node_stream_t stream;
+    test_node_stream_init(&tree, &stream, messages, sizeof(messages) - 1, sizeof(messages), 64, 0);
+    TEST_TRUE(test_node_stream_parse(&tree));
+    TEST_TRUE(2 == mpack_node_array_length(mpack_tree_root(&tree)));
+    mpack_tree_set_allocator(&tree, &test_allocator);
+    TEST_TRUE(test_allocator_count() == 2);
+    TEST_TRUE(test_node_stream_parse(&tree));
+    TEST_TRUE(3 == mpack_node_i32(mpack_node_array_at(mpack_tree_root(&tree), 0)));
+
+    // the allocator can't change during a parse
+    TEST_TRUE(false == mpack_tree_try_parse(&tree));
+    TEST_TRUE(mpack_ok == mpack_tree_error(&tree));
+    TEST_BREAK((mpack_tree_set_allocator(&tree, NULL), true));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_bug);
+    TEST_TRUE(test_allocator_count() == 0);
+
+    // a deep message grows its parsing stack with the allocator
+    mpack_tree_init_stream(&tree, test_node_stream_read, &stream, 64, 0);
+    mpack_tree_set_allocator(&tree, &test_allocator);
+    static const char deep[] = "\x91\x91\x91\x91\x91\x91\x91\x91\x91\x91\x91\x91\x91\x91\x91\x91\xc0";
+    stream.data = deep;
+    stream.left = sizeof(deep) - 1;
+    stream.step = 1;
+    TEST_TRUE(test_node_stream_parse(&tree));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+    TEST_TRUE(test_allocator_count() == 0);
+    TEST_TRUE(test_malloc_count() == count);
+}
+
+// Expands nodes of a lazy tree, allowing mpack_error_memory from the
+// failure system.
+static bool test_node_read_lazy_expand() {
+    char buf[1024];
+    buf[0] = '\x92';
+    size_t size = test_node_map_index_data(buf + 1) + 1;
+    buf[size++] = '\x90';
+
+    mpack_tree_t tree;
+    mpack_tree_init_lazy(&tree, buf, size);
+    if (mpack_tree_error(&tree) == mpack_error_memory) {
+        mpack_tree_destroy(&tree);
+        return false;
+    }
+
+    mpack_node_t map = mpack_node_array_at(mpack_tree_root(&tree), 0);
+    int32_t value = mpack_node_i32(mpack_node_map_int(map, 0));
+    mpack_error_t error = mpack_tree_destroy(&tree);
+    if (error == mpack_error_memory)
+        return false;
+    TEST_TRUE(error == mpack_ok, "unexpected error state %i (%s)", (int)error, mpack_error_to_string(error));
+    TEST_TRUE(value == 150);
+    return true;
+}
+
+static void test_node_read_lazy() {
+    // {"a": [1, [2, 3], {"x": "y"}], "b": {"c": {"d": 4}}, "e": 5, "f": []}
+    static const char data[] =
+        "\x84\xa1""a\x93\x01\x92\x02\x03\x81\xa1""x\xa1""y"
+        "\xa1""b\x81\xa1""c\x81\xa1""d\x04\xa1""e\x05\xa1""f\x90";
+    mpack_tree_t tree;
+
+    // only the root's children are parsed up front
+    mpack_tree_init_lazy(&tree, data, sizeof(data) - 1);
+    TEST_TRUE(mpack_tree_size(&tree) == sizeof(data) - 1);
+    TEST_TRUE(tree.node_count == 9);
+    mpack_node_t root = mpack_tree_root(&tree);
+    TEST_TRUE(5 == mpack_node_i32(mpack_node_map_cstr(root, "e")));
+    TEST_TRUE(0 == mpack_node_array_length(mpack_node_map_cstr(root, "f")));
+    mpack_node_t a = mpack_node_map_cstr(root, "a");
+    TEST_TRUE(3 == mpack_node_array_length(a));
+    TEST_TRUE(0 != (a.data->flags & MPACK_NODE_FLAG_UNEXPANDED));
+    TEST_TRUE(tree.node_count == 9);
+
+    // other nodes are parsed one level at a time on first access
+    TEST_TRUE(3 == mpack_node_i32(mpack_node_array_at(mpack_node_array_at(a, 1), 1)));
+    TEST_TRUE(tree.node_count == 14);
+    TEST_TRUE(0 == (a.data->flags & MPACK_NODE_FLAG_UNEXPANDED));
+    TEST_TRUE(1 == mpack_node_i32(mpack_node_array_at(a, 0)));
+    TEST_TRUE(tree.node_count == 14);
+    TEST_TRUE(mpack_node_map_contains_cstr(mpack_node_array_at(a, 2), "x"));
+    mpack_node_t c = mpack_node_map_cstr(mpack_node_map_cstr(root, "b"), "c");
+    TEST_TRUE(4 == mpack_node_i32(mpack_node_map_cstr(c, "d")));
+    TEST_TRUE(4 == mpack_node_i32(mpack_node_map_value_at(c, 0)));
+    TEST_TRUE(mpack_type_nil == mpack_node_type(mpack_node_map_cstr_optional(c, "z")));
+    TEST_TRUE(tree.node_count == 20);
+    TEST_TREE_DESTROY_NOERROR(&tree);
+
+    // unparsed nodes are still checked
+    mpack_tree_init_lazy(&tree, data, sizeof(data) - 2);
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_invalid);
+    mpack_tree_init_lazy(&tree, "\x91\x91\x92\xc0\xc1", 5);
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_invalid);
+    mpack_tree_init_lazy(&tree, "\x91\x91\xdd\xff\xff\xff\xff\xc0", 8);
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_invalid);
+
+    // maps are indexed when they are expanded, and the tree stays lazy
+    // when parsed again
+    char buf[1024];
+    buf[0] = '\x91';
+    size_t size = test_node_map_index_data(buf + 1) + 1;
+    mpack_tree_init(&tree, "\x07", 1);
+    TEST_TRUE(!tree.lazy);
+    mpack_tree_destroy(&tree);
+    mpack_tree_init_lazy(&tree, "\x07", 1);
+    mpack_tree_parse_again(&tree, buf, size);
+    TEST_TRUE(tree.lazy);
+    mpack_node_t map = mpack_node_array_at(mpack_tree_root(&tree), 0);
+    TEST_TRUE(203 == mpack_node_map_count(map));
+    TEST_TRUE(tree.node_count == 2);
+    TEST_TRUE(42 == mpack_node_i32(mpack_node_map_cstr(map, "k42")));
+    TEST_TRUE(100 == mpack_node_i32(mpack_node_map_int(map, -50)));
+    TEST_TRUE(tree.node_count == 2 + 203 * 2);
+    #if MPACK_NODE_MAP_INDEX_THRESHOLD && MPACK_NODE_MAP_INDEX_THRESHOLD <= 203
+    TEST_TRUE(0 != (map.data->flags & MPACK_NODE_FLAG_INDEXED));
+    #endif
+    TEST_TREE_DESTROY_NOERROR(&tree);
+
+    test_system_fail_until_ok(&test_node_read_lazy_expand);
+}
+
+// Checks that two trees of the same data have the same nodes
+static bool test_node_same(mpack_node_t a, mpack_node_t b) {
+    if (!mpack_tag_equal(mpack_node_tag(a), mpack_node_tag(b)))
+        return false;
+    mpack_type_t type = mpack_node_type(a);
+    if (type == mpack_type_str || type == mpack_type_bin || type == mpack_type_ext)
+        return a.data->value.offset == b.data->value.offset;
+    if (type != mpack_type_array && type != mpack_type_map)
+        return true;
+    if (a.data->flags != b.data->flags)
+        return false;
+    size_t count = (type == mpack_type_map) ? a.data->len * 2 : a.data->len;
+    for (size_t i = 0; i < count; ++i)
+        if (!test_node_same(mpack_node(a.tree, mpack_node_child(a, i)), mpack_node(b.tree, mpack_node_child(b, i))))
+            return false;
+    return true;
+}
+
+// Parses a lazy tree with two workers, allowing mpack_error_memory from
+// the failure system.
+static bool test_node_read_range_workers() {
+    mpack_tree_t tree;
+    mpack_tree_t workers[2];
+    mpack_tree_init_lazy(&tree, test_node_range_data, sizeof(test_node_range_data) - 1);
+    mpack_tree_init_range(&workers[0], &tree, 0, 2);
+    mpack_tree_init_range(&workers[1], &tree, 2, 3);
+    mpack_tree_join(&tree, &workers[1]);
+    mpack_tree_join(&tree, &workers[0]);
+
+    size_t node_count = tree.node_count;
+    mpack_error_t error = mpack_tree_destroy(&tree);
+    if (error == mpack_error_memory)
+        return false;
+    TEST_TRUE(error == mpack_ok, "unexpected error state %i (%s)", (int)error, mpack_error_to_string(error));
+    TEST_TRUE(node_count == 22);
+    return true;
+}
+
+static void test_node_read_range() {
+    static const char* data = test_node_range_data;
+    static const size_t size = sizeof(test_node_range_data) - 1;
+    mpack_tree_t eager;
+    mpack_tree_t tree;
+    mpack_tree_t workers[2];
+    mpack_tree_init(&eager, data, size);
+    TEST_TRUE(eager.node_count == 22);
+
+    // workers can be joined in any order, and the result is the same as
+    // parsing the whole tree
+    mpack_tree_init_lazy(&tree, data, size);
+    TEST_TRUE(tree.node_count == 6);
+    mpack_tree_init_range(&workers[0], &tree, 0, 2);
+    mpack_tree_init_range(&workers[1], &tree, 2, 3);
+    mpack_tree_join(&tree, &workers[1]);
+    TEST_TRUE(tree.node_count == 10);
+    mpack_tree_join(&tree, &workers[0]);
+    TEST_TRUE(tree.node_count == 22);
+    TEST_TRUE(test_node_same(mpack_tree_root(&tree), mpack_tree_root(&eager)));
+    TEST_TRUE(6 == mpack_node_i32(mpack_node_array_at(mpack_node_array_at(mpack_node_array_at(
+            mpack_node_array_at(mpack_tree_root(&tree), 4), 0), 0), 0)));
+    TEST_TRUE(tree.node_count == 22);
+
+    // the tree can be parsed again after joining
+    mpack_tree_parse_again(&tree, data, size);
+    TEST_TRUE(tree.node_count == 6);
+    TEST_TREE_DESTROY_NOERROR(&tree);
+
+    // elements that were already parsed are kept, and empty ranges are fine
+    mpack_tree_init_lazy(&tree, data, size);
+    mpack_node_t a = mpack_node_map_cstr(mpack_node_array_at(mpack_tree_root(&tree), 0), "a");
+    TEST_TRUE(tree.node_count == 8);
+    mpack_tree_init_range(&workers[0], &tree, 0, 5);
+    mpack_tree_init_range(&workers[1], &tree, 5, 0);
+    mpack_tree_join(&tree, &workers[0]);
+    mpack_tree_join(&tree, &workers[1]);
+    TEST_TRUE(test_node_same(mpack_tree_root(&tree), mpack_tree_root(&eager)));
+
+    // a handle inside the range taken before the join is stale: it still
+    // reads the tree's earlier, unexpanded copy. Fetched again from the
+    // root, it's the worker's fully parsed node.
+    TEST_TRUE(mpack_node_array_length(a) == 2);
+    TEST_TRUE(a.data->flags & MPACK_NODE_FLAG_UNEXPANDED);
+    mpack_node_t joined = mpack_node_map_cstr(mpack_node_array_at(mpack_tree_root(&tree), 0), "a");
+    TEST_TRUE(joined.data != a.data);
+    TEST_TRUE(!(joined.data->flags & MPACK_NODE_FLAG_UNEXPANDED));
+    TEST_TRUE(3 == mpack_node_i32(mpack_node_array_at(mpack_node_array_at(joined, 1), 1)));
+    TEST_TRUE(tree.node_count == 22);
+    TEST_TREE_DESTROY_NOERROR(&tree);
+
+    // a worker can be destroyed without joining it, leaving the tree as
+    // it was (including parts of the range that were already parsed)
+    mpack_tree_init_lazy(&tree, data, size);
+    a = mpack_node_map_cstr(mpack_node_array_at(mpack_tree_root(&tree), 0), "a");
+    mpack_tree_init_range(&workers[0], &tree, 0, 2);
+    TEST_TREE_DESTROY_NOERROR(&workers[0]);
+    TEST_TRUE(2 == mpack_node_i32(mpack_node_array_at(mpack_node_array_at(a, 1), 0)));
+    TEST_TRUE(5 == mpack_node_i32(mpack_node_array_at(mpack_tree_root(&tree), 2)));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+
+    // the range of a map is of key/value pairs
+    // {"a": [1, [2, 3], {"x": "y"}], "b": {"c": {"d": 4}}, "e": 5, "f": []}
+    static const char map_data[] =
+        "\x84\xa1""a\x93\x01\x92\x02\x03\x81\xa1""x\xa1""y"
+        "\xa1""b\x81\xa1""c\x81\xa1""d\x04\xa1""e\x05\xa1""f\x90";
+    mpack_tree_t map_eager;
+    mpack_tree_init(&map_eager, map_data, sizeof(map_data) - 1);
+    mpack_tree_init_lazy(&tree, map_data, sizeof(map_data) - 1);
+    mpack_tree_init_range(&workers[0], &tree, 0, 1);
+    mpack_tree_init_range(&workers[1], &tree, 1, 3);
+    mpack_tree_join(&tree, &workers[0]);
+    mpack_tree_join(&tree, &workers[1]);
+    TEST_TRUE(tree.node_count == map_eager.node_count);
+    TEST_TRUE(test_node_same(mpack_tree_root(&tree), mpack_tree_root(&map_eager)));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+    TEST_TREE_DESTROY_NOERROR(&map_eager);
+
+    // misuse is flagged on the worker, and passed on to the tree when joined
+    TEST_BREAK((mpack_tree_init_range(&workers[0], &eager, 0, 1), true));
+    TEST_TREE_DESTROY_ERROR(&workers[0], mpack_error_bug);
+    mpack_tree_init_lazy(&tree, data, size);
+    TEST_BREAK((mpack_tree_init_range(&workers[0], &tree, 3, 3), true));
+    mpack_tree_join(&tree, &workers[0]);
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_bug);
+    mpack_tree_init_lazy(&tree, "\x07", 1);
+    TEST_BREAK((mpack_tree_init_range(&workers[0], &tree, 0, 0), true));
+    TEST_TREE_DESTROY_ERROR(&workers[0], mpack_error_bug);
+    TEST_TREE_DESTROY_NOERROR(&tree);
+
+    // a worker can only be joined to its own tree
+    mpack_tree_t other;
+    mpack_tree_init_lazy(&tree, data, size);
+    mpack_tree_init_lazy(&other, data, size);
+    mpack_tree_init_range(&workers[0], &other, 0, 5);
+    TEST_BREAK((mpack_tree_join(&tree, &workers[0]), true));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_bug);
+    TEST_TREE_DESTROY_NOERROR(&other);
+
+    // a tree in an error state flags it on its workers
+    mpack_tree_init_lazy(&tree, data, size - 1);
+    mpack_tree_init_range(&workers[0], &tree, 0, 5);
+    TEST_TREE_DESTROY_ERROR(&workers[0], mpack_error_invalid);
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_invalid);
+
+    TEST_TREE_DESTROY_NOERROR(&eager);
+    test_system_fail_until_ok(&test_node_read_range_workers);
+}
+
+// Parses a tree with exact allocation, allowing mpack_error_memory from
+// the failure system.
+static bool test_node_read_exact_memory() {
+    mpack_tree_t tree;
+    mpack_tree_init_exact(&tree, test_node_range_data, sizeof(test_node_range_data) - 1);
+    mpack_error_t error = mpack_tree_destroy(&tree);
+    if (error == mpack_error_memory)
+        return false;
+    TEST_TRUE(error == mpack_ok, "unexpected error state %i (%s)", (int)error, mpack_error_to_string(error));
+    return true;
+}
+
+static void test_node_read_exact() {
+    // an array of two copies of an indexed map
+    char buf[2048];
+    size_t map_size = test_node_map_index_data(buf + 1);
+    buf[0] = (char)0x92;
+    mpack_memcpy(buf + 1 + map_size, buf + 1, map_size);
+    size_t size = 1 + map_size * 2;
+    size_t count = mpack_tree_count_nodes(buf, size);
+
+    // the nodes are in a single page with nothing left over
+    mpack_tree_t eager;
+    mpack_tree_t tree;
+    mpack_tree_init(&eager, buf, size);
+    mpack_tree_init_exact(&tree, buf, size);
+    TEST_TRUE(tree.page.next == NULL);
+    TEST_TRUE(tree.page.pos == count);
+    TEST_TRUE(tree.page.left == 0);
+    TEST_TRUE(tree.node_count == eager.node_count);
+    TEST_TRUE(test_node_same(mpack_tree_root(&tree), mpack_tree_root(&eager)));
+
+    // the tree grows as usual when parsed again
+    mpack_tree_parse_again(&tree, buf, size);
+    TEST_TRUE(tree.page.pos == count);
+    mpack_tree_parse_again(&tree, "\x07", 1);
+    TEST_TRUE(7 == mpack_node_i32(mpack_tree_root(&tree)));
+    mpack_tree_parse_again(&tree, buf, size);
+    TEST_TRUE(test_node_same(mpack_tree_root(&tree), mpack_tree_root(&eager)));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+    TEST_TREE_DESTROY_NOERROR(&eager);
+
+    mpack_tree_init_exact(&tree, "\x92\x01", 2);
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_invalid);
+    mpack_tree_init_exact(&tree, "\x07\x08", 2);
+    TEST_TRUE(1 == mpack_tree_size(&tree));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+
+    test_system_fail_until_ok(&test_node_read_exact_memory);
+}
+#endif
+
+static void test_node_read_frozen() {
+    static const char data[] = "\x82\xa1""a\x92\x01\x02\xa1""b\x81\xa1""c\x03";
+    mpack_tree_t tree;
+    mpack_tree_t views[2];
+    mpack_node_data_t pool[16];
+    mpack_tree_init_pool(&tree, data, sizeof(data) - 1, pool, sizeof(pool) / sizeof(*pool));
+
+    // a tree must be frozen to be viewed, and misuse is flagged on the view
+    TEST_BREAK((mpack_tree_init_view(&views[0], &tree), true));
+    TEST_TREE_DESTROY_ERROR(&views[0], mpack_error_bug);
+    TEST_TRUE(mpack_tree_error(&tree) == mpack_ok);
+
+    // errors on a view don't affect the tree or other views
+    mpack_tree_freeze(&tree);
+    mpack_tree_init_view(&views[0], &tree);
+    mpack_tree_init_view(&views[1], &tree);
+    TEST_TRUE(mpack_tree_root(&views[0]).data == mpack_tree_root(&tree).data);
+    TEST_TRUE(mpack_tree_size(&views[0]) == sizeof(data) - 1);
+    mpack_tree_set_error_handler(&views[0], test_tree_error_handler);
+    mpack_node_t missing = mpack_node_map_cstr(mpack_tree_root(&views[0]), "x");
+    TEST_TRUE(missing.data == &views[0].nil_node);
+    TEST_TRUE(test_tree_error == mpack_error_data);
+    test_tree_error = mpack_ok;
+    TEST_TRUE(3 == mpack_node_i32(mpack_node_map_cstr(mpack_node_map_cstr(mpack_tree_root(&views[1]), "b"), "c")));
+    TEST_TRUE(2 == mpack_node_i32(mpack_node_array_at(mpack_node_map_cstr(mpack_tree_root(&tree), "a"), 1)));
+
+    // neither a frozen tree nor its views can be parsed again
+    TEST_BREAK((mpack_tree_parse_again(&views[1], data, sizeof(data) - 1), true));
+    TEST_TREE_DESTROY_ERROR(&views[1], mpack_error_bug);
+    TEST_TREE_DESTROY_ERROR(&views[0], mpack_error_data);
+    TEST_BREAK((mpack_tree_parse_again(&tree, "\x07", 1), true));
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_bug);
+
+    // a tree in an error state can't be frozen, and flags it on its views
+    mpack_tree_init_pool(&tree, data, sizeof(data) - 2, pool, sizeof(pool) / sizeof(*pool));
+    mpack_tree_freeze(&tree);
+    TEST_TRUE(!tree.frozen);
+    mpack_tree_init_view(&views[0], &tree);
+    TEST_TREE_DESTROY_ERROR(&views[0], mpack_error_invalid);
+    TEST_TREE_DESTROY_ERROR(&tree, mpack_error_invalid);
+
+    #ifdef MPACK_MALLOC
+    // a lazy tree is fully parsed when frozen
+    char buf[1024];
+    size_t size = test_node_map_index_data(buf);
+    mpack_tree_t eager;
+    mpack_tree_init(&eager, buf, size);
+    mpack_tree_init_lazy(&tree, buf, size);
+    mpack_tree_freeze(&tree);
+    TEST_TRUE(tree.node_count == eager.node_count);
+    mpack_tree_init_view(&views[0], &tree);
+    TEST_TRUE(test_node_same(mpack_tree_root(&views[0]), mpack_tree_root(&eager)));
+    TEST_TREE_DESTROY_NOERROR(&views[0]);
+    TEST_BREAK((mpack_tree_init_range(&views[0], &tree, 0, 1), true));
+    TEST_TREE_DESTROY_ERROR(&views[0], mpack_error_bug);
+    TEST_TREE_DESTROY_NOERROR(&tree);
+    TEST_TREE_DESTROY_NOERROR(&eager);
+    #endif
+}
+
+#ifdef MPACK_TEST_THREADS
+#define TEST_NODE_FROZEN_THREADS 64
+#define TEST_NODE_FROZEN_KEYS 64
+
+typedef struct test_node_frozen_thread_t {
+    pthread_t thread;
+    const mpack_tree_t* tree;
+    int index;
+    int failures;
+} test_node_frozen_thread_t;
+
+// Reads every entry of the shared tree through views, flagging an error
+// on every other view. Failures are counted rather than tested since the
+// test harness isn't thread-safe.
+static void* test_node_frozen_thread(void* arg) {
+    test_node_frozen_thread_t* thread = (test_node_frozen_thread_t*)arg;
+    for (int iteration = 0; iteration < 100; ++iteration) {
+        mpack_tree_t view;
+        mpack_tree_init_view(&view, thread->tree);
+        mpack_node_t root = mpack_tree_root(&view);
+
+        for (int i = 0; i < TEST_NODE_FROZEN_KEYS; ++i) {
+            int k = (i + thread->index) % TEST_NODE_FROZEN_KEYS;
+            char key[4] = {'k', (char)('0' + k / 10), (char)('0' + k % 10), '\0'};
+            mpack_node_t entry = mpack_node_map_cstr(root, key);
+            mpack_node_t values = mpack_node_map_cstr(entry, "v");
+            int32_t sum = 0;
+            for (size_t j = 0; j < mpack_node_array_length(values); ++j)
+                sum += mpack_node_i32(mpack_node_array_at(values, j));
+            if (mpack_node_i32(mpack_node_map_cstr(entry, "id")) != k || sum != 3 * k + 3)
+                ++thread->failures;
+        }
+
+        mpack_error_t expected = mpack_ok;
+        if ((iteration + thread->index) % 2 == 0) {
+            mpack_node_map_cstr(root, "missing");
+            expected = mpack_error_data;
+        }
+        if (mpack_tree_destroy(&view) != expected)
+            ++thread->failures;
+    }
+    return NULL;
+}
+
+static void test_node_read_frozen_threads() {
+    // {"k00": {"id": 0, "v": [0, 1, 2]}, "k01": {"id": 1, "v": [1, 2, 3]}, ...}
+    char buf[TEST_NODE_FROZEN_KEYS * 16 + 3];
+    char* p = buf;
+    *p++ = (char)0xde;
+    *p++ = 0;
+    *p++ = TEST_NODE_FROZEN_KEYS;
+    for (int k = 0; k < TEST_NODE_FROZEN_KEYS; ++k) {
+        static const char entry[] = "\xa3k00\x82\xa2id\x00\xa1v\x93\x00\x01\x02";
+        mpack_memcpy(p, entry, sizeof(entry) - 1);
+        p[2] = (char)('0' + k / 10);
+        p[3] = (char)('0' + k % 10);
+        p[8] = (char)k;
+        p[12] = (char)k;
+        p[13] = (char)(k + 1);
+        p[14] = (char)(k + 2);
+        p += sizeof(entry) - 1;
+    }
+
+    mpack_tree_t tree;
+    mpack_tree_init_lazy(&tree, buf, (size_t)(p - buf));
+    mpack_tree_freeze(&tree);
+    TEST_TRUE(mpack_tree_error(&tree) == mpack_ok);
+
+    test_node_frozen_thread_t threads[TEST_NODE_FROZEN_THREADS];
+    for (int i = 0; i < TEST_NODE_FROZEN_THREADS; ++i) {
+        threads[i].tree = &tree;
+        threads[i].index = i;
+        threads[i].failures = 0;
+        TEST_TRUE(0 == pthread_create(&threads[i].thread, NULL, &test_node_frozen_thread, &threads[i]));
+    }
+    for (int i = 0; i < TEST_NODE_FROZEN_THREADS; ++i) {
+        TEST_TRUE(0 == pthread_join(threads[i].thread, NULL));
+        TEST_TRUE(threads[i].failures == 0, "thread %i had %i failures", i, threads[i].failures);
+    }
+
+    TEST_TREE_DESTROY_NOERROR(&tree);
+}
+#endif
+
+#define TEST_VALIDATE(data, limits, error) \
+    TEST_TRUE((error) == mpack_validate(data, sizeof(data) - 1, limits), \
+            "validating " #data " did not give " #error)
+
+static void test_node_validate() {
+    TEST_VALIDATE("\x07", NULL, mpack_ok);
+    TEST_VALIDATE("\x82\xa1""a\x92\x01\xcb\x00\x00\x00\x00\x00\x00\x00\x00\xa1""b\xc7\x01\x05\x00", NULL, mpack_ok);
+    TEST_VALIDATE("", NULL, mpack_error_invalid);
+    TEST_VALIDATE("\xc1", NULL, mpack_error_invalid);
+    TEST_VALIDATE("\x92\x01", NULL, mpack_error_invalid);
+    TEST_VALIDATE("\xd9\x05""abc", NULL, mpack_error_invalid);
+    TEST_VALIDATE("\xdd\xff\xff\xff\xff\x01", NULL, mpack_error_invalid);
+
+    // data after the message is invalid
+    TEST_VALIDATE("\x01\x02", NULL, mpack_error_invalid);
+
+    // every prefix of a message is invalid, as when parsing a tree
+    // [{"a": [1, [2, 3]]}, {"b": {"c": {"d": 4}}}, 5, [], [[[6]], "x"]]
+    static const char data[] =
+        "\x95\x81\xa1""a\x92\x01\x92\x02\x03\x81\xa1""b\x81\xa1""c\x81\xa1""d\x04"
+        "\x05\x90\x92\x91\x91\x06\xa1""x";
+    TEST_VALIDATE(data, NULL, mpack_ok);
+    for (size_t i = 0; i < sizeof(data) - 1; ++i) {
+        mpack_tree_t tree;
+        mpack_node_data_t pool[32];
+        mpack_tree_init_pool(&tree, data, i, pool, sizeof(pool) / sizeof(*pool));
+        TEST_TRUE(mpack_tree_destroy(&tree) == mpack_validate(data, i, NULL));
+    }
+
+    // depth and node limits
+    mpack_validate_limits_t limits;
+    mpack_memset(&limits, 0, sizeof(limits));
+    limits.max_depth = 2;
+    TEST_VALIDATE("\x07", &limits, mpack_ok);
+    TEST_VALIDATE("\x92\x91\x01\x91\x90", &limits, mpack_error_too_big);
+    TEST_VALIDATE("\x92\x91\x01\x81\x01\x02", &limits, mpack_ok);
+    TEST_VALIDATE("\x92\x91\x01\x81\x01\x91\x01", &limits, mpack_error_too_big);
+    limits.max_depth = 1;
+    TEST_VALIDATE("\x93\x01\x02\x90", &limits, mpack_error_too_big);
+    TEST_VALIDATE("\x93\x01\x02\x03", &limits, mpack_ok);
+    limits.max_depth = 0;
+    limits.max_nodes = 5;
+    TEST_VALIDATE("\x82\x01\x02\x03\x04", &limits, mpack_ok);
+    TEST_VALIDATE("\x82\x01\x02\x03\x91\x04", &limits, mpack_error_too_big);
+    TEST_VALIDATE("\x91\x91\x91\x91\x91\x01", &limits, mpack_error_too_big);
+    limits.max_depth = MPACK_NODE_MAX_DEPTH_WITHOUT_MALLOC + 1;
+    TEST_BREAK(mpack_error_bug == mpack_validate("\x07", 1, &limits));
+
+    // strings are only checked for UTF-8 if requested
+    static const char latin1[] = "\x92\xaa""abcdefgh\xe9!\xa2\xc3\xa9";
+    static const char utf8[] = "\x92\xa9""abcdefg\xc3\xa9\xa2\xc3\xa9";
+    mpack_memset(&limits, 0, sizeof(limits));
+    TEST_VALIDATE(latin1, &limits, mpack_ok);
+    limits.check_utf8 = true;
+    TEST_VALIDATE(latin1, &limits, mpack_error_type);
+    TEST_VALIDATE(utf8, &limits, mpack_ok);
+    TEST_VALIDATE("\xc4\x01\xff", &limits, mpack_ok);
+    TEST_VALIDATE("\xa2\xed\xa0", &limits, mpack_error_type);
+}
+
 static void test_node_read_compound_errors(void) {
     mpack_node_data_t pool[128];
 
@@ -717,6 +2528,97 @@ static void test_node_read_data(void) {
     TEST_TREE_DESTROY_NOERROR(&tree);
 }
 
+#if MPACK_WRITER
+// [nil, true, {"a": 5, "b": [1, -200, 1.5, 2.5]}, <bin 00>, <ext 5: 41>] with the largest encodings
+static const char test_node_write_wide[] =
+    "\xdd\x00\x00\x00\x05\xc0\xc3"
+    "\xdf\x00\x00\x00\x02\xdb\x00\x00\x00\x01""a\xcf\x00\x00\x00\x00\x00\x00\x00\x05"
+        "\xda\x00\x01""b\xdc\x00\x04\xd3\x00\x00\x00\x00\x00\x00\x00\x01\xd1\xff\x38"
+        "\xca\x3f\xc0\x00\x00\xcb\x40\x04\x00\x00\x00\x00\x00\x00"
+    "\xc6\x00\x00\x00\x01\x00\xc9\x00\x00\x00\x01\x05\x41";
+static const char test_node_write_minimal[] =
+    "\x95\xc0\xc3"
+    "\x82\xa1""a\x05\xa1""b\x94\x01\xd1\xff\x38\xca\x3f\xc0\x00\x00\xcb\x40\x04\x00\x00\x00\x00\x00\x00"
+    "\xc4\x01\x00\xd4\x05\x41";
+
+static bool test_node_write_matches(mpack_node_t node, const char* expected, size_t length) {
+    char buf[64];
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, buf, sizeof(buf));
+    mpack_write_node(&writer, node);
+    size_t used = mpack_writer_buffer_used(&writer);
+    return mpack_writer_destroy(&writer) == mpack_ok && used == length && memcmp(buf, expected, length) == 0;
+}
+
+static void test_node_write() {
+    mpack_node_data_t pool[128];
+    char buf[64];
+    mpack_writer_t writer;
+
+    // integers, strings, blobs and headers are written in their smallest encodings
+    TEST_SIMPLE_TREE_READ(test_node_write_wide, test_node_write_matches(node,
+                test_node_write_minimal, sizeof(test_node_write_minimal) - 1));
+    TEST_SIMPLE_TREE_READ(test_node_write_minimal, test_node_write_matches(node,
+                test_node_write_minimal, sizeof(test_node_write_minimal) - 1));
+    TEST_SIMPLE_TREE_READ(test_node_write_wide, test_node_write_matches(mpack_node_map_cstr(mpack_node_array_at(node, 2), "b"),
+                "\x94\x01\xd1\xff\x38\xca\x3f\xc0\x00\x00\xcb\x40\x04\x00\x00\x00\x00\x00\x00", 19));
+    TEST_SIMPLE_TREE_READ("\x90", test_node_write_matches(node, "\x90", 1));
+    TEST_SIMPLE_TREE_READ("\xd0\x05", test_node_write_matches(node, "\x05", 1));
+
+    // the tree's error is flagged on the writer
+    TEST_SIMPLE_TREE_READ_ERROR("\x91\xc0", (mpack_node_array_at(node, 1),
+                !test_node_write_matches(node, "\x91\xc0", 2)), mpack_error_data);
+
+    // the writer runs out of space
+    mpack_tree_t tree;
+    mpack_tree_init_pool(&tree, test_node_write_wide, sizeof(test_node_write_wide) - 1, pool, sizeof(pool) / sizeof(*pool));
+    mpack_writer_init(&writer, buf, 10);
+    mpack_write_node(&writer, mpack_tree_root(&tree));
+    TEST_TRUE(mpack_writer_destroy(&writer) == mpack_error_io);
+    TEST_TREE_DESTROY_NOERROR(&tree);
+
+    #ifdef MPACK_MALLOC
+    // lazy trees are parsed as they're written
+    mpack_tree_init_lazy(&tree, test_node_write_wide, sizeof(test_node_write_wide) - 1);
+    TEST_TRUE(test_node_write_matches(mpack_tree_root(&tree), test_node_write_minimal, sizeof(test_node_write_minimal) - 1));
+    TEST_TREE_DESTROY_NOERROR(&tree);
+    #endif
+}
+
+#ifdef MPACK_MALLOC
+// Writes nodes nested deeper than the initial stack
+static bool test_node_write_deep() {
+    static const int depth = 200;
+    char data[1024];
+    char buf[1024];
+    char* p = data;
+    for (int i = 0; i < depth; ++i) {
+        *p++ = '\x81';
+        *p++ = '\x04';
+        *p++ = '\x91';
+    }
+    *p++ = '\x07';
+    size_t size = (size_t)(p - data);
+
+    mpack_tree_t tree;
+    mpack_tree_init(&tree, data, size);
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, buf, sizeof(buf));
+    mpack_write_node(&writer, mpack_tree_root(&tree));
+    size_t used = mpack_writer_buffer_used(&writer);
+    mpack_error_t error = mpack_writer_destroy(&writer);
+    mpack_error_t tree_error = mpack_tree_destroy(&tree);
+    if (error == mpack_error_memory)
+        return false;
+
+    TEST_TRUE(error == mpack_ok, "unexpected error state %i (%s)", (int)error, mpack_error_to_string(error));
+    TEST_TRUE(tree_error == mpack_ok);
+    TEST_TRUE(used == size && memcmp(buf, data, size) == 0);
+    return true;
+}
+#endif
+#endif
+
 static void test_node_read_deep_stack(void) {
     static const int depth = 1200;
     char buf[4096];
@@ -771,11 +2673,52 @@ void test_node(void) {
 
     // compound types
     test_node_read_array();
+    test_node_read_iter();
+    test_node_read_array_copy();
     test_node_read_map();
     test_node_read_map_search();
+    test_node_read_map_index();
+    test_node_read_count();
+    test_node_read_map_sorted();
+    test_node_read_map_dense();
+    test_node_read_number_runs();
+    test_node_read_path();
+    test_node_read_path_cached();
+    test_node_read_map_many();
+    test_node_read_map_cursor();
+    test_node_read_columns();
+    #if MPACK_NODE_RAW
+    test_node_read_raw();
+    #endif
+    test_node_read_parse_again();
+    #ifdef MPACK_MALLOC
+    test_node_read_stream();
+    test_node_read_stream_messages();
+    test_node_read_stream_limits();
+    test_node_read_stream_number_runs();
+    #if MPACK_NODE_RAW
+    test_node_read_stream_raw();
+    #endif
+    test_node_read_allocator();
+    test_node_read_lazy();
+    test_node_read_range();
+    test_node_read_exact();
+    #endif
+    test_node_read_frozen();
+    test_node_validate();
+    #ifdef MPACK_TEST_THREADS
+    test_node_read_frozen_threads();
+    #endif
     test_node_read_compound_errors();
     test_node_read_data();
     test_node_read_deep_stack();
+
+    #if MPACK_WRITER
+    test_node_write();
+    #ifdef MPACK_MALLOC
+    test_system_fail_until_ok(&test_node_write_deep);
+    #endif
+    #endif
 }
 
 #endif
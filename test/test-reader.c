@@ -32,6 +32,27 @@ void test_read_error_handler(mpack_reader_t* reader, mpack_error_t error) {
     test_read_error = error;
 }
 
+#if MPACK_READ_TRACKING
+static void test_read_allocator() {
+    mpack_reader_t reader;
+
+    // the tracking stack is allocated and grown with the allocator
+    size_t count = test_malloc_count();
+    mpack_reader_init_data(&reader, "\x91\x91\x91\x91\x91\xc0", 6);
+    mpack_reader_set_allocator(&reader, &test_allocator);
+    TEST_TRUE(test_allocator_count() == 0);
+    TEST_TRUE(1 == mpack_expect_array(&reader));
+    TEST_TRUE(test_allocator_count() == 1 && test_malloc_count() == count + 1);
+    for (int i = 1; i < 5; ++i)
+        TEST_TRUE(1 == mpack_expect_array(&reader));
+    mpack_expect_nil(&reader);
+    for (int i = 0; i < 5; ++i)
+        mpack_done_array(&reader);
+    TEST_READER_DESTROY_NOERROR(&reader);
+    TEST_TRUE(test_allocator_count() == 0);
+}
+#endif
+
 void test_reader() {
     // almost all reader functions are tested by the expect tests.
     // minor miscellaneous read tests are added here.
@@ -42,6 +63,10 @@ void test_reader() {
     // truncated discard errors
     TEST_SIMPLE_READ_ERROR("\x91", (mpack_discard(&reader), true), mpack_error_invalid); // array
     TEST_SIMPLE_READ_ERROR("\x81", (mpack_discard(&reader), true), mpack_error_invalid); // map
+
+    #if MPACK_READ_TRACKING
+    test_read_allocator();
+    #endif
 }
 
 #endif
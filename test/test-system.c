@@ -140,6 +140,34 @@ void test_free(void* p) {
     free(p);
 }
 
+static size_t test_allocator_active = 0;
+
+size_t test_allocator_count(void) {
+    return test_allocator_active;
+}
+
+static void* test_allocator_alloc(void* context, size_t size) {
+    TEST_TRUE(context == &test_allocator_active, "wrong allocator context");
+    void* p = test_malloc(size);
+    if (p)
+        ++test_allocator_active;
+    return p;
+}
+
+static void test_allocator_free(void* context, void* p) {
+    TEST_TRUE(context == &test_allocator_active, "wrong allocator context");
+    TEST_TRUE(test_allocator_active != 0, "freeing memory not allocated by the test allocator");
+    --test_allocator_active;
+    test_free(p);
+}
+
+const mpack_allocator_t test_allocator = {
+    test_allocator_alloc,
+    NULL,
+    test_allocator_free,
+    &test_allocator_active
+};
+
 #endif
 
 
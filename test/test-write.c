@@ -327,6 +327,10 @@ static void test_write_simple_misc() {
     TEST_SIMPLE_WRITE("\xcb\x40\x09\x21\xfb\x53\xc8\xd4\xf1", mpack_write_double(&writer, 3.14159265));
     TEST_SIMPLE_WRITE("\xcb\xc0\x09\x21\xfb\x53\xc8\xd4\xf1", mpack_write_double(&writer, -3.14159265));
 
+    // pre-encoded objects
+    TEST_SIMPLE_WRITE("\x92\x01\x91\xc0", (mpack_start_array(&writer, 2), mpack_write_object_bytes(&writer, "\x01", 1),
+                mpack_write_object_bytes(&writer, "\x91\xc0", 2), mpack_finish_array(&writer)));
+
 }
 
 #ifdef MPACK_MALLOC
@@ -714,6 +718,83 @@ static bool test_write_deep_growth() {
     return true;
 
 }
+
+// Data written past the end of a growable buffer is appended after
+// growing it, and only the buffered data is copied (MPACK_REALLOC may not
+// be defined, so growing can copy with the given size.)
+static void test_write_growable_extra_data() {
+    static const char text[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+    char* buf;
+    size_t size;
+    mpack_writer_t writer;
+
+    // a little buffered data and a lot of extra data
+    mpack_writer_init_growable(&writer, &buf, &size);
+    mpack_write_u8(&writer, 7);
+    mpack_write_str(&writer, text, 36);
+    TEST_WRITER_DESTROY_NOERROR(&writer);
+    TEST_TRUE(size == 1 + 2 + 36);
+    TEST_TRUE(0 == memcmp("\x07\xd9\x24", buf, 3) && 0 == memcmp(text, buf + 3, 36));
+    MPACK_FREE(buf);
+
+    // a lot of buffered data and a little extra data
+    mpack_writer_init_growable(&writer, &buf, &size);
+    mpack_write_str(&writer, text, 36);
+    mpack_write_bin(&writer, text, 8);
+    TEST_WRITER_DESTROY_NOERROR(&writer);
+    TEST_TRUE(size == 2 + 36 + 2 + 8);
+    TEST_TRUE(0 == memcmp(text, buf + 2, 36) && 0 == memcmp(text, buf + 40, 8));
+    MPACK_FREE(buf);
+}
+
+static void test_write_allocator() {
+    char* buf;
+    size_t size;
+    mpack_writer_t writer;
+
+    // a growable writer initialized with an allocator never calls
+    // MPACK_MALLOC, and the data must be freed with the allocator
+    size_t count = test_malloc_count();
+    mpack_writer_init_growable_allocator(&writer, &buf, &size, &test_allocator);
+    TEST_TRUE(test_allocator_count() == 2 && test_malloc_count() == count + 2);
+    mpack_write_cstr(&writer, "abc");
+    for (int i = 0; i < 5; ++i)
+        mpack_start_array(&writer, 1);
+    mpack_write_cstr(&writer, "a string that is longer than the buffer");
+    for (int i = 0; i < 5; ++i)
+        mpack_finish_array(&writer);
+    TEST_TRUE(test_allocator_count() == test_malloc_count() - count);
+    TEST_WRITER_DESTROY_NOERROR(&writer);
+    TEST_TRUE(test_allocator_count() == 1);
+    TEST_TRUE(size == 50);
+    TEST_TRUE(0 == memcmp("\xa3""abc\x91\x91\x91\x91\x91\xd9\x27""a string", buf, 16));
+    test_allocator.free_fn(test_allocator.context, buf);
+
+    // the growable buffer of a writer initialized without one moves to
+    // the allocator
+    mpack_writer_init_growable(&writer, &buf, &size);
+    mpack_write_cstr(&writer, "abc");
+    mpack_writer_set_allocator(&writer, &test_allocator);
+    TEST_TRUE(test_allocator_count() == 1 + MPACK_WRITE_TRACKING);
+    for (int i = 0; i < 5; ++i)
+        mpack_start_array(&writer, 1);
+    mpack_write_cstr(&writer, "a string that is longer than the buffer");
+    for (int i = 0; i < 5; ++i)
+        mpack_finish_array(&writer);
+    TEST_WRITER_DESTROY_NOERROR(&writer);
+    TEST_TRUE(test_allocator_count() == 1);
+    TEST_TRUE(size == 50);
+    TEST_TRUE(0 == memcmp("\xa3""abc\x91\x91\x91\x91\x91\xd9\x27""a string", buf, 16));
+    test_allocator.free_fn(test_allocator.context, buf);
+
+    // switching back to MPACK_MALLOC
+    mpack_writer_init_growable(&writer, &buf, &size);
+    mpack_writer_set_allocator(&writer, &test_allocator);
+    mpack_writer_set_allocator(&writer, NULL);
+    TEST_TRUE(test_allocator_count() == 0);
+    mpack_write_nil(&writer);
+    TEST_DESTROY_MATCH("\xc0");
+}
 #endif
 
 #if MPACK_WRITE_TRACKING
@@ -761,6 +842,12 @@ static void test_write_tracking() {
     TEST_BREAK((mpack_write_bytes(&writer, "test", 4), true));
     TEST_WRITER_DESTROY_ERROR(&writer, mpack_error_bug);
 
+    // writing an object in a string
+    mpack_writer_init(&writer, buf, sizeof(buf));
+    mpack_start_str(&writer, 50);
+    TEST_BREAK((mpack_write_object_bytes(&writer, "\xc0", 1), true));
+    TEST_WRITER_DESTROY_ERROR(&writer, mpack_error_bug);
+
     // writing too many bytes
     mpack_writer_init(&writer, buf, sizeof(buf));
     mpack_start_str(&writer, 2);
@@ -790,6 +877,8 @@ void test_writes() {
     test_write_basic_structures();
     test_write_small_structure_trees();
     test_system_fail_until_ok(&test_write_deep_growth);
+    test_write_growable_extra_data();
+    test_write_allocator();
     #endif
 
     #if MPACK_WRITE_TRACKING
@@ -30,6 +30,7 @@
 #include "test-buffer.h"
 #include "test-common.h"
 #include "test-node.h"
+#include "test-json.h"
 #include "test-file.h"
 #include "test-system.h"
 
@@ -98,6 +99,9 @@ int main(void) {
     #if MPACK_NODE
     test_node();
     #endif
+    #if MPACK_JSON
+    test_json();
+    #endif
     #if MPACK_STDIO
     test_file();
     #endif
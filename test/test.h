@@ -138,6 +138,17 @@ extern bool test_break_hit;
 
 #endif
 
+#ifdef MPACK_MALLOC
+// An allocator that counts its active allocations, for testing that trees,
+// readers and writers allocate through it. It allocates with test_malloc(),
+// so it fails along with it under test_system_fail_after(). It has no
+// realloc function so resizing falls back to allocating and copying.
+extern const mpack_allocator_t test_allocator;
+
+// Returns the number of test_allocator allocations that have not yet been freed.
+size_t test_allocator_count(void);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
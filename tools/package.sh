@@ -16,7 +16,8 @@ FILES="\
     mpack-writer \
     mpack-reader \
     mpack-expect \
-    mpack-node"
+    mpack-node \
+    mpack-json"
 
 # add top license and comment
 rm -rf build/amalgamation